@@ -18,6 +18,7 @@
 #include "cmdutils.h"
 
 #include "cliopt.h"
+#include "cmd_api.h"
 #include "cmds.h"
 #include "dterm.h"
 #include "birdmon_app.h"
@@ -47,7 +48,7 @@ int cmd_cmdlist(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, s
     INPUT_SANITIZE();
     
     
-    bytesout = cmdtab_list(dth->cmdtab, cmdprint, 1024);
+    bytesout = cmd_list(dth->cmdtab, cmdprint, 1024);
     if (bytesout >= 0) {
         dterm_send_cmdmsg(dth, "cmdls", cmdprint);
         bytesout = 0;
@@ -16,11 +16,15 @@
 
 // Local Headers
 #include "cmdutils.h"
+#include "trace.h"
 
 #include <talloc.h>
 
 // Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -74,6 +78,36 @@ int cmdutils_hexstr_to_uint8(uint8_t* dst, const char* src) {
 }
 
 
+int cmdutils_uint8_to_base64(char* dst, uint8_t* src, size_t src_bytes) {
+    const char convert[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char* start = dst;
+    
+    while (src_bytes >= 3) {
+        *dst++ = convert[src[0] >> 2];
+        *dst++ = convert[((src[0] & 0x03) << 4) | (src[1] >> 4)];
+        *dst++ = convert[((src[1] & 0x0f) << 2) | (src[2] >> 6)];
+        *dst++ = convert[src[2] & 0x3f];
+        src += 3;
+        src_bytes -= 3;
+    }
+    if (src_bytes != 0) {
+        *dst++ = convert[src[0] >> 2];
+        if (src_bytes == 1) {
+            *dst++ = convert[(src[0] & 0x03) << 4];
+            *dst++ = '=';
+        }
+        else {
+            *dst++ = convert[((src[0] & 0x03) << 4) | (src[1] >> 4)];
+            *dst++ = convert[(src[1] & 0x0f) << 2];
+        }
+        *dst++ = '=';
+    }
+    *dst = 0;
+    
+    return (int)(dst - start);
+}
+
+
 int cmdutils_base64_to_uint8(uint8_t* dst, const char* src) {
 ///@todo build this function on a rainy day -- probably reference a BASE64 lib.
     return 0;
@@ -132,20 +166,20 @@ uint8_t* cmdutils_goto_eol(uint8_t* src) {
 }
 
 
-int cmdutils_parsestring(void* ctx, char*** pargv, const char* cmdname, char* src, size_t src_limit) {
+/// Zero out whitespace that's not protected, in place, and return the number
+/// of tokens left in src.
+/// Protections:
+/// - Quotes "..."
+/// - Brackets [...]
+/// - Parentheses (...)
+static int sub_tokenize(char* src, size_t src_limit) {
     char* cursor;
     int argc = 0;
     int remdata;
     int paren, brack, quote;
     bool ws_lead;
 
-    cursor = src;
-
-    /// Zero out whitespace that's not protected
-    /// Protections:
-    /// - Quotes "..."
-    /// - Brackets [...]
-    /// - Parentheses (...)
+    cursor  = src;
     ws_lead = true;
     remdata = (int)src_limit;
     paren   = 0;
@@ -174,15 +208,42 @@ int cmdutils_parsestring(void* ctx, char*** pargv, const char* cmdname, char* sr
         remdata--;
     }
     
-    /// If 'cmdname' is NULL: the command name is included in the source string
-    /// If 'cmdname' is not NULL: the command name is supplied in 'cmdname'
+    return argc;
+}
+
+/// Populate argv array with pointers to first chars after zeros.
+/// If 'cmdname' is NULL: the command name is included in the source string
+/// If 'cmdname' is not NULL: the command name is supplied in 'cmdname'
+static void sub_fillargv(char** argv, int argc, const char* cmdname, char* src) {
+    char* cursor = src;
+    int i;
+    
     if (cmdname != NULL) {
-        argc++;
+        argv[0] = (char*)cmdname;
+        i = 1;
+    }
+    else {
+        i = 0;
     }
     
-    /// If argc is not 0:
-    /// - allocate argv
-    /// - populate argv array with pointers to first chars after zeros.
+    // Bypass leading whitespace (now zeros)
+    // Fill argv[i]
+    // Bypass trailing non-whitespace
+    for (; i<argc; i++) {
+        for (; *cursor==0; cursor++);
+        argv[i] = cursor;
+        for (; *cursor!=0; cursor++);
+    }
+}
+
+
+int cmdutils_parsestring(void* ctx, char*** pargv, const char* cmdname, char* src, size_t src_limit) {
+    int argc;
+    uint64_t t_start = trace_begin();
+
+    argc = sub_tokenize(src, src_limit) + (cmdname != NULL);
+    
+    /// If argc is not 0: allocate argv and populate it
     if (argc != 0) {
         if (ctx == NULL) {
             *pargv = calloc(sizeof(char*), argc);
@@ -194,27 +255,11 @@ int cmdutils_parsestring(void* ctx, char*** pargv, const char* cmdname, char* sr
             argc = -2;
         }
         else {
-            int i;
-            if (cmdname != NULL) {
-                (*pargv)[0] = (char*)cmdname;
-                i = 1;
-            }
-            else {
-                i = 0;
-            }
-            
-            // Bypass leading whitespace (now zeros)
-            // Fill argv[i]
-            // Bypass trailing non-whitespace
-            cursor = src;
-            for (; i<argc; i++) {
-                for (; *cursor==0; cursor++);
-                (*pargv)[i] = cursor;
-                for (; *cursor!=0; cursor++);
-            }
+            sub_fillargv(*pargv, argc, cmdname, src);
         }
     }
 
+    trace_end("argv", "cmd", t_start);
     return argc;
 }
 
@@ -229,13 +274,187 @@ void cmdutils_freeargv(void* ctx, char** argv) {
 
 
 
+/// Prebuilt argtables and argv storage, one block per thread.  Blocks are
+/// never freed: when a thread exits its block goes onto a free list and the
+/// next new thread adopts it, tables included.  The pool thus stays as large
+/// as the peak number of threads that have run commands.
+#define CMDUTILS_MAXSCHEMAS 64
+
+typedef struct cmdutils_tls {
+    struct cmdutils_tls* next;
+    void**  table[CMDUTILS_MAXSCHEMAS];
+    char*   argv[BIRDMON_PARAM_MAXARGC+1];
+} cmdutils_tls_t;
+
+static cmdutils_argschema_t*    schemas[CMDUTILS_MAXSCHEMAS];
+static int                      numschemas  = 0;
+static pthread_mutex_t          schema_mutex= PTHREAD_MUTEX_INITIALIZER;
+
+static __thread cmdutils_tls_t* tls         = NULL;
+static cmdutils_tls_t*          tls_free    = NULL;
+static pthread_key_t            tls_key;
+static pthread_once_t           tls_once    = PTHREAD_ONCE_INIT;
+
+static void* (*args_malloc)(size_t) = NULL;
+static void  (*args_free)(void*)    = NULL;
+static __thread bool            args_building = false;
+
+
+static void sub_tls_retire(void* arg) {
+    cmdutils_tls_t* block = arg;
+
+    pthread_mutex_lock(&schema_mutex);
+    block->next = tls_free;
+    tls_free    = block;
+    pthread_mutex_unlock(&schema_mutex);
+}
+
+static void sub_tls_keyinit(void) {
+    pthread_key_create(&tls_key, &sub_tls_retire);
+}
+
+static cmdutils_tls_t* sub_tls(void) {
+    cmdutils_tls_t* block;
+    
+    if (tls == NULL) {
+        pthread_once(&tls_once, &sub_tls_keyinit);
+        
+        pthread_mutex_lock(&schema_mutex);
+        block = tls_free;
+        if (block != NULL) {
+            tls_free = block->next;
+        }
+        pthread_mutex_unlock(&schema_mutex);
+        
+        if (block == NULL) {
+            block = calloc(1, sizeof(cmdutils_tls_t));
+        }
+        if (block != NULL) {
+            block->next = NULL;
+            pthread_setspecific(tls_key, block);
+            tls = block;
+        }
+    }
+    
+    return tls;
+}
+
+
+/// argtable always gets these trampolines, so a thread building its tables
+/// can use the standard allocators without touching the global hooks, which
+/// other threads may be using.
+static void* sub_args_malloc(size_t size) {
+    return ((args_malloc == NULL) || args_building) ? malloc(size) : args_malloc(size);
+}
+
+static void sub_args_free(void* ptr) {
+    if ((args_free == NULL) || args_building) {
+        free(ptr);
+    }
+    else {
+        args_free(ptr);
+    }
+}
+
+void cmdutils_set_allocators(void* (*malloc_fn)(size_t), void (*free_fn)(void*)) {
+    args_malloc = malloc_fn;
+    args_free   = free_fn;
+    arg_set_allocators(&sub_args_malloc, &sub_args_free);
+}
+
+
+int cmdutils_argschema(cmdutils_argschema_t* schema) {
+    int rc = 0;
+    
+    if ((schema == NULL) || (schema->build == NULL) || (schema->size == 0)) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&schema_mutex);
+    if (schema->id <= 0) {
+        if (numschemas >= CMDUTILS_MAXSCHEMAS) {
+            rc = -1;
+        }
+        else {
+            schemas[numschemas] = schema;
+            schema->id          = ++numschemas;
+        }
+    }
+    pthread_mutex_unlock(&schema_mutex);
+    
+    return rc;
+}
+
+
+void** cmdutils_argtable(cmdutils_argschema_t* schema) {
+    cmdutils_tls_t* block;
+    void** table;
+    
+    if ((schema == NULL) || (schema->id <= 0)) {
+        return NULL;
+    }
+    block = sub_tls();
+    if (block == NULL) {
+        return NULL;
+    }
+    
+    table = block->table[schema->id - 1];
+    if (table == NULL) {
+        /// Tables outlive the request, so they must not come from the
+        /// request's memory context: build with the standard allocators.
+        table = calloc(schema->size, sizeof(void*));
+        if (table == NULL) {
+            return NULL;
+        }
+        args_building = true;
+        schema->build(table);
+        if (arg_nullcheck(table) != 0) {
+            arg_freetable(table, schema->size);
+            free(table);
+            table = NULL;
+        }
+        args_building = false;
+        block->table[schema->id - 1] = table;
+    }
+    
+    return table;
+}
+
+
+int cmdutils_parseargs(char*** pargv, const char* cmdname, char* src, size_t src_limit) {
+    cmdutils_tls_t* block;
+    int argc;
+    uint64_t t_start = trace_begin();
+    
+    block = sub_tls();
+    if (block == NULL) {
+        argc = -2;
+    }
+    else {
+        argc = sub_tokenize(src, src_limit) + (cmdname != NULL);
+        if (argc > BIRDMON_PARAM_MAXARGC) {
+            argc = -3;
+        }
+        else {
+            sub_fillargv(block->argv, argc, cmdname, src);
+            block->argv[argc]   = NULL;
+            *pargv              = block->argv;
+        }
+    }
+    
+    trace_end("argv", "cmd", t_start);
+    return argc;
+}
+
+
+
 int cmdutils_argcheck(void* argtable, struct arg_end* end, int argc, char** argv) {
     int rc = 0;
     
     if (arg_nullcheck(argtable) != 0) {
         rc = -1;
     }
-    if ((argc <= 1) || (arg_parse(argc, argv, argtable) > 0)) {
+    if ((argc <= 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
         arg_print_errors(stderr, end, argv[0]);
         ///@todo print help
         rc = -2;
@@ -244,3 +463,13 @@ int cmdutils_argcheck(void* argtable, struct arg_end* end, int argc, char** argv
     return rc;
 }
 
+
+int cmdutils_argparse(int argc, char** argv, void* argtable) {
+    uint64_t t_start = trace_begin();
+    int nerrors;
+    
+    nerrors = arg_parse(argc, argv, argtable);
+    trace_end("argtable", "cmd", t_start);
+    return nerrors;
+}
+
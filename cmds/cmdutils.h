@@ -15,6 +15,7 @@
   */
 
 // Local Headers
+#include "birdmon_cfg.h"
 #include "cliopt.h"
 #include "cmds.h"
 
@@ -34,6 +35,9 @@ int cmdutils_uint8_to_hexstr(char* dst, uint8_t* src, size_t src_bytes);
 int cmdutils_hexstr_to_uint8(uint8_t* dst, const char* src);
 
 
+int cmdutils_uint8_to_base64(char* dst, uint8_t* src, size_t src_bytes);
+
+
 int cmdutils_base64_to_uint8(uint8_t* dst, const char* src);
 
 
@@ -49,8 +53,41 @@ int cmdutils_parsestring(void* ctx, char*** pargv, const char* cmdname, char* sr
 void cmdutils_freeargv(void* ctx, char** argv);
 
 
+/** @brief Argtable schema of a command
+  * A command describes its argtable once, with a build function that fills
+  * argtable[0..size-1] (arg_end last).  Each thread that runs the command
+  * builds the table on first use and then keeps it, so the per-request path
+  * does no argtable allocation.  Declare schemas static with id = 0.
+  */
+typedef struct {
+    int     id;
+    size_t  size;
+    void    (*build)(void** argtable);
+} cmdutils_argschema_t;
+
+/// Registers a schema.  Call from the command's init path (dth == NULL).
+/// Returns 0, or -1 if the schema table is full.
+int cmdutils_argschema(cmdutils_argschema_t* schema);
+
+/// Returns the calling thread's argtable for the schema, building it on first
+/// use.  Returns NULL if the schema is unregistered or the build failed.
+void** cmdutils_argtable(cmdutils_argschema_t* schema);
+
+/// Like cmdutils_parsestring(), but *pargv points to a per-thread array that
+/// is valid until the thread's next call.  Nothing to free.  Returns argc,
+/// -2 if the per-thread state is unavailable, -3 on too many arguments.
+int cmdutils_parseargs(char*** pargv, const char* cmdname, char* src, size_t src_limit);
+
+/// Sets the allocators argtable uses for parsing.  Prebuilt argtables are
+/// always built with the standard allocators.
+void cmdutils_set_allocators(void* (*malloc_fn)(size_t), void (*free_fn)(void*));
+
+
 int cmdutils_argcheck(void* argtable, struct arg_end* end, int argc, char** argv);
 
+/// arg_parse(), recorded as a trace span
+int cmdutils_argparse(int argc, char** argv, void* argtable);
+
 
 #define INPUT_SANITIZE() do { \
     if ((src == NULL) || (dst == NULL)) {   \
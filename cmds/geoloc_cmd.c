@@ -26,6 +26,8 @@
 #include "dterm.h"
 #include "birdmon_app.h"
 #include "birdmon_cfg.h"
+#include "geocache.h"
+#include "lockprof.h"
 #include "utils.h"
 //#include "test.h"
 
@@ -38,6 +40,7 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -46,45 +49,81 @@
 #include <math.h>
 
 
+#define GEOLOC_BUFSIZE  32768
+
+
+
+static int sub_urlencode(char* dst, size_t dstmax, const char* src) {
+/// Percent-encodes src for a query string.  Returns the length, or -1 if it
+/// does not fit.
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    for (; *src != 0; src++) {
+        uint8_t c = (uint8_t)*src;
+        if (isalnum(c) || (c == '-') || (c == '_') || (c == '.') || (c == '~')) {
+            if (len+1 >= dstmax) return -1;
+            dst[len++] = (char)c;
+        }
+        else {
+            if (len+3 >= dstmax) return -1;
+            dst[len++] = '%';
+            dst[len++] = hex[c >> 4];
+            dst[len++] = hex[c & 15];
+        }
+    }
+    dst[len] = 0;
+    return (int)len;
+}
+
+
+static void sub_geoloc_argtable(void** argtable) {
+    argtable[0] = arg_lit0("e","echo",
+                           "echo the resolved lat/lon");
+    argtable[1] = arg_str0("m","mode","geo|postal|wlan|ip",
+                           "Mode to use for location info. Default: geo");
+    argtable[2] = arg_str1(NULL,NULL,"location info",
+                           "geo:lat/lon, postal:\"mailing address\", wlan:if, ip:ipaddr");
+    argtable[3] = arg_end(4);
+}
+
+static cmdutils_argschema_t geoloc_schema = { .size = 4, .build = &sub_geoloc_argtable };
 
 
 
 int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     char** argv;
+    void** argtable;
     int argc;
     int rc = 0;
     birdmon_app_t* appdata;
     
     if (dth == NULL) {
-        return 0;
+        return cmdutils_argschema(&geoloc_schema);
     }
     
     INPUT_SANITIZE();
 
     appdata = dth->ext;
-    argc = cmdutils_parsestring(dth->tctx, &argv, "geoloc", (char*)src, (size_t)*inbytes);
+    argc     = cmdutils_parseargs(&argv, "geoloc", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&geoloc_schema);
     if (argc <= 0) {
         rc = -256 + argc;
     }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
     else {
-        struct arg_lit* echo    = arg_lit0("e","echo",
-                                            "echo results of geolocation operation");
-        struct arg_str* mode    = arg_str0("m","mode","geo|postal|wlan|ip", 
-                                            "Mode to use for location info. Default: geo");
-        struct arg_str* loc     = arg_str1(NULL,NULL,"location info",
-                                            "geo:lat/lon, postal:\"mailing address\", wlan:if, ip:ipaddr");
-        struct arg_end* end     = arg_end(4);
-        void* argtable[]        = { echo, mode, loc, end };
+        struct arg_lit* echo    = argtable[0];
+        struct arg_str* mode    = argtable[1];
+        struct arg_str* loc     = argtable[2];
+        struct arg_end* end     = argtable[3];
         int mode_type;
         double lat = NAN;
         double lon = NAN;
 
         ///@todo wrap this routine into cmdutils subroutine
-        if (arg_nullcheck(argtable) != 0) {
-            rc = -1;
-            goto cmd_geoloc_TERM;
-        }
-        if ((argc <= 1) || (arg_parse(argc, argv, argtable) > 0)) {
+        if ((argc <= 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
             arg_print_errors(stderr, end, argv[0]);
             rc = -2;
             goto cmd_geoloc_TERM;
@@ -149,14 +188,27 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
         // Return value is JSON that gets parsed and evaluated.
         case 1: {
             char gmaps_qstr[1024];
-            uint8_t filebuf[4096];
-            size_t filebuf_max = sizeof(filebuf);
+            char key[GEOCACHE_KEYMAX];
+            uint8_t* filebuf;
+            size_t filebuf_max = GEOLOC_BUFSIZE;
             const char* gmaps_key;
+            const char* status = NULL;
+            size_t keylen;
+            int qlen;
             cJSON* top_obj;
             cJSON* obj;
             const char* walkv[] = {"results", "0", "geometry", "location"};
             
-            // Build URI Querystring with API Key
+            // Addresses are looked up in the cache first.  An address that
+            // could not be found stays not found until its entry expires.
+            keylen = geocache_key(key, loc->sval[0]);
+            if (keylen != 0) {
+                if (geocache_get(key, &lat, &lon) != GEOCACHE_miss) {
+                    break;
+                }
+            }
+            
+            // Build URI Querystring with API Key and address
             gmaps_key = otvar_get_string(dth->vardict, "gmaps_key");
             if (gmaps_key == NULL) {
                 rc = -512 -8;
@@ -164,12 +216,32 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
                 goto cmd_geoloc_TERM;
             }
             
-            snprintf(gmaps_qstr, sizeof(gmaps_qstr), "%s%s", 
+            qlen = snprintf(gmaps_qstr, sizeof(gmaps_qstr), "%s%s&address=", 
                         otvar_get_string(dth->vardict, "gmaps_uri"),
                         gmaps_key);
+            if ((qlen < 0) || (sub_urlencode(&gmaps_qstr[qlen], sizeof(gmaps_qstr)-qlen, loc->sval[0]) < 0)) {
+                rc = -512 -9;
+                sprintf((char*)dst, "postal address is too long");
+                goto cmd_geoloc_TERM;
+            }
             
+            // Responses carry the full address breakdown, often over 4 KB
+            filebuf = malloc(filebuf_max);
+            if (filebuf == NULL) {
+                rc = -512 -10;
+                sprintf((char*)dst, "out of memory");
+                goto cmd_geoloc_TERM;
+            }
+            
+            // Other commands can run while the geocoder is answering.  If
+            // the caller does not hold the isolation mutex, it is not
+            // released, and the download runs under the caller's lock.
+            filebuf[0] = 0;
+            dterm_iso_unlock(dth);
             rc = utils_downloader(gmaps_qstr, (char*)dst, filebuf, &filebuf_max, false);
+            dterm_iso_lock(dth);
             if (rc < 0) {
+                free(filebuf);
                 rc -= 512;
                 goto cmd_geoloc_TERM;
             }
@@ -185,7 +257,10 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
             obj     = top_obj;
             if (cJSON_IsObject(obj)) {
                 obj = cJSON_GetObjectItemCaseSensitive(obj, "status");
-                if (cJSON_IsString(obj) && (strcmp(obj->valuestring, "OK") == 0)) {
+                if (cJSON_IsString(obj)) {
+                    status = obj->valuestring;
+                }
+                if ((status != NULL) && (strcmp(status, "OK") == 0)) {
                     obj = cJSON_walk(top_obj, 4, walkv);
                     if (cJSON_IsObject(obj)) {
                         cJSON* data;
@@ -200,7 +275,20 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
                     }
                 }
             }
-            cJSON_free(top_obj);
+            
+            // Only answers about the address are cached.  Errors like an
+            // over-quota or a denied key are not, so the next call retries.
+            if (keylen != 0) {
+                if (!isnan(lat) && !isnan(lon)) {
+                    geocache_put(key, true, lat, lon);
+                }
+                else if ((status != NULL) 
+                     && ((strcmp(status, "ZERO_RESULTS") == 0) || (strcmp(status, "OK") == 0))) {
+                    geocache_put(key, false, 0., 0.);
+                }
+            }
+            cJSON_Delete(top_obj);
+            free(filebuf);
             
         } break;
         
@@ -220,23 +308,28 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
 
         /// If lat and lon variables are available (not NAN), then the location
         /// resolution succeeded.
-        if ((lat != NAN) && (lon != NAN)) {
-            pthread_mutex_lock(&appdata->ctx->data_mutex);
+        if (!isnan(lat) && !isnan(lon)) {
+            LP_LOCK(&appdata->ctx->data_mutex, LOCK_data);
             appdata->ctx->client_lat = lat;
             appdata->ctx->client_lon = lon;
-            pthread_mutex_unlock(&appdata->ctx->data_mutex);
+            LP_UNLOCK(&appdata->ctx->data_mutex, LOCK_data);
             rc = 0;
+            
+            if (echo->count > 0) {
+                if ((cliopt_getformat() == FORMAT_Json) || (cliopt_getformat() == FORMAT_JsonHex)) {
+                    rc = snprintf((char*)dst, dstmax, "{\"geoloc\":{\"lat\":%.7f, \"lon\":%.7f}}\n", lat, lon);
+                }
+                else {
+                    rc = snprintf((char*)dst, dstmax, "geoloc %.7f %.7f\n", lat, lon);
+                }
+            }
         }
         else {
             sprintf((char*)dst, "lat/lon could not be resolved");
             rc = -512 -32;
         }
-        
-        cmd_geoloc_TERM:
-        arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
     }
 
-    cmdutils_freeargv(dth->tctx, argv);
-    
+    cmd_geoloc_TERM:
     return rc;
 }
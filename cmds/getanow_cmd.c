@@ -23,6 +23,10 @@
 #include "dterm.h"
 #include "birdmon_app.h"
 #include "birdmon_cfg.h"
+#include "arena.h"
+#include "compress.h"
+#include "jobsched.h"
+#include "lockprof.h"
 #include "utils.h"
 //#include "test.h"
 
@@ -33,10 +37,13 @@
 
 // Standard C & POSIX Libraries
 #include <search.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 // Libcurl for hitting HTTP
@@ -112,169 +119,614 @@ const char *ubx_mga_symbol(ubx_header_t* h) {
 
 
 
+/* A packet that the client already holds, per the getanow --have summary */
+typedef struct {
+    uint32_t key;
+    uint32_t digest;
+    bool     found;
+} held_pkt_t;
+
+
+
+/* Comparison function for qsort(3) and bsearch(3) */
+static int held_cmp(const void *x, const void *y) {
+    uint32_t k1 = ((const held_pkt_t*)x)->key;
+    uint32_t k2 = ((const held_pkt_t*)y)->key;
+    return (k1 > k2) - (k1 < k2);
+}
+
+
+
+/* Parse the summary supplied with --have.  It is a hex string of 7 byte
+ * records, where each record is a 3 byte packet key followed by a 4 byte
+ * packet digest, both big endian.  See ubx_pkt_t in backend.h.
+ *
+ * Upon success, return the number of records (sorted by key), or a negative
+ * value if the summary is malformed or cannot be stored. */
+static int sub_parse_held(held_pkt_t** held, const char* summary) {
+    size_t hexlen;
+    uint8_t* bytes;
+    int count;
+    
+    *held   = NULL;
+    hexlen  = strlen(summary);
+    if ((hexlen % 14) != 0) {
+        return -1;
+    }
+    count = (int)(hexlen / 14);
+    if (count == 0) {
+        return 0;
+    }
+    
+    bytes = arena_alloc((hexlen / 2) + 1);
+    *held = arena_alloc(count * sizeof(held_pkt_t));
+    if ((bytes == NULL) || (*held == NULL)) {
+        arena_free(bytes);
+        arena_free(*held);
+        *held = NULL;
+        return -2;
+    }
+    
+    cmdutils_hexstr_to_uint8(bytes, summary);
+    for (int i=0; i<count; i++) {
+        uint8_t* rec = &bytes[i*7];
+        (*held)[i].key      = ((uint32_t)rec[0] << 16) | ((uint32_t)rec[1] << 8) | rec[2];
+        (*held)[i].digest   = ((uint32_t)rec[3] << 24) | ((uint32_t)rec[4] << 16) 
+                            | ((uint32_t)rec[5] << 8)  | rec[6];
+        (*held)[i].found    = false;
+    }
+    arena_free(bytes);
+    
+    qsort(*held, count, sizeof(held_pkt_t), &held_cmp);
+    return count;
+}
+
+
+
+/* Options that shape the getanow output */
+typedef struct {
+    FORMAT_Type fmt;
+    const char* etag;
+    time_t      nextfetch;
+    bool        stale;
+    bool        delta;
+    held_pkt_t* held;
+    int         numheld;
+} anow_render_t;
+
+
+
+/* Write binary data to the sink as base64 or as a hex string, in chunks so
+ * that the encoding never has to fit in the buffer all at once. */
+static int sub_sink_base64(dterm_sink_t* sink, const uint8_t* src, size_t srclen) {
+    while (srclen > 0) {
+        size_t chunk = (srclen < 768) ? srclen : 768;
+        char* dcurs  = (char*)dterm_sink_reserve(sink, ((chunk + 2) / 3) * 4 + 1);
+        if (dcurs == NULL) {
+            return sink->err;
+        }
+        dterm_sink_commit(sink, cmdutils_uint8_to_base64(dcurs, (uint8_t*)src, chunk));
+        src     += chunk;
+        srclen  -= chunk;
+    }
+    return 0;
+}
+
+static int sub_sink_hexstr(dterm_sink_t* sink, const uint8_t* src, size_t srclen) {
+    while (srclen > 0) {
+        size_t chunk = (srclen < 512) ? srclen : 512;
+        char* dcurs  = (char*)dterm_sink_reserve(sink, (chunk * 2) + 1);
+        if (dcurs == NULL) {
+            return sink->err;
+        }
+        dterm_sink_commit(sink, cmdutils_uint8_to_hexstr(dcurs, (uint8_t*)src, chunk));
+        src     += chunk;
+        srclen  -= chunk;
+    }
+    return 0;
+}
+
+
+
+/* True if the client holds the packet unchanged.  Packets it holds are
+ * marked found, so the ones left unfound are its tombstones. */
+static bool sub_held_skip(anow_render_t* opt, const ubx_pkt_t* pkt) {
+    held_pkt_t needle = { .key = pkt->key };
+    held_pkt_t* match;
+    
+    if (opt->numheld <= 0) {
+        return false;
+    }
+    match = bsearch(&needle, opt->held, opt->numheld, sizeof(held_pkt_t), &held_cmp);
+    if (match == NULL) {
+        return false;
+    }
+    match->found = true;
+    return (match->digest == pkt->digest);
+}
+
+
+/* Write the keys the client holds that are no longer in the snapshot.  JSON
+ * gets a "del" member, the default format "del" lines, and the others have
+ * no way to carry them. */
+static void sub_sink_tombstones(dterm_sink_t* sink, anow_render_t* opt) {
+    const char* sep = "";
+    
+    switch (opt->fmt) {
+        default: break;
+        
+        case FORMAT_Default: 
+            for (int i=0; i<opt->numheld; i++) {
+                if (opt->held[i].found == false) {
+                    dterm_sink_printf(sink, "del %06X\n", opt->held[i].key);
+                }
+            }
+            break;
+            
+        case FORMAT_Json:
+        case FORMAT_JsonHex: 
+            dterm_sink_printf(sink, ", \"del\":[");
+            for (int i=0; i<opt->numheld; i++) {
+                if (opt->held[i].found == false) {
+                    dterm_sink_printf(sink, "%s\"%06X\"", sep, opt->held[i].key);
+                    sep = ",";
+                }
+            }
+            dterm_sink_write(sink, "]", 1);
+            break;
+    }
+}
+
+
+
+/* Render the snapshot into the sink in the requested format.  On delta,
+ * packets that the client holds unchanged are skipped and its missing keys
+ * are marked as tombstones.  When the sink is a request sink, the snapshot
+ * is streamed to the client whatever its size.  When it is a plain buffer
+ * and is full, output stops at a packet boundary.
+ *
+ * Return 0, or negative if the sink failed. */
+static int sub_render_anow(dterm_sink_t* sink, assistnow_t* anow, anow_render_t* opt) {
+    const char* sep = "";
+    
+    // Print the front material
+    switch (opt->fmt) {
+        default: break;
+        
+        case FORMAT_Default:
+            dterm_sink_printf(sink, "ubx_anow hash=%s timestamp=%lu next=%lu stale=%i\n",
+                        opt->etag, anow->timestamp, opt->nextfetch, (int)opt->stale);
+            break;
+        
+        // At present, JSON and JSONHex treatment is the same, because 
+        // a full-featured ubx data parser isn't implemented yet.
+        case FORMAT_Json:
+        case FORMAT_JsonHex: 
+            dterm_sink_printf(sink, 
+                        "{\"ubx_anow\":{\"hash\":\"%s\", \"timestamp\":%lu, \"next\":%lu, \"stale\":%s, \"delta\":%s, \"pkt\":[", 
+                        opt->etag, anow->timestamp, opt->nextfetch, opt->stale ? "true" : "false", 
+                        opt->delta ? "true" : "false");
+            break;
+        
+        // For hexdump, it all happens here unless this is a delta, in
+        // which case the changed frames are dumped in the packet loop.
+        case FORMAT_Hex: {
+            uint8_t* scurs;
+            size_t remaining;
+            if (opt->delta) {
+                break;
+            }
+            scurs       = anow->buf;
+            remaining   = anow->bufsize;
+            while (remaining > 0) {
+                size_t chunk    = (remaining < 512) ? remaining : 512;
+                size_t accum    = 0;
+                uint8_t* dcurs  = dterm_sink_reserve(sink, (chunk * 2) + 1);
+                if (dcurs == NULL) {
+                    return sink->err;
+                }
+                fmt_printhex(dcurs, &accum, &scurs, chunk, 0);
+                dterm_sink_commit(sink, accum);
+                remaining -= chunk;
+            }
+            dterm_sink_write(sink, "\n", 1);
+        } return sink->err;
+    }
+    
+    // Print each packet
+    for (int i=0; i<anow->numpkts; i++) {
+        const char* pkt_type    = ubx_mga_symbol(&anow->pkt[i].hdr);
+        uint8_t* scurs          = anow->pkt[i].data;
+        size_t accum            = 0;
+        size_t remaining;
+        char* dcurs;
+        
+        if (sub_held_skip(opt, &anow->pkt[i])) {
+            continue;
+        }
+        
+        // Worst case for a packet: hex payload and frame, line breaks, and
+        // the envelope text.
+        remaining   = ((anow->pkt[i].len + 8) * 3) + 192;
+        dcurs       = (char*)dterm_sink_reserve(sink, remaining);
+        if (dcurs == NULL) {
+            break;
+        }
+    
+        switch (opt->fmt) {
+            default:
+            case FORMAT_Default: {
+                accum = snprintf(dcurs, remaining, "ubx %s\n", pkt_type);
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 16);
+            } break;
+            
+            // At present, JSON and JSONHex treatment is the same, because 
+            // a full-featured ubx data parser isn't implemented yet.
+            case FORMAT_Json:
+            case FORMAT_JsonHex: {
+                accum = snprintf(dcurs, remaining, 
+                                "%s{\"type\":\"%s\", \"key\":\"%06X\", \"dig\":\"%08X\", \"size\":%u, \"dat\":",
+                                sep, pkt_type, anow->pkt[i].key, anow->pkt[i].digest, 
+                                (unsigned int)anow->pkt[i].len);
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 0);
+                dcurs[accum++] = '}';
+                sep = ",";
+            } break;
+            
+            case FORMAT_Bintex: {
+                accum = snprintf(dcurs, remaining, "\"ubx %s\"", pkt_type);
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 0);
+                dcurs[accum++] = '\n';
+            } break;
+            
+            // Only reached on delta: dump the whole UBX frame
+            case FORMAT_Hex: {
+                scurs = anow->pkt[i].data - 6;
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len + 8, 0);
+            } break;
+        }
+        dterm_sink_commit(sink, accum);
+    }
+    
+    // Print the back material, including tombstones on delta.
+    // Hex output is raw frames only, so it has no way to carry tombstones.
+    switch (opt->fmt) {
+        default: break;
+        
+        case FORMAT_Default: 
+            sub_sink_tombstones(sink, opt);
+            break;
+            
+        case FORMAT_Json:
+        case FORMAT_JsonHex: 
+            dterm_sink_write(sink, "]", 1);
+            if (opt->delta) {
+                sub_sink_tombstones(sink, opt);
+            }
+            dterm_sink_write(sink, "}}\n", 3);
+            break;
+            
+        case FORMAT_Hex:
+            dterm_sink_write(sink, "\n", 1);
+            break;
+    }
+    
+    return sink->err;
+}
+
+
+
+/* Write compressed bytes to the sink, wrapped in the envelope of the format.
+ * JSON and default formats carry them as base64, hex formats as hex.  They
+ * decompress to UBX frames, as rawsize bytes.  dict is the id of the
+ * dictionary they need (getanow --dict), or 0 for none.
+ *
+ * Return 0, or negative if the sink failed */
+static int sub_emit_compressed(dterm_sink_t* sink, assistnow_t* anow, anow_render_t* opt, COMP_Type comp,
+                               const uint8_t* zdata, size_t zsize, size_t rawsize, uint32_t dict) {
+    switch (opt->fmt) {
+        case FORMAT_Json:
+        case FORMAT_JsonHex:
+            dterm_sink_printf(sink, 
+                        "{\"ubx_anow\":{\"hash\":\"%s\", \"timestamp\":%lu, \"next\":%lu, \"stale\":%s, \"delta\":%s, "
+                        "\"enc\":\"%s\", \"dict\":\"%08X\", \"rawsize\":%zu, \"z\":\"", 
+                        opt->etag, anow->timestamp, opt->nextfetch, opt->stale ? "true" : "false", 
+                        opt->delta ? "true" : "false", compress_name(comp), dict, rawsize);
+            sub_sink_base64(sink, zdata, zsize);
+            dterm_sink_write(sink, "\"", 1);
+            if (opt->delta) {
+                sub_sink_tombstones(sink, opt);
+            }
+            dterm_sink_write(sink, "}}\n", 3);
+            break;
+            
+        case FORMAT_Default:
+            dterm_sink_printf(sink, 
+                        "ubx_anow hash=%s timestamp=%lu next=%lu stale=%i enc=%s dict=%08X rawsize=%zu\n",
+                        opt->etag, anow->timestamp, opt->nextfetch, (int)opt->stale, compress_name(comp), 
+                        dict, rawsize);
+            sub_sink_base64(sink, zdata, zsize);
+            dterm_sink_write(sink, "\n", 1);
+            sub_sink_tombstones(sink, opt);
+            break;
+            
+        default:
+            sub_sink_hexstr(sink, zdata, zsize);
+            dterm_sink_write(sink, "\n", 1);
+            break;
+    }
+    
+    return sink->err;
+}
+
+
+
+/* Compressed output.  The full snapshot was compressed once, when the
+ * backend built it, so it is only copied out.  A delta is specific to the
+ * client: its frames are compressed here, at the request effort, on a
+ * compression context of this thread.
+ *
+ * Return 0, or negative on error. */
+static int sub_getanow_compressed(dterm_sink_t* sink, assistnow_t* anow, anow_render_t* opt, COMP_Type comp) {
+    uint8_t* frames;
+    uint8_t* zdata;
+    size_t rawsize = 0;
+    size_t zmax;
+    uint32_t dict;
+    int rc;
+    
+    if (opt->delta == false) {
+        if ((anow->zbuf == NULL) && (anow->bufsize != 0)) {
+            return -2;
+        }
+        return sub_emit_compressed(sink, anow, opt, comp, anow->zbuf, anow->zsize, anow->bufsize, anow->zdict);
+    }
+    
+    frames = arena_alloc(anow->bufsize + 1);
+    if (frames == NULL) {
+        return -1;
+    }
+    for (int i=0; i<anow->numpkts; i++) {
+        size_t framelen = 6 + anow->pkt[i].len + 2;
+        if (sub_held_skip(opt, &anow->pkt[i]) == false) {
+            memcpy(&frames[rawsize], anow->pkt[i].data - 6, framelen);
+            rawsize += framelen;
+        }
+    }
+    
+    zmax    = compress_bound(comp, rawsize);
+    zdata   = arena_alloc(zmax + 1);
+    if (zdata == NULL) {
+        arena_free(frames);
+        return -1;
+    }
+    rc = compress_run(comp, COMP_request, zdata, zmax, frames, rawsize, &dict);
+    arena_free(frames);
+    if (rc >= 0) {
+        rc = sub_emit_compressed(sink, anow, opt, comp, zdata, (size_t)rc, rawsize, dict);
+    }
+    arena_free(zdata);
+    return rc;
+}
+
+
+
+static void sub_getanow_argtable(void** argtable) {
+    argtable[0] = arg_int0("a","age","seconds",
+                           "Maximum allowable age of returned AGNSS data (default = infinity)");
+    argtable[1] = arg_str0("H","have","summary",
+                           "Return only packets not in summary (hex: 3 byte key + 4 byte digest per packet)");
+    argtable[2] = arg_str0(NULL,"if-none-match","hash",
+                           "Return only a not-modified response if snapshot hash matches");
+    argtable[3] = arg_str0("z","compress","none|zstd",
+                           "Return the UBX frames compressed (default = none)");
+    argtable[4] = arg_lit0(NULL,"dict",
+                           "Return the dictionary needed to decompress -z output");
+    argtable[5] = arg_end(4);
+}
+
+static cmdutils_argschema_t getanow_schema = { .size = 6, .build = &sub_getanow_argtable };
+
+
+
 int cmd_getanow(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     char** argv;
+    void** argtable;
     int argc;
     int rc = 0;
     birdmon_app_t* appdata;
     
     if (dth == NULL) {
-        return 0;
+        return cmdutils_argschema(&getanow_schema);
     }
     
     INPUT_SANITIZE();
 
     appdata = dth->ext;
-    argc = cmdutils_parsestring(dth->tctx, &argv, "getanow", (char*)src, (size_t)*inbytes);
+    argc     = cmdutils_parseargs(&argv, "getanow", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&getanow_schema);
     if (argc <= 0) {
         rc = -256 + argc;
     }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
     else {
-        struct arg_int* age = arg_int0("a","age","seconds", 
-                                            "Maximum allowable age of returned AGNSS data (default = infinity)");
-        struct arg_end* end = arg_end(4);
-        void* argtable[]    = { age, end };
+        struct arg_int* age = argtable[0];
+        struct arg_str* have= argtable[1];
+        struct arg_str* inm = argtable[2];
+        struct arg_str* zip = argtable[3];
+        struct arg_lit* dict= argtable[4];
+        struct arg_end* end = argtable[5];
         assistnow_t* anow;
-        char* dcurs;
+        char etag[SHA256_SIZE*2 + 1];
+        anow_render_t opt;
+        int comp            = COMP_none;
+        dterm_sink_t local;
+        dterm_sink_t* sink;
+        held_pkt_t* held    = NULL;
+        int numheld         = 0;
 
         ///@todo wrap this routine into cmdutils subroutine
-        if (arg_nullcheck(argtable) != 0) {
-            rc = -1;
-            goto cmd_getanow_TERM;
-        }
-        if ((argc < 1) || (arg_parse(argc, argv, argtable) > 0)) {
+        if ((argc < 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
             arg_print_errors(stderr, end, argv[0]);
             rc = -2;
             goto cmd_getanow_TERM;
         }
+        
+        if (zip->count > 0) {
+            comp = compress_type(zip->sval[0]);
+            if (comp < 0) {
+                sprintf((char*)dst, "compression \"%s\" not supported", zip->sval[0]);
+                rc = -4;
+                goto cmd_getanow_TERM;
+            }
+        }
+        
+        // The dictionary is made from the first snapshot, and kept for the
+        // life of the daemon.  Clients fetch it once, and again when the
+        // dict id in -z output changes.
+        if (dict->count > 0) {
+            size_t dictsize;
+            uint32_t dictid;
+            const uint8_t* dictdata = compress_dict(&dictsize, &dictid);
+            if (dictdata == NULL) {
+                sprintf((char*)dst, "dictionary not available");
+                rc = -4;
+                goto cmd_getanow_TERM;
+            }
+            sink = dterm_sink_open(&local, dst, dstmax);
+            switch (cliopt_getformat()) {
+                case FORMAT_Json:
+                case FORMAT_JsonHex:
+                    dterm_sink_printf(sink, "{\"ubx_anow_dict\":{\"id\":\"%08X\", \"size\":%zu, \"d\":\"", dictid, dictsize);
+                    sub_sink_base64(sink, dictdata, dictsize);
+                    dterm_sink_write(sink, "\"}}\n", 4);
+                    break;
+                case FORMAT_Default:
+                    dterm_sink_printf(sink, "ubx_anow_dict id=%08X size=%zu\n", dictid, dictsize);
+                    sub_sink_base64(sink, dictdata, dictsize);
+                    dterm_sink_write(sink, "\n", 1);
+                    break;
+                default:
+                    sub_sink_hexstr(sink, dictdata, dictsize);
+                    dterm_sink_write(sink, "\n", 1);
+                    break;
+            }
+            rc = dterm_sink_close(sink);
+            if (rc < 0) {
+                sprintf((char*)dst, "dictionary could not be written");
+            }
+            goto cmd_getanow_TERM;
+        }
+        
+        // A delta request carries a summary of the packets the client holds.
+        // Only changed or missing packets are returned, plus a list of keys
+        // the client holds that are no longer in the snapshot (tombstones).
+        if (have->count > 0) {
+            numheld = sub_parse_held(&held, have->sval[0]);
+            if (numheld < 0) {
+                sprintf((char*)dst, "--have summary is malformed");
+                rc = -3;
+                goto cmd_getanow_TERM;
+            }
+        }
 
         // If a max-age parameter is provided, we need to make sure the agnss
-        // file is acceptably fresh.  This is done by signalling the backend,
-        // and then waiting for it to release the data.
+        // file is acceptably fresh.  The age is that of the last ephemeris
+        // fetch, as the other feeds merge into the same snapshot on their
+        // own schedules.  A stale one is refreshed by running the fetch job,
+        // and then waiting for the next ephemeris fetch to be done.  The
+        // generation is read before the job is started, so a fetch that is
+        // done before the wait is not missed.  Other commands may run during
+        // the wait.  If the fetch fails, the snapshot is the last good one,
+        // flagged as stale.
         if (age->count > 0) {
             time_t now;
             time_t delta_s;
+            unsigned int gen;
             
             now     = time(NULL);
-            pthread_mutex_lock(&appdata->ctx->data_mutex);
-            delta_s = appdata->ctx->assistnow.timestamp;
-            pthread_mutex_unlock(&appdata->ctx->data_mutex);
+            LP_LOCK(&appdata->ctx->data_mutex, LOCK_data);
+            delta_s = appdata->ctx->feed[0].fetched;
+            LP_UNLOCK(&appdata->ctx->data_mutex, LOCK_data);
             delta_s = (delta_s < now) ? (now - delta_s) : 0;
             
             if (delta_s > (time_t)age->ival[0]) {
-                pthread_mutex_lock(&appdata->ctx->cronmutex);
-                appdata->ctx->croncond_pred = false;
-                pthread_cond_signal(&appdata->ctx->croncond);
-                pthread_mutex_unlock(&appdata->ctx->cronmutex);
+                LP_LOCK(&appdata->ctx->readymutex, LOCK_ready);
+                gen = appdata->ctx->ready_gen;
+                LP_UNLOCK(&appdata->ctx->readymutex, LOCK_ready);
+                jobsched_run_now(ANOW_JOB);
                 
-                pthread_mutex_lock(&appdata->ctx->readymutex);
-                appdata->ctx->readycond_cnt++;
-                while (appdata->ctx->readycond_cnt > 0) {
-                    pthread_cond_wait(&appdata->ctx->readycond, &appdata->ctx->readymutex);
+                dterm_iso_unlock(dth);
+                LP_LOCK(&appdata->ctx->readymutex, LOCK_ready);
+                while (appdata->ctx->ready_gen == gen) {
+                    LP_COND_WAIT(&appdata->ctx->readycond, &appdata->ctx->readymutex, LOCK_ready);
                 }
-                pthread_mutex_unlock(&appdata->ctx->readymutex);
+                LP_UNLOCK(&appdata->ctx->readymutex, LOCK_ready);
+                dterm_iso_lock(dth);
             }
         }
         
         /// Process the data for the client.  Right now, the output format is
         /// controlled by the "fmt" command line option, but potentially in the
         /// future we could override this with specific flags to this command.
-        pthread_mutex_lock(&appdata->ctx->data_mutex);
-        
-        // Print the front material
-        anow    = &appdata->ctx->assistnow;
-        dcurs   = (char*)dst;
-        switch (cliopt_getformat()) {
-            default: break;
-            
-            // At present, JSON and JSONHex treatment is the same, because 
-            // a full-featured ubx data parser isn't implemented yet.
-            case FORMAT_Json:
-            case FORMAT_JsonHex: 
-                dcurs += snprintf(dcurs, dstmax, 
-                            "{\"ubx_anow\":{\"timestamp\":%lu, \"pkt\":[", 
-                            anow->timestamp);
-                break;
-            
-            // For hexdump, it all happens here
-            case FORMAT_Hex: {
-                uint8_t* scurs  = anow->buf;
-                size_t accum    = 0;
-                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->bufsize, 0);
-                dcurs += accum;
-                strcpy(dcurs, "\n");
-                dcurs++;
-            } goto cmd_getanow_END;
-        }
+        /// The snapshot does not change while it is held, so the data mutex
+        /// is only needed to take it.
+        LP_LOCK(&appdata->ctx->data_mutex, LOCK_data);
+        anow            = backend_retain(appdata->ctx->assistnow);
+        opt.nextfetch   = appdata->ctx->nextfetch;
+        opt.stale       = appdata->ctx->stale;
+        LP_UNLOCK(&appdata->ctx->data_mutex, LOCK_data);
         
-        // Print each packet
-        for (int i=0; i<anow->numpkts; i++) {
-            const char* pkt_type    = ubx_mga_symbol(&anow->pkt[i].hdr);
-            uint8_t* scurs          = anow->pkt[i].data;
-            size_t accum            = 0;
-            int loadlen             = (int)((uint8_t*)dcurs-dst);
-            
-            if (loadlen > dstmax) {
-                break;
-            }
-            dstmax -= loadlen;
+        cmdutils_uint8_to_hexstr(etag, anow->hash, SHA256_SIZE);
+        opt.fmt         = cliopt_getformat();
+        opt.etag        = etag;
+        opt.delta       = (have->count > 0);
+        opt.held        = held;
+        opt.numheld     = numheld;
         
-            switch (cliopt_getformat()) {
-                default:
-                case FORMAT_Default: {
-                    dcurs += snprintf(dcurs, dstmax, "ubx %s\n", pkt_type);
-                    fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 16);
-                    dcurs += accum;
-                } break;
-                
-                // At present, JSON and JSONHex treatment is the same, because 
-                // a full-featured ubx data parser isn't implemented yet.
-                case FORMAT_Json:
-                case FORMAT_JsonHex: {
-                    dcurs += snprintf(dcurs, dstmax, 
-                                    "{\"type\":\"%s\", \"size\":%u, \"dat\":",
-                                    pkt_type, (unsigned int)anow->pkt[i].len);
-                    fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 0);
-                    dcurs += accum;
-                    strcpy(dcurs, "},");
-                    dcurs += 2;
-                } break;
+        // Conditional request: if the client already has this snapshot, it
+        // only gets the hash and the expected time of the next refresh.
+        // Hex and Bintex have no envelope, so they get an empty response.
+        // Everything else is streamed, so the snapshot is not limited by
+        // dstmax.
+        sink = dterm_sink_open(&local, dst, dstmax);
+        if ((inm->count > 0) && (strcasecmp(inm->sval[0], etag) == 0)) {
+            switch (opt.fmt) {
+                default: break;
                 
-                case FORMAT_Bintex: {
-                    dcurs += snprintf(dcurs, dstmax, "\"ubx %s\"", pkt_type);
-                    fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->pkt[i].len, 0);
-                    dcurs += accum;
-                    strcpy(dcurs, "\n");
-                    dcurs++;
-                } break;
+                case FORMAT_Default:
+                    dterm_sink_printf(sink, 
+                                "ubx_anow not-modified hash=%s timestamp=%lu next=%lu stale=%i\n",
+                                etag, anow->timestamp, opt.nextfetch, (int)opt.stale);
+                    break;
                 
-                case FORMAT_Hex: {
-                    
-                } break;
+                case FORMAT_Json:
+                case FORMAT_JsonHex:
+                    dterm_sink_printf(sink, 
+                                "{\"ubx_anow\":{\"hash\":\"%s\", \"timestamp\":%lu, \"next\":%lu, \"stale\":%s, \"notmodified\":true}}\n",
+                                etag, anow->timestamp, opt.nextfetch, opt.stale ? "true" : "false");
+                    break;
             }
         }
-        
-        // Print the back material
-        switch (cliopt_getformat()) {
-            default: break;
-            case FORMAT_Json:
-            case FORMAT_JsonHex: 
-                dcurs--;    // eat last comma
-                strcpy(dcurs, "]}}\n");
-                dcurs += 4;
-                break;
+        else if (comp != COMP_none) {
+            if (sub_getanow_compressed(sink, anow, &opt, (COMP_Type)comp) < 0) {
+                sink->err = (sink->err < 0) ? sink->err : -5;
+            }
         }
-        
-        rc = (int)((uint8_t*)dcurs - dst);
-        
-        cmd_getanow_END:
-        pthread_mutex_unlock(&appdata->ctx->data_mutex);
+        else {
+            sub_render_anow(sink, anow, &opt);
+        }
+        rc = dterm_sink_close(sink);
+        if (rc < 0) {
+            sprintf((char*)dst, "output could not be generated");
+        }
+        backend_release(anow);
         
         cmd_getanow_TERM:
-        arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+        arena_free(held);
     }
 
-    cmdutils_freeargv(dth->tctx, argv);
-    
     return rc;
 }
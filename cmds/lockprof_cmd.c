@@ -0,0 +1,104 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "cmds.h"
+#include "cmdutils.h"
+
+#include "cliopt.h"
+#include "cmds.h"
+#include "dterm.h"
+#include "birdmon_app.h"
+#include "birdmon_cfg.h"
+#include "lockprof.h"
+//#include "test.h"
+
+#include <argtable3.h>
+#include <bintex.h>
+#include <cJSON.h>
+#include <otvar.h>
+
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+
+
+
+
+static void sub_lockprof_argtable(void** argtable) {
+    argtable[0] = arg_lit0("r","reset", "clear the profile after printing it");
+    argtable[1] = arg_end(4);
+}
+
+static cmdutils_argschema_t lockprof_schema = { .size = 2, .build = &sub_lockprof_argtable };
+
+
+
+int cmd_lockprof(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    char** argv;
+    void** argtable;
+    int argc;
+    int rc = 0;
+    
+    if (dth == NULL) {
+        return cmdutils_argschema(&lockprof_schema);
+    }
+    
+    INPUT_SANITIZE();
+
+    argc     = cmdutils_parseargs(&argv, "lockprof", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&lockprof_schema);
+    if (argc <= 0) {
+        rc = -256 + argc;
+    }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
+    else {
+        struct arg_lit* reset   = argtable[0];
+        struct arg_end* end     = argtable[1];
+
+        ///@todo wrap this routine into cmdutils subroutine
+        if ((argc < 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
+            arg_print_errors(stderr, end, argv[0]);
+            rc = -2;
+            goto cmd_lockprof_TERM;
+        }
+        
+        if (BIRDMON_FEATURE(LOCKPROF) == DISABLED) {
+            sprintf((char*)dst, "lock profiling not built (make BIRDMON_LOCKPROF=1)");
+            rc = -3;
+            goto cmd_lockprof_TERM;
+        }
+        
+        rc = lockprof_print((char*)dst, dstmax, cliopt_getformat());
+        if (rc < 0) {
+            sprintf((char*)dst, "lock profile does not fit in output buffer");
+            rc = -4;
+        }
+        else if (reset->count > 0) {
+            lockprof_reset();
+        }
+    }
+
+    cmd_lockprof_TERM:
+    return rc;
+}
@@ -23,6 +23,8 @@
 #include "dterm.h"
 #include "birdmon_app.h"
 #include "birdmon_cfg.h"
+#include "jobsched.h"
+#include "lockprof.h"
 //#include "test.h"
 
 #include <argtable3.h>
@@ -42,37 +44,54 @@
 
 
 
+static void sub_schedule_argtable(void** argtable) {
+    argtable[0] = arg_lit0("n","now", "force the job to run now (in addition to scheduled times)");
+    argtable[1] = arg_lit0("l","list", "list the scheduled jobs");
+    argtable[2] = arg_int0("j","jitter","seconds", "most random delay added to each run of the job");
+    argtable[3] = arg_str0(NULL,"job","name", "job to change (default = "ANOW_JOB")");
+    argtable[4] = arg_str0(NULL,NULL,"cron-expression",
+                           "standard cron expression, including seconds field, or \""ANOW_ADAPTIVE"\" for the "ANOW_JOB" job");
+    argtable[5] = arg_end(4);
+}
+
+static cmdutils_argschema_t schedule_schema = { .size = 6, .build = &sub_schedule_argtable };
+
+
+
 int cmd_schedule(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     char** argv;
+    void** argtable;
     int argc;
     int rc = 0;
     birdmon_app_t* appdata;
     
     if (dth == NULL) {
-        return 0;
+        return cmdutils_argschema(&schedule_schema);
     }
     
     INPUT_SANITIZE();
 
     appdata = dth->ext;
-    argc = cmdutils_parsestring(dth->tctx, &argv, "geoloc", (char*)src, (size_t)*inbytes);
+    argc     = cmdutils_parseargs(&argv, "schedule", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&schedule_schema);
     if (argc <= 0) {
         rc = -256 + argc;
     }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
     else {
-        struct arg_lit* now     = arg_lit0("n","now", "force backend to run now (in addition to scheduled times)");
-        struct arg_str* cronexp = arg_str0(NULL,NULL,"cron-expression",
-                                            "standard cron expression, including seconds field");
-        struct arg_end* end     = arg_end(4);
-        void* argtable[]        = { now, cronexp, end };
+        struct arg_lit* now     = argtable[0];
+        struct arg_lit* list    = argtable[1];
+        struct arg_int* jitter  = argtable[2];
+        struct arg_str* job     = argtable[3];
+        struct arg_str* cronexp = argtable[4];
+        struct arg_end* end     = argtable[5];
+        const char* jobname     = (job->count > 0) ? job->sval[0] : ANOW_JOB;
         const char* error_str;
 
         ///@todo wrap this routine into cmdutils subroutine
-        if (arg_nullcheck(argtable) != 0) {
-            rc = -1;
-            goto cmd_schedule_TERM;
-        }
-        if ((argc < 1) || (arg_parse(argc, argv, argtable) > 0)) {
+        if ((argc < 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
             arg_print_errors(stderr, end, argv[0]);
             rc = -2;
             goto cmd_schedule_TERM;
@@ -82,29 +101,46 @@ int cmd_schedule(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src,
             return -3;
         }
         
-        pthread_mutex_lock(&appdata->ctx->data_mutex);
         if (cronexp->count > 0) {
-            cron_parse_expr(cronexp->sval[0], &appdata->ctx->cronexp, &error_str);
-            if (error_str != NULL) {
+            // The expression has spaces, so it arrives in quotes
+            const char* expr = cronexp->sval[0];
+            size_t exprlen   = strlen(expr);
+            char exprbuf[128];
+            
+            if ((exprlen >= 2) && (expr[0] == '\"') && (expr[exprlen-1] == '\"')) {
+                snprintf(exprbuf, sizeof(exprbuf), "%.*s", (int)(exprlen-2), &expr[1]);
+                expr = exprbuf;
+            }
+            if (strcmp(jobname, ANOW_JOB) == 0) {
+                rc = backend_schedule(appdata->ctx, expr, &error_str);
+            }
+            else {
+                rc = jobsched_set_cron(jobname, expr, &error_str);
+            }
+            if (rc == -2) {
                 strncpy((char*)dst, error_str, dstmax);
                 ///@todo need to add cron_parse_expr() to error module
                 rc = -4;
+                goto cmd_schedule_TERM;
             }
-            
         }
-        if (now->count > 0) {
-            pthread_mutex_lock(&appdata->ctx->cronmutex);
-            appdata->ctx->croncond_pred = false;
-            pthread_cond_signal(&appdata->ctx->croncond);
-            pthread_mutex_unlock(&appdata->ctx->cronmutex);
+        if ((rc == 0) && (jitter->count > 0)) {
+            rc = jobsched_set_jitter(jobname, jitter->ival[0] * 1000);
+        }
+        if ((rc == 0) && (now->count > 0)) {
+            rc = jobsched_run_now(jobname);
+        }
+        if (rc != 0) {
+            snprintf((char*)dst, dstmax, "job \"%s\" cannot be changed", jobname);
+            rc = -5;
+            goto cmd_schedule_TERM;
         }
-        pthread_mutex_unlock(&appdata->ctx->data_mutex);
         
-        cmd_schedule_TERM:
-        arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+        if (list->count > 0) {
+            rc = jobsched_print((char*)dst, dstmax, cliopt_getformat());
+        }
     }
 
-    cmdutils_freeargv(dth->tctx, argv);
-    
+    cmd_schedule_TERM:
     return rc;
 }
@@ -0,0 +1,117 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "cmds.h"
+#include "cmdutils.h"
+
+#include "cliopt.h"
+#include "cmds.h"
+#include "dterm.h"
+#include "birdmon_app.h"
+#include "birdmon_cfg.h"
+//#include "test.h"
+
+#include <argtable3.h>
+#include <bintex.h>
+#include <cJSON.h>
+#include <otvar.h>
+
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+
+
+
+
+
+static void sub_subscribe_argtable(void** argtable) {
+    argtable[0] = arg_lit0("x","off", "cancel the subscription");
+    argtable[1] = arg_str0(NULL,NULL,"notify|payload",
+                           "push hash & timestamp (notify, default) or the whole snapshot (payload)");
+    argtable[2] = arg_end(4);
+}
+
+static cmdutils_argschema_t subscribe_schema = { .size = 3, .build = &sub_subscribe_argtable };
+
+
+
+int cmd_subscribe(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    char** argv;
+    void** argtable;
+    int argc;
+    int rc = 0;
+    
+    if (dth == NULL) {
+        return cmdutils_argschema(&subscribe_schema);
+    }
+    
+    INPUT_SANITIZE();
+
+    argc     = cmdutils_parseargs(&argv, "subscribe", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&subscribe_schema);
+    if (argc <= 0) {
+        rc = -256 + argc;
+    }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
+    else {
+        struct arg_lit* off     = argtable[0];
+        struct arg_str* mode    = argtable[1];
+        struct arg_end* end     = argtable[2];
+        const char* modestr     = "notify";
+        uint32_t xid            = ANOW_XID_NOTIFY;
+
+        ///@todo wrap this routine into cmdutils subroutine
+        if ((argc < 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
+            arg_print_errors(stderr, end, argv[0]);
+            rc = -2;
+            goto cmd_subscribe_TERM;
+        }
+        
+        if (off->count > 0) {
+            dth->sub_xid = 0;
+            rc = snprintf((char*)dst, dstmax, "subscribe off\n");
+            goto cmd_subscribe_TERM;
+        }
+        
+        if (mode->count > 0) {
+            modestr = mode->sval[0];
+            if (strcmp(modestr, "payload") == 0) {
+                xid = ANOW_XID_PAYLOAD;
+            }
+            else if (strcmp(modestr, "notify") != 0) {
+                sprintf((char*)dst, "unknown mode \"%s\"", modestr);
+                rc = -3;
+                goto cmd_subscribe_TERM;
+            }
+        }
+        
+        // The xid is applied to the client by dterm once the command returns,
+        // and it stays in place until the client unsubscribes or disconnects.
+        dth->sub_xid = xid;
+        rc = snprintf((char*)dst, dstmax, "subscribe %s\n", modestr);
+    }
+
+    cmd_subscribe_TERM:
+    return rc;
+}
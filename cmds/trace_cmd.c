@@ -0,0 +1,147 @@
+/* Copyright 2014, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+// Local Headers
+#include "cmds.h"
+#include "cmdutils.h"
+
+#include "cliopt.h"
+#include "cmds.h"
+#include "dterm.h"
+#include "birdmon_app.h"
+#include "birdmon_cfg.h"
+#include "trace.h"
+//#include "test.h"
+
+#include <argtable3.h>
+#include <bintex.h>
+#include <cJSON.h>
+#include <otvar.h>
+
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+
+
+
+
+static void sub_trace_argtable(void** argtable) {
+    argtable[0] = arg_str0(NULL,NULL,"on|off|clear",
+                           "start or stop recording spans, or discard recorded spans");
+    argtable[1] = arg_file0("o","output","file",
+                            "write recorded spans to file as Chrome trace JSON.  Socket clients give a file name in the --tracedir of the daemon");
+    argtable[2] = arg_end(4);
+}
+
+static cmdutils_argschema_t trace_schema = { .size = 3, .build = &sub_trace_argtable };
+
+
+
+int cmd_trace(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
+    char** argv;
+    void** argtable;
+    int argc;
+    int rc = 0;
+    
+    if (dth == NULL) {
+        return cmdutils_argschema(&trace_schema);
+    }
+    
+    INPUT_SANITIZE();
+
+    argc     = cmdutils_parseargs(&argv, "trace", (char*)src, (size_t)*inbytes);
+    argtable = cmdutils_argtable(&trace_schema);
+    if (argc <= 0) {
+        rc = -256 + argc;
+    }
+    else if (argtable == NULL) {
+        rc = -1;
+    }
+    else {
+        struct arg_str* action  = argtable[0];
+        struct arg_file* out    = argtable[1];
+        struct arg_end* end     = argtable[2];
+        char* dcurs             = (char*)dst;
+        char path[1024];
+
+        ///@todo wrap this routine into cmdutils subroutine
+        if ((argc < 1) || (cmdutils_argparse(argc, argv, argtable) > 0)) {
+            arg_print_errors(stderr, end, argv[0]);
+            rc = -2;
+            goto cmd_trace_TERM;
+        }
+        
+        if (action->count > 0) {
+            if (strcmp(action->sval[0], "on") == 0) {
+                trace_enable(true);
+            }
+            else if (strcmp(action->sval[0], "off") == 0) {
+                trace_enable(false);
+            }
+            else if (strcmp(action->sval[0], "clear") == 0) {
+                trace_clear();
+            }
+            else {
+                sprintf((char*)dst, "unknown action \"%s\"", action->sval[0]);
+                rc = -3;
+                goto cmd_trace_TERM;
+            }
+        }
+        
+        // Socket clients may be remote, so they only name a file in the
+        // directory the daemon was started with.  The local console writes
+        // where it likes, as the user running the daemon.
+        if ((out->count > 0) && (dth->intf->type == INTF_socket)) {
+            const char* name = out->filename[0];
+            const char* dir  = trace_dir();
+            if (dir == NULL) {
+                sprintf((char*)dst, "trace output is not allowed on sockets without --tracedir");
+                rc = -5;
+                goto cmd_trace_TERM;
+            }
+            if ((name[0] == 0) || (name[0] == '.') || (strchr(name, '/') != NULL)
+            ||  (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))) {
+                sprintf((char*)dst, "trace output must be a file name, without a path");
+                rc = -6;
+                goto cmd_trace_TERM;
+            }
+        }
+        else if (out->count > 0) {
+            snprintf(path, sizeof(path), "%s", out->filename[0]);
+        }
+        
+        dcurs += snprintf(dcurs, dstmax, "trace %s", trace_isenabled() ? "on" : "off");
+        if (out->count > 0) {
+            int spans = trace_dump(path);
+            if (spans < 0) {
+                sprintf((char*)dst, "trace could not be written to %s", out->filename[0]);
+                rc = -4;
+                goto cmd_trace_TERM;
+            }
+            dcurs += snprintf(dcurs, dstmax - (dcurs - (char*)dst), " spans=%i file=%s", spans, out->filename[0]);
+        }
+        dcurs  = stpcpy(dcurs, "\n");
+        rc     = (int)(dcurs - (char*)dst);
+    }
+
+    cmd_trace_TERM:
+    return rc;
+}
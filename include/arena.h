@@ -0,0 +1,66 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef arena_h
+#define arena_h
+
+#include "cliopt.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/// Request memory.  Each thread has one arena, allocated on first use and
+/// kept for the life of the thread.  Between arena_begin() and arena_end(),
+/// arena_alloc() bumps a pointer in the arena, and arena_end() resets it.
+/// Allocations that do not fit go to malloc(), and are freed by arena_end()
+/// if they were not freed before.
+///
+/// Outside of arena_begin() / arena_end(), arena_alloc() and arena_free()
+/// are malloc() and free().  So they can be installed once, as the cJSON and
+/// argtable allocators, for every thread.
+///
+/// Memory from arena_alloc() must not be used after the arena_end() of the
+/// request it was allocated in.
+
+/** @brief Bind the calling thread's arena
+  * @param size     (size_t) arena size, used when the arena is created
+  * @retval bool    true if the arena was bound by this call, false if it was
+  *                 already bound (and arena_end() is for the outer caller)
+  */
+bool arena_begin(size_t size);
+
+/// Reset the calling thread's arena, and record its use for arena_print()
+void arena_end(void);
+
+void* arena_alloc(size_t size);
+void arena_free(void* ptr);
+
+/** @brief Print the arena size, use and high-water mark
+  * @param dst      (char*) output buffer
+  * @param dstmax   (size_t) size of dst
+  * @param fmt      (FORMAT_Type) FORMAT_Json(Hex) for JSON, otherwise text
+  * @retval int     bytes written to dst, or negative if dst is too small
+  *
+  * The high-water mark is the most memory any one request has used.  If it
+  * is above the arena size, requests are going to malloc() and the pool size
+  * should be raised.
+  */
+int arena_print(char* dst, size_t dstmax, FORMAT_Type fmt);
+
+
+#endif
@@ -18,11 +18,13 @@
 #define backend_h
 
 // Local Headers
+#include "cliopt.h"
 #include "formatters.h"
+#include "sha256.h"
+#include "ubx.h"
 //#include "birdmon_app.h"
 
 // HB Library Headers
-#include <ccronexpr.h>
 //#include <cJSON.h>
 
 // Standard C & POSIX Libraries
@@ -45,67 +47,179 @@ typedef enum {
 } backend_ds_t;
 
 
+/// A snapshot is not changed once it is published.  Each fetch merges its
+/// packets into a copy of the current snapshot, and swaps the copy in under
+/// the data mutex.  Readers take a reference with backend_retain(), also
+/// under the data mutex, and may then use the snapshot without the mutex
+/// until backend_release().
+///
+/// buf holds the packets, and the hash is a SHA-256 of it.  The hash is the
+/// snapshot's ETag, and it is all zeros in the empty snapshot that is there
+/// until the first fetch.  timestamp is the time of the last merge.  zbuf is
+/// buf compressed with zstd when the snapshot is built, using the dictionary
+/// zdict, or NULL if compression is not available.
 typedef struct {
-    unsigned char sync1;
-    unsigned char sync2;
-    unsigned char msg_class;
-    unsigned char msg_id;
-    unsigned short plen;
-} ubx_header_t;
-
-typedef struct {
-    size_t len;
-    ubx_header_t hdr;
-    uint8_t* data;
-} ubx_pkt_t;
-
-typedef struct {
+    int         refs;
     size_t      numpkts;
     ubx_pkt_t*  pkt;
     uint8_t*    buf;
     size_t      bufsize;
+    uint8_t*    zbuf;
+    size_t      zsize;
+    uint32_t    zdict;
     time_t      timestamp;
+    uint8_t     hash[SHA256_SIZE];
 } assistnow_t;
 
 
 
 
 
+/// Subscription transfer ids.  A client that subscribes takes one of these as
+/// its xid, and the backend publishes to it each time a snapshot is stored.
+/// - NOTIFY:   hash, timestamp and next fetch time of the new snapshot
+/// - PAYLOAD:  the same, plus the whole snapshot as hex
+#define ANOW_XID_NOTIFY     0x414E0001
+#define ANOW_XID_PAYLOAD    0x414E0002
+
+
+
+/// State of the adaptive fetch schedule.  The next fetch is planned from the
+/// earliest ephemeris expiry in the snapshot, less the "latency" variable
+/// (how long after a fetch clients may still be using the data).  Fetches
+/// that return the same snapshot back off.  cadence is a running average of
+/// the time between snapshots that changed, and fetches are not planned
+/// sooner than half a cadence after a change, unless data would expire.
+typedef struct {
+    bool        adaptive;
+    time_t      latency;
+    time_t      expires;
+    time_t      last_change;
+    time_t      cadence;
+    int         unchanged;
+    int         errors;
+} anow_plan_t;
+
+
+
+/// Upstream endpoints.  The "ubx_uri" variable is a list of URIs, separated
+/// by commas or spaces, in order of preference.  A fetch goes to the first
+/// one, and to the next one as well each time hedge_ms passes without a
+/// valid response.  The first response that passes the UBX checksums wins.
+/// hedge_ms is the p95 of the last ANOW_SAMPLES fetch times.  Only the fetch
+/// job uses this, so it has no lock.
+#define ANOW_SAMPLES        32
+
+typedef struct {
+    uint32_t    sample[ANOW_SAMPLES];   // fetch times, in ms
+    int         count;
+    int         next;
+    int         hedge_ms;
+    int         endpoint;               // winner of the last fetch
+} anow_hedge_t;
+
+
+
+/// AssistNow datatypes are fetched on their own schedules, each by a job of
+/// the scheduler.  Ephemerides change every couple of hours, and they are
+/// fetched by ANOW_JOB, on the schedule given to backend_start(), along with
+/// any datatype that has no feed of its own.  Almanacs and auxiliary data
+/// change about daily, and have slower cron schedules.  Only the datatypes
+/// in the "ubx_datatype" variable are fetched.
+///
+/// A fetch is merged into the snapshot by packet key, so per constellation,
+/// message type and SV.  Fetched packets replace the ones with the same key,
+/// unless they are ephemerides that expire sooner.  Other packets are kept
+/// until they expire, but not once their datatype or GNSS is dropped from
+/// "ubx_datatype" or "ubx_gnss", nor once a fetch of their datatype leaves
+/// them out.  Almanacs are kept for ANOW_ALM_MAXAGE at most.
+#define ANOW_FEEDS          3
+#define ANOW_CRON_ALM       "0 20 3 * * *"
+#define ANOW_CRON_AUX       "0 40 0/6 * * *"
+
+typedef struct {
+    const char* datatype;
+    const char* job;
+    const char* cron;
+    int         errors;             // failed fetches in a row
+    void*       appdata;
+    time_t      fetched;            // last good fetch, under data_mutex
+} anow_feed_t;
+
+
+
+
+
+
 // These files are generally opened via fmemopen(), which yields no remnant
 // in the filesystem
 typedef struct {
     pthread_mutex_t data_mutex;
     
-    pthread_cond_t  croncond;
-    pthread_mutex_t cronmutex;
-    bool            croncond_pred;
-    
     pthread_cond_t  readycond;
     pthread_mutex_t readymutex;
-    int             readycond_cnt;
+    unsigned int    ready_gen;      // ephemeris fetches done, good or failed
     
     double          client_lon;
     double          client_lat;
     
-    assistnow_t     assistnow;
+    assistnow_t*    assistnow;
+    bool            stale;          // a feed is failing: the snapshot is the last good one
     
-    cron_expr       cronexp;
-    time_t          cronbasis;
+    time_t          nextfetch;
+    anow_plan_t     plan;
+    anow_hedge_t    hedge;
+    anow_feed_t     feed[ANOW_FEEDS];
     
 } backend_ctx_t;
 
 
 
 
-int backend_init(backend_handle_t* handle, const char* cronstr);
+/// The ephemeris fetch is the job ANOW_JOB in the job scheduler.  Run it with
+/// jobsched_run_now(ANOW_JOB) to refresh the snapshot out of schedule.
+#define ANOW_JOB            "anow"
+#define ANOW_CRON_DEFAULT   "0 0 0/1 * * *"
+
+/// Schedule string for the adaptive fetch schedule, instead of a cron
+#define ANOW_ADAPTIVE       "adaptive"
+
+int backend_init(backend_handle_t* handle);
 
 void backend_deinit(backend_handle_t handle);
 
+/** @brief Schedule the AGNSS fetches
+  * @param handle   (backend_handle_t) backend context
+  * @param appdata  (void*) birdmon_app_t of the application
+  * @param cronstr  (const char*) ANOW_JOB schedule, or NULL for the default
+  * @retval int     0 on success, -2 if cronstr is invalid (the job then
+  *                 only runs on demand), other negatives if not scheduled
+  *
+  * The feeds with their own schedules are also run once at the start, so
+  * that the snapshot does not wait a day for an almanac.
+  */
+int backend_start(backend_handle_t handle, void* appdata, const char* cronstr);
+
+/** @brief Change the AGNSS fetch schedule
+  * @param handle   (backend_handle_t) backend context
+  * @param cronstr  (const char*) cron expression, or ANOW_ADAPTIVE
+  * @param err      (const char**) cron parser error, if not NULL
+  * @retval int     0 on success, -2 if cronstr is invalid
+  */
+int backend_schedule(backend_handle_t handle, const char* cronstr, const char** err);
+
+/// Take a reference to a snapshot.  Must be called with the data mutex held.
+assistnow_t* backend_retain(assistnow_t* anow);
+
+/// Drop a reference to a snapshot, and free it if it was the last one.  The
+/// data mutex is not needed.
+void backend_release(assistnow_t* anow);
+
 
 
-// Thread Functions
+// Job Functions
 ///@todo move into mpipe_io section
-void* agnss_reader(void* args);
+void agnss_reader(void* args);
 
 
 
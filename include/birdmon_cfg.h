@@ -83,6 +83,19 @@
 #endif
 
 
+/// zstd compression of large command outputs (getanow -z).  Requires libzstd,
+/// enable with "make BIRDMON_ZSTD=1"
+#ifndef BIRDMON_FEATURE_ZSTD
+#   define BIRDMON_FEATURE_ZSTD       DISABLED
+#endif
+
+/// Lock contention profiling of the named mutexes (see lockprof.h).  Adds
+/// timing to every lock and unlock, enable with "make BIRDMON_LOCKPROF=1"
+#ifndef BIRDMON_FEATURE_LOCKPROF
+#   define BIRDMON_FEATURE_LOCKPROF   DISABLED
+#endif
+
+
 /// Parameter configuration defaults
 #define BIRDMON_PARAM(VAL)            BIRDMON_PARAM_##VAL
 #ifndef BIRDMON_PARAM_NAME
@@ -104,5 +117,135 @@
 #   define BIRDMON_PARAM_MMAP_PAGESIZE (128*1024)
 #endif
 
+/// Log writer: ring slots (power of 2), bytes per slot, rotation size & count
+#ifndef BIRDMON_PARAM_LOG_SLOTS
+#   define BIRDMON_PARAM_LOG_SLOTS    1024
+#endif
+#ifndef BIRDMON_PARAM_LOG_MSGSIZE
+#   define BIRDMON_PARAM_LOG_MSGSIZE  512
+#endif
+#ifndef BIRDMON_PARAM_LOG_MAXSIZE
+#   define BIRDMON_PARAM_LOG_MAXSIZE  (8*1024*1024)
+#endif
+#ifndef BIRDMON_PARAM_LOG_ROTATIONS
+#   define BIRDMON_PARAM_LOG_ROTATIONS 4
+#endif
+
+/// Spans kept per thread by the tracer (power of 2)
+#ifndef BIRDMON_PARAM_TRACE_SPANS
+#   define BIRDMON_PARAM_TRACE_SPANS  4096
+#endif
+
+/// Most argv tokens a command line may carry, including the command name
+#ifndef BIRDMON_PARAM_MAXARGC
+#   define BIRDMON_PARAM_MAXARGC      32
+#endif
+
+/// Socket request pipelining: worker threads, and the most requests with an
+/// id that one client may have in flight
+#ifndef BIRDMON_PARAM_WORKERS
+#   define BIRDMON_PARAM_WORKERS      4
+#endif
+#ifndef BIRDMON_PARAM_PIPELINE
+#   define BIRDMON_PARAM_PIPELINE     16
+#endif
+
+/// Most requests in one batch envelope
+#ifndef BIRDMON_PARAM_BATCHMAX
+#   define BIRDMON_PARAM_BATCHMAX     64
+#endif
+
+/// Milliseconds a socket client may take no output before it is dropped,
+/// while a response is written to it under the isolation mutex
+#ifndef BIRDMON_PARAM_WRITE_TIMEOUT
+#   define BIRDMON_PARAM_WRITE_TIMEOUT 5000
+#endif
+
+/// Co-process external commands: most co-processes per command, most
+/// commands, and milliseconds to wait for a response (see coproc.h)
+#ifndef BIRDMON_PARAM_COPROC_WORKERS
+#   define BIRDMON_PARAM_COPROC_WORKERS 2
+#endif
+#ifndef BIRDMON_PARAM_COPROC_MAX
+#   define BIRDMON_PARAM_COPROC_MAX   16
+#endif
+#ifndef BIRDMON_PARAM_COPROC_TIMEOUT
+#   define BIRDMON_PARAM_COPROC_TIMEOUT 5000
+#endif
+
+/// Milliseconds a co-process has to exit on SIGTERM before it is killed
+#ifndef BIRDMON_PARAM_COPROC_GRACE
+#   define BIRDMON_PARAM_COPROC_GRACE 100
+#endif
+
+/// Seconds between Prometheus dumps of the stats (--metrics)
+#ifndef BIRDMON_PARAM_STATS_INTERVAL
+#   define BIRDMON_PARAM_STATS_INTERVAL 15
+#endif
+
+/// Job scheduler: most jobs, and milliseconds per tick of the timer wheel
+#ifndef BIRDMON_PARAM_SCHED_JOBS
+#   define BIRDMON_PARAM_SCHED_JOBS   16
+#endif
+#ifndef BIRDMON_PARAM_SCHED_TICK
+#   define BIRDMON_PARAM_SCHED_TICK   100
+#endif
+
+/// Default most random delay, in seconds, added to each AGNSS fetch
+#ifndef BIRDMON_PARAM_ANOW_JITTER
+#   define BIRDMON_PARAM_ANOW_JITTER  30
+#endif
+
+/// Adaptive AGNSS schedule: least and most seconds between fetches.  The
+/// least is also the first retry delay after a failed fetch.
+#ifndef BIRDMON_PARAM_ANOW_MINWAIT
+#   define BIRDMON_PARAM_ANOW_MINWAIT 60
+#endif
+#ifndef BIRDMON_PARAM_ANOW_MAXWAIT
+#   define BIRDMON_PARAM_ANOW_MAXWAIT (6*3600)
+#endif
+
+/// AGNSS endpoints: most endpoints in ubx_uri, and milliseconds to wait for
+/// an endpoint before the next one is tried as well.  The wait is the p95
+/// of recent fetch times, within MIN and MAX.  HEDGE is used until there
+/// are enough fetches to measure.  TIMEOUT is the most time for one fetch.
+#ifndef BIRDMON_PARAM_ANOW_ENDPOINTS
+#   define BIRDMON_PARAM_ANOW_ENDPOINTS 4
+#endif
+#ifndef BIRDMON_PARAM_ANOW_HEDGE
+#   define BIRDMON_PARAM_ANOW_HEDGE   2000
+#endif
+#ifndef BIRDMON_PARAM_ANOW_HEDGE_MIN
+#   define BIRDMON_PARAM_ANOW_HEDGE_MIN 250
+#endif
+#ifndef BIRDMON_PARAM_ANOW_HEDGE_MAX
+#   define BIRDMON_PARAM_ANOW_HEDGE_MAX 15000
+#endif
+#ifndef BIRDMON_PARAM_ANOW_TIMEOUT
+#   define BIRDMON_PARAM_ANOW_TIMEOUT 60000
+#endif
+
+/// Most seconds an almanac is kept in the snapshot after it was fetched, when
+/// the almanac feed has not replaced it since
+#ifndef BIRDMON_PARAM_ANOW_ALM_MAXAGE
+#   define BIRDMON_PARAM_ANOW_ALM_MAXAGE (14*86400)
+#endif
+
+/// Geocoding cache: most addresses kept, seconds to keep an address that
+/// was found, and an address that was not.  SAVE is the most seconds before
+/// a changed cache is written to its file.
+#ifndef BIRDMON_PARAM_GEOCACHE_SIZE
+#   define BIRDMON_PARAM_GEOCACHE_SIZE 1024
+#endif
+#ifndef BIRDMON_PARAM_GEOCACHE_TTL
+#   define BIRDMON_PARAM_GEOCACHE_TTL (30*86400)
+#endif
+#ifndef BIRDMON_PARAM_GEOCACHE_NEGTTL
+#   define BIRDMON_PARAM_GEOCACHE_NEGTTL 86400
+#endif
+#ifndef BIRDMON_PARAM_GEOCACHE_SAVE
+#   define BIRDMON_PARAM_GEOCACHE_SAVE 60
+#endif
+
 
 #endif
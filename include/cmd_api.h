@@ -24,6 +24,8 @@
 // External Dependencies
 #include <cmdtab.h>
 
+#include <pthread.h>
+
 
 
 
@@ -31,8 +33,21 @@ int cmd_init(cmdtab_t** init_table, const char* xpath);
 
 int cmd_free(cmdtab_t* init_table);
 
+/** @brief Watch the external command path and apply changes live
+  * @retval int         0 on success, or if there is nothing to watch
+  *
+  * Commands added to or removed from the path given to cmd_init() are added
+  * to or removed from searches without a restart.  Requires inotify (Linux):
+  * elsewhere the path is only scanned by cmd_init().
+  */
+int cmd_watch(void);
+
 int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 
+/// True if the command changes no shared state, and so may run in parallel
+/// with other such commands.  External commands are never readonly.
+bool cmd_isreadonly(const cmdtab_item_t* cmd);
+
 
 
 /** @brief Extracts command name from command line, returns command name length
@@ -40,6 +55,8 @@ int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* in
 int cmd_getname(char* cmdname, char* cmdline, size_t max_cmdname);
 
 size_t cmd_strmark(char* str, size_t max);
+
+// like cmd_search(), and the result must be given to cmd_release() as well
 const cmdtab_item_t* cmd_quoteline_resolve(char* quoteline, dterm_handle_t* dth);
 
 
@@ -53,6 +70,15 @@ const cmdtab_item_t* cmd_search(cmdtab_t* cmdtab, char *name);
 // returns command index or -1 if command not found or there is more than one match
 const cmdtab_item_t* cmd_subsearch(cmdtab_t* cmdtab, char *namepart);
 
+/// Every command found by cmd_search() or cmd_subsearch() must be given to
+/// cmd_release() once it is no longer used, including after cmd_run().  An
+/// external command stays valid until then, even if the command path is
+/// rescanned.  NULL is ignored.
+void cmd_release(const cmdtab_item_t* cmd);
+
+// lists builtin and external commands, like cmdtab_list()
+int cmd_list(cmdtab_t* cmdtab, char* dst, size_t dstmax);
+
 
 
 
@@ -50,6 +50,18 @@ int cmd_geoloc(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, si
 int cmd_getanow(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 int cmd_schedule(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
 
+/// Subscribe the client to pushes on each snapshot refresh
+int cmd_subscribe(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+/// Counters and latency histograms
+int cmd_stats(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+/// Lock contention profile (requires BIRDMON_FEATURE_LOCKPROF)
+int cmd_lockprof(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
+/// Span tracing control and Chrome trace export
+int cmd_trace(dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax);
+
 
 
 /// Application protocol commands sent over the MPipe
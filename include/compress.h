@@ -0,0 +1,92 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef compress_h
+#define compress_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    COMP_none   = 0,
+    COMP_zstd   = 1,
+    COMP_MAX
+} COMP_Type;
+
+
+/// Effort: ingest is for output compressed once and served many times, in
+/// the backend job.  request is for output specific to one client, on the
+/// request thread.
+typedef enum {
+    COMP_request    = 0,
+    COMP_ingest     = 1
+} COMP_Effort;
+
+
+/** @brief Initialize the compressor
+  * @retval (int)   0 on success, negative if compression is unavailable
+  *
+  * Compression is optional.  If birdmon is built without a compression
+  * library, only COMP_none is available and compress_type() reports the
+  * others as unsupported.
+  */
+int compress_init(void);
+void compress_deinit(void);
+
+
+/** @brief Build the dictionary from real MGA data, once
+  * @param src      (const uint8_t*) UBX frames of a snapshot
+  * @param srcsize  (size_t) bytes in src
+  *
+  * The first call with data makes the dictionary, and later calls do
+  * nothing, so it stays the same for the life of the process.  Until then,
+  * compression runs without one.
+  */
+void compress_train(const uint8_t* src, size_t srcsize);
+
+
+/** @brief Resolve a compression name ("none", "zstd") to a type
+  * @retval (int)   COMP_Type, or negative if unknown or not built-in
+  */
+int compress_type(const char* name);
+
+const char* compress_name(COMP_Type type);
+
+
+/** @brief Worst-case compressed size of srcsize input bytes
+  */
+size_t compress_bound(COMP_Type type, size_t srcsize);
+
+
+/** @brief Compress a buffer using the MGA dictionary
+  * @param dictid   (uint32_t*) output: id of the dictionary used, 0 if none
+  * @retval (int)   Negative on error, else number of bytes written to dst
+  *
+  * Each thread has its own compression context, so calls do not wait on
+  * each other.
+  */
+int compress_run(COMP_Type type, COMP_Effort effort, uint8_t* dst, size_t dstmax, 
+                 const uint8_t* src, size_t srcsize, uint32_t* dictid);
+
+
+/** @brief Get the raw-content dictionary that clients need for decompression
+  * @param dictid   (uint32_t*) output: id of the dictionary
+  * @retval (const uint8_t*) dictionary, or NULL if not available yet
+  */
+const uint8_t* compress_dict(size_t* dictsize, uint32_t* dictid);
+
+
+#endif
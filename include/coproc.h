@@ -0,0 +1,87 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef coproc_h
+#define coproc_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Co-process commands are external commands that stay running between
+/// requests, instead of being started with popen() for each one.  An
+/// executable in the external command path opts in by having the suffix
+/// COPROC_SUFFIX, which is not part of the command name.
+///
+/// The co-process reads requests on stdin and writes responses on stdout.
+/// Integers are 32 bits, big endian:
+/// - Request:  [length] [argument string, without the command name]
+/// - Response: [status] [length] [output bytes]
+/// A negative status is an error code, and the output is its description.
+/// Otherwise the output is the command output, sent to the client as-is.
+///
+/// Each command has a small pool of co-processes, started when they are
+/// first needed.  A co-process that exits, breaks the protocol, or takes
+/// longer than BIRDMON_PARAM_COPROC_TIMEOUT is killed, and a new one is
+/// started for the next request.  One that closes before it responds, e.g.
+/// because it exited while idle, is replaced and the request is sent once
+/// more.  Co-processes that are stopped get SIGTERM, and SIGKILL if they
+/// are still running after BIRDMON_PARAM_COPROC_GRACE.
+
+#define COPROC_SUFFIX   ".coproc"
+
+typedef struct coproc_pool coproc_t;
+
+
+/** @brief Get the co-process pool for an executable
+  * @param path     (const char*) path of the executable
+  * @retval coproc_t*   pool handle, or NULL if there are too many pools
+  *
+  * Each open takes a reference on the pool, which coproc_close() drops.
+  * Opening the same path again returns the same pool.  No process is
+  * started until the first request.
+  * If the executable has been replaced since the last open, its running
+  * co-processes are stopped when idle, and new ones run the new executable.
+  */
+coproc_t* coproc_open(const char* path);
+
+/** @brief Run a request on a co-process of the pool
+  * @param pool     (coproc_t*) pool handle from coproc_open()
+  * @param dst      (uint8_t*) output buffer
+  * @param dstmax   (size_t) size of dst
+  * @param src      (const uint8_t*) argument string
+  * @param srclen   (int) length of src
+  * @retval int     bytes of output, or negative on error.
+  *
+  * Output that does not fit in dst is dropped.  For errors from the
+  * co-process, dst holds the description as a string.
+  */
+int coproc_run(coproc_t* pool, uint8_t* dst, size_t dstmax, const uint8_t* src, int srclen);
+
+/** @brief Drop a reference from coproc_open()
+  * @param pool     (coproc_t*) pool handle, or NULL
+  *
+  * With the last reference, the co-processes of the pool are stopped and it
+  * is freed.  It must not be running a request then.
+  */
+void coproc_close(coproc_t* pool);
+
+/// Stops all co-processes and frees all pools
+void coproc_deinit(void);
+
+
+#endif
@@ -24,6 +24,7 @@
 // Application Headers
 #include "cmdhistory.h"
 #include "backend.h"
+#include "logger.h"
 
 // HB Libraries
 #include <clithread.h>
@@ -47,7 +48,7 @@
 
 ///@todo CMDBUF and LINESIZE must be dynamically allocated and defined by the
 ///      controlling application at initialization.
-#define LINESIZE            1024
+#define LINESIZE            4096
 #define CMDBUF              16384       
 
 #define APP_NAME            (BIRDMON_PARAM(NAME) " " BIRDMON_PARAM(VERSION))
@@ -127,15 +128,17 @@ typedef struct {
     clithread_handle_t  clithread;
     otvar_handle_t      vardict;
     
-    // Logger File Path
+    // Logger File Path, and the writer that owns it (NULL if no log)
     const char*         logfile_path;
+    logger_handle_t     logger;
     
     // Client Thread I/O parameters.
     // Should be altered per client thread in cloned dterm_handle_t
     dterm_fd_t          fd;
     
     // Process Context:
-    // Thread Context: may be null if not using talloc
+    // Thread Context: may be null if not using talloc.  Memory for a
+    // command comes from the arena of its thread (see arena.h).
     TALLOC_CTX*         pctx;
     TALLOC_CTX*         tctx;
     
@@ -148,6 +151,11 @@ typedef struct {
     // Thread flags
     bool thread_active;
     
+    // Subscription transfer id (0 when not subscribed).  On socket clients
+    // it is the clithread xid kept between commands, so the client receives
+    // anything published to it.
+    uint32_t            sub_xid;
+    
     // Externally Initialized data elements
     // These should only be used within lock provided by isolation mutex
     void*               ext;
@@ -211,6 +219,92 @@ int dterm_force_cmdmsg(int fd_out, const char* cmdname, const char* msg);
 
 //int dterm_force_rxstat(int fd_out, DFMT_Type dfmt, void* rxdata, size_t rxsize, uint64_t rxaddr, uint32_t sid, time_t tstamp, int crcqual);
 
+/** @brief Publish a message to every client subscribed to xid
+  * @param dth      (dterm_handle_t*) parent dterm handle
+  * @param xid      (uint32_t) subscription transfer id
+  * @param msg      (uint8_t*) message to send, already formatted
+  * @param msgsize  (size_t) bytes in msg
+  * @retval int     msgsize, 0 if no interface can receive it, negative on error
+  *
+  * The message is written under the isolation mutex, so it never lands in the
+  * middle of a command response.  It must not be called from a command.
+  */
+int dterm_publish(dterm_handle_t* dth, uint32_t xid, uint8_t* msg, size_t msgsize);
+
+
+/** @brief Number of clients subscribed to xid
+  * @param dth      (dterm_handle_t*) parent dterm handle
+  * @param xid      (uint32_t) subscription transfer id
+  * @retval int     number of subscribers, which may be over the true number
+  *
+  * A publisher can call it to skip rendering a message that nobody takes.
+  * It takes no lock besides its own, so it can be called under other locks.
+  */
+int dterm_subscribers(dterm_handle_t* dth, uint32_t xid);
+
+
+/** @brief Release the isolation mutex from inside a command
+  * @param dth      (dterm_handle_t*) handle passed to the command
+  *
+  * @retval bool   true if it was released, false if the caller of the
+  *                 command does not hold it, or shares it with a batch
+  *
+  * For commands that block for a long time, e.g. waiting on the backend, so
+  * other commands can run meanwhile.  The command must call dterm_iso_lock()
+  * before it returns, which takes the mutex back only if it was released.
+  * Its request memory is in the arena of its own thread, so it stays valid
+  * in between.
+  */
+bool dterm_iso_unlock(dterm_handle_t* dth);
+void dterm_iso_lock(dterm_handle_t* dth);
+
+/** Streaming command output <BR>
+  * ========================================================================<BR>
+  * A command writes into dst, which holds dstmax bytes.  A command whose
+  * output may be larger can write it through a sink on dst instead: when dst
+  * fills up, the sink sends its contents to the client and starts over at
+  * the front of dst.  The write waits while the client is not reading, so
+  * the memory for a response stays at dstmax whatever its size, but a socket
+  * client that takes nothing for BIRDMON_PARAM_WRITE_TIMEOUT is dropped.
+  * The command returns dterm_sink_close(), which is the number of bytes
+  * still in dst.  If a command fails after a flush, the partial response
+  * line is ended and the error says that the response was truncated.
+  *
+  * A sink without a flush function is a plain buffer: writes that do not fit
+  * fail, and dterm_sink_close() returns a negative value.
+  */
+typedef struct dterm_sink {
+    int             (*flush)(struct dterm_sink* sink, const uint8_t* data, size_t len);
+    void*           ctx;
+    uint8_t*        head;       // start of the data not yet flushed
+    uint8_t*        base;       // dst
+    uint8_t*        cursor;
+    uint8_t*        end;
+    size_t          flushed;
+    int             err;
+} dterm_sink_t;
+
+/** @brief Get a sink on the output buffer of a command
+  * @param local    (dterm_sink_t*) storage for a plain sink, if needed
+  * @param dst      (uint8_t*) dst of the command
+  * @param dstmax   (size_t) dstmax of the command
+  * @retval dterm_sink_t*   the sink of the request, if dst is its output
+  *                         buffer, otherwise 'local' as a plain sink on dst
+  */
+dterm_sink_t* dterm_sink_open(dterm_sink_t* local, uint8_t* dst, size_t dstmax);
+
+/// Returns the bytes left in dst, or negative if a write failed
+int dterm_sink_close(dterm_sink_t* sink);
+
+/// Returns a pointer to 'len' contiguous bytes, flushing if needed, or NULL
+/// if len is larger than the buffer.  dterm_sink_commit() the bytes used.
+uint8_t* dterm_sink_reserve(dterm_sink_t* sink, size_t len);
+void dterm_sink_commit(dterm_sink_t* sink, size_t len);
+
+int dterm_sink_write(dterm_sink_t* sink, const void* data, size_t len);
+int dterm_sink_printf(dterm_sink_t* sink, const char* format, ...);
+
+
 int dterm_publish_rxstat(   dterm_handle_t* dth, DFMT_Type dfmt,
                             void* rxdata, size_t rxsize, 
                             bool broadcast, uint64_t rxaddr,
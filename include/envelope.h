@@ -0,0 +1,72 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef envelope_h
+#define envelope_h
+
+#include <stddef.h>
+
+
+/// Request envelope: { "type":"${cmd_type}", "data":"${cmd_data}", "id":${req_id} }
+/// The fields point into the scanned line, unescaped and null terminated.
+/// "id" is optional (NULL if absent), and may be a string or a number.
+typedef struct {
+    char* type;
+    char* data;
+    char* id;
+} envelope_t;
+
+/// Results of envelope_scan()
+typedef enum {
+    ENVELOPE_overflow   = -3,   ///< Batch has more requests than allowed
+    ENVELOPE_fallback   = -2,   ///< Not handled by the scanner: use cJSON
+    ENVELOPE_invalid    = -1,   ///< JSON object without string type & data
+    ENVELOPE_raw        = 0,    ///< Not a JSON object: a plain command line
+    ENVELOPE_ok         = 1
+} ENVELOPE_Type;
+
+
+/** @brief Scans a request line for the JSON envelope, in place
+  * @param env      (envelope_t*) output type & data, valid on ENVELOPE_ok
+  * @param line     (char*) request line.  Modified only on ENVELOPE_ok.
+  * @param len      (size_t) bytes in line (the scan also stops at a null)
+  * @retval ENVELOPE_Type
+  *
+  * The scanner does no allocation.  It handles objects whose members all
+  * have string or number values, and strings with the common escapes.
+  * Anything else that opens with '{' (nested values, literals, \u escapes,
+  * malformed JSON) returns
+  * ENVELOPE_fallback, and the line is unchanged for a full JSON parser.
+  * Trailing characters after the object are ignored, as by cJSON_Parse().
+  */
+int envelope_scan(envelope_t* env, char* line, size_t len);
+
+/** @brief Scans a request line for a batch: a JSON array of envelopes
+  * @param env      (envelope_t*) output array of envelopes
+  * @param maxenv   (int) size of the env array
+  * @param line     (char*) request line.  Modified only on success.
+  * @param len      (size_t) bytes in line (the scan also stops at a null)
+  * @retval int     number of envelopes (> 0), or an ENVELOPE_Type <= 0
+  *
+  * Each object is scanned as by envelope_scan().  ENVELOPE_raw means the
+  * line does not open with '['.  If one object is invalid, or falls back,
+  * so does the whole batch.
+  */
+int envelope_scan_batch(envelope_t* env, int maxenv, char* line, size_t len);
+
+
+#endif /* envelope_h */
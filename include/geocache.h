@@ -0,0 +1,79 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef geocache_h
+#define geocache_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/// Geocoding results, by address.  Addresses are keyed in normalized form,
+/// so that case, spacing and punctuation do not make a new lookup.  A found
+/// address is kept for BIRDMON_PARAM_GEOCACHE_TTL seconds.  An address the
+/// geocoder could not find is kept for BIRDMON_PARAM_GEOCACHE_NEGTTL, so it
+/// is not looked up again on every request.  When the cache is full, the
+/// least recently used address is dropped.
+///
+/// The cache works without geocache_init(), in memory only.  With a file, it
+/// is loaded from the file at geocache_init(), and written back by the job
+/// "geocache" when it has changed, and at geocache_deinit().
+
+#define GEOCACHE_KEYMAX     192
+
+typedef enum {
+    GEOCACHE_miss       = -1,
+    GEOCACHE_notfound   = 0,
+    GEOCACHE_found      = 1
+} GEOCACHE_Type;
+
+
+/** @brief Load the cache from a file, and keep it there from now on
+  * @param path     (const char*) cache file.  It need not exist yet.
+  * @retval int     0 on success, negative if the file cannot be kept
+  *
+  * Expired entries in the file are skipped.  The file is written aside and
+  * renamed, so it is never seen partly written.
+  */
+int geocache_init(const char* path);
+
+/// Write the cache to its file if it has changed, and free it
+void geocache_deinit(void);
+
+/** @brief Normalize an address into a cache key
+  * @param key      (char*) output, GEOCACHE_KEYMAX bytes
+  * @param address  (const char*) address as given
+  * @retval size_t  key length, or 0 if the address is empty or too long
+  *
+  * Letters are lowered, and each run of spaces and punctuation becomes one
+  * space.  '#' and '-' are kept, as in "#5" or "5-A".
+  */
+size_t geocache_key(char* key, const char* address);
+
+/** @brief Look up an address
+  * @param key      (const char*) key from geocache_key()
+  * @param lat      (double*) latitude, set if found
+  * @param lon      (double*) longitude, set if found
+  * @retval GEOCACHE_Type   found, notfound, or miss if not cached or expired
+  */
+GEOCACHE_Type geocache_get(const char* key, double* lat, double* lon);
+
+/// Store the result of a lookup.  lat and lon are ignored when not found.
+void geocache_put(const char* key, bool found, double lat, double lon);
+
+
+#endif
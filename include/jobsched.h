@@ -0,0 +1,104 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+
+#ifndef jobsched_h
+#define jobsched_h
+
+#include "cliopt.h"
+
+#include <stddef.h>
+#include <time.h>
+
+
+/// Job scheduler.  One thread runs every timed job: the AGNSS fetch, the
+/// stats dump, and anything else that needs to happen on a schedule.  Jobs
+/// are named, and either follow a cron expression (with seconds) or repeat
+/// at an interval.  Deadlines are kept on CLOCK_MONOTONIC in a hierarchical
+/// timer wheel, and the thread sleeps until the nearest one is due.
+///
+/// Each job may have a jitter: a random delay of up to jitter_ms is added to
+/// every deadline, so that many daemons with the same schedule do not all
+/// hit a server in the same second.
+///
+/// Jobs run one at a time on the scheduler thread, so a job that blocks
+/// delays the others.  A job is never run concurrently with itself.
+
+typedef void (*jobsched_fn)(void* arg);
+
+
+/// Start the scheduler thread.  Jobs may be added before or after.
+int jobsched_init(void);
+
+/// Stop the scheduler thread.  The jobs are kept, but no longer run.
+void jobsched_deinit(void);
+
+/** @brief Add a job that runs on a cron schedule
+  * @param name     (const char*) unique job name, up to 15 characters
+  * @param cronstr  (const char*) cron expression, including seconds
+  * @param jitter_ms (int) most random delay added to each deadline
+  * @param fn       (jobsched_fn) job function
+  * @param arg      (void*) argument for fn
+  * @param err      (const char**) cron parser error, if not NULL
+  * @retval int     0 on success, -1 on bad arguments, -2 if cronstr is
+  *                 invalid, -3 if the name is taken or there are too many
+  *
+  * On -2, the job is still added, but it only runs with jobsched_run_now()
+  * until it gets a valid expression from jobsched_set_cron().
+  */
+int jobsched_add_cron(const char* name, const char* cronstr, int jitter_ms, 
+                      jobsched_fn fn, void* arg, const char** err);
+
+/// As jobsched_add_cron(), but runs every interval_ms, starting interval_ms
+/// from now.
+int jobsched_add_interval(const char* name, int interval_ms, int jitter_ms, 
+                          jobsched_fn fn, void* arg);
+
+/// Change the cron expression of a job.  On an invalid expression, the job
+/// keeps its current schedule and -2 is returned.  -3 if there is no job.
+int jobsched_set_cron(const char* name, const char* cronstr, const char** err);
+
+/// Replace the cron schedule of a job with one run at wall clock time 'when'
+/// (or as soon as possible if it is past).  The job is not run again until
+/// it sets another time, or gets a cron expression.  The jitter of the job
+/// is taken before 'when' rather than after.
+int jobsched_set_at(const char* name, time_t when);
+
+/// Run a job once more at wall clock time 'when', ahead of its schedule,
+/// for a retry after it failed.  The schedule is not changed, and if it
+/// comes first, the retry is dropped.  Not for interval jobs.
+int jobsched_retry(const char* name, time_t when);
+
+/// Change the jitter of a job, from its next deadline
+int jobsched_set_jitter(const char* name, int jitter_ms);
+
+/// Run a job as soon as possible, in addition to its schedule
+int jobsched_run_now(const char* name);
+
+/// Wall clock time of the next scheduled run of a job, or 0 if it has none
+time_t jobsched_next(const char* name);
+
+/** @brief Print the jobs, their schedules and run counts
+  * @param dst      (char*) output buffer
+  * @param dstmax   (size_t) size of dst
+  * @param fmt      (FORMAT_Type) FORMAT_Json(Hex) for JSON, otherwise text
+  * @retval int     bytes written to dst, or negative if dst is too small
+  */
+int jobsched_print(char* dst, size_t dstmax, FORMAT_Type fmt);
+
+
+#endif
@@ -0,0 +1,79 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef lockprof_h
+#define lockprof_h
+
+#include "birdmon_cfg.h"
+#include "cliopt.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+
+/// Named locks that are profiled
+typedef enum {
+    LOCK_iso = 0,       // dterm isolation mutex: one command at a time
+    LOCK_data,          // backend data_mutex: snapshot and schedule
+    LOCK_cron,          // job scheduler mutex
+    LOCK_ready,         // backend readymutex
+    LOCK_MAX
+} LOCK_Type;
+
+
+/// With BIRDMON_FEATURE_LOCKPROF, the LP_ macros record for each named lock
+/// the acquisitions, how many were contended, wait time and hold time.  These
+/// are attributed to the tag of the thread (the command it runs, or the
+/// backend stage).  Acquisition and wait go to the tag at lock time; hold time
+/// is split across tag changes while the lock is held.  Without the feature,
+/// the macros are the plain pthread calls and LP_TAG() is empty.
+#if BIRDMON_FEATURE(LOCKPROF)
+#   define LP_LOCK(MUTEX, ID)                   lockprof_lock((MUTEX), (ID))
+#   define LP_UNLOCK(MUTEX, ID)                 lockprof_unlock((MUTEX), (ID))
+#   define LP_COND_WAIT(COND, MUTEX, ID)        lockprof_cond_wait((COND), (MUTEX), (ID), NULL)
+#   define LP_COND_TIMEDWAIT(COND, MUTEX, ID, TS) lockprof_cond_wait((COND), (MUTEX), (ID), (TS))
+#   define LP_TAG(NAME)                         lockprof_tag(NAME)
+#else
+#   define LP_LOCK(MUTEX, ID)                   pthread_mutex_lock(MUTEX)
+#   define LP_UNLOCK(MUTEX, ID)                 pthread_mutex_unlock(MUTEX)
+#   define LP_COND_WAIT(COND, MUTEX, ID)        pthread_cond_wait((COND), (MUTEX))
+#   define LP_COND_TIMEDWAIT(COND, MUTEX, ID, TS) pthread_cond_timedwait((COND), (MUTEX), (TS))
+#   define LP_TAG(NAME)                         do { } while (0)
+#endif
+
+
+int lockprof_lock(pthread_mutex_t* mutex, LOCK_Type id);
+int lockprof_unlock(pthread_mutex_t* mutex, LOCK_Type id);
+int lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, LOCK_Type id, const struct timespec* abstime);
+
+/// Tag the calling thread.  name must stay valid (literal or command name).
+void lockprof_tag(const char* name);
+
+/** @brief Print the lock profile
+  * @param dst      (char*) output buffer
+  * @param dstmax   (size_t) size of dst
+  * @param fmt      (FORMAT_Type) FORMAT_Json(Hex) for JSON, otherwise text
+  * @retval int     bytes written, negative if dst is too small or the
+  *                 feature is not built
+  */
+int lockprof_print(char* dst, size_t dstmax, FORMAT_Type fmt);
+
+void lockprof_reset(void);
+
+
+#endif
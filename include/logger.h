@@ -0,0 +1,65 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef logger_h
+#define logger_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+
+/// Asynchronous log writer.
+/// Producers copy each message into a bounded lock-free ring and return
+/// immediately.  One writer thread keeps the log file (or FIFO) open, and it
+/// drains the ring in batches with writev().  When the ring is full, the
+/// message is dropped and counted rather than blocking the producer.
+///
+/// Each message becomes one record: on a regular file it is terminated by a
+/// newline, on a FIFO by a NUL, unless the message already ends that way.
+typedef void* logger_handle_t;
+
+
+/** @brief Open the log and start the writer thread
+  * @param handle   (logger_handle_t*) returns the new logger
+  * @param path     (const char*) path to a regular file or a FIFO, or NULL
+  *                 to log to stderr, which is never rotated
+  * @param maxsize  (size_t) regular file is rotated at this size, 0 to disable
+  * @param rotations (int) number of rotated files kept (path.1 ... path.N)
+  * @retval int     0 on success, negative on error
+  */
+int logger_init(logger_handle_t* handle, const char* path, size_t maxsize, int rotations);
+
+/** @brief Flush the ring, stop the writer thread and close the log
+  */
+void logger_deinit(logger_handle_t handle);
+
+/** @brief Queue a message, gathered from iovcnt pieces, without blocking
+  * @retval int     bytes queued, -1 if dropped because the ring is full,
+  *                 -2 on bad parameters.  Messages beyond the slot size of
+  *                 the ring are truncated.
+  */
+int logger_pushv(logger_handle_t handle, const struct iovec* iov, int iovcnt);
+
+int logger_push(logger_handle_t handle, const char* msg, size_t len);
+
+/** @brief Number of messages dropped since init
+  */
+uint64_t logger_dropped(logger_handle_t handle);
+
+
+#endif
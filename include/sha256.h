@@ -0,0 +1,44 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef sha256_h
+#define sha256_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE     32
+
+typedef struct {
+    uint32_t    state[8];
+    uint64_t    bitlen;
+    uint8_t     block[64];
+    size_t      blocklen;
+} sha256_ctx_t;
+
+
+void sha256_init(sha256_ctx_t* ctx);
+void sha256_update(sha256_ctx_t* ctx, const uint8_t* data, size_t len);
+void sha256_final(sha256_ctx_t* ctx, uint8_t* digest);
+
+/** @brief One-shot SHA-256 of a buffer
+  * @param digest   (uint8_t*) output, must be SHA256_SIZE bytes
+  * @param data     (const uint8_t*) input buffer
+  * @param len      (size_t) input length
+  */
+void sha256(uint8_t* digest, const uint8_t* data, size_t len);
+
+#endif
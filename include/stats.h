@@ -0,0 +1,101 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef stats_h
+#define stats_h
+
+#include "cliopt.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Counters.  Gauges (last value) are marked (g).
+typedef enum {
+    STAT_cmd_calls = 0,
+    STAT_cmd_errors,
+    STAT_dl_calls,
+    STAT_dl_errors,
+    STAT_dl_bytes,
+    STAT_anow_fetches,
+    STAT_anow_errors,
+    STAT_anow_snapshots,
+    STAT_anow_pkts,             // (g) packets in the current snapshot
+    STAT_anow_bytes,            // (g) bytes in the current snapshot
+    STAT_anow_unchanged,        // fetches that returned the current snapshot
+    STAT_anow_hedges,           // fetches sent to a further endpoint
+    STAT_anow_stale,            // (g) 1 while the last fetch has failed
+    STAT_geo_hits,              // geocoding answered from the cache
+    STAT_geo_misses,            // geocoding sent to the geocoder
+    STAT_MAX
+} STAT_Type;
+
+/// Latency histograms, in microseconds
+typedef enum {
+    STATH_cmd = 0,              // any command, in cmd_run()
+    STATH_download,             // utils_downloader()
+    STATH_anow_fetch,           // agnss_reader: download stage, all endpoints
+    STATH_anow_validate,        // agnss_reader: UBX framing & checksums, per response
+    STATH_anow_ingest,          // agnss_reader: indexing, hashing, push render
+    STATH_anow_publish,         // agnss_reader: push to subscribers
+    STATH_MAX
+} STATH_Type;
+
+
+/// Counters and histograms live in blocks that belong to one thread each, so
+/// recording is a plain load/add/store on thread-local memory: no locks and
+/// no atomic RMW.  Readers sum the blocks.  When a thread exits, its block is
+/// folded into a retired total and recycled for the next thread.
+
+int stats_init(void);
+void stats_deinit(void);
+
+/// Monotonic time in microseconds, for use with stats_record()
+uint64_t stats_now(void);
+
+void stats_add(STAT_Type id, uint64_t value);
+void stats_set(STAT_Type id, uint64_t value);
+void stats_record(STATH_Type id, uint64_t usec);
+
+/// Record a command call.  Commands get their own histograms, by name.
+void stats_cmd(const char* cmdname, uint64_t usec, bool error);
+
+/** @brief Print a snapshot of all stats
+  * @param dst      (char*) output buffer
+  * @param dstmax   (size_t) size of dst
+  * @param fmt      (FORMAT_Type) FORMAT_Json(Hex) for JSON, otherwise text
+  * @retval int     bytes written to dst, or negative if dst is too small
+  */
+int stats_print(char* dst, size_t dstmax, FORMAT_Type fmt);
+
+/** @brief Print a snapshot in Prometheus text exposition format
+  */
+int stats_print_prometheus(char* dst, size_t dstmax);
+
+/** @brief Periodically write Prometheus text to a file (atomically replaced)
+  * @param path     (const char*) output file
+  * @param interval (int) seconds between writes
+  * @retval int     0 on success
+  *
+  * The writes are the job "stats" of the job scheduler.  The scheduler must
+  * be stopped before stats_deinit().
+  */
+int stats_dump_start(const char* path, int interval);
+
+
+#endif
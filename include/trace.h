@@ -0,0 +1,71 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Span recorder for request and backend tracing.
+/// Each thread records completed spans into its own ring, so recording takes
+/// no locks.  When tracing is off (the default), trace_begin() returns 0 and
+/// trace_end() returns at once.  trace_dump() writes all rings to a file in
+/// the Chrome trace-event format (chrome://tracing, Perfetto).
+///
+/// Span names and categories must be string literals or otherwise outlive
+/// the trace.
+
+/** @brief Start the recorder, with tracing off
+  * @param dir      (const char*) directory that socket clients can write
+  *                 traces to, or NULL to let only the local console write them
+  * @retval int     0 on success
+  */
+int trace_init(const char* dir);
+void trace_deinit(void);
+
+/// Directory given to trace_init(), or NULL
+const char* trace_dir(void);
+
+void trace_enable(bool on);
+bool trace_isenabled(void);
+
+/// Name the calling thread in the trace
+void trace_thread(const char* name);
+
+/// Start a new request on this thread: later spans carry its id
+uint64_t trace_request(void);
+
+/// Timestamp for trace_end(), or 0 when tracing is off
+uint64_t trace_begin(void);
+
+/// Record a span from start (trace_begin) to now
+void trace_end(const char* name, const char* cat, uint64_t start);
+
+/// Record a span with explicit start and duration (microseconds)
+void trace_span(const char* name, const char* cat, uint64_t start, uint64_t dur);
+
+/// Write all rings to path as Chrome trace JSON.  Returns spans written.
+int trace_dump(const char* path);
+
+/// Discard recorded spans
+void trace_clear(void);
+
+
+#endif
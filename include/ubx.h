@@ -0,0 +1,116 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+#ifndef ubx_h
+#define ubx_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+typedef struct {
+    unsigned char sync1;
+    unsigned char sync2;
+    unsigned char msg_class;
+    unsigned char msg_id;
+    unsigned short plen;
+} ubx_header_t;
+
+/// Each packet in the snapshot is indexed by a key and a digest.
+/// - key:    (msg_id << 16) | (type << 8) | svId.  svId is 0 for messages
+///           that are not per-SV (ini, utc, iono, health, timeoffset).
+/// - digest: 32 bit FNV-1a over the payload.  A client that holds a packet
+///           with the same key and digest does not need it again.
+/// - fetched: time the packet was downloaded.  It is set when the packet is
+///           merged into a snapshot.
+typedef struct {
+    size_t len;
+    ubx_header_t hdr;
+    uint8_t* data;
+    uint32_t key;
+    uint32_t digest;
+    time_t fetched;
+} ubx_pkt_t;
+
+#define UBX_KEY(MSGID, TYPE, SVID)  (((uint32_t)(MSGID) << 16) | ((uint32_t)(TYPE) << 8) | (uint32_t)(SVID))
+#define UBX_KEY_MSGID(KEY)          (((KEY) >> 16) & 0xFF)
+#define UBX_KEY_TYPE(KEY)           (((KEY) >> 8) & 0xFF)
+#define UBX_KEY_SVID(KEY)           ((KEY) & 0xFF)
+
+
+/// Errors from ubx_validate_mga()
+typedef enum {
+    UBX_ERR_none = 0,
+    UBX_ERR_checksum,
+    UBX_ERR_header,
+    UBX_ERR_notmga,
+    UBX_ERR_framing,
+    UBX_ERR_MAX
+} UBX_ERR_Type;
+
+
+/** @brief Validates a buffer of concatenated UBX-MGA packets
+  * @param buf      (const uint8_t*) packet buffer, e.g. an AssistNow download
+  * @param size     (int) bytes in buf
+  * @param numpkts  (int*) output number of valid packets.  Can be NULL.
+  * @param offset   (int*) output byte offset of the first invalid packet,
+  *                 or size when all are valid.  Can be NULL.
+  * @retval UBX_ERR_Type  0 when the whole buffer is valid
+  */
+int ubx_validate_mga(const uint8_t* buf, int size, int* numpkts, int* offset);
+
+/// String description of a UBX_ERR_Type
+const char* ubx_strerror(int err);
+
+/// Fills a packet index entry (hdr, data, len, key, digest) from the UBX
+/// packet at src, and returns the packet's size in bytes
+size_t ubx_index(ubx_pkt_t* pkt, uint8_t* src);
+
+uint32_t ubx_key(const ubx_header_t* hdr, const uint8_t* payload);
+uint32_t ubx_digest(const uint8_t* payload, size_t len);
+
+/// GPS time is ahead of UTC by the leap seconds since 1980
+#define UBX_LEAPSECONDS     18
+
+/** @brief Time at which the ephemeris in an MGA packet stops being valid
+  * @param pkt      (const ubx_pkt_t*) indexed packet
+  * @param now      (time_t) current time, near the time of the ephemeris
+  * @retval time_t  UTC expiry, or 0 if the packet is not an ephemeris
+  *
+  * Ephemerides carry their reference time (toe, or tb for GLONASS) within
+  * the week or day, so the week or day is taken as the one that puts it
+  * nearest to now.  The expiry is the end of the fit interval, which is
+  * half of it after the reference time.
+  */
+time_t ubx_expiry(const ubx_pkt_t* pkt, time_t now);
+
+/** @brief AssistNow datatype of an MGA packet, as named in the query
+  * @param pkt      (const ubx_pkt_t*) indexed packet
+  * @retval const char*  "eph", "alm", "aux" or "pos", or NULL if the packet
+  *                 comes with any query (e.g. MGA-INI-TIME)
+  */
+const char* ubx_datatype(const ubx_pkt_t* pkt);
+
+/** @brief GNSS of an MGA packet, as named in the query
+  * @param pkt      (const ubx_pkt_t*) indexed packet
+  * @retval const char*  "gps", "gal", "bds", "qzss" or "glo", or NULL if the
+  *                 packet is not for one GNSS
+  */
+const char* ubx_gnss(const ubx_pkt_t* pkt);
+
+
+#endif /* ubx_h */
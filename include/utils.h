@@ -38,4 +38,40 @@ cJSON* cJSON_walk(cJSON* obj, int argc, const char* argv[]);
   */
 int utils_downloader(const char* url, char* errbuf, uint8_t* filebuf, size_t* bufmax, bool buf_isdynamic);
 
+
+/// Checks a completed download.  Returns NULL if it is good, otherwise a
+/// description of the problem.
+typedef const char* (*utils_validator_t)(const uint8_t* data, size_t size, void* arg);
+
+/// Options and results of utils_hedged_downloader()
+typedef struct {
+    int                 hedge_ms;       // wait before trying the next URL
+    int                 timeout_ms;     // most time for one URL
+    utils_validator_t   validate;       // NULL to take any complete response
+    void*               arg;            // for validate
+    
+    int                 winner;         // URL of the result, or -1
+    int                 started;        // URLs tried
+    uint32_t            elapsed_ms;     // from the start to the result
+} utils_hedge_t;
+
+/** @brief Download the same file from a list of mirrors, in parallel when
+  *        the first ones are slow
+  * @param url      (const char**) URLs in order of preference
+  * @param buf      (uint8_t**) one buffer per URL, each bufmax bytes
+  * @param numurls  (int) number of URLs
+  * @param bufmax   (size_t) size of each buffer
+  * @param hedge    (utils_hedge_t*) options, and results on return
+  * @param errbuf   (char*) buffer for the last error message.  Can be NULL.
+  * @retval (int)   bytes downloaded into buf[hedge->winner], or negative if
+  *                 no URL gave a valid file
+  *
+  * The first URL is started at once.  Each time hedge_ms passes without a
+  * valid response, the next URL is started as well, and when a URL fails,
+  * the next one is started immediately.  The first response that completes
+  * and passes validate wins, and the others are cancelled.
+  */
+int utils_hedged_downloader(const char* url[], uint8_t* buf[], int numurls, size_t bufmax,
+                            utils_hedge_t* hedge, char* errbuf);
+
 #endif
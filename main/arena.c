@@ -0,0 +1,269 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "arena.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define ARENA_ALIGN     16
+
+/// Allocations that do not fit in the arena.  The header keeps the payload
+/// aligned like the arena.
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t              size;
+} __attribute__((aligned(ARENA_ALIGN))) arena_chunk_t;
+
+/// Arenas are only written by their own thread.  The counters are read by
+/// arena_print() from other threads, as whole values.  When a thread exits,
+/// its arena is kept for the next thread, counters and all.
+typedef struct arena {
+    struct arena*       next;
+    bool                live;
+    bool                bound;
+    uint8_t*            base;
+    size_t              size;
+    size_t              used;
+    arena_chunk_t*      overflow;
+    size_t              overflow_bytes;     // this request, including freed
+    uint64_t            requests;
+    uint64_t            overflows;          // requests that used malloc()
+    uint64_t            highwater;
+} arena_t;
+
+static struct {
+    pthread_mutex_t     mutex;
+    pthread_once_t      once;
+    pthread_key_t       key;
+    arena_t*            arenas;
+} registry = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+
+static __thread arena_t* tls_arena = NULL;
+
+#define TLS_SET(LVAL, VAL)  __atomic_store_n(&(LVAL), (VAL), __ATOMIC_RELAXED)
+#define TLS_GET(LVAL)       __atomic_load_n(&(LVAL), __ATOMIC_RELAXED)
+
+
+
+
+static void sub_release_overflow(arena_t* arena) {
+    while (arena->overflow != NULL) {
+        arena_chunk_t* chunk = arena->overflow;
+        arena->overflow = chunk->next;
+        free(chunk);
+    }
+}
+
+
+static void sub_retire(void* arg) {
+    arena_t* arena = arg;
+    sub_release_overflow(arena);
+    arena->bound = false;
+    arena->used  = 0;
+    pthread_mutex_lock(&registry.mutex);
+    arena->live  = false;
+    pthread_mutex_unlock(&registry.mutex);
+}
+
+static void sub_keyinit(void) {
+    pthread_key_create(&registry.key, &sub_retire);
+}
+
+
+static arena_t* sub_arena_get(size_t size) {
+    arena_t* arena;
+
+    if (tls_arena != NULL) {
+        return tls_arena;
+    }
+    pthread_once(&registry.once, &sub_keyinit);
+
+    /// Take a retired arena of the same size, or make a new one
+    pthread_mutex_lock(&registry.mutex);
+    for (arena = registry.arenas; arena != NULL; arena = arena->next) {
+        if (!arena->live && (arena->size == size)) {
+            break;
+        }
+    }
+    if (arena == NULL) {
+        arena = calloc(1, sizeof(arena_t));
+        if (arena != NULL) {
+            arena->size = size;
+            arena->base = (size > 0) ? malloc(size) : NULL;
+            if (arena->base == NULL) {
+                arena->size = 0;
+            }
+            arena->next     = registry.arenas;
+            registry.arenas = arena;
+        }
+    }
+    if (arena != NULL) {
+        arena->live = true;
+    }
+    pthread_mutex_unlock(&registry.mutex);
+
+    if (arena != NULL) {
+        pthread_setspecific(registry.key, arena);
+        tls_arena = arena;
+    }
+    return arena;
+}
+
+
+
+
+bool arena_begin(size_t size) {
+    arena_t* arena = sub_arena_get(size);
+
+    if ((arena == NULL) || arena->bound) {
+        return false;
+    }
+    arena->bound = true;
+    return true;
+}
+
+
+void arena_end(void) {
+    arena_t* arena = tls_arena;
+    uint64_t bytes;
+
+    if ((arena == NULL) || !arena->bound) {
+        return;
+    }
+
+    bytes = arena->used + arena->overflow_bytes;
+    if (bytes > TLS_GET(arena->highwater)) {
+        TLS_SET(arena->highwater, bytes);
+    }
+    if (arena->overflow_bytes != 0) {
+        TLS_SET(arena->overflows, TLS_GET(arena->overflows) + 1);
+    }
+    TLS_SET(arena->requests, TLS_GET(arena->requests) + 1);
+
+    sub_release_overflow(arena);
+    arena->overflow_bytes   = 0;
+    arena->used             = 0;
+    arena->bound            = false;
+}
+
+
+void* arena_alloc(size_t size) {
+    arena_t* arena = tls_arena;
+    arena_chunk_t* chunk;
+    size_t aligned;
+
+    if ((arena == NULL) || !arena->bound) {
+        return malloc(size);
+    }
+
+    aligned = (size + (ARENA_ALIGN-1)) & ~(size_t)(ARENA_ALIGN-1);
+    if (aligned <= (arena->size - arena->used)) {
+        void* ptr = &arena->base[arena->used];
+        arena->used += aligned;
+        return ptr;
+    }
+
+    chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size             = size;
+    chunk->next             = arena->overflow;
+    arena->overflow         = chunk;
+    arena->overflow_bytes  += size;
+    return (void*)(chunk + 1);
+}
+
+
+void arena_free(void* ptr) {
+/// Memory in the arena is freed by the reset.  Overflow chunks are freed
+/// now, since they tend to be big.  Anything else came from malloc().
+    arena_t* arena = tls_arena;
+
+    if (ptr == NULL) {
+        return;
+    }
+    if (arena != NULL) {
+        arena_chunk_t** prev;
+
+        if (((uint8_t*)ptr >= arena->base) && ((uint8_t*)ptr < &arena->base[arena->size])) {
+            return;
+        }
+        for (prev = &arena->overflow; *prev != NULL; prev = &(*prev)->next) {
+            if ((void*)(*prev + 1) == ptr) {
+                arena_chunk_t* chunk = *prev;
+                *prev = chunk->next;
+                free(chunk);
+                return;
+            }
+        }
+    }
+    free(ptr);
+}
+
+
+int arena_print(char* dst, size_t dstmax, FORMAT_Type fmt) {
+    bool json = ((fmt == FORMAT_Json) || (fmt == FORMAT_JsonHex));
+    uint64_t requests   = 0;
+    uint64_t overflows  = 0;
+    uint64_t highwater  = 0;
+    size_t size         = 0;
+    int arenas          = 0;
+    int live            = 0;
+    int rc;
+
+    pthread_mutex_lock(&registry.mutex);
+    for (arena_t* arena = registry.arenas; arena != NULL; arena = arena->next) {
+        arenas++;
+        live       += arena->live;
+        requests   += TLS_GET(arena->requests);
+        overflows  += TLS_GET(arena->overflows);
+        if (TLS_GET(arena->highwater) > highwater) {
+            highwater = TLS_GET(arena->highwater);
+        }
+        if (arena->size > size) {
+            size = arena->size;
+        }
+    }
+    pthread_mutex_unlock(&registry.mutex);
+
+    if (json) {
+        rc = snprintf(dst, dstmax, "{\"arena\":{\"size\":%zu, \"arenas\":%i, \"live\":%i, "
+                                    "\"requests\":%llu, \"overflows\":%llu, \"highwater\":%llu}}",
+                        size, arenas, live, (unsigned long long)requests,
+                        (unsigned long long)overflows, (unsigned long long)highwater);
+    }
+    else {
+        rc = snprintf(dst, dstmax, "arena\n"
+                                    "  %-16s %zu\n  %-16s %i (%i live)\n  %-16s %llu\n"
+                                    "  %-16s %llu\n  %-16s %llu\n",
+                        "size", size, "arenas", arenas, live,
+                        "requests", (unsigned long long)requests,
+                        "overflows", (unsigned long long)overflows,
+                        "highwater", (unsigned long long)highwater);
+    }
+
+    return ((rc < 0) || ((size_t)rc >= dstmax)) ? -1 : rc;
+}
@@ -19,12 +19,16 @@
 #include "debug.h"
 #include "birdmon_app.h"
 #include "backend.h"
+#include "compress.h"
 #include "formatters.h"
+#include "jobsched.h"
+#include "lockprof.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 // Local Libraries/Includes
 #include <bintex.h>
-#include <ccronexpr.h>
 #include <dterm.h>
 #include <hbutils/timespec.h>
 
@@ -46,16 +50,23 @@
 
 
 
+/// The first feed is ANOW_JOB, and it takes the datatypes that are not in
+/// the others.
+static const anow_feed_t anow_feeds[ANOW_FEEDS] = {
+    { "eph",    ANOW_JOB,       NULL },
+    { "alm",    "anow_alm",     ANOW_CRON_ALM },
+    { "aux",    "anow_aux",     ANOW_CRON_AUX },
+};
 
 
-int backend_init(backend_handle_t* handle, const char* cronstr) {
+
+
+int backend_init(backend_handle_t* handle) {
 /// Initialize the interface table based on the num_intf parameter.  If it's
 /// zero then it is considered to be 1.
     CURLcode curl_rc;
     backend_ctx_t* ctx;
     int rc = -3;
-    const char* cron_err;
-    const char* cronstr_def = "0 0 0/1 * * *";
 
     if (handle == NULL) {
         return -1;
@@ -66,51 +77,52 @@ int backend_init(backend_handle_t* handle, const char* cronstr) {
         return -2;
     }
     
-    bzero(&ctx->assistnow, sizeof(assistnow_t));
+    // The empty snapshot
+    ctx->assistnow = calloc(1, sizeof(assistnow_t));
+    if (ctx->assistnow == NULL) {
+        free(ctx);
+        return -2;
+    }
+    ctx->assistnow->refs = 1;
+    ctx->stale = false;
+    memcpy(ctx->feed, anow_feeds, sizeof(anow_feeds));
+    
+    bzero(&ctx->plan, sizeof(anow_plan_t));
+    bzero(&ctx->hedge, sizeof(anow_hedge_t));
     
     if (pthread_mutex_init(&ctx->data_mutex, NULL) != 0) {
         goto backend_init_ERR1;
     }
-    if (pthread_cond_init(&ctx->croncond, NULL) != 0) {
-        goto backend_init_ERR2;
-    }
-    if (pthread_mutex_init(&ctx->cronmutex, NULL) != 0) {
-        goto backend_init_ERR3;
-    }
     if (pthread_cond_init(&ctx->readycond, NULL) != 0) {
-        goto backend_init_ERR4;
+        goto backend_init_ERR2;
     }
     if (pthread_mutex_init(&ctx->readymutex, NULL) != 0) {
-        goto backend_init_ERR5;
+        goto backend_init_ERR3;
     }
     
     curl_rc = curl_global_init(CURL_GLOBAL_ALL);
     if (curl_rc != 0) {
-        goto backend_init_ERR6;
+        goto backend_init_ERR4;
     }
     
-    bzero(&ctx->cronexp, sizeof(cron_expr));
-    if (cronstr == NULL) {
-        cronstr = cronstr_def;
-    }
-    cron_parse_expr(cronstr, &ctx->cronexp, &cron_err);
-    ctx->cronbasis = 0;
+    // Compression is optional: failure just means getanow -z is unavailable
+    compress_init();
+    
+    ctx->nextfetch = 0;
+    ctx->ready_gen = 0;
     
     *handle = (backend_handle_t)ctx;
     return 0;
     
     // Error handling destructors
-    backend_init_ERR6:
-    pthread_mutex_destroy(&ctx->readymutex);    rc--;
-    backend_init_ERR5:
-    pthread_cond_destroy(&ctx->readycond);      rc--;
     backend_init_ERR4:
-    pthread_mutex_destroy(&ctx->cronmutex);     rc--;
+    pthread_mutex_destroy(&ctx->readymutex);    rc--;
     backend_init_ERR3:
-    pthread_cond_destroy(&ctx->croncond);       rc--;
+    pthread_cond_destroy(&ctx->readycond);      rc--;
     backend_init_ERR2:
     pthread_mutex_destroy(&ctx->data_mutex);    rc--;
     backend_init_ERR1:
+    free(ctx->assistnow);
     free(ctx);
     
     return rc;
@@ -124,12 +136,12 @@ void backend_deinit(backend_handle_t handle) {
     if (handle != NULL) {
         ctx = (backend_ctx_t*)handle;
         
+        backend_release(ctx->assistnow);
+        compress_deinit();
         curl_global_cleanup();
         
         pthread_mutex_destroy(&ctx->readymutex);
         pthread_cond_destroy(&ctx->readycond);
-        pthread_mutex_destroy(&ctx->cronmutex);
-        pthread_cond_destroy(&ctx->croncond);
         pthread_mutex_destroy(&ctx->data_mutex);
         
         free(ctx);
@@ -146,278 +158,908 @@ void backend_deinit(backend_handle_t handle) {
 /** Backend Threads <BR>
   * ========================================================================<BR>
   * <LI> agnss_reader() : reads AGNSS information from various HTTP servers
-  *         (namely Ublox AssistNow), and stores it to local cache. </LI>
+  *         (namely Ublox AssistNow), and merges it into the local cache.
+  *         Each feed is a job of the scheduler, and runs once per call. </LI>
   */
-typedef struct {
-    ubx_header_t header;
-    uint8_t* front;
-    uint8_t* payload;
-    uint8_t* checksum;
-} ubx_packet_t;
-
-
-static int sub_validate_ubx(ubx_packet_t* pkt) {
-    union {
-        uint8_t ubyte[2];
-        uint16_t ushort;
-    } fletcher;
-    union {
-        uint8_t ubyte[2];
-        uint16_t ushort;
-    } ck;
-    int length;
-    uint8_t* cursor;
-    uint16_t output;
-    
 
-    fletcher.ubyte[0] = pkt->checksum[0];
-    fletcher.ubyte[1] = pkt->checksum[1];
 
-//HEX_DUMP(pkt->front, (pkt->header.plen+8), "packet-total: \n");
-//HEX_DUMP((uint8_t*)&pkt->header, sizeof(ubx_header_t), "packet-header: \n");
-//HEX_DUMP((uint8_t*)&fletcher.ubyte[0], 2, "packet-checksum: \n");
+/* Render a refresh push for subscribers, in the output format of the server.
+ * The payload variant carries the whole snapshot.  dst must have room for
+ * (bufsize*2 + 512) bytes on payload, 512 bytes otherwise.
+ *
+ * Return the number of bytes written to dst. */
+static int sub_render_push(char* dst, size_t dstmax, assistnow_t* anow, time_t nextfetch, bool payload) {
+    char* dcurs = dst;
+    char etag[SHA256_SIZE*2 + 1];
+    uint8_t* scurs;
+    size_t accum = 0;
+    FORMAT_Type fmt = cliopt_getformat();
+    
+    for (int i=0; i<SHA256_SIZE; i++) {
+        sprintf(&etag[i*2], "%02X", anow->hash[i]);
+    }
+    
+    switch (fmt) {
+        case FORMAT_Json:
+        case FORMAT_JsonHex:
+            dcurs += snprintf(dcurs, dstmax, 
+                        "{\"type\":\"ubx_anow_push\", \"data\":{\"hash\":\"%s\", \"timestamp\":%lu, \"next\":%lu", 
+                        etag, anow->timestamp, nextfetch);
+            if (payload) {
+                scurs   = anow->buf;
+                dcurs  += sprintf(dcurs, ", \"size\":%zu, \"dat\":", anow->bufsize);
+                
+                // JsonHex hex strings are not quoted by the formatter
+                if (fmt == FORMAT_JsonHex) {
+                    *dcurs++ = '"';
+                }
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->bufsize, 0);
+                dcurs  += accum;
+                if (fmt == FORMAT_JsonHex) {
+                    *dcurs++ = '"';
+                }
+            }
+            dcurs = stpcpy(dcurs, "}}\n");
+            break;
+            
+        // Hex output has no envelope: notify is the hash, payload is the blob
+        case FORMAT_Hex:
+        case FORMAT_Bintex:
+            if (payload) {
+                scurs   = anow->buf;
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->bufsize, 0);
+                dcurs  += accum;
+            }
+            else {
+                dcurs = stpcpy(dcurs, etag);
+            }
+            dcurs = stpcpy(dcurs, "\n");
+            break;
+        
+        default:
+            dcurs += snprintf(dcurs, dstmax, 
+                        "ubx_anow_push hash=%s timestamp=%lu next=%lu",
+                        etag, anow->timestamp, nextfetch);
+            if (payload) {
+                scurs   = anow->buf;
+                dcurs  += sprintf(dcurs, " size=%zu\n", anow->bufsize);
+                fmt_printhex((uint8_t*)dcurs, &accum, &scurs, anow->bufsize, 0);
+                dcurs  += accum;
+            }
+            dcurs = stpcpy(dcurs, "\n");
+            break;
+    }
     
-    ck.ushort = 0;
-    cursor = &pkt->front[2];
-    length = 4 + pkt->header.plen;
+    return (int)(dcurs - dst);
+}
+
+
+
+
+typedef enum {
+    PLAN_select = 0,        // adaptive schedule was just selected
+    PLAN_error,
+    PLAN_unchanged,
+    PLAN_changed
+} PLAN_Type;
+
+
+static time_t sub_anow_expiry(const ubx_pkt_t* pkt, size_t numpkts, time_t now) {
+/// Earliest ephemeris expiry in a fetch.  Ones already expired are left
+/// out: a refetch cannot fix them until upstream does.
+    time_t earliest = 0;
     
-    while (length > 0) {
-        length--;
-        ck.ubyte[0] += *cursor++;
-        ck.ubyte[1] += ck.ubyte[0];
+    for (size_t i=0; i<numpkts; i++) {
+        time_t expires = ubx_expiry(&pkt[i], now);
+        if ((expires > now) && ((earliest == 0) || (expires < earliest))) {
+            earliest = expires;
+        }
     }
+    return earliest;
+}
 
-    output = fletcher.ushort - ck.ushort;
 
-    return (int)output;
+static time_t sub_backoff(time_t now, int errors) {
+/// Time of the retry after a number of failures in a row
+    time_t next = now + (BIRDMON_PARAM(ANOW_MINWAIT) << ((errors < 8) ? (errors-1) : 7));
+    return (next > (now + BIRDMON_PARAM(ANOW_MAXWAIT))) ? (now + BIRDMON_PARAM(ANOW_MAXWAIT)) : next;
 }
 
 
+static void sub_anow_plan(backend_ctx_t* ctx, PLAN_Type outcome) {
+/// Plan the next fetch of the adaptive schedule.  Must be called with the
+/// data_mutex held.
+    anow_plan_t* plan   = &ctx->plan;
+    time_t now          = time(NULL);
+    time_t minwait      = BIRDMON_PARAM(ANOW_MINWAIT);
+    time_t maxwait      = BIRDMON_PARAM(ANOW_MAXWAIT);
+    time_t bound;
+    time_t next;
+    
+    // On cron, only failures are planned: they are retried with a backoff,
+    // and the cron schedule carries on.
+    if (plan->adaptive == false) {
+        if (outcome == PLAN_error) {
+            plan->errors++;
+            jobsched_retry(ANOW_JOB, sub_backoff(now, plan->errors));
+            ctx->nextfetch = jobsched_next(ANOW_JOB);
+        }
+        else {
+            plan->errors = 0;
+        }
+        return;
+    }
+    
+    // Data must be fetched latency seconds before it expires
+    bound = (plan->expires > 0) ? (plan->expires - plan->latency) : (now + maxwait);
+    
+    switch (outcome) {
+        default:
+        case PLAN_select:
+            next = (plan->expires == 0) ? now : bound;
+            break;
+        
+        case PLAN_error:
+            plan->errors++;
+            next = sub_backoff(now, plan->errors);
+            break;
+        
+        // Fetched too soon: wait for the bound.  Once it is past, upstream
+        // is late, so back off, but not past the expiry itself.
+        case PLAN_unchanged:
+            plan->errors = 0;
+            if (bound > now) {
+                next = bound;
+            }
+            else {
+                plan->unchanged++;
+                next = now + (minwait << ((plan->unchanged < 8) ? (plan->unchanged-1) : 7));
+                if ((plan->expires > now) && (next > plan->expires)) {
+                    next = plan->expires;
+                }
+            }
+            break;
+        
+        // Upstream is not likely to have changed again in half a cadence,
+        // but data must not be left to expire waiting for it.
+        case PLAN_changed:
+            if (plan->last_change > 0) {
+                time_t interval = now - plan->last_change;
+                plan->cadence   = (plan->cadence > 0) ? (((plan->cadence * 3) + interval) / 4) : interval;
+            }
+            plan->last_change   = now;
+            plan->errors        = 0;
+            plan->unchanged     = 0;
+            next = bound;
+            if ((plan->cadence > 0) && (next < (now + (plan->cadence / 2)))) {
+                next = now + (plan->cadence / 2);
+                if ((plan->expires > 0) && (next > plan->expires)) {
+                    next = plan->expires;
+                }
+            }
+            break;
+    }
+    
+    if (outcome != PLAN_select) {
+        next = (next < (now + minwait)) ? (now + minwait) : next;
+    }
+    next = (next > (now + maxwait)) ? (now + maxwait) : next;
+    
+    ctx->nextfetch = next;
+    jobsched_set_at(ANOW_JOB, next);
+}
+
 
+int backend_schedule(backend_handle_t handle, const char* cronstr, const char** err) {
+    backend_ctx_t* ctx = (backend_ctx_t*)handle;
+    int rc = 0;
+    
+    if ((ctx == NULL) || (cronstr == NULL)) {
+        return -1;
+    }
+    
+    LP_LOCK(&ctx->data_mutex, LOCK_data);
+    if (strcmp(cronstr, ANOW_ADAPTIVE) == 0) {
+        ctx->plan.adaptive = true;
+        sub_anow_plan(ctx, PLAN_select);
+    }
+    else {
+        rc = jobsched_set_cron(ANOW_JOB, cronstr, err);
+        if (rc == 0) {
+            ctx->plan.adaptive = false;
+            ctx->nextfetch = jobsched_next(ANOW_JOB);
+        }
+    }
+    LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+    
+    return rc;
+}
 
 
-void* agnss_reader(void* args) {
-    birdmon_app_t* appdata  = args;
+int backend_start(backend_handle_t handle, void* appdata, const char* cronstr) {
+    backend_ctx_t* ctx = (backend_ctx_t*)handle;
     dterm_handle_t* dth;
-    const char* assistnow_apikey;
-    char tmpbuf[256];
-    char assistnow_url[1024];
-    uint8_t assistnow_buf[65536];
-    size_t assistnow_bufmax = sizeof(assistnow_buf);
+    const char* cron_err;
+    bool adaptive;
+    int rc;
     
-    if (args == NULL) {
-        goto agnss_reader_TERM;
+    if ((ctx == NULL) || (appdata == NULL)) {
+        return -1;
     }
-    dth = appdata->dterm_parent;
-    if (dth == NULL) {
-        goto agnss_reader_TERM;
+    dth         = ((birdmon_app_t*)appdata)->dterm_parent;
+    cronstr     = (cronstr != NULL) ? cronstr : ANOW_CRON_DEFAULT;
+    adaptive    = (strcmp(cronstr, ANOW_ADAPTIVE) == 0);
+    
+    for (int i=0; i<ANOW_FEEDS; i++) {
+        ctx->feed[i].appdata = appdata;
     }
+    for (int i=1; i<ANOW_FEEDS; i++) {
+        jobsched_add_cron(ctx->feed[i].job, ctx->feed[i].cron, BIRDMON_PARAM(ANOW_JITTER)*1000, 
+                          &agnss_reader, &ctx->feed[i], NULL);
+        jobsched_run_now(ctx->feed[i].job);
+    }
+    
+    rc = jobsched_add_cron(ANOW_JOB, adaptive ? ANOW_CRON_DEFAULT : cronstr, 
+                           BIRDMON_PARAM(ANOW_JITTER)*1000, &agnss_reader, &ctx->feed[0], &cron_err);
+    if (rc == -2) {
+        const char* logmsg = "Cron string provided to backend is invalid -- waiting for resync event.";
+        dterm_send_log(dth, logmsg, strlen(logmsg));
+    }
+    else if ((rc == 0) && adaptive) {
+        return backend_schedule(handle, ANOW_ADAPTIVE, NULL);
+    }
+    
+    // Clients are told when to expect the next snapshot
+    LP_LOCK(&ctx->data_mutex, LOCK_data);
+    ctx->nextfetch = jobsched_next(ANOW_JOB);
+    LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+    
+    return rc;
+}
 
-    while (1) {
-        struct timespec next = {.tv_nsec=0, .tv_sec=0};
-        
-        pthread_mutex_lock(&appdata->ctx->data_mutex);
-        next.tv_sec = cron_next(&appdata->ctx->cronexp, appdata->ctx->cronbasis);
-        pthread_mutex_unlock(&appdata->ctx->data_mutex);
-        
-        /// Error case: invalid cron, wait until a resynchronization event
-        if (next.tv_sec < 0) {
-            const char* logmsg = "Cron string provided to backend is invalid -- waiting for resync event.";
-            dterm_send_log(dth, logmsg, strlen(logmsg));
-            
-            pthread_mutex_lock(&appdata->ctx->cronmutex);
-            appdata->ctx->croncond_pred = true;
-            while (appdata->ctx->croncond_pred) {
-                pthread_cond_wait(&appdata->ctx->croncond, &appdata->ctx->cronmutex);
-            }
-            pthread_mutex_unlock(&appdata->ctx->cronmutex);
-            
+
+
+
+assistnow_t* backend_retain(assistnow_t* anow) {
+    __atomic_add_fetch(&anow->refs, 1, __ATOMIC_RELAXED);
+    return anow;
+}
+
+
+void backend_release(assistnow_t* anow) {
+    if ((anow != NULL) && (__atomic_sub_fetch(&anow->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        free(anow->pkt);
+        free(anow->buf);
+        free(anow->zbuf);
+        free(anow);
+    }
+}
+
+
+
+
+static int sub_key_cmp(const void* a, const void* b) {
+    uint32_t x = (*(ubx_pkt_t* const*)a)->key;
+    uint32_t y = (*(ubx_pkt_t* const*)b)->key;
+    return (x > y) - (x < y);
+}
+
+
+static bool sub_anow_older(const ubx_pkt_t* fetched, const ubx_pkt_t* current, time_t now) {
+/// An ephemeris from a lagging endpoint may expire before the one it would
+/// replace.  Other packets carry no time, and the fetched one is taken.
+    time_t fetched_exp = ubx_expiry(fetched, now);
+    time_t current_exp = ubx_expiry(current, now);
+    return (fetched_exp != 0) && (current_exp != 0) && (fetched_exp < current_exp);
+}
+
+
+/// What the merge keeps: the configured datatypes and GNSS, and the
+/// datatypes of this fetch
+typedef struct {
+    const char* datatypes;
+    const char* gnss;
+    const char* fetched;
+} anow_scope_t;
+
+
+static bool sub_in_list(const char* list, const char* item) {
+/// True if item is one of the words in list, which are separated by commas
+/// or spaces.  A NULL list has all items.
+    size_t len = strlen(item);
+    
+    if (list == NULL) {
+        return true;
+    }
+    list += strspn(list, ", ");
+    while (*list != 0) {
+        size_t wordlen = strcspn(list, ", ");
+        if ((wordlen == len) && (strncmp(list, item, len) == 0)) {
+            return true;
+        }
+        list += wordlen;
+        list += strspn(list, ", ");
+    }
+    return false;
+}
+
+
+static bool sub_anow_keep(const ubx_pkt_t* pkt, const anow_scope_t* scope, time_t now) {
+/// A current packet that was not fetched is kept if its datatype and GNSS
+/// are still configured, and it has not expired.  If its datatype was in the
+/// fetch, the endpoint does not serve it anymore (e.g. an SV that left the
+/// filter), and it is only kept while it has a fit interval to run.
+/// Almanacs have none, so they have an age limit instead.
+    const char* datatype    = ubx_datatype(pkt);
+    const char* gnss        = ubx_gnss(pkt);
+    time_t expires          = ubx_expiry(pkt, now);
+    
+    if ((datatype != NULL) && (sub_in_list(scope->datatypes, datatype) == false)) {
+        return false;
+    }
+    if ((gnss != NULL) && (sub_in_list(scope->gnss, gnss) == false)) {
+        return false;
+    }
+    if ((expires != 0) && (expires <= now)) {
+        return false;
+    }
+    if ((datatype != NULL) && (expires == 0) && sub_in_list(scope->fetched, datatype)) {
+        return false;
+    }
+    if ((datatype != NULL) && (strcmp(datatype, "alm") == 0)
+    &&  ((now - pkt->fetched) > BIRDMON_PARAM(ANOW_ALM_MAXAGE))) {
+        return false;
+    }
+    return true;
+}
+
+
+static assistnow_t* sub_anow_merge(const assistnow_t* cur, ubx_pkt_t* fetched, int numfetched, 
+                                   const anow_scope_t* scope, time_t now) {
+/// Build the next snapshot from the current one and a fetch.  A fetched
+/// packet takes the place of the current one with its key, so the upload
+/// order is kept, and new keys go at the end.  Current packets that were
+/// not fetched are kept as sub_anow_keep() says.  The packets are copied, so
+/// the snapshot does not depend on the download buffer.
+    assistnow_t* next;
+    ubx_pkt_t** sorted;
+    bool* taken;
+    size_t bufsize  = 0;
+    size_t count    = 0;
+    int numsorted   = 0;
+    uint8_t* cursor;
+    
+    next    = calloc(1, sizeof(assistnow_t));
+    sorted  = malloc((numfetched + 1) * sizeof(ubx_pkt_t*));
+    taken   = calloc(numfetched + 1, sizeof(bool));
+    if ((next == NULL) || (sorted == NULL) || (taken == NULL)) {
+        goto sub_anow_merge_ERR;
+    }
+    next->pkt = malloc((cur->numpkts + numfetched + 1) * sizeof(ubx_pkt_t));
+    if (next->pkt == NULL) {
+        goto sub_anow_merge_ERR;
+    }
+    
+    // Fetched packets by key.  If a key is fetched twice, the later one is
+    // the one used.
+    for (int i=0; i<numfetched; i++) {
+        sorted[i] = &fetched[i];
+    }
+    qsort(sorted, numfetched, sizeof(ubx_pkt_t*), &sub_key_cmp);
+    for (int i=0; i<numfetched; i++) {
+        if ((numsorted > 0) && (sorted[numsorted-1]->key == sorted[i]->key)) {
+            ubx_pkt_t** keep = &sorted[numsorted-1];
+            ubx_pkt_t* drop  = (*keep > sorted[i]) ? sorted[i] : *keep;
+            *keep            = (*keep > sorted[i]) ? *keep : sorted[i];
+            taken[drop - fetched] = true;
             continue;
         }
+        sorted[numsorted++] = sorted[i];
+    }
+    
+    for (size_t i=0; i<cur->numpkts; i++) {
+        const ubx_pkt_t* pkt = &cur->pkt[i];
+        const ubx_pkt_t* key = pkt;
+        ubx_pkt_t** match;
         
-        /// Case where need to wait N seconds before doing actions
-        if (next.tv_sec > 0) {     
-            int rc = 0;
-            
-            // Need to make next.tv_sec compatible with REALTIME clock
-            next.tv_sec += time(NULL);
-            
-            pthread_mutex_lock(&appdata->ctx->cronmutex);
-            appdata->ctx->croncond_pred = true;
-            while (appdata->ctx->croncond_pred && (rc == 0)) {
-                rc = pthread_cond_timedwait(&appdata->ctx->croncond, &appdata->ctx->cronmutex, &next);
+        match = bsearch(&key, sorted, numsorted, sizeof(ubx_pkt_t*), &sub_key_cmp);
+        if (match != NULL) {
+            taken[*match - fetched] = true;
+            if (sub_anow_older(*match, pkt, now) == false) {
+                pkt = *match;
             }
-            pthread_mutex_unlock(&appdata->ctx->cronmutex);
         }
-        
-        /// Download some stuff from the assistnow server
-        assistnow_apikey = otvar_get_string(dth->vardict, "ubx_key");
-        if (assistnow_apikey == NULL) {
-            const char* logmsg = "UBX AssistNow API Key is not provided";
-            dterm_send_log(dth, logmsg, strlen(logmsg));
+        else if (sub_anow_keep(pkt, scope, now) == false) {
+            continue;
         }
-        else {
-            ubx_packet_t packet;
-            int dlbytes;
-            uint8_t* cursor;
-            int accum;
-            int fileerror;
-            int numpkts;
-            ubx_pkt_t* plist;
+        next->pkt[count++]  = *pkt;
+        bufsize            += 6 + pkt->len + 2;
+    }
+    for (int i=0; i<numfetched; i++) {
+        if (taken[i] == false) {
+            next->pkt[count++]  = fetched[i];
+            bufsize            += 6 + fetched[i].len + 2;
+        }
+    }
+    
+    next->buf = malloc((bufsize > 0) ? bufsize : 1);
+    if (next->buf == NULL) {
+        goto sub_anow_merge_ERR;
+    }
+    cursor = next->buf;
+    for (size_t i=0; i<count; i++) {
+        size_t rawlen = 6 + next->pkt[i].len + 2;
+        memcpy(cursor, next->pkt[i].data - 6, rawlen);
+        next->pkt[i].data   = cursor + 6;
+        cursor             += rawlen;
+    }
+    next->refs      = 1;
+    next->numpkts   = count;
+    next->bufsize   = bufsize;
+    next->timestamp = now;
+    sha256(next->hash, next->buf, bufsize);
+    
+    free(sorted);
+    free(taken);
+    return next;
+    
+    sub_anow_merge_ERR:
+    if (next != NULL) {
+        free(next->pkt);
+        free(next);
+    }
+    free(sorted);
+    free(taken);
+    return NULL;
+}
 
-// Example 
-// https://online-live1.services.u-blox.com/GetOnlineData.ashx?token=OaiZ3dS_eUyYXJRAi4V90Q;datatype=eph,alm,aux;format=mga;gnss=gps;lat=37.7769487;lon=-122.3978603;alt=17;pacc=20;tacc=10;latency=600;
-            snprintf(assistnow_url, sizeof(assistnow_url), 
-                            "%s?"
-                            "token=%s;"
-                            "datatype=%s;"
-                            "format=%s;"
-                            "gnss=%s;"
-                            "lat=%lf;"
-                            "lon=%lf;"
-                            "alt=%i;"
-                            "pacc=%i;"
-                            "tacc=%i;"
-                            "latency=%i;"
-                            "filteronpos;"
-                            ,
-                            otvar_get_string(dth->vardict, "ubx_uri"),
-                            assistnow_apikey,
-                            otvar_get_string(dth->vardict, "ubx_datatype"),
-                            otvar_get_string(dth->vardict, "ubx_format"),
-                            otvar_get_string(dth->vardict, "ubx_gnss"),
-                            otvar_get_number(dth->vardict, "lat"),
-                            otvar_get_number(dth->vardict, "lon"),
-                            (int)otvar_get_integer(dth->vardict, "alt"),
-                            (int)otvar_get_integer(dth->vardict, "pacc"),
-                            (int)otvar_get_integer(dth->vardict, "tacc"),
-                            (int)otvar_get_integer(dth->vardict, "latency")
-                        );
-            
-            /// backend context data mutex protects the context elements.
-            /// Commands don't need to worry about it, because it is subordinate
-            /// to the iso-mutex.
-            pthread_mutex_lock(&appdata->ctx->data_mutex);
-            dlbytes = utils_downloader(assistnow_url, tmpbuf, assistnow_buf, &assistnow_bufmax, false);
-            if (dlbytes <= 0) {
-                dterm_send_log(dth, tmpbuf, strlen(tmpbuf));
-                goto agnss_parse_EXIT;
-            }
-            
-            fileerror = 4;
-            accum = 0;
-            numpkts = 0;
-            cursor = assistnow_buf;
-            while (accum < dlbytes) {
-                int filesize;
-                packet.header.sync1     = cursor[0];
-                packet.header.sync2     = cursor[1];
-                packet.header.msg_class = cursor[2];
-                packet.header.msg_id    = cursor[3];
-                packet.header.plen      = ((uint16_t)cursor[5] * 256) + cursor[4];    //little endian
-                
-                packet.front            = (uint8_t*)cursor;
-                packet.payload          = (uint8_t*)&cursor[6];
-                packet.checksum         = packet.payload + packet.header.plen;
-                filesize                = 6 + packet.header.plen + 2;
-                
-                if (sub_validate_ubx(&packet) != 0) {
-                    //checksum error
-                    fileerror = 1;
-                    break;
-                }   
-                if ((packet.header.sync1 != 0xB5) || (packet.header.sync2 != 0x62)) {
-                    //header error
-                    fileerror = 2;
-                    break;
-                }
-                if (packet.header.msg_class != 0x13) {
-                    //not an MGA packet
-                    fileerror = 3;
-                    break;
-                }
-                
-                numpkts++;
-                accum += filesize;
-                cursor += filesize;
-            }
-            
-            if (accum == dlbytes) {
-                fileerror = 0;
-            }
-            else {
-                const char* null_err = "Unknown error";
-                const char* checksum_err = "Checksum failed";
-                const char* header_err = "Header not B562";
-                const char* mga_err = "Not an MGA Packet";
-                const char* frame_err = "Framing error";
-                const char* errmsg[5] = {null_err, checksum_err, header_err, mga_err, frame_err};
-                
-                snprintf(tmpbuf, sizeof(tmpbuf), "UBX AssistNow packet integrity error on byte offset %i (%s)", 
-                            accum, errmsg[fileerror]);
-                dterm_send_log(dth, tmpbuf, strlen(tmpbuf));
-                goto agnss_parse_EXIT;
-            }
-            
-            // UBX file is validated.  Only remaining error is malloc.
-            ///@todo this really should be done via a talloc context.
-            plist = malloc(sizeof(ubx_pkt_t) * numpkts);
-            if (plist == NULL) {
-                const char* logmsg = "UBX AssistNow downloaded, but could not be stored (malloc error)";
-                dterm_send_log(dth, logmsg, strlen(logmsg));
-                goto agnss_parse_EXIT;
-            }
-            
-            // Clear the old packet list and link it to the new one.
-            free(appdata->ctx->assistnow.pkt);
-            appdata->ctx->assistnow.numpkts     = numpkts;
-            appdata->ctx->assistnow.pkt         = plist;
-            appdata->ctx->assistnow.buf         = (uint8_t*)assistnow_buf;
-            appdata->ctx->assistnow.bufsize     = dlbytes;
-            appdata->ctx->assistnow.timestamp   = time(NULL);
-            
-            accum = 0;
-            cursor = assistnow_buf;
-            for (int i=0; i<numpkts; i++) {
-                int filesize;
-                appdata->ctx->assistnow.pkt[i].hdr.sync1    = cursor[0];
-                appdata->ctx->assistnow.pkt[i].hdr.sync2    = cursor[1];
-                appdata->ctx->assistnow.pkt[i].hdr.msg_class= cursor[2];
-                appdata->ctx->assistnow.pkt[i].hdr.msg_id   = cursor[3];
-                appdata->ctx->assistnow.pkt[i].hdr.plen     = ((uint16_t)cursor[5] * 256) + cursor[4];    //little endian
-                
-                appdata->ctx->assistnow.pkt[i].data         = appdata->ctx->assistnow.buf + accum + 6;
-                appdata->ctx->assistnow.pkt[i].len          = appdata->ctx->assistnow.pkt[i].hdr.plen;
-                
-                filesize    = 6 + (int)appdata->ctx->assistnow.pkt[i].len + 2;
-                accum      += filesize;
-                cursor     += filesize;
-            }
 
-            // Signal any listeners that data is ready
-            pthread_mutex_lock(&appdata->ctx->readymutex);
-            appdata->ctx->readycond_cnt = 0;
-            pthread_cond_broadcast(&appdata->ctx->readycond);
-            pthread_mutex_unlock(&appdata->ctx->readymutex);
+static void sub_anow_compress(assistnow_t* snap) {
+/// getanow -z serves the snapshot as it is compressed here, once per
+/// snapshot, in the backend job.  The first snapshot with data is made the
+/// dictionary.  Without compression, zbuf stays NULL.
+    size_t zmax;
+    int rc;
+    
+    if ((snap->bufsize == 0) || (compress_type("zstd") != COMP_zstd)) {
+        return;
+    }
+    compress_train(snap->buf, snap->bufsize);
+    
+    zmax        = compress_bound(COMP_zstd, snap->bufsize);
+    snap->zbuf  = malloc(zmax);
+    if (snap->zbuf == NULL) {
+        return;
+    }
+    rc = compress_run(COMP_zstd, COMP_ingest, snap->zbuf, zmax, snap->buf, snap->bufsize, &snap->zdict);
+    if (rc < 0) {
+        free(snap->zbuf);
+        snap->zbuf = NULL;
+        return;
+    }
+    snap->zsize = (size_t)rc;
+}
 
-            DEBUG_PRINTF("UBX Assistnow Package Downloaded on: %s\n", fmt_time(&appdata->ctx->assistnow.timestamp, NULL));
 
-            agnss_parse_EXIT:
-            pthread_mutex_unlock(&appdata->ctx->data_mutex);
+static bool sub_anow_stale(backend_ctx_t* ctx) {
+/// The snapshot is stale while any feed is failing.  The empty one is not.
+    for (int i=0; i<ANOW_FEEDS; i++) {
+        if (ctx->feed[i].errors > 0) {
+            return (ctx->assistnow->timestamp != 0);
         }
     }
+    return false;
+}
+
+
+static int sub_feed_datatypes(backend_ctx_t* ctx, anow_feed_t* feed, const char* ubx_datatype, 
+                              char* dst, size_t dstmax) {
+/// Write the datatypes in ubx_datatype that a feed fetches, as a list for
+/// the query, and return how many
+    char list[128];
+    char* saveptr;
+    char* datatype;
+    size_t len  = 0;
+    int count   = 0;
     
-    agnss_reader_TERM:
+    dst[0] = 0;
+    if (ubx_datatype == NULL) {
+        return 0;
+    }
+    snprintf(list, sizeof(list), "%s", ubx_datatype);
     
-    /// This occurs on uncorrected errors, such as case 4 from above, or other 
-    /// unknown errors.
-    raise(SIGTERM);
+    for (datatype = strtok_r(list, ", ", &saveptr); datatype != NULL; datatype = strtok_r(NULL, ", ", &saveptr)) {
+        anow_feed_t* owner = &ctx->feed[0];
+        for (int i=1; i<ANOW_FEEDS; i++) {
+            if (strcmp(datatype, ctx->feed[i].datatype) == 0) {
+                owner = &ctx->feed[i];
+            }
+        }
+        if ((owner == feed) && ((len + strlen(datatype) + 2) <= dstmax)) {
+            len += sprintf(&dst[len], "%s%s", (count > 0) ? "," : "", datatype);
+            count++;
+        }
+    }
+    return count;
+}
+
+
+
+
+#define ANOW_URLMAX     1024
+
+/// UBX validation of the responses from the endpoints
+typedef struct {
+    int     numpkts;
+    char    msg[128];
+} anow_check_t;
+
+
+static const char* sub_anow_validate(const uint8_t* data, size_t size, void* arg) {
+    anow_check_t* check = arg;
+    uint64_t t_stage    = stats_now();
+    uint64_t t_trace    = trace_begin();
+    int fileerror;
+    int accum;
+    
+    fileerror = ubx_validate_mga(data, (int)size, &check->numpkts, &accum);
+    stats_record(STATH_anow_validate, stats_now() - t_stage);
+    trace_end("validate", "anow", t_trace);
+    
+    if (fileerror != UBX_ERR_none) {
+        snprintf(check->msg, sizeof(check->msg), "UBX AssistNow packet integrity error on byte offset %i (%s)", 
+                    accum, ubx_strerror(fileerror));
+        return check->msg;
+    }
     return NULL;
 }
 
 
+static int sub_cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+static int sub_hedge_delay(anow_hedge_t* hedge) {
+/// p95 of the recent fetch times.  A few fetches are not enough to say what
+/// is slow, so until there are 8, the default is used.
+    uint32_t sorted[ANOW_SAMPLES];
+    int delay;
+    
+    if (hedge->count < 8) {
+        hedge->hedge_ms = BIRDMON_PARAM(ANOW_HEDGE);
+        return hedge->hedge_ms;
+    }
+    memcpy(sorted, hedge->sample, hedge->count * sizeof(uint32_t));
+    qsort(sorted, hedge->count, sizeof(uint32_t), &sub_cmp_u32);
+    delay = (int)sorted[(((hedge->count * 95) + 99) / 100) - 1];
+    delay = (delay < BIRDMON_PARAM(ANOW_HEDGE_MIN)) ? BIRDMON_PARAM(ANOW_HEDGE_MIN) : delay;
+    delay = (delay > BIRDMON_PARAM(ANOW_HEDGE_MAX)) ? BIRDMON_PARAM(ANOW_HEDGE_MAX) : delay;
+    hedge->hedge_ms = delay;
+    return delay;
+}
+
+
+static void sub_hedge_sample(anow_hedge_t* hedge, uint32_t elapsed_ms) {
+    hedge->sample[hedge->next]  = elapsed_ms;
+    hedge->next                 = (hedge->next + 1) % ANOW_SAMPLES;
+    hedge->count               += (hedge->count < ANOW_SAMPLES);
+}
+
 
+static int sub_anow_urls(dterm_handle_t* dth, const char* apikey, const char* datatype, char url[][ANOW_URLMAX]) {
+/// Build the request URL of each endpoint in ubx_uri, and return how many
+    const char* ubx_uri = otvar_get_string(dth->vardict, "ubx_uri");
+    char list[1024];
+    char* saveptr;
+    char* uri;
+    int count = 0;
+    
+    if (ubx_uri == NULL) {
+        return 0;
+    }
+    snprintf(list, sizeof(list), "%s", ubx_uri);
+    
+    for (uri = strtok_r(list, ", \t", &saveptr); 
+         (uri != NULL) && (count < BIRDMON_PARAM_ANOW_ENDPOINTS); 
+         uri = strtok_r(NULL, ", \t", &saveptr)) {
+        // A file:// URI is a local corpus, used for test fixtures and
+        // offline benchmarks.  It takes no query.
+        if (strncmp(uri, "file://", 7) == 0) {
+            snprintf(url[count++], ANOW_URLMAX, "%s", uri);
+            continue;
+        }
+// Example 
+// https://online-live1.services.u-blox.com/GetOnlineData.ashx?token=OaiZ3dS_eUyYXJRAi4V90Q;datatype=eph,alm,aux;format=mga;gnss=gps;lat=37.7769487;lon=-122.3978603;alt=17;pacc=20;tacc=10;latency=600;
+        snprintf(url[count++], ANOW_URLMAX, 
+                        "%s?"
+                        "token=%s;"
+                        "datatype=%s;"
+                        "format=%s;"
+                        "gnss=%s;"
+                        "lat=%lf;"
+                        "lon=%lf;"
+                        "alt=%i;"
+                        "pacc=%i;"
+                        "tacc=%i;"
+                        "latency=%i;"
+                        "filteronpos;"
+                        ,
+                        uri,
+                        apikey,
+                        datatype,
+                        otvar_get_string(dth->vardict, "ubx_format"),
+                        otvar_get_string(dth->vardict, "ubx_gnss"),
+                        otvar_get_number(dth->vardict, "lat"),
+                        otvar_get_number(dth->vardict, "lon"),
+                        (int)otvar_get_integer(dth->vardict, "alt"),
+                        (int)otvar_get_integer(dth->vardict, "pacc"),
+                        (int)otvar_get_integer(dth->vardict, "tacc"),
+                        (int)otvar_get_integer(dth->vardict, "latency")
+                    );
+    }
+    return count;
+}
 
 
 
 
+void agnss_reader(void* args) {
+/// Fetch the datatypes of one feed, and merge them into the snapshot.  The
+/// feeds are jobs, and only the scheduler thread runs them, one at a time.
+/// So they share the download buffers (one per endpoint), and the snapshot
+/// is only replaced here.
+    static uint8_t anow_buf[BIRDMON_PARAM_ANOW_ENDPOINTS][65536];
+    anow_feed_t* feed = args;
+    birdmon_app_t* appdata;
+    backend_ctx_t* ctx;
+    dterm_handle_t* dth;
+    const char* assistnow_apikey;
+    char tmpbuf[256];
+    char datatype[64];
+    char datatypes[128];
+    char gnss[64];
+    anow_scope_t scope;
+    const char* var;
+    char url[BIRDMON_PARAM_ANOW_ENDPOINTS][ANOW_URLMAX];
+    const char* urlp[BIRDMON_PARAM_ANOW_ENDPOINTS];
+    uint8_t* dlbuf[BIRDMON_PARAM_ANOW_ENDPOINTS];
+    int numurls;
+    int dlbytes;
+    int numpkts;
+    uint8_t* cursor;
+    ubx_pkt_t* plist;
+    assistnow_t* snap;
+    assistnow_t* prev;
+    utils_hedge_t hedge;
+    anow_check_t check;
+    char* push_notify   = NULL;
+    char* push_payload  = NULL;
+    int notify_len      = 0;
+    int payload_len     = 0;
+    time_t expires      = 0;
+    time_t now;
+    bool mainfeed;
+    bool stale;
+    PLAN_Type outcome;
+    uint64_t t_stage;
+    uint64_t t_trace;
+    
+    if ((feed == NULL) || (feed->appdata == NULL)) {
+        return;
+    }
+    appdata = feed->appdata;
+    dth     = appdata->dterm_parent;
+    ctx     = appdata->ctx;
+    if (dth == NULL) {
+        return;
+    }
+    mainfeed = (feed == &ctx->feed[0]);
+    
+    // On cron, the scheduler has already set the time of the next run.  On
+    // the adaptive schedule, it is planned when this run is done.
+    if (mainfeed) {
+        LP_LOCK(&ctx->data_mutex, LOCK_data);
+        ctx->plan.latency = (time_t)otvar_get_integer(dth->vardict, "latency");
+        if (ctx->plan.adaptive == false) {
+            ctx->nextfetch = jobsched_next(ANOW_JOB);
+        }
+        LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+    }
+    
+    // Nothing to do if ubx_datatype has none of the datatypes of the feed
+    var = otvar_get_string(dth->vardict, "ubx_datatype");
+    snprintf(datatypes, sizeof(datatypes), "%s", (var != NULL) ? var : "");
+    var = otvar_get_string(dth->vardict, "ubx_gnss");
+    snprintf(gnss, sizeof(gnss), "%s", (var != NULL) ? var : "");
+    scope.datatypes = datatypes;
+    scope.gnss      = (var != NULL) ? gnss : NULL;
+    scope.fetched   = datatype;
+    if (sub_feed_datatypes(ctx, feed, datatypes, datatype, sizeof(datatype)) == 0) {
+        if (mainfeed) {
+            LP_LOCK(&ctx->data_mutex, LOCK_data);
+            sub_anow_plan(ctx, PLAN_unchanged);
+            LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+        }
+        goto agnss_reader_READY;
+    }
+    
+    /// Download some stuff from the assistnow server
+    assistnow_apikey = otvar_get_string(dth->vardict, "ubx_key");
+    if (assistnow_apikey == NULL) {
+        const char* logmsg = "UBX AssistNow API Key is not provided";
+        dterm_send_log(dth, logmsg, strlen(logmsg));
+        goto agnss_reader_FAIL;
+    }
+    numurls = sub_anow_urls(dth, assistnow_apikey, datatype, url);
+    if (numurls == 0) {
+        const char* logmsg = "UBX AssistNow URI is not provided";
+        dterm_send_log(dth, logmsg, strlen(logmsg));
+        goto agnss_reader_FAIL;
+    }
+    for (int i=0; i<numurls; i++) {
+        urlp[i]     = url[i];
+        dlbuf[i]    = anow_buf[i];
+    }
+    
+    /// The download does not hold the data mutex, so the current snapshot
+    /// is served while it runs.  Responses are validated as they complete,
+    /// and the first one with good UBX framing and checksums is taken.
+    LP_TAG("anow_fetch");
+    stats_add(STAT_anow_fetches, 1);
+    t_stage = stats_now();
+    trace_request();
+    hedge.hedge_ms      = sub_hedge_delay(&ctx->hedge);
+    hedge.timeout_ms    = BIRDMON_PARAM(ANOW_TIMEOUT);
+    hedge.validate      = &sub_anow_validate;
+    hedge.arg           = &check;
+    dlbytes = utils_hedged_downloader(urlp, dlbuf, numurls, sizeof(anow_buf[0]), &hedge, tmpbuf);
+    stats_record(STATH_anow_fetch, stats_now() - t_stage);
+    if (hedge.started > 1) {
+        stats_add(STAT_anow_hedges, (uint64_t)(hedge.started - 1));
+    }
+    if (dlbytes <= 0) {
+        stats_add(STAT_anow_errors, 1);
+        dterm_send_log(dth, tmpbuf, strlen(tmpbuf));
+        goto agnss_reader_FAIL;
+    }
+    sub_hedge_sample(&ctx->hedge, hedge.elapsed_ms);
+    ctx->hedge.endpoint = hedge.winner;
+    if (hedge.winner > 0) {
+        DEBUG_PRINTF("UBX AssistNow (%s) taken from endpoint %i after %u ms\n", datatype, hedge.winner, hedge.elapsed_ms);
+    }
+    
+    // UBX file is validated.  Only remaining error is malloc.  The next
+    // snapshot is built without the data mutex: the current one is only
+    // read, and only this thread replaces it.
+    ///@todo this really should be done via a talloc context.
+    LP_TAG("anow_ingest");
+    t_stage = stats_now();
+    t_trace = trace_begin();
+    numpkts = check.numpkts;
+    plist   = malloc(sizeof(ubx_pkt_t) * (numpkts + 1));
+    snap    = NULL;
+    now     = time(NULL);
+    if (plist != NULL) {
+        cursor = dlbuf[hedge.winner];
+        for (int i=0; i<numpkts; i++) {
+            cursor += ubx_index(&plist[i], cursor);
+            plist[i].fetched = now;
+        }
+        if (mainfeed) {
+            expires = sub_anow_expiry(plist, (size_t)numpkts, now);
+        }
+        snap = sub_anow_merge(ctx->assistnow, plist, numpkts, &scope, now);
+        free(plist);
+    }
+    if (snap != NULL) {
+        sub_anow_compress(snap);
+    }
+    if (snap == NULL) {
+        const char* logmsg = "UBX AssistNow downloaded, but could not be stored (malloc error)";
+        stats_add(STAT_anow_errors, 1);
+        dterm_send_log(dth, logmsg, strlen(logmsg));
+        goto agnss_reader_FAIL;
+    }
+    
+    /// backend context data mutex protects the context elements.
+    /// Commands don't need to worry about it, because it is subordinate
+    /// to the iso-mutex.
+    LP_LOCK(&ctx->data_mutex, LOCK_data);
+    prev            = ctx->assistnow;
+    ctx->assistnow  = snap;
+    feed->errors    = 0;
+    feed->fetched   = now;
+    ctx->stale      = sub_anow_stale(ctx);
+    stale           = ctx->stale;
+    
+    // The next fetch goes in the pushes, so it is planned first
+    outcome = (memcmp(snap->hash, prev->hash, SHA256_SIZE) == 0) ? PLAN_unchanged : PLAN_changed;
+    if (outcome == PLAN_unchanged) {
+        stats_add(STAT_anow_unchanged, 1);
+    }
+    if (mainfeed) {
+        // The backoff is for one expiry: the next one starts over
+        if (expires != ctx->plan.expires) {
+            ctx->plan.unchanged = 0;
+        }
+        ctx->plan.expires = expires;
+        sub_anow_plan(ctx, outcome);
+    }
+
+    // Render the pushes for subscribers while the snapshot is locked.
+    // They are published after it is released.  The payload push is the
+    // whole snapshot in hex, so it is only rendered if someone takes it.
+    if (dterm_subscribers(dth, ANOW_XID_NOTIFY) > 0) {
+        push_notify = malloc(512);
+        if (push_notify != NULL) {
+            notify_len = sub_render_push(push_notify, 512, snap, ctx->nextfetch, false);
+        }
+    }
+    if (dterm_subscribers(dth, ANOW_XID_PAYLOAD) > 0) {
+        push_payload = malloc((snap->bufsize * 2) + 512);
+        if (push_payload != NULL) {
+            payload_len = sub_render_push(push_payload, (snap->bufsize * 2) + 512, snap, ctx->nextfetch, true);
+        }
+    }
+    LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+    
+    // Readers still holding the previous snapshot keep it until they are done
+    backend_release(prev);
+    
+    stats_record(STATH_anow_ingest, stats_now() - t_stage);
+    trace_end("ingest", "anow", t_trace);
+    stats_add(STAT_anow_snapshots, 1);
+    stats_set(STAT_anow_pkts, (uint64_t)snap->numpkts);
+    stats_set(STAT_anow_bytes, (uint64_t)snap->bufsize);
+    stats_set(STAT_anow_stale, (uint64_t)stale);
+    
+    DEBUG_PRINTF("UBX Assistnow (%s) merged on: %s\n", datatype, fmt_time(&snap->timestamp, NULL));
+    goto agnss_reader_READY;
+    
+    // The last good snapshot is kept, and served as stale until a retry
+    // gets a new one.
+    agnss_reader_FAIL:
+    LP_LOCK(&ctx->data_mutex, LOCK_data);
+    feed->errors++;
+    ctx->stale  = sub_anow_stale(ctx);
+    stale       = ctx->stale;
+    if (mainfeed) {
+        sub_anow_plan(ctx, PLAN_error);
+    }
+    else {
+        jobsched_retry(feed->job, sub_backoff(time(NULL), feed->errors));
+    }
+    LP_UNLOCK(&ctx->data_mutex, LOCK_data);
+    stats_set(STAT_anow_stale, (uint64_t)stale);
+    
+    // Signal any listeners that the ephemeris fetch is done.  On failure,
+    // they get the stale snapshot.  The other feeds do not refresh what
+    // they wait for.
+    agnss_reader_READY:
+    if (mainfeed) {
+        LP_LOCK(&ctx->readymutex, LOCK_ready);
+        ctx->ready_gen++;
+        pthread_cond_broadcast(&ctx->readycond);
+        LP_UNLOCK(&ctx->readymutex, LOCK_ready);
+    }
+    
+    // Push the refresh to subscribed clients
+    if ((notify_len > 0) || (payload_len > 0)) {
+        LP_TAG("anow_publish");
+        t_stage = stats_now();
+        t_trace = trace_begin();
+        if (notify_len > 0) {
+            dterm_publish(dth, ANOW_XID_NOTIFY, (uint8_t*)push_notify, (size_t)notify_len);
+        }
+        if (payload_len > 0) {
+            dterm_publish(dth, ANOW_XID_PAYLOAD, (uint8_t*)push_payload, (size_t)payload_len);
+        }
+        stats_record(STATH_anow_publish, stats_now() - t_stage);
+        trace_end("publish", "anow", t_trace);
+    }
+    free(push_notify);
+    free(push_payload);
+}
@@ -18,15 +18,29 @@
 #include "cmds.h"
 #include "cmd_api.h"
 #include "birdmon_app.h"
+#include "coproc.h"
+#include "lockprof.h"
+#include "stats.h"
 
 // HB libraries
 #include <cmdtab.h>
 #include <bintex.h>
 
 // Standard libs
+#include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#   include <sys/inotify.h>
+#endif
 
 
 
@@ -38,9 +52,12 @@
 ///@todo this will need to be dynamic and build during startup based on an 
 ///      initialization file and plug-in libraries stored with the app.
 ///
+/// readonly: the command changes no shared state, so it may run in parallel
+/// with other readonly commands (see batch requests in dterm).
 typedef struct {
     const char      name[12]; 
     cmdaction_t     action; 
+    bool            readonly;
 } cmd_t;
 
 
@@ -49,15 +66,19 @@ typedef struct {
 
 
 static const cmd_t birdmon_commands[] = {
-    { "bye",        &cmd_quit  },
-    { "cmdls",      &cmd_cmdlist },
-    { "geoloc",     &cmd_geoloc },
-    { "getanow",    &cmd_getanow },
-    { "null",       &app_null },
-    { "quit",       &cmd_quit },
-    { "raw",        &cmd_raw },
-    { "schedule",   &cmd_schedule },
-    { "var",        &cmd_var },
+    { "bye",        &cmd_quit,      false },
+    { "cmdls",      &cmd_cmdlist,   true },
+    { "geoloc",     &cmd_geoloc,    false },
+    { "getanow",    &cmd_getanow,   true },
+    { "lockprof",   &cmd_lockprof,  false },
+    { "null",       &app_null,      true },
+    { "quit",       &cmd_quit,      false },
+    { "raw",        &cmd_raw,       false },
+    { "schedule",   &cmd_schedule,  false },
+    { "stats",      &cmd_stats,     true },
+    { "subscribe",  &cmd_subscribe, false },
+    { "trace",      &cmd_trace,     false },
+    { "var",        &cmd_var,       false },
 };
 
 
@@ -66,12 +87,247 @@ static const cmd_t birdmon_commands[] = {
 typedef enum {
     EXTCMD_null     = 0,
     EXTCMD_path,
+    EXTCMD_coproc,
     EXTCMD_MAX
 } birdmon_extcmd_t;
 
 
 
 
+/// External commands are kept apart from the builtin table, in a table that
+/// is rebuilt whenever the command path changes.  The new table replaces the
+/// old one under a short mutex, so dispatch never waits on a rebuild.  A
+/// search that finds an external command takes a reference on its table,
+/// which cmd_release() drops, so a table outlives every use of its entries.
+/// The last reference frees it, and drops its co-process pools: the pool of
+/// a removed .coproc file is stopped once no table has it.
+///
+/// The action of an external command is its entry, which leads back to the
+/// table.  The mutex is a leaf: nothing else is locked while it is held.
+struct xcmd_table;
+
+typedef struct xcmd_entry {
+    struct xcmd_entry*  next;
+    struct xcmd_table*  table;
+    coproc_t*           pool;       // NULL for EXTCMD_path
+} xcmd_entry_t;
+
+typedef struct xcmd_table {
+    cmdtab_t            tab;
+    int                 refs;
+    xcmd_entry_t*       entries;
+} xcmd_table_t;
+
+static struct {
+    pthread_mutex_t     mutex;
+    xcmd_table_t*       table;
+    char*               path;       // with trailing '/'
+    pthread_t           watcher;
+    bool                watching;
+} xcmd = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+
+
+
+static void sub_xcmd_free(xcmd_table_t* table) {
+    while (table->entries != NULL) {
+        xcmd_entry_t* entry = table->entries;
+        table->entries      = entry->next;
+        coproc_close(entry->pool);
+        free(entry);
+    }
+    cmdtab_free(&table->tab);
+    free(table);
+}
+
+
+static xcmd_table_t* sub_xcmd_acquire(void) {
+    xcmd_table_t* table;
+    
+    pthread_mutex_lock(&xcmd.mutex);
+    table = xcmd.table;
+    if (table != NULL) {
+        table->refs++;
+    }
+    pthread_mutex_unlock(&xcmd.mutex);
+    return table;
+}
+
+
+static void sub_xcmd_release(xcmd_table_t* table) {
+    bool last;
+    
+    if (table == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&xcmd.mutex);
+    last = (--table->refs == 0);
+    pthread_mutex_unlock(&xcmd.mutex);
+    
+    if (last) {
+        sub_xcmd_free(table);
+    }
+}
+
+
+static int sub_xcmd_add(xcmd_table_t* table, const char* name, coproc_t* pool, birdmon_extcmd_t type) {
+    xcmd_entry_t* entry = malloc(sizeof(xcmd_entry_t));
+    
+    if (entry == NULL) {
+        coproc_close(pool);
+        return -1;
+    }
+    if (cmdtab_add(&table->tab, name, (void*)entry, (void*)type) != 0) {
+        coproc_close(pool);
+        free(entry);
+        return -2;
+    }
+    entry->table    = table;
+    entry->pool     = pool;
+    entry->next     = table->entries;
+    table->entries  = entry;
+    return 0;
+}
+
+
+static xcmd_table_t* sub_xcmd_scan(const char* xpath) {
+/// Adds every executable regular file in the command path.  Files named
+/// with COPROC_SUFFIX are co-process commands, named without the suffix.
+/// The table starts with the reference that publishing it hands over.
+    xcmd_table_t* table;
+    DIR* dir;
+    struct dirent* entry;
+    int dirfd;
+    
+    table = calloc(1, sizeof(xcmd_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    if (cmdtab_init(&table->tab) != 0) {
+        free(table);
+        return NULL;
+    }
+    table->refs = 1;
+    
+    dirfd = open(xpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return table;
+    }
+    dir = fdopendir(dirfd);
+    if (dir == NULL) {
+        close(dirfd);
+        return table;
+    }
+    
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char name[32];
+        size_t name_len = strlen(entry->d_name);
+        
+        if ((entry->d_name[0] == '.') || (name_len >= sizeof(name))) {
+            continue;
+        }
+        if (fstatat(dirfd, entry->d_name, &st, 0) != 0) {
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || ((st.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)) == 0)) {
+            continue;
+        }
+        
+        memcpy(name, entry->d_name, name_len+1);
+        if ((name_len > (sizeof(COPROC_SUFFIX)-1)) \
+        && (strcmp(&name[name_len-(sizeof(COPROC_SUFFIX)-1)], COPROC_SUFFIX) == 0)) {
+            char fullpath[512];
+            coproc_t* pool;
+            snprintf(fullpath, sizeof(fullpath), "%s%s", xpath, entry->d_name);
+            pool = coproc_open(fullpath);
+            if (pool != NULL) {
+                name[name_len-(sizeof(COPROC_SUFFIX)-1)] = 0;
+                sub_xcmd_add(table, name, pool, EXTCMD_coproc);
+            }
+        }
+        else {
+            sub_xcmd_add(table, name, NULL, EXTCMD_path);
+        }
+    }
+    
+    closedir(dir);
+    return table;
+}
+
+
+static void sub_xcmd_publish(xcmd_table_t* table) {
+/// The old table goes once the commands running from it are done
+    xcmd_table_t* old;
+    
+    pthread_mutex_lock(&xcmd.mutex);
+    old         = xcmd.table;
+    xcmd.table  = table;
+    pthread_mutex_unlock(&xcmd.mutex);
+    
+    sub_xcmd_release(old);
+}
+
+
+#if defined(__linux__)
+static void* sub_xcmd_watcher(void* args) {
+/// Rescans the command path when files are added, removed, replaced or
+/// have their mode changed.  Events that come in a burst (e.g. a deployment
+/// of several files) get one rescan.
+    int fd = (int)(intptr_t)args;
+    uint8_t events[4096];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    
+    while (read(fd, events, sizeof(events)) > 0) {
+        int cancel_state;
+        xcmd_table_t* table;
+        
+        while (poll(&pfd, 1, 200) > 0) {
+            if (read(fd, events, sizeof(events)) <= 0) {
+                break;
+            }
+        }
+        
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+        table = sub_xcmd_scan(xcmd.path);
+        if (table != NULL) {
+            sub_xcmd_publish(table);
+        }
+        pthread_setcancelstate(cancel_state, NULL);
+    }
+    
+    return NULL;
+}
+#endif
+
+
+int cmd_watch(void) {
+    if ((xcmd.path == NULL) || xcmd.watching) {
+        return 0;
+    }
+    
+#   if defined(__linux__)
+    {   int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        if (inotify_add_watch(fd, xcmd.path, IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+                            | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE) < 0) {
+            close(fd);
+            return -2;
+        }
+        if (pthread_create(&xcmd.watcher, NULL, &sub_xcmd_watcher, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            return -3;
+        }
+        xcmd.watching = true;
+    }
+#   endif
+
+    return 0;
+}
+
+
+
 int cmd_init(cmdtab_t** init_table, const char* xpath) {
     
     if (init_table == NULL) {
@@ -88,41 +344,21 @@ int cmd_init(cmdtab_t** init_table, const char* xpath) {
         }
     }
 
-    /// cmdtab_add prioritizes subsequent command adds, so the highest priority
-    /// commands should be added last.
-
     /// First, add commands that are available from the external command path.
-    if (xpath != NULL) {
+    /// External commands go in their own table, and builtins take priority
+    /// over them in searches.
+    if ((xpath != NULL) && (xpath[0] != 0) && (xcmd.path == NULL)) {
         size_t xpath_len = strlen(xpath);
-        char buffer[256];
-        char* cmd;
-        FILE* stream;
-        int test;
-        if (xpath_len > 0) { 
-            ///@todo make this find call work properly on mac and linux.
-#           if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
-            snprintf(buffer, 256, "find %s -perm +111 -type f", xpath);
-            stream = popen(buffer, "r");
-#           elif defined(__linux__)
-            snprintf(buffer, 256, "find %s -perm /u=x,g=x,o=x -type f", xpath);
-            stream = popen(buffer, "r");
-#           else
-            stream = NULL;
-#           endif
-            if (stream != NULL) {
-                do {
-                    test = fscanf(stream, "%s", buffer);
-                    if (test == 1) {
-                        cmd = &buffer[xpath_len];
-                        if (strlen(cmd) >= 2) {
-                            cmdtab_add(*init_table, buffer, (void*)xpath, (void*)EXTCMD_path);
-                        }
-                    }
-                } while (test != EOF);
-                
-                pclose(stream);
-            }
+        xcmd.path = malloc(xpath_len + 2);
+        if (xcmd.path == NULL) {
+            return -2;
+        }
+        memcpy(xcmd.path, xpath, xpath_len+1);
+        if (xpath[xpath_len-1] != '/') {
+            xcmd.path[xpath_len]    = '/';
+            xcmd.path[xpath_len+1]  = 0;
         }
+        sub_xcmd_publish(sub_xcmd_scan(xcmd.path));
     }
 
     /// Last, Add commands to the cmdtab.
@@ -144,11 +380,22 @@ int cmd_init(cmdtab_t** init_table, const char* xpath) {
 
 
 int cmd_free(cmdtab_t* init_table) {
-    
     if (init_table == NULL) {
         return -1;
     }
-    /// First, free commands on xpath (should require nothing)
+    /// First, free commands on xpath: the watcher is stopped, then the
+    /// co-processes.
+#   if defined(__linux__)
+    if (xcmd.watching) {
+        pthread_cancel(xcmd.watcher);
+        pthread_join(xcmd.watcher, NULL);
+        xcmd.watching = false;
+    }
+#   endif
+    sub_xcmd_publish(NULL);
+    free(xcmd.path);
+    xcmd.path = NULL;
+    coproc_deinit();
     
     /// third, free cmdtab
     cmdtab_free(init_table);
@@ -163,11 +410,15 @@ int cmd_free(cmdtab_t* init_table) {
 
 int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* inbytes, uint8_t* src, size_t dstmax) {
     int output;
+    uint64_t t_start;
 
     if (cmd == NULL) {
         return -1;
     }
     
+    t_start = stats_now();
+    LP_TAG(cmd->name);
+    
     // handling of different command types
     switch ((birdmon_extcmd_t)cmd->extcmd) {
         case EXTCMD_null:
@@ -183,7 +434,7 @@ int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* in
             //fprintf(stderr, "EXTCMD_path: inbytes=%d, src=%s\n", *inbytes, (char*)src);
             
             cursor          = xpath;
-            cursor          = stpncpy(cursor, (const char*)(cmd->action), (&xpath[512] - cursor));
+            cursor          = stpncpy(cursor, xcmd.path, (&xpath[512] - cursor));
             cursor          = stpncpy(cursor, (const char*)(cmd->name), (&xpath[512] - cursor));
             cursor          = stpncpy(cursor, " ", (&xpath[512] - cursor));
             rsize           = (int)(&xpath[512] - cursor);
@@ -201,17 +452,37 @@ int cmd_run(const cmdtab_item_t* cmd, dterm_handle_t* dth, uint8_t* dst, int* in
             }
         } break;
 
+        case EXTCMD_coproc:
+            output = coproc_run(((xcmd_entry_t*)cmd->action)->pool, dst, dstmax, src, *inbytes);
+            break;
+
         default:
             //fprintf(stderr, "No Command Extension found: inbytes=%d, src=%s\n", *inbytes, (char*)src);
             output = -2;
             break;
     }
+    
+    stats_cmd(cmd->name, stats_now() - t_start, (output < 0));
 
     return output;
 }
 
 
 
+bool cmd_isreadonly(const cmdtab_item_t* cmd) {
+    if ((cmd == NULL) || ((birdmon_extcmd_t)cmd->extcmd != EXTCMD_null)) {
+        return false;
+    }
+    for (int i=0; i<(sizeof(birdmon_commands)/sizeof(cmd_t)); i++) {
+        if ((void*)birdmon_commands[i].action == cmd->action) {
+            return birdmon_commands[i].readonly;
+        }
+    }
+    return false;
+}
+
+
+
 int cmd_getname(char* cmdname, char* cmdline, size_t max_cmdname) {
 	size_t diff = max_cmdname;
     
@@ -304,13 +575,56 @@ const cmdtab_item_t* cmd_quoteline_resolve(char* quoteline, dterm_handle_t* dth)
 
 
 const cmdtab_item_t* cmd_search(cmdtab_t* cmdtab, char *cmdname) {
-    return cmdtab_search(cmdtab, cmdname);
+    const cmdtab_item_t* cmd;
+    xcmd_table_t* xtable;
+    
+    cmd = cmdtab_search(cmdtab, cmdname);
+    if ((cmd == NULL) && ((xtable = sub_xcmd_acquire()) != NULL)) {
+        cmd = cmdtab_search(&xtable->tab, cmdname);
+        if (cmd == NULL) {
+            sub_xcmd_release(xtable);
+        }
+    }
+    return cmd;
 }
 
 
 
 const cmdtab_item_t* cmd_subsearch(cmdtab_t* cmdtab, char *namepart) {
-    return cmdtab_subsearch(cmdtab, namepart);
+    const cmdtab_item_t* cmd;
+    xcmd_table_t* xtable;
+    
+    cmd = cmdtab_subsearch(cmdtab, namepart);
+    if ((cmd == NULL) && ((xtable = sub_xcmd_acquire()) != NULL)) {
+        cmd = cmdtab_subsearch(&xtable->tab, namepart);
+        if (cmd == NULL) {
+            sub_xcmd_release(xtable);
+        }
+    }
+    return cmd;
 }
 
 
+
+void cmd_release(const cmdtab_item_t* cmd) {
+    if ((cmd != NULL) && ((birdmon_extcmd_t)cmd->extcmd != EXTCMD_null)) {
+        sub_xcmd_release(((xcmd_entry_t*)cmd->action)->table);
+    }
+}
+
+
+
+int cmd_list(cmdtab_t* cmdtab, char* dst, size_t dstmax) {
+    int bytesout;
+    xcmd_table_t* xtable;
+    
+    bytesout = cmdtab_list(cmdtab, dst, dstmax);
+    if ((bytesout >= 0) && ((xtable = sub_xcmd_acquire()) != NULL)) {
+        int xbytes = cmdtab_list(&xtable->tab, &dst[bytesout], dstmax - (size_t)bytesout);
+        if (xbytes > 0) {
+            bytesout += xbytes;
+        }
+        sub_xcmd_release(xtable);
+    }
+    return bytesout;
+}
@@ -0,0 +1,235 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+#include "compress.h"
+#include "birdmon_cfg.h"
+
+#if BIRDMON_FEATURE(ZSTD)
+#   include <zstd.h>
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/// The dictionary is raw content (no zstd dictionary header), so clients can
+/// use it with ZSTD_decompress_usingDict() after fetching it via getanow.
+/// It is the UBX frames of the first snapshot, which have the same headers,
+/// reserved fields and slow-changing orbital terms as later ones.  Its id is
+/// an FNV-1a hash of its content, so clients can tell when it changes, e.g.
+/// after a restart.
+#define DICT_MAX    16384
+
+static uint8_t  dict_buf[DICT_MAX];
+static size_t   dict_size = 0;
+static uint32_t dict_id = 0;
+static pthread_mutex_t zmutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if BIRDMON_FEATURE(ZSTD)
+#   define ZSTD_LEVEL_REQUEST   3
+#   define ZSTD_LEVEL_INGEST    9
+static pthread_key_t    zkey;
+static bool             zactive = false;
+static ZSTD_CDict*      zcdict[2] = { NULL, NULL };    // by COMP_Effort
+#endif
+
+
+
+
+#if BIRDMON_FEATURE(ZSTD)
+static void sub_cctx_free(void* arg) {
+    ZSTD_freeCCtx((ZSTD_CCtx*)arg);
+}
+
+static ZSTD_CCtx* sub_cctx_get(void) {
+    ZSTD_CCtx* cctx = pthread_getspecific(zkey);
+    
+    if (cctx == NULL) {
+        cctx = ZSTD_createCCtx();
+        if (cctx != NULL) {
+            pthread_setspecific(zkey, cctx);
+        }
+    }
+    return cctx;
+}
+#endif
+
+
+
+int compress_init(void) {
+#   if BIRDMON_FEATURE(ZSTD)
+    if (pthread_key_create(&zkey, &sub_cctx_free) != 0) {
+        return -2;
+    }
+    zactive = true;
+    return 0;
+#   else
+    return -1;
+#   endif
+}
+
+
+void compress_deinit(void) {
+#   if BIRDMON_FEATURE(ZSTD)
+    pthread_mutex_lock(&zmutex);
+    if (zactive) {
+        ZSTD_freeCDict(zcdict[COMP_request]);
+        ZSTD_freeCDict(zcdict[COMP_ingest]);
+        zcdict[COMP_request]    = NULL;
+        zcdict[COMP_ingest]     = NULL;
+        zactive                 = false;
+    }
+    pthread_mutex_unlock(&zmutex);
+#   endif
+}
+
+
+void compress_train(const uint8_t* src, size_t srcsize) {
+    uint32_t hash = 2166136261u;
+    size_t size;
+    
+    if ((src == NULL) || (srcsize == 0)) {
+        return;
+    }
+    
+    pthread_mutex_lock(&zmutex);
+    if (dict_size == 0) {
+        size = (srcsize < DICT_MAX) ? srcsize : DICT_MAX;
+        memcpy(dict_buf, src, size);
+        for (size_t i=0; i<size; i++) {
+            hash ^= dict_buf[i];
+            hash *= 16777619u;
+        }
+        
+        // The id must be set before a reader can see a CDict or the size
+        dict_id = (hash != 0) ? hash : 1;
+        
+#       if BIRDMON_FEATURE(ZSTD)
+        if (zactive) {
+            ZSTD_CDict* req = ZSTD_createCDict(dict_buf, size, ZSTD_LEVEL_REQUEST);
+            ZSTD_CDict* ing = ZSTD_createCDict(dict_buf, size, ZSTD_LEVEL_INGEST);
+            if ((req == NULL) || (ing == NULL)) {
+                ZSTD_freeCDict(req);
+                ZSTD_freeCDict(ing);
+                pthread_mutex_unlock(&zmutex);
+                return;
+            }
+            __atomic_store_n(&zcdict[COMP_request], req, __ATOMIC_RELEASE);
+            __atomic_store_n(&zcdict[COMP_ingest], ing, __ATOMIC_RELEASE);
+        }
+#       endif
+        
+        __atomic_store_n(&dict_size, size, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&zmutex);
+}
+
+
+int compress_type(const char* name) {
+    if ((name == NULL) || (strcmp(name, "none") == 0)) {
+        return COMP_none;
+    }
+#   if BIRDMON_FEATURE(ZSTD)
+    if ((strcmp(name, "zstd") == 0) && zactive) {
+        return COMP_zstd;
+    }
+#   endif
+    return -1;
+}
+
+
+const char* compress_name(COMP_Type type) {
+    switch (type) {
+        case COMP_zstd: return "zstd";
+        default:        return "none";
+    }
+}
+
+
+size_t compress_bound(COMP_Type type, size_t srcsize) {
+    switch (type) {
+#       if BIRDMON_FEATURE(ZSTD)
+        case COMP_zstd: return ZSTD_compressBound(srcsize);
+#       endif
+        default:        return srcsize;
+    }
+}
+
+
+int compress_run(COMP_Type type, COMP_Effort effort, uint8_t* dst, size_t dstmax, 
+                 const uint8_t* src, size_t srcsize, uint32_t* dictid) {
+    int rc;
+    
+    if ((dst == NULL) || (src == NULL) || (dictid == NULL)) {
+        return -1;
+    }
+    *dictid = 0;
+    
+    switch (type) {
+        case COMP_none: {
+            if (srcsize > dstmax) {
+                return -2;
+            }
+            memcpy(dst, src, srcsize);
+            rc = (int)srcsize;
+        } break;
+        
+#       if BIRDMON_FEATURE(ZSTD)
+        case COMP_zstd: {
+            ZSTD_CCtx* cctx = sub_cctx_get();
+            ZSTD_CDict* cdict;
+            size_t zrc;
+            
+            if (cctx == NULL) {
+                return -3;
+            }
+            cdict = __atomic_load_n(&zcdict[effort], __ATOMIC_ACQUIRE);
+            if (cdict != NULL) {
+                *dictid = dict_id;
+                zrc     = ZSTD_compress_usingCDict(cctx, dst, dstmax, src, srcsize, cdict);
+            }
+            else {
+                zrc = ZSTD_compressCCtx(cctx, dst, dstmax, src, srcsize,
+                        (effort == COMP_ingest) ? ZSTD_LEVEL_INGEST : ZSTD_LEVEL_REQUEST);
+            }
+            rc = ZSTD_isError(zrc) ? -4 : (int)zrc;
+        } break;
+#       endif
+        
+        default:
+            rc = -3;
+            break;
+    }
+    
+    return rc;
+}
+
+
+const uint8_t* compress_dict(size_t* dictsize, uint32_t* dictid) {
+    size_t size = __atomic_load_n(&dict_size, __ATOMIC_ACQUIRE);
+    
+    if (dictsize != NULL) {
+        *dictsize = size;
+    }
+    if (dictid != NULL) {
+        *dictid = (size != 0) ? dict_id : 0;
+    }
+    return (size != 0) ? dict_buf : NULL;
+}
@@ -0,0 +1,451 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "coproc.h"
+#include "debug.h"
+
+// Standard C & POSIX Libraries
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+
+typedef struct {
+    pid_t           pid;            // 0 when not running
+    int             fd;
+    bool            busy;
+    unsigned int    gen;
+} coproc_worker_t;
+
+/// gen changes when the executable is replaced.  Co-processes started from
+/// an older executable are stopped once they are idle.
+struct coproc_pool {
+    char*           path;
+    int             refs;           // under coproc.mutex
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    unsigned int    gen;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    coproc_worker_t worker[BIRDMON_PARAM_COPROC_WORKERS];
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    int             numpools;
+    coproc_t*       pool[BIRDMON_PARAM_COPROC_MAX];
+} coproc = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+
+
+
+static int64_t sub_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+static int sub_start(coproc_t* pool, coproc_worker_t* worker) {
+/// The co-process gets one end of a socketpair as stdin and stdout.  Both
+/// ends are close-on-exec, and dup2() in the child clears that on 0 and 1.
+    posix_spawn_file_actions_t actions;
+    char* argv[2] = { pool->path, NULL };
+    int sv[2];
+    int rc;
+
+#   ifdef SOCK_CLOEXEC
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -1;
+    }
+#   else
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#   endif
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDOUT_FILENO);
+    rc = posix_spawn(&worker->pid, pool->path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+
+    if (rc != 0) {
+        close(sv[0]);
+        worker->pid = 0;
+        return -1;
+    }
+
+    worker->fd  = sv[0];
+    worker->gen = pool->gen;
+    DEBUG_PRINTF("co-process %s started (pid %i)\n", pool->path, (int)worker->pid);
+    return 0;
+}
+
+
+static void sub_stop(coproc_worker_t* worker, int sig) {
+/// Callers hold mutexes that requests wait on, so a co-process that ignores
+/// SIGTERM is only given BIRDMON_PARAM_COPROC_GRACE to exit.  Closing the
+/// socket first lets one that is reading requests exit by itself.
+    if (worker->pid != 0) {
+        int64_t deadline = sub_now_ms() + BIRDMON_PARAM_COPROC_GRACE;
+        pid_t rc;
+        
+        close(worker->fd);
+        kill(worker->pid, sig);
+        while (sig != SIGKILL) {
+            rc = waitpid(worker->pid, NULL, WNOHANG);
+            if ((rc == worker->pid) || ((rc < 0) && (errno != EINTR))) {
+                break;
+            }
+            if (sub_now_ms() >= deadline) {
+                sig = SIGKILL;
+                kill(worker->pid, sig);
+                break;
+            }
+            usleep(2000);
+        }
+        if (sig == SIGKILL) {
+            while ((waitpid(worker->pid, NULL, 0) < 0) && (errno == EINTR));
+        }
+        worker->pid = 0;
+        worker->fd  = -1;
+    }
+}
+
+
+static int sub_send(int fd, const void* buf, size_t len) {
+    const uint8_t* cursor = buf;
+
+    while (len > 0) {
+        ssize_t rc = send(fd, cursor, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        cursor += rc;
+        len    -= (size_t)rc;
+    }
+    return 0;
+}
+
+
+static int sub_recv(int fd, void* buf, size_t len, int64_t deadline) {
+/// Returns 0 when all of buf is read, -1 on error or EOF, -2 on timeout, or
+/// -3 on EOF before any of buf is read
+    uint8_t* cursor = buf;
+
+    while (len > 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int64_t wait_ms = deadline - sub_now_ms();
+        ssize_t rc;
+
+        if (wait_ms <= 0) {
+            return -2;
+        }
+        rc = poll(&pfd, 1, (int)wait_ms);
+        if (rc == 0) {
+            return -2;
+        }
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        rc = recv(fd, cursor, len, 0);
+        if (rc <= 0) {
+            if ((rc < 0) && (errno == EINTR)) {
+                continue;
+            }
+            return ((rc == 0) && (cursor == buf)) ? -3 : -1;
+        }
+        cursor += rc;
+        len    -= (size_t)rc;
+    }
+    return 0;
+}
+
+
+static int sub_exchange(coproc_worker_t* worker, uint8_t* dst, size_t dstmax, const uint8_t* src, int srclen) {
+/// One request and its response.  Returns the output length or status, or
+/// -3 when the co-process failed, -4 when it timed out, -5 when it closed
+/// without sending anything back.
+    uint32_t hdr[2];
+    int64_t deadline;
+    size_t resplen;
+    size_t keep;
+    int status;
+    int rc;
+
+    hdr[0] = htonl((uint32_t)srclen);
+    if ((sub_send(worker->fd, hdr, 4) != 0) || (sub_send(worker->fd, src, (size_t)srclen) != 0)) {
+        return -5;
+    }
+
+    deadline = sub_now_ms() + BIRDMON_PARAM_COPROC_TIMEOUT;
+    rc = sub_recv(worker->fd, hdr, 8, deadline);
+    if (rc != 0) {
+        return (rc == -2) ? -4 : ((rc == -3) ? -5 : -3);
+    }
+    status  = (int)(int32_t)ntohl(hdr[0]);
+    resplen = (size_t)ntohl(hdr[1]);
+
+    // Error descriptions are strings, so save room for the terminator
+    keep = (status < 0) ? dstmax-1 : dstmax;
+    keep = (resplen < keep) ? resplen : keep;
+    rc   = sub_recv(worker->fd, dst, keep, deadline);
+
+    // Drop what does not fit
+    resplen -= keep;
+    while ((rc == 0) && (resplen > 0)) {
+        uint8_t scrap[256];
+        size_t chunk = (resplen < sizeof(scrap)) ? resplen : sizeof(scrap);
+        rc       = sub_recv(worker->fd, scrap, chunk, deadline);
+        resplen -= chunk;
+    }
+    if (rc != 0) {
+        return (rc == -2) ? -4 : -3;
+    }
+
+    if (status < 0) {
+        dst[keep] = 0;
+        return status;
+    }
+    return (int)keep;
+}
+
+
+
+
+static bool sub_stat(coproc_t* pool, const char* path) {
+/// Returns true if the executable is not the one seen last time
+    struct stat st;
+    bool changed;
+
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    changed = (st.st_dev != pool->dev) || (st.st_ino != pool->ino)
+            || (st.st_mtim.tv_sec != pool->mtime.tv_sec)
+            || (st.st_mtim.tv_nsec != pool->mtime.tv_nsec);
+    pool->dev   = st.st_dev;
+    pool->ino   = st.st_ino;
+    pool->mtime = st.st_mtim;
+    return changed;
+}
+
+
+coproc_t* coproc_open(const char* path) {
+    coproc_t* pool = NULL;
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&coproc.mutex);
+    for (int i=0; i<coproc.numpools; i++) {
+        if (strcmp(coproc.pool[i]->path, path) == 0) {
+            pool = coproc.pool[i];
+            pool->refs++;
+            pthread_mutex_lock(&pool->mutex);
+            if (sub_stat(pool, path)) {
+                pool->gen++;
+                for (int j=0; j<BIRDMON_PARAM_COPROC_WORKERS; j++) {
+                    if (!pool->worker[j].busy) {
+                        sub_stop(&pool->worker[j], SIGTERM);
+                    }
+                }
+            }
+            pthread_mutex_unlock(&pool->mutex);
+            goto coproc_open_EXIT;
+        }
+    }
+    if (coproc.numpools >= BIRDMON_PARAM_COPROC_MAX) {
+        goto coproc_open_EXIT;
+    }
+
+    pool = calloc(1, sizeof(coproc_t));
+    if (pool == NULL) {
+        goto coproc_open_EXIT;
+    }
+    pool->path = strdup(path);
+    if (pool->path == NULL) {
+        free(pool);
+        pool = NULL;
+        goto coproc_open_EXIT;
+    }
+    pool->refs = 1;
+    sub_stat(pool, path);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i=0; i<BIRDMON_PARAM_COPROC_WORKERS; i++) {
+        pool->worker[i].fd = -1;
+    }
+    coproc.pool[coproc.numpools++] = pool;
+
+    coproc_open_EXIT:
+    pthread_mutex_unlock(&coproc.mutex);
+    return pool;
+}
+
+
+
+int coproc_run(coproc_t* pool, uint8_t* dst, size_t dstmax, const uint8_t* src, int srclen) {
+    coproc_worker_t* worker = NULL;
+    int rc;
+
+    if ((pool == NULL) || (dst == NULL) || (dstmax == 0) || (srclen < 0)) {
+        return -1;
+    }
+
+    /// Take an idle co-process, or start one in an empty slot, or wait.
+    /// Running ones are preferred, so extra ones only start under load.
+    pthread_mutex_lock(&pool->mutex);
+    while (worker == NULL) {
+        for (int i=0; i<BIRDMON_PARAM_COPROC_WORKERS; i++) {
+            if ((pool->worker[i].pid != 0) && !pool->worker[i].busy) {
+                worker = &pool->worker[i];
+                break;
+            }
+        }
+        for (int i=0; (worker==NULL) && (i<BIRDMON_PARAM_COPROC_WORKERS); i++) {
+            if (pool->worker[i].pid == 0) {
+                if (sub_start(pool, &pool->worker[i]) != 0) {
+                    pthread_mutex_unlock(&pool->mutex);
+                    snprintf((char*)dst, dstmax, "co-process cannot be started");
+                    return -2;
+                }
+                worker = &pool->worker[i];
+            }
+        }
+        if (worker == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+    }
+    worker->busy = true;
+    pthread_mutex_unlock(&pool->mutex);
+
+    rc = sub_exchange(worker, dst, dstmax, src, srclen);
+
+    /// A co-process that closed before responding, most likely because it
+    /// exited while idle, is replaced in the same slot and given the request
+    /// once more.
+    pthread_mutex_lock(&pool->mutex);
+    if (rc == -5) {
+        sub_stop(worker, SIGKILL);
+        if (sub_start(pool, worker) == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            rc = sub_exchange(worker, dst, dstmax, src, srclen);
+            pthread_mutex_lock(&pool->mutex);
+        }
+        rc = (rc == -5) ? -3 : rc;
+    }
+
+    /// A co-process that failed is not trusted with another request: it is
+    /// killed, and the slot starts a new one when it is next needed.
+    if ((rc == -3) || (rc == -4)) {
+        sub_stop(worker, SIGKILL);
+        snprintf((char*)dst, dstmax, (rc == -4) ? "co-process timed out" : "co-process failed");
+    }
+    else if (worker->gen != pool->gen) {
+        sub_stop(worker, SIGTERM);
+    }
+    worker->busy = false;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return rc;
+}
+
+
+
+static void sub_pool_free(coproc_t* pool) {
+    for (int j=0; j<BIRDMON_PARAM_COPROC_WORKERS; j++) {
+        sub_stop(&pool->worker[j], SIGTERM);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->path);
+    free(pool);
+}
+
+
+void coproc_close(coproc_t* pool) {
+    bool last = false;
+    
+    if (pool == NULL) {
+        return;
+    }
+    
+    // The pool leaves the list first, so coproc_open() of the same path,
+    // e.g. a file that comes back, starts a new pool.
+    pthread_mutex_lock(&coproc.mutex);
+    if (--pool->refs == 0) {
+        for (int i=0; i<coproc.numpools; i++) {
+            if (coproc.pool[i] == pool) {
+                coproc.pool[i] = coproc.pool[--coproc.numpools];
+                break;
+            }
+        }
+        last = true;
+    }
+    pthread_mutex_unlock(&coproc.mutex);
+    
+    if (last) {
+        DEBUG_PRINTF("co-process pool %s closed\n", pool->path);
+        sub_pool_free(pool);
+    }
+}
+
+
+
+void coproc_deinit(void) {
+    pthread_mutex_lock(&coproc.mutex);
+    for (int i=0; i<coproc.numpools; i++) {
+        sub_pool_free(coproc.pool[i]);
+    }
+    coproc.numpools = 0;
+    pthread_mutex_unlock(&coproc.mutex);
+}
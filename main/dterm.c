@@ -17,10 +17,15 @@
 ///@todo harmonize this with the more slick dterm from otdb project
 
 // Application Headers
+#include "arena.h"
 #include "cliopt.h"         // to be part of dterm via environment variables
 #include "cmdhistory.h"     // to be part of dterm
 #include "cmd_api.h"        // to be part of dterm
+#include "cmds/cmdutils.h"   // argtable allocator hooks
 #include "dterm.h"
+#include "envelope.h"
+#include "lockprof.h"
+#include "trace.h"
 #include "birdmon_app.h"      // must be external to dterm
 //#include "../test/test.h"
 
@@ -36,6 +41,7 @@
 // Standard C & POSIX Libraries
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -50,6 +56,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
@@ -102,6 +109,9 @@ static int sub_remc(dterm_intf_t *dt, int count);
 static void sub_remln(dterm_intf_t *dt, dterm_fd_t* fd);
 static void sub_reset(dterm_intf_t *dt);
 
+// writes everything, without blocking on a client that stops reading
+static int sub_write_all(int fd, const uint8_t* data, size_t len);
+
 
 
 static int sub_put(dterm_fd_t* fd, char *s, int size) {
@@ -243,24 +253,15 @@ static int sub_hexsnstream(char* dst, size_t lim, uint8_t* src, size_t srcsz) {
 }
 
 
-static void iso_free(void* ctx) {
-    talloc_free(ctx);
-}
-
-static TALLOC_CTX* iso_ctx;
-static void* iso_malloc(size_t size) {
-    return talloc_size(iso_ctx, size);
-}
-
-static void cjson_iso_allocators(void) {
+static void sub_arena_allocators(void) {
+/// Request memory comes from the arena of the thread running the request.
+/// The allocators are the same for every thread, and outside of a request
+/// they are malloc() and free().
     cJSON_Hooks hooks;
-    hooks.free_fn   = &iso_free;
-    hooks.malloc_fn = &iso_malloc;
+    hooks.malloc_fn = &arena_alloc;
+    hooks.free_fn   = &arena_free;
     cJSON_InitHooks(&hooks);
-}
-
-static void cjson_std_allocators(void) {
-    cJSON_InitHooks(NULL);
+    cmdutils_set_allocators(&arena_alloc, &arena_free);
 }
 
 
@@ -290,8 +291,11 @@ int dterm_init(dterm_handle_t* dth, void* ext_data, const char* logfile, INTF_Ty
     dth->intf           = NULL;
     dth->iso_mutex      = NULL;
     dth->logfile_path   = logfile;
+    dth->logger         = NULL;
+    dth->sub_xid        = 0;
     
     talloc_disable_null_tracking();
+    sub_arena_allocators();
     dth->pctx = talloc_new(NULL);
     dth->tctx = NULL;
     if (dth->pctx == NULL){
@@ -332,6 +336,17 @@ int dterm_init(dterm_handle_t* dth, void* ext_data, const char* logfile, INTF_Ty
         goto dterm_init_TERM;
     }
     
+    // The daemon is still of use without its log file, so it logs to
+    // stderr instead.  Without that either, logs are dropped.
+    if (logfile != NULL) {
+        if (logger_init(&dth->logger, logfile, BIRDMON_PARAM(LOG_MAXSIZE), BIRDMON_PARAM(LOG_ROTATIONS)) != 0) {
+            fprintf(stderr, "Log \"%s\" could not be opened: logging to stderr\n", logfile);
+            if (logger_init(&dth->logger, NULL, 0, 0) != 0) {
+                dth->logger = NULL;
+            }
+        }
+    }
+    
     /// If sockets are being used, SIGPIPE can cause trouble that we don't
     /// want, and it is safe to ignore.
     if (dth->intf->type == INTF_socket) {
@@ -358,6 +373,9 @@ int dterm_init_cmdtab(dterm_handle_t* dth, const char* xpath) {
     if (cmd_init(&dth->cmdtab, xpath) < 0) {
         return -2;
     }
+    if (cmd_watch() != 0) {
+        fprintf(stderr, "External commands will not be reloaded on changes.\n");
+    }
     return 0;
 }
 
@@ -389,6 +407,10 @@ void dterm_deinit(dterm_handle_t* dth) {
     }
     
     clithread_deinit(dth->clithread);
+    
+    // Flushes anything still queued
+    logger_deinit(dth->logger);
+    dth->logger = NULL;
 
     if (dth->iso_mutex != NULL) {
         pthread_mutex_unlock(dth->iso_mutex);
@@ -541,77 +563,35 @@ void dterm_unsquelch(dterm_handle_t* dth) {
 
 
 int dterm_send_log(dterm_handle_t* dth, const char* logmsg, size_t loglen) {
-    struct stat st;
-    int rc = 0;
-    int fd;
-    FILE* fp;
-    char init[4] = {0,0,0,0};
-    char term[4] = {0,0,0,0};
-    int initlen = 0;
-    int termlen = 0;
+    struct iovec iov[3];
+    int iovcnt = 0;
     
     if (dth == NULL) {
-        rc = -1;
-        goto dterm_send_log_END;
-    }
-    if (dth->logfile_path == NULL) {
-        goto dterm_send_log_END;
+        return -1;
     }
-    if (stat(dth->logfile_path, &st) < 0) {
-        rc = -2;
-        goto dterm_send_log_END;
+    if ((dth->logger == NULL) || (logmsg == NULL) || (loglen == 0)) {
+        return 0;
     }
     
     ///@note JSON formated logs require additional wrapping.  The log input
     /// format is as an embeddable object, i.e. no opening/closing braces.
+    /// The logger terminates each message for the log type (file or FIFO).
     if (cliopt_getformat() == FORMAT_Json) {
-        init[0] = '{';
-        term[0] = '}';
-        initlen = 1;
-        termlen = 1;
-    }
-    
-    if (S_ISFIFO(st.st_mode)) {
-        fd = open(dth->logfile_path, O_WRONLY);
-        if (fd < 0) {
-            rc = -4;
-            goto dterm_send_log_END;
-        }
-        if (logmsg[loglen-1] != 0) {
-            termlen++;
-        }
-        if (initlen > 0) {
-            write(fd, init, initlen);
-        }
-        write(fd, logmsg, loglen);
-        if (termlen > 0) {
-            write(fd, term, termlen);
-        }
-        close(fd);
-        rc = initlen + (int)loglen + termlen;
-    }
-    else if (S_ISREG(st.st_mode)) {
-        fp = fopen(dth->logfile_path, "a");
-        if (fp == NULL) {
-            rc = -4;
-            goto dterm_send_log_END;
-        }
-        if (logmsg[loglen-1] != '\n') {
-            term[termlen] = '\n';
-            termlen++;
-        }
-        fwrite(init, 1, initlen, fp);
-        fwrite(logmsg, 1, loglen, fp);
-        fwrite(term, 1, termlen, fp);
-        fclose(fp);
-        rc = initlen + (int)loglen + termlen;
+        iov[iovcnt].iov_base    = "{";
+        iov[iovcnt].iov_len     = 1;
+        iovcnt++;
     }
-    else {
-        rc = -3;
+    iov[iovcnt].iov_base    = (void*)logmsg;
+    iov[iovcnt].iov_len     = loglen;
+    iovcnt++;
+    if (cliopt_getformat() == FORMAT_Json) {
+        iov[iovcnt].iov_base    = "}";
+        iov[iovcnt].iov_len     = 1;
+        iovcnt++;
     }
     
-    dterm_send_log_END:
-    return rc;
+    // Non-blocking: the message is queued for the log writer thread
+    return logger_pushv(dth->logger, iov, iovcnt);
 }
 
 
@@ -642,6 +622,95 @@ int dterm_send_rxstat(dterm_handle_t* dth, DFMT_Type dfmt, void* rxdata, size_t
 }
 
 
+/// Socket clients subscribed to each xid, so a publisher can skip rendering
+/// a push that nobody takes.  Clients on xids beyond the table are counted
+/// as untracked, and while there are any, every xid may have subscribers.
+/// The mutex is a leaf: nothing else is locked while it is held.
+#define SUB_XIDS    8
+
+static struct {
+    pthread_mutex_t     mutex;
+    uint32_t            xid[SUB_XIDS];
+    int                 count[SUB_XIDS];
+    int                 untracked;
+} subs = { PTHREAD_MUTEX_INITIALIZER };
+
+
+static void sub_xid_count(uint32_t xid, int delta) {
+    int slot = -1;
+    
+    if (xid == 0) {
+        return;
+    }
+    pthread_mutex_lock(&subs.mutex);
+    for (int i=0; i<SUB_XIDS; i++) {
+        if ((subs.count[i] > 0) && (subs.xid[i] == xid)) {
+            slot = i;
+            break;
+        }
+        if ((subs.count[i] == 0) && (slot < 0) && (delta > 0)) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        subs.xid[slot]      = xid;
+        subs.count[slot]   += delta;
+    }
+    else {
+        subs.untracked     += delta;
+    }
+    pthread_mutex_unlock(&subs.mutex);
+}
+
+
+
+int dterm_publish(dterm_handle_t* dth, uint32_t xid, uint8_t* msg, size_t msgsize) {
+    int rc = 0;
+    
+    if ((dth == NULL) || (msg == NULL) || (xid == 0)) {
+        return -1;
+    }
+    
+    LP_LOCK(dth->iso_mutex, LOCK_iso);
+    
+    // Socket clients each carry their own xid in the clithread table.  Other
+    // interfaces have a single client, which uses the parent handle.
+    if (dth->intf->type == INTF_socket) {
+        clithread_publish(dth->clithread, false, xid, msg, msgsize);
+        rc = (int)msgsize;
+    }
+    else if ((dth->sub_xid == xid) && (dth->fd.out >= 0)) {
+        rc = (int)write(dth->fd.out, msg, msgsize);
+    }
+    
+    LP_UNLOCK(dth->iso_mutex, LOCK_iso);
+    return rc;
+}
+
+
+int dterm_subscribers(dterm_handle_t* dth, uint32_t xid) {
+    int count = 0;
+    
+    if ((dth == NULL) || (xid == 0)) {
+        return 0;
+    }
+    if (dth->intf->type != INTF_socket) {
+        return (dth->sub_xid == xid);
+    }
+    
+    pthread_mutex_lock(&subs.mutex);
+    for (int i=0; i<SUB_XIDS; i++) {
+        if (subs.xid[i] == xid) {
+            count += subs.count[i];
+        }
+    }
+    count += subs.untracked;
+    pthread_mutex_unlock(&subs.mutex);
+    
+    return count;
+}
+
+
 ///@todo clithread_publish is not safe when the file descriptor is lost before
 ///      the response arrives.  Need to implement a way to indicate when a
 ///      client drops in order to skip write and update clithread-table
@@ -914,8 +983,8 @@ int dterm_force_cmdmsg(int fd_out, const char* cmdname, const char* msg) {
 
 
 
-int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid, const char* desc) {
-    char output[1024];
+static int sub_format_ack(char* output, const char* cmdname, int errcode, uint32_t sid, const char* desc) {
+/// Formats an ack (errcode 0) or error into output, which has 1024 bytes
     char* dst   = output;
     int lim     = 1024-1;
     int a;
@@ -937,16 +1006,18 @@ int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid
                 break;
             }
             
+            // Errors carry the sid too, when the request had one
             a = 0;
-            if (errcode == 0) {
-                if (sid >= 0) {
-                    a = snprintf(dst, lim, ", \"sid\":%u", sid);
-                }
+            if ((errcode == 0) || (sid != 0)) {
+                a = snprintf(dst, lim, ", \"sid\":%u", sid);
             }
-            else if (desc != NULL) {
+            dst    += a;
+            lim    -= a;
+            
+            a = 0;
+            if ((errcode != 0) && (desc != NULL) && (lim > 0)) {
                 a = snprintf(dst, lim, ", \"desc\":\"%s\"", desc);
             }
-            
             dst    += a;
             lim    -= a;
             if (lim > 0) {
@@ -979,6 +1050,11 @@ int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid
                 if (lim <= 0) {
                     break;
                 }
+                if (sid != 0) {
+                    a       = snprintf(dst, lim, " [%u]", sid);
+                    dst    += a;
+                    lim    -= a;
+                }
                 if (desc != NULL) {
                     a       = snprintf(dst, lim, ": %s", desc);
                     dst    += a;
@@ -997,7 +1073,18 @@ int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid
         a = (int)(dst - output);
     }
     
-    write(fd_out, output, a);
+    return a;
+}
+
+
+int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid, const char* desc) {
+    char output[1024];
+    int a;
+    
+    a = sub_format_ack(output, cmdname, errcode, sid, desc);
+    if (sub_write_all(fd_out, (const uint8_t*)output, (size_t)a) != 0) {
+        return -1;
+    }
     return a;
 }
 
@@ -1016,110 +1103,654 @@ int dterm_force_error(int fd_out, const char* cmdname, int errcode, uint32_t sid
   * character input and analysis, and it enables shell-like features.
   */
 
-static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, int linelen) {
+/// A request line with its envelope taken off
+typedef struct {
+    char*       type;       ///< envelope type, or NULL for a plain command line
+    char*       line;       ///< command line
+    uint32_t    sid;        ///< request id echoed in the response, 0 if none
+} dterm_req_t;
+
+
+static uint32_t sub_request_sid(const char* id) {
+/// The envelope "id" is an unsigned 32 bit integer, as a number or a string.
+/// Anything else gives 0, which is the same as no id.
+    unsigned long val;
+    char* end;
+    
+    if ((id == NULL) || (*id < '0') || (*id > '9')) {
+        return 0;
+    }
+    val = strtoul(id, &end, 10);
+    if ((*end != 0) || (val > UINT32_MAX)) {
+        return 0;
+    }
+    return (uint32_t)val;
+}
+
+
+static void sub_env_request(dterm_req_t* req, envelope_t* env) {
+    req->type   = env->type;
+    req->line   = env->data;
+    req->sid    = sub_request_sid(env->id);
+}
+
+
+static int sub_cjson_request(dterm_req_t* req, cJSON* obj) {
+/// For envelopes that envelope_scan() leaves to cJSON
+    cJSON* dataobj;
+    cJSON* typeobj;
+    cJSON* idobj;
+    
+    typeobj = cJSON_GetObjectItemCaseSensitive(obj, "type");
+    dataobj = cJSON_GetObjectItemCaseSensitive(obj, "data");
+    idobj   = cJSON_GetObjectItemCaseSensitive(obj, "id");
+    if (!cJSON_IsObject(obj) || !cJSON_IsString(typeobj) || !cJSON_IsString(dataobj)) {
+        return ENVELOPE_invalid;
+    }
+    
+    req->type   = typeobj->valuestring;
+    req->line   = dataobj->valuestring;
+    req->sid    = 0;
+    if (cJSON_IsString(idobj)) {
+        req->sid = sub_request_sid(idobj->valuestring);
+    }
+    else if (cJSON_IsNumber(idobj) && (idobj->valuedouble >= 1) && (idobj->valuedouble <= UINT32_MAX)) {
+        req->sid = (uint32_t)idobj->valuedouble;
+    }
+    return ENVELOPE_ok;
+}
+
+
+/// Output builder: responses and acks are collected here and flushed with a
+/// single write.  The buffer keeps its capacity, so a builder that is reused
+/// stops allocating once it has grown to fit.
+typedef struct {
+    char*   buf;
+    size_t  size;
+    size_t  alloc;
+    bool    stream;     // output may be flushed before the builder is done
+} dterm_out_t;
+
+static void sub_out_put(dterm_out_t* out, const void* data, size_t len) {
+    if ((out->size + len) > out->alloc) {
+        size_t alloc = (out->alloc < 1024) ? 1024 : out->alloc;
+        char* buf;
+        while (alloc < (out->size + len)) {
+            alloc *= 2;
+        }
+        buf = realloc(out->buf, alloc);
+        if (buf == NULL) {
+            return;
+        }
+        out->buf    = buf;
+        out->alloc  = alloc;
+    }
+    memcpy(&out->buf[out->size], data, len);
+    out->size += len;
+}
+
+static int sub_write_all(int fd, const uint8_t* data, size_t len) {
+/// Responses are written under the isolation mutex, so a client that stops
+/// reading must not hold up the others.  Sockets are written without
+/// blocking, and one that takes nothing for BIRDMON_PARAM_WRITE_TIMEOUT is
+/// shut down, which ends its client thread.  Returns 0, -1 on error, or -2
+/// when the client was dropped.
+    bool sock = true;
+    
+    while (len > 0) {
+        ssize_t rc = sock ? send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) : write(fd, data, len);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOTSOCK) {
+                sock = false;
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                rc = poll(&pfd, 1, BIRDMON_PARAM_WRITE_TIMEOUT);
+                if (rc == 0) {
+                    shutdown(fd, SHUT_RDWR);
+                    return -2;
+                }
+                if ((rc < 0) && (errno != EINTR)) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+        data   += rc;
+        len    -= (size_t)rc;
+    }
+    return 0;
+}
+
+static int sub_out_flush(dterm_handle_t* dth, dterm_out_t* out) {
+    int rc = 0;
+    uint64_t t_stage;
+    
+    if (out->size > 0) {
+        t_stage = trace_begin();
+        rc      = sub_write_all(dth->fd.out, (const uint8_t*)out->buf, out->size);
+        trace_end("write", "dterm", t_stage);
+        out->size = 0;
+    }
+    return rc;
+}
+
+
+
+/// The sink of the command running on this thread
+static __thread dterm_sink_t* tls_sink = NULL;
+
+typedef struct {
+    dterm_handle_t* dth;
+    dterm_out_t*    out;
+} dterm_sinkctx_t;
+
+static int sub_sink_flush(dterm_sink_t* sink, const uint8_t* data, size_t len) {
+/// A batch keeps every response until it is done, so a sink in a batch only
+/// moves its data to the builder.  Otherwise, whatever the builder already
+/// has goes first, then the data goes straight to the client.
+    dterm_sinkctx_t* sc = sink->ctx;
+    int rc;
+    uint64_t t_stage;
+    
+    if ((sc->out != NULL) && !sc->out->stream) {
+        sub_out_put(sc->out, data, len);
+        return 0;
+    }
+    if ((sc->out != NULL) && (sub_out_flush(sc->dth, sc->out) != 0)) {
+        return -1;
+    }
+    t_stage = trace_begin();
+    rc      = sub_write_all(sc->dth->fd.out, data, len);
+    trace_end("write", "dterm", t_stage);
+    return rc;
+}
+
+static int sub_sink_drain(dterm_sink_t* sink) {
+    size_t len = (size_t)(sink->cursor - sink->head);
+    
+    if ((sink->flush == NULL) || (sink->err < 0)) {
+        sink->err = -1;
+        return -1;
+    }
+    if ((len > 0) && (sink->flush(sink, sink->head, len) != 0)) {
+        sink->err = -2;
+        return -2;
+    }
+    sink->flushed  += len;
+    sink->head      = sink->base;
+    sink->cursor    = sink->base;
+    return 0;
+}
+
+
+dterm_sink_t* dterm_sink_open(dterm_sink_t* local, uint8_t* dst, size_t dstmax) {
+    if ((tls_sink != NULL) && (tls_sink->base == dst)) {
+        return tls_sink;
+    }
+    local->flush    = NULL;
+    local->ctx      = NULL;
+    local->head     = dst;
+    local->base     = dst;
+    local->cursor   = dst;
+    local->end      = dst + dstmax;
+    local->flushed  = 0;
+    local->err      = 0;
+    return local;
+}
+
+int dterm_sink_close(dterm_sink_t* sink) {
+    return (sink->err < 0) ? sink->err : (int)(sink->cursor - sink->base);
+}
+
+uint8_t* dterm_sink_reserve(dterm_sink_t* sink, size_t len) {
+    if ((size_t)(sink->end - sink->cursor) >= len) {
+        return sink->cursor;
+    }
+    if (((size_t)(sink->end - sink->base) < len) || (sub_sink_drain(sink) != 0)) {
+        sink->err = (sink->err < 0) ? sink->err : -1;
+        return NULL;
+    }
+    return sink->cursor;
+}
+
+void dterm_sink_commit(dterm_sink_t* sink, size_t len) {
+    sink->cursor += len;
+}
+
+int dterm_sink_write(dterm_sink_t* sink, const void* data, size_t len) {
+    const uint8_t* src = data;
+    
+    while (len > 0) {
+        size_t chunk = (size_t)(sink->end - sink->cursor);
+        if (chunk == 0) {
+            if (sub_sink_drain(sink) != 0) {
+                return sink->err;
+            }
+            continue;
+        }
+        chunk = (len < chunk) ? len : chunk;
+        memcpy(sink->cursor, src, chunk);
+        sink->cursor   += chunk;
+        src            += chunk;
+        len            -= chunk;
+    }
+    return 0;
+}
+
+int dterm_sink_printf(dterm_sink_t* sink, const char* format, ...) {
+    va_list args;
+    size_t room = (size_t)(sink->end - sink->cursor);
+    int len;
+    
+    va_start(args, format);
+    len = vsnprintf((char*)sink->cursor, room, format, args);
+    va_end(args);
+    
+    if ((len >= 0) && ((size_t)len >= room)) {
+        if (dterm_sink_reserve(sink, (size_t)len + 1) == NULL) {
+            return sink->err;
+        }
+        va_start(args, format);
+        len = vsnprintf((char*)sink->cursor, (size_t)(sink->end - sink->cursor), format, args);
+        va_end(args);
+    }
+    if (len < 0) {
+        sink->err = -1;
+        return -1;
+    }
+    sink->cursor += len;
+    return len;
+}
+
+
+static void sub_send_ack(dterm_handle_t* dth, dterm_out_t* out, const char* cmdname, int errcode, uint32_t sid, const char* desc) {
+    if (out == NULL) {
+        dterm_send_error(dth, cmdname, errcode, sid, desc);
+    }
+    else {
+        char ack[1024];
+        sub_out_put(out, ack, (size_t)sub_format_ack(ack, cmdname, errcode, sid, desc));
+    }
+}
+
+
+/// The isolation mutex is taken and released through these, so a thread
+/// knows whether it holds it.  dterm_iso_unlock() only releases it for a
+/// command whose caller holds it, and dterm_iso_lock() only takes back what
+/// was released.
+static __thread bool iso_owned      = false;
+static __thread bool iso_released   = false;
+
+static void sub_iso_lock(dterm_handle_t* dth) {
+    LP_LOCK(dth->iso_mutex, LOCK_iso);
+    iso_owned = true;
+}
+
+static void sub_iso_unlock(dterm_handle_t* dth) {
+    iso_owned = false;
+    LP_UNLOCK(dth->iso_mutex, LOCK_iso);
+}
+
+
+static void sub_iso_enter(dterm_handle_t* dth) {
+/// Must be called with the isolation mutex held.  Binds the request memory
+/// of this thread, unless it is already bound (by a batch).
+    arena_begin(cliopt_getpoolsize());
+    
+    ///@todo set context for other data systems
+}
+
+
+static void sub_iso_exit(void) {
+    // Reset the request memory of this thread
+    arena_end();
+}
+
+
+static int sub_proc_request(dterm_handle_t* dth, int* cmdrc, dterm_req_t* req, int linelen, dterm_out_t* out) {
+/// Runs the command in the request and writes the response and the ack, or
+/// puts them in 'out' if it is not NULL.
+/// Must be called inside sub_iso_enter() / sub_iso_exit().
     uint8_t     protocol_buf[CMDBUF];
     char        cmdname[32];
     int         cmdlen;
-    cJSON*      cmdobj;
     uint8_t*    cursor  = protocol_buf;
     int         bufmax  = sizeof(protocol_buf);
     int         bytesout = 0;
-    uint32_t    output_sid = 0;
     int         output_err = 0;
     const cmdtab_item_t* cmdptr;
+    dterm_sink_t sink;
+    uint64_t    t_stage;
     
-    DEBUG_PRINTF("raw input (%i bytes) %.*s\n", linelen, linelen, loadbuf);
-
-    // Isolation memory context
-    iso_ctx = dth->tctx;
-
-    // Set allocators for cJSON, argtable
-    cjson_iso_allocators();
-    arg_set_allocators(&iso_malloc, &iso_free);
-    
-    ///@todo set context for other data systems
-    
-    /// The input can be JSON of the form:
-    /// { "type":"${cmd_type}", data:"${cmd_data}" }
-    /// where we only truly care about the data object, which must be a string.
-    cmdobj = cJSON_Parse(loadbuf);
-    if (cJSON_IsObject(cmdobj)) {
-        cJSON* dataobj;
-        cJSON* typeobj;
-        typeobj = cJSON_GetObjectItemCaseSensitive(cmdobj, "type");
-        dataobj = cJSON_GetObjectItemCaseSensitive(cmdobj, "data");
-
-        if (cJSON_IsString(typeobj) && cJSON_IsString(dataobj)) {
-            int hdr_sz;
-            VCLIENT_PRINTF("JSON Request (%i bytes): %.*s\n", linelen, linelen, loadbuf);
-            loadbuf = dataobj->valuestring;
-            hdr_sz  = snprintf((char*)cursor, bufmax-1, "{\"type\":\"%s\", \"data\":", typeobj->valuestring);
-            cursor += hdr_sz;
-            bufmax -= hdr_sz;
+    if (req->type != NULL) {
+        int hdr_sz;
+        if (req->sid != 0) {
+            hdr_sz = snprintf((char*)cursor, bufmax-1, "{\"type\":\"%s\", \"sid\":%u, \"data\":", req->type, req->sid);
         }
         else {
-            goto sub_proc_lineinput_FREE;
+            hdr_sz = snprintf((char*)cursor, bufmax-1, "{\"type\":\"%s\", \"data\":", req->type);
         }
+        cursor += hdr_sz;
+        bufmax -= hdr_sz;
     }
     
     // determine length until newline, or null.
     // then search/get command in list.
-    cmdlen  = cmd_getname(cmdname, loadbuf, sizeof(cmdname));
+    t_stage = trace_begin();
+    cmdlen  = cmd_getname(cmdname, req->line, sizeof(cmdname)-1);
     cmdptr  = cmd_search(dth->cmdtab, cmdname);
+    trace_end("lookup", "dterm", t_stage);
     if (cmdptr == NULL) {
         if (linelen > 0) {
-            dterm_send_error(dth, cmdname, 1, 0, "command not found");
+            sub_send_ack(dth, out, cmdname, 1, req->sid, "command not found");
         }
     }
     else {
         int bytesin = linelen;
         
+        // Commands may stream their output through the sink.  Until the
+        // first flush, its data starts with the header in protocol_buf.
+        dterm_sinkctx_t sinkctx = { dth, out };
+        sink.flush      = &sub_sink_flush;
+        sink.ctx        = &sinkctx;
+        sink.head       = protocol_buf;
+        sink.base       = cursor;
+        sink.cursor     = cursor;
+        sink.end        = cursor + bufmax;
+        sink.flushed    = 0;
+        sink.err        = 0;
+        
         // Null terminate the cursor: errors may report a string.
         *cursor  = 0;
-        bytesout = cmd_run(cmdptr, dth, cursor, &bytesin, (uint8_t*)(loadbuf+cmdlen), bufmax);
+        t_stage  = trace_begin();
+        tls_sink = &sink;
+        bytesout = cmd_run(cmdptr, dth, cursor, &bytesin, (uint8_t*)(req->line+cmdlen), bufmax);
+        tls_sink = NULL;
+        cmd_release(cmdptr);
+        trace_end("exec", "dterm", t_stage);
 
         if (cmdrc != NULL) {
             *cmdrc = bytesout;
         }
-        if (bytesout < 0) {
-            dterm_send_error(dth, cmdname, bytesout, 0, (char*)cursor);
+        if ((bytesout < 0) && (sink.flushed > 0)) {
+            // Part of the response is already out: end its line, and say
+            // in the error that it is cut short.
+            char desc[256];
+            snprintf(desc, sizeof(desc), "response truncated after %zu bytes: %s", sink.flushed, (char*)cursor);
+            if (out != NULL) {
+                sub_out_put(out, "\n", 1);
+            }
+            else {
+                sub_write_all(dth->fd.out, (const uint8_t*)"\n", 1);
+            }
+            sub_send_ack(dth, out, cmdname, bytesout, req->sid, desc);
+        }
+        else if (bytesout < 0) {
+            sub_send_ack(dth, out, cmdname, bytesout, req->sid, (char*)cursor);
         }
         else {
+            struct iovec iov[2];
+            char ack[1024];
+            int iovcnt = 0;
+        
+            // After a flush, the header has already been sent
             if (bytesout > 0) {
+                uint8_t* head           = (sink.flushed > 0) ? cursor : protocol_buf;
+                iov[iovcnt].iov_base    = head;
+                iov[iovcnt].iov_len     = (cursor - head) + bytesout;
+                iovcnt++;
+            }
+            
+            // This is actually an ack message, which is an error with code=0
+            // In interactive mode, acks are suppressed
+            if (dth->intf->type != INTF_interactive) {
+                t_stage = trace_begin();
+                iov[iovcnt].iov_base    = ack;
+                iov[iovcnt].iov_len     = (size_t)sub_format_ack(ack, cmdname, output_err, req->sid, NULL);
+                iovcnt++;
+                trace_end("ack", "dterm", t_stage);
+            }
+            
+            // The response and the ack go out together, back to back
+            if (out != NULL) {
+                for (int i=0; i<iovcnt; i++) {
+                    sub_out_put(out, iov[i].iov_base, iov[i].iov_len);
+                }
+            }
+            else if (iovcnt > 0) {
                 ///@todo what's between these lines should be a callback provided
                 /// by the user of DTerm into DTerm
                 // ---------------------------------------------------------------
-                if ((fcntl(dth->fd.out, F_GETFD) != -1) || (errno != EBADF)) {
-                    write(dth->fd.out, (char*)protocol_buf, bytesout);
-                }
-                else {
-                    perror("could not write back to client");
-                    bytesout = -1;
+                t_stage = trace_begin();
+                for (int i=0; i<iovcnt; i++) {
+                    if (sub_write_all(dth->fd.out, iov[i].iov_base, iov[i].iov_len) != 0) {
+                        perror("could not write back to client");
+                        bytesout = -1;
+                        break;
+                    }
                 }
+                trace_end("write", "dterm", t_stage);
                 // ---------------------------------------------------------------
             }
-            
-            // This is actually an ack message, which is an error with code=0
-            // In interactive mode, acks are suppressed
-            if (dth->intf->type != INTF_interactive) {
-                dterm_send_error(dth, cmdname, output_err, output_sid, NULL);
+        }
+    }
+    
+    return bytesout;
+}
+
+
+/// A batch being run in parallel.  Runners take requests by index.  The
+/// batch owner is one of them, and the others are pool workers it lends.
+typedef struct {
+    dterm_handle_t*     dth;
+    dterm_req_t*        req;
+    dterm_out_t*        out;
+    int                 numreq;
+    int                 linelen;
+    int                 next;
+    int                 running;        // lent workers in it, under pool.mutex
+    pthread_cond_t      done;
+} dterm_batch_t;
+
+static void sub_pool_lend(dterm_batch_t* batch, int count);
+static void sub_pool_reclaim(dterm_batch_t* batch);
+
+/// Set in the threads running a parallel batch, which holds the isolation
+/// mutex on behalf of all of them
+static __thread bool iso_shared = false;
+
+
+static void sub_batch_run(dterm_batch_t* batch) {
+/// Each runner has its own copy of the handle, and request memory from the
+/// arena of its thread.  The batch owner's arena is already bound.
+    dterm_handle_t dts;
+    bool bound;
+    int i;
+    
+    memcpy(&dts, batch->dth, sizeof(dterm_handle_t));
+    bound       = arena_begin(cliopt_getpoolsize());
+    iso_shared  = true;
+    
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->numreq) {
+        trace_request();
+        sub_proc_request(&dts, NULL, &batch->req[i], batch->linelen, &batch->out[i]);
+    }
+    
+    if (bound) {
+        arena_end();
+    }
+    iso_shared  = false;
+}
+
+
+static int sub_proc_batch(dterm_handle_t* dth, dterm_req_t* req, int numreq, int linelen, dterm_out_t* dst) {
+/// Runs the requests of a batch and writes all the responses at once, in
+/// request order, followed by an ack for the batch.  If every command in the
+/// batch is readonly, they run in parallel.  If 'dst' is not NULL, the
+/// responses are put there instead of written.
+/// Must be called inside sub_iso_enter() / sub_iso_exit().
+    dterm_out_t out[BIRDMON_PARAM_BATCHMAX];
+    struct iovec iov[BIRDMON_PARAM_BATCHMAX+1];
+    char ack[1024];
+    int iovcnt = 0;
+    bool parallel;
+    uint64_t t_stage;
+    
+    memset(out, 0, numreq * sizeof(dterm_out_t));
+    
+    parallel = (numreq > 1) && (BIRDMON_PARAM_WORKERS > 1);
+    for (int i=0; parallel && (i<numreq); i++) {
+        char cmdname[32];
+        const cmdtab_item_t* cmd;
+        cmd_getname(cmdname, req[i].line, sizeof(cmdname)-1);
+        cmd      = cmd_search(dth->cmdtab, cmdname);
+        parallel = cmd_isreadonly(cmd);
+        cmd_release(cmd);
+    }
+    
+    if (parallel) {
+        dterm_batch_t batch = { dth, req, out, numreq, linelen, 0, 0 };
+        int extra = ((numreq < BIRDMON_PARAM_WORKERS) ? numreq : BIRDMON_PARAM_WORKERS) - 1;
+        
+        pthread_cond_init(&batch.done, NULL);
+        sub_pool_lend(&batch, extra);
+        sub_batch_run(&batch);
+        sub_pool_reclaim(&batch);
+        pthread_cond_destroy(&batch.done);
+    }
+    else {
+        for (int i=0; i<numreq; i++) {
+            sub_proc_request(dth, NULL, &req[i], linelen, &out[i]);
+        }
+    }
+    
+    for (int i=0; i<numreq; i++) {
+        if (out[i].size > 0) {
+            iov[iovcnt].iov_base    = out[i].buf;
+            iov[iovcnt].iov_len     = out[i].size;
+            iovcnt++;
+        }
+    }
+    if (dth->intf->type != INTF_interactive) {
+        iov[iovcnt].iov_base    = ack;
+        iov[iovcnt].iov_len     = (size_t)sub_format_ack(ack, "batch", 0, req[0].sid, NULL);
+        iovcnt++;
+    }
+    if (dst != NULL) {
+        for (int i=0; i<iovcnt; i++) {
+            sub_out_put(dst, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    else if (iovcnt > 0) {
+        t_stage = trace_begin();
+        for (int i=0; i<iovcnt; i++) {
+            if (sub_write_all(dth->fd.out, iov[i].iov_base, iov[i].iov_len) != 0) {
+                perror("could not write back to client");
+                break;
             }
         }
+        trace_end("write", "dterm", t_stage);
     }
     
-    sub_proc_lineinput_FREE:
-    cJSON_Delete(cmdobj);
+    for (int i=0; i<numreq; i++) {
+        free(out[i].buf);
+    }
+    return numreq;
+}
+
+
+static int sub_proc_lineinput(dterm_handle_t* dth, int* cmdrc, char* loadbuf, int linelen) {
+    cJSON*      cmdobj  = NULL;
+    envelope_t  env[BIRDMON_PARAM_BATCHMAX];
+    dterm_req_t req[BIRDMON_PARAM_BATCHMAX];
+    int         envrc;
+    bool        batch   = false;
+    uint64_t    t_stage;
     
-    // Return cJSON and argtable to generic context allocators
-    cjson_std_allocators();
-    arg_set_allocators(NULL, NULL);
+    DEBUG_PRINTF("raw input (%i bytes) %.*s\n", linelen, linelen, loadbuf);
+    trace_request();
+    sub_iso_enter(dth);
+    req[0].sid = 0;
     
-    return output_sid;
+    /// The input can be JSON of the form:
+    /// { "type":"${cmd_type}", data:"${cmd_data}", "id":${req_id} }
+    /// where we only truly care about the data object, which must be a string.
+    /// It can also be a batch: a JSON array of such objects.
+    /// The envelope is scanned in place, and cJSON only gets the inputs that
+    /// the scanner does not handle.  envrc is the number of requests, or an
+    /// ENVELOPE_Type.
+    t_stage = trace_begin();
+    envrc   = envelope_scan(&env[0], loadbuf, (size_t)linelen);
+    if (envrc == ENVELOPE_raw) {
+        envrc = envelope_scan_batch(env, BIRDMON_PARAM_BATCHMAX, loadbuf, (size_t)linelen);
+        batch = (envrc != ENVELOPE_raw);
+    }
+    for (int i=0; i<envrc; i++) {
+        sub_env_request(&req[i], &env[i]);
+    }
+    if (envrc == ENVELOPE_fallback) {
+        envrc   = ENVELOPE_raw;
+        cmdobj  = cJSON_Parse(loadbuf);
+        if (batch && cJSON_IsArray(cmdobj)) {
+            cJSON* item;
+            envrc = 0;
+            cJSON_ArrayForEach(item, cmdobj) {
+                if (envrc >= BIRDMON_PARAM_BATCHMAX) {
+                    envrc = ENVELOPE_overflow;
+                    break;
+                }
+                if (sub_cjson_request(&req[envrc], item) != ENVELOPE_ok) {
+                    envrc = ENVELOPE_invalid;
+                    break;
+                }
+                envrc++;
+            }
+            if (envrc == 0) {
+                envrc = ENVELOPE_invalid;
+            }
+        }
+        else if (!batch && cJSON_IsObject(cmdobj)) {
+            envrc = sub_cjson_request(&req[0], cmdobj);
+        }
+    }
+    trace_end("parse", "dterm", t_stage);
+    
+    if (envrc == ENVELOPE_raw) {
+        req[0].type = NULL;
+        req[0].line = loadbuf;
+        req[0].sid  = 0;
+        sub_proc_request(dth, cmdrc, &req[0], linelen, NULL);
+    }
+    else if (envrc == ENVELOPE_overflow) {
+        dterm_send_error(dth, "batch", -1, 0, "too many requests in batch");
+    }
+    else if (envrc < 0) {
+        // Invalid envelope: ignored
+    }
+    else if (batch) {
+        VCLIENT_PRINTF("JSON Batch (%i bytes): %i requests\n", linelen, envrc);
+        sub_proc_batch(dth, req, envrc, linelen, NULL);
+    }
+    else {
+        VCLIENT_PRINTF("JSON Request (%i bytes): type=%s data=%s\n", linelen, req[0].type, req[0].line);
+        sub_proc_request(dth, cmdrc, &req[0], linelen, NULL);
+    }
+    
+    cJSON_Delete(cmdobj);
+    sub_iso_exit();
+    
+    return (int)req[0].sid;
 }
 
 
 
-static int sub_readline(size_t* bytesread, int fd, char* buf_a, char* buf_b, int max) {
+static int sub_readline(size_t* bytesread, int fd, char* buf_a, char* buf_b, int max, uint64_t* t_first) {
     size_t bytesin;
     char* start = buf_a;
     int rc = 0;
@@ -1130,6 +1761,11 @@ static int sub_readline(size_t* bytesread, int fd, char* buf_a, char* buf_b, int
         if (rc != 1) {
             break;
         }
+        
+        // The line starts at its first byte, not when the wait began
+        if ((t_first != NULL) && (buf_a == start)) {
+            *t_first = trace_begin();
+        }
         max--;
         test = *buf_a++;
         if ((test == '\n') || (test == 0)) {
@@ -1152,15 +1788,349 @@ static int sub_readline(size_t* bytesread, int fd, char* buf_a, char* buf_b, int
 }
 
 
+/** Socket Request Pipelining <BR>
+  * ========================================================================<BR>
+  * A request with an "id" in its envelope is handed to the worker pool, and
+  * the client thread goes on reading.  The response and ack carry the id as
+  * "sid", and they are sent when the command completes, so several requests
+  * from one client may be in flight and complete in any order.  Requests
+  * without an id wait for those in flight and run in the client thread, in
+  * order, as they always have.
+  *
+  * Commands are still serialized by the isolation mutex, which also covers
+  * the response writes.  A command that blocks for a long time can release
+  * it with dterm_iso_unlock() / dterm_iso_lock().
+  */
+
+/// State shared by a client thread and the workers running its requests
+typedef struct {
+    dterm_handle_t      dts;
+    clithread_args_t*   ct_args;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    int                 inflight;
+    uint32_t            xid;            // as applied in clithread
+} dterm_conn_t;
+
+typedef struct dterm_job {
+    struct dterm_job*   next;
+    dterm_batch_t*      part;           // if not NULL, a runner lent to a batch
+    dterm_conn_t*       conn;
+    dterm_req_t*        req;
+    int                 numreq;
+    bool                batch;
+    int                 linelen;
+    char                line[];
+} dterm_job_t;
+
+static struct {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    dterm_job_t*        head;
+    dterm_job_t*        tail;
+    int                 numworkers;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+
+static void sub_conn_chxid(dterm_conn_t* conn) {
+/// Applies the subscription xid of the client in clithread, and counts it.
+/// Called under the isolation mutex, which covers conn->dts.sub_xid.
+    if (conn->xid != conn->dts.sub_xid) {
+        sub_xid_count(conn->xid, -1);
+        sub_xid_count(conn->dts.sub_xid, 1);
+        conn->xid = conn->dts.sub_xid;
+    }
+    clithread_chxid(conn->ct_args->clithread_self, conn->xid);
+}
+
+
+static void sub_conn_unlock(void* args) {
+    pthread_mutex_unlock((pthread_mutex_t*)args);
+}
+
+static void sub_conn_wait(dterm_conn_t* conn, int limit) {
+/// Waits until the connection has at most 'limit' requests in flight.  A
+/// client thread cancelled in the wait gets the mutex back, so it is
+/// released before sub_conn_drain() runs.
+    pthread_mutex_lock(&conn->mutex);
+    pthread_cleanup_push(&sub_conn_unlock, &conn->mutex);
+    while (conn->inflight > limit) {
+        pthread_cond_wait(&conn->cond, &conn->mutex);
+    }
+    pthread_cleanup_pop(1);
+}
+
+static void sub_conn_drain(void* args) {
+/// Also the cleanup handler of a cancelled client thread: workers must be
+/// done with the connection before its stack goes away.  Its subscription
+/// is no longer counted.
+    dterm_conn_t* conn = args;
+    sub_conn_wait(conn, 0);
+    sub_xid_count(conn->xid, -1);
+    conn->xid = 0;
+}
+
+
+static void sub_pool_help(dterm_job_t* job) {
+/// Runs requests of a parallel batch until there are none left.  The batch
+/// is on the owner's stack, and it is gone once 'running' is decremented.
+    dterm_batch_t* batch = job->part;
+    
+    free(job);
+    sub_batch_run(batch);
+    
+    pthread_mutex_lock(&pool.mutex);
+    batch->running--;
+    pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static void sub_pool_lend(dterm_batch_t* batch, int count) {
+/// Queues runners for a batch ahead of the requests, which would only wait
+/// for the isolation mutex the batch holds.  Workers that are all busy just
+/// leave the batch to its owner.
+    dterm_job_t* job;
+    
+    pthread_mutex_lock(&pool.mutex);
+    count = (count < pool.numworkers) ? count : pool.numworkers;
+    while (count-- > 0) {
+        job = malloc(sizeof(dterm_job_t));
+        if (job == NULL) {
+            break;
+        }
+        job->part   = batch;
+        job->conn   = NULL;
+        job->next   = pool.head;
+        pool.head   = job;
+        if (pool.tail == NULL) {
+            pool.tail = job;
+        }
+    }
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static void sub_pool_reclaim(dterm_batch_t* batch) {
+/// Called by the owner once it runs out of requests: runners not yet taken
+/// are withdrawn, and the ones running are waited for.  A client thread is
+/// not cancelled in the wait, as the runners are still using its stack.
+    dterm_job_t** link;
+    dterm_job_t* job;
+    int cancel_state;
+    
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&pool.mutex);
+    link        = &pool.head;
+    pool.tail   = NULL;
+    while ((job = *link) != NULL) {
+        if (job->part == batch) {
+            *link = job->next;
+            free(job);
+        }
+        else {
+            pool.tail   = job;
+            link        = &job->next;
+        }
+    }
+    while (batch->running > 0) {
+        pthread_cond_wait(&batch->done, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+
+static void* sub_worker(void* args) {
+/// Takes one job at a time, and writes its responses and acks in one write
+/// as soon as it is done.  Other jobs of the same connection go to other
+/// workers, so a slow request does not hold up the ones behind it.
+    dterm_out_t out = { NULL, 0, 0, true };
+    dterm_job_t* job;
+    dterm_conn_t* conn;
+    
+    talloc_disable_null_tracking();
+    trace_thread("worker");
+    
+    while (1) {
+        pthread_mutex_lock(&pool.mutex);
+        while (pool.head == NULL) {
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        }
+        job         = pool.head;
+        pool.head   = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        if (job->part != NULL) {
+            job->part->running++;
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        
+        if (job->part != NULL) {
+            sub_pool_help(job);
+            continue;
+        }
+        
+        conn = job->conn;
+        LP_TAG("dterm");
+        sub_iso_lock(&conn->dts);
+        sub_iso_enter(&conn->dts);
+        trace_request();
+        if (job->batch) {
+            sub_proc_batch(&conn->dts, job->req, job->numreq, job->linelen, &out);
+        }
+        else {
+            sub_proc_request(&conn->dts, NULL, &job->req[0], job->linelen, &out);
+        }
+        free(job);
+        sub_iso_exit();
+        sub_out_flush(&conn->dts, &out);
+        sub_conn_chxid(conn);
+        sub_iso_unlock(&conn->dts);
+        
+        // The connection may be gone once inflight is decremented
+        pthread_mutex_lock(&conn->mutex);
+        conn->inflight--;
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->mutex);
+    }
+    
+    return NULL;
+}
+
+
+static int sub_pool_start(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (pool.numworkers < BIRDMON_PARAM_WORKERS) {
+        if (pthread_create(&thread, &attr, &sub_worker, NULL) != 0) {
+            break;
+        }
+        pool.numworkers++;
+    }
+    pthread_attr_destroy(&attr);
+    
+    return pool.numworkers;
+}
+
+
+static bool sub_has_id(const char* line, int linelen) {
+/// True if "id" is anywhere in the line.  Lines without it cannot be queued,
+/// so they are not copied and scanned twice.
+    for (int i=0; i<(linelen-3); i++) {
+        if ((line[i] == '"') && (line[i+1] == 'i') && (line[i+2] == 'd') && (line[i+3] == '"')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int sub_dispatch(dterm_conn_t* conn, const char* line, int linelen) {
+/// Queues the line to the worker pool if it is an envelope, or a batch of
+/// envelopes, where every request has an id.
+/// Returns 0 if it was queued, else the caller must run it.
+    dterm_job_t* job;
+    envelope_t env[BIRDMON_PARAM_BATCHMAX];
+    size_t reqoffset;
+    int numreq;
+    bool batch;
+    uint64_t t_stage;
+    
+    if ((pool.numworkers == 0) || ((line[0] != '{') && (line[0] != '['))) {
+        return -1;
+    }
+    if (!sub_has_id(line, linelen)) {
+        return -1;
+    }
+    
+    // The envelope is scanned on the job's copy of the line, so the line is
+    // left intact for the caller if it is not queued.  The requests go after
+    // the line.
+    t_stage     = trace_begin();
+    reqoffset   = (sizeof(dterm_job_t) + linelen + 1 + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    job         = malloc(reqoffset + (BIRDMON_PARAM_BATCHMAX * sizeof(dterm_req_t)));
+    if (job == NULL) {
+        return -1;
+    }
+    memcpy(job->line, line, linelen);
+    job->line[linelen] = 0;
+    batch   = (line[0] == '[');
+    numreq  = batch ? envelope_scan_batch(env, BIRDMON_PARAM_BATCHMAX, job->line, (size_t)linelen) \
+                    : envelope_scan(&env[0], job->line, (size_t)linelen);
+    if (numreq <= 0) {
+        free(job);
+        return -1;
+    }
+    job->req = (dterm_req_t*)((uint8_t*)job + reqoffset);
+    for (int i=0; i<numreq; i++) {
+        sub_env_request(&job->req[i], &env[i]);
+        if (job->req[i].sid == 0) {
+            free(job);
+            return -1;
+        }
+    }
+    trace_end("parse", "dterm", t_stage);
+    VCLIENT_PRINTF("JSON Request (%i bytes): type=%s data=%s id=%u, %i in batch\n", linelen, job->req[0].type, job->req[0].line, job->req[0].sid, numreq);
+    job->part       = NULL;
+    job->numreq     = numreq;
+    job->batch      = batch;
+    job->linelen    = linelen;
+    job->conn       = conn;
+    job->next       = NULL;
+    
+    // Back-pressure: stop reading from a client that has too much in flight
+    sub_conn_wait(conn, BIRDMON_PARAM_PIPELINE - 1);
+    pthread_mutex_lock(&conn->mutex);
+    conn->inflight++;
+    pthread_mutex_unlock(&conn->mutex);
+    
+    pthread_mutex_lock(&pool.mutex);
+    if (pool.tail == NULL) {
+        pool.head = job;
+    }
+    else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+    
+    return 0;
+}
+
+
+bool dterm_iso_unlock(dterm_handle_t* dth) {
+    // The commands of a parallel batch run under the batch's lock
+    if (iso_shared || !iso_owned) {
+        return false;
+    }
+    sub_iso_unlock(dth);
+    iso_released = true;
+    return true;
+}
+
+void dterm_iso_lock(dterm_handle_t* dth) {
+    if (iso_released) {
+        iso_released = false;
+        sub_iso_lock(dth);
+    }
+}
+
+
+
 void* dterm_socket_clithread(void* args) {
 /// Thread that:
 /// <LI> Listens to stdin via read() pipe </LI>
 /// <LI> Processes each LINE and takes action accordingly. </LI>
 
     dterm_handle_t* dth;
-    dterm_handle_t dts;
+    dterm_conn_t conn;
     clithread_args_t* ct_args;
-    char databuf[1024];
+    char databuf[LINESIZE+1];
     
     ct_args = (clithread_args_t*)args;
     if (args == NULL)
@@ -1172,60 +2142,76 @@ void* dterm_socket_clithread(void* args) {
 
     // Thread-local memory elements
     dth = ((clithread_args_t*)args)->app_handle;
-    memcpy(&dts, dth, sizeof(dterm_handle_t));
-    dts.fd.in   = ((clithread_args_t*)args)->fd_in;
-    dts.fd.out  = ((clithread_args_t*)args)->fd_out;
-    dts.tctx    = ct_args->tctx;
+    memcpy(&conn.dts, dth, sizeof(dterm_handle_t));
+    conn.dts.fd.in  = ((clithread_args_t*)args)->fd_in;
+    conn.dts.fd.out = ((clithread_args_t*)args)->fd_out;
+    conn.dts.tctx   = ct_args->tctx;
+    conn.ct_args    = ct_args;
+    conn.inflight   = 0;
+    conn.xid        = 0;
+    pthread_mutex_init(&conn.mutex, NULL);
+    pthread_cond_init(&conn.cond, NULL);
 
     clithread_sigup(ct_args->clithread_self);
+    trace_thread("client");
 
     // Deferred cancellation: will wait until the blocking read() call is in
     // idle before killing the thread.
     pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-    VERBOSE_PRINTF("Client Thread on socket:fd=%i has started\n", dts.fd.out);
+    pthread_cleanup_push(&sub_conn_drain, &conn);
+    VERBOSE_PRINTF("Client Thread on socket:fd=%i has started\n", conn.dts.fd.out);
     
     /// Get a packet from the Socket
     while (1) {
         int linelen;
         int loadlen;
-        char* loadbuf = databuf;
+        char* loadbuf   = databuf;
+        uint64_t t_read = 0;
         
         bzero(databuf, sizeof(databuf));
 
-        VERBOSE_PRINTF("Waiting for read on socket:fd=%i\n", dts.fd.out);
-        loadlen = sub_readline(NULL, dts.fd.out, loadbuf, NULL, LINESIZE);
-        if (loadlen > 0) {
-            sub_str_sanitize(loadbuf, (size_t)loadlen);
-            pthread_mutex_lock(dts.iso_mutex);
-            dts.intf->state = prompt_off;
-            
-            do {
-                int output_sid;
-
-                // Burn whitespace ahead of command.
-                while (isspace(*loadbuf)) { loadbuf++; loadlen--; }
-                linelen = (int)sub_str_mark(loadbuf, (size_t)loadlen);
-
-                // Process the line-input command
-                output_sid = sub_proc_lineinput(&dts, NULL, loadbuf, linelen);
-                clithread_chxid(ct_args->clithread_self, output_sid);
-
-                // +1 eats the terminator
-                loadlen -= (linelen + 1);
-                loadbuf += (linelen + 1);
-
-            } while (loadlen > 0);
-
-            pthread_mutex_unlock(dts.iso_mutex);
-        }
-        else {
-            // After servicing the client socket, it is important to close it.
-            close(dts.fd.out);
+        VERBOSE_PRINTF("Waiting for read on socket:fd=%i\n", conn.dts.fd.out);
+        loadlen = sub_readline(NULL, conn.dts.fd.out, loadbuf, NULL, LINESIZE, &t_read);
+        if (loadlen <= 0) {
             break;
         }
+        
+        trace_end("read", "dterm", t_read);
+        sub_str_sanitize(loadbuf, (size_t)loadlen);
+        
+        do {
+            // Burn whitespace ahead of command.
+            while (isspace(*loadbuf)) { loadbuf++; loadlen--; }
+            linelen = (int)sub_str_mark(loadbuf, (size_t)loadlen);
+
+            // Process the line-input command, unless a worker takes it
+            if (sub_dispatch(&conn, loadbuf, linelen) != 0) {
+                sub_conn_wait(&conn, 0);
+                LP_TAG("dterm");
+                sub_iso_lock(&conn.dts);
+                conn.dts.intf->state = prompt_off;
+                sub_proc_lineinput(&conn.dts, NULL, loadbuf, linelen);
+                
+                // A subscribed client keeps its subscription xid
+                sub_conn_chxid(&conn);
+                sub_iso_unlock(&conn.dts);
+            }
+
+            // +1 eats the terminator
+            loadlen -= (linelen + 1);
+            loadbuf += (linelen + 1);
+
+        } while (loadlen > 0);
     }
+    
+    // After servicing the client socket, it is important to close it, but
+    // only once the workers are done writing to it.
+    pthread_cleanup_pop(1);
+    close(conn.dts.fd.out);
+    pthread_cond_destroy(&conn.cond);
+    pthread_mutex_destroy(&conn.mutex);
 
-    VERBOSE_PRINTF("Client Thread on socket:fd=%i is exiting\n", dts.fd.out);
+    VERBOSE_PRINTF("Client Thread on socket:fd=%i is exiting\n", conn.dts.fd.out);
     
     /// End of thread: it *must* call clithread_exit() before exiting
     clithread_exit( ((clithread_args_t*)args)->clithread_self  );
@@ -1244,6 +2230,11 @@ void* dterm_socketer(void* args) {
     
     // Socket operation has no interface prompt
     dth->intf->state        = prompt_off;
+    
+    // Workers for pipelined requests.  Without them, requests run in order.
+    if (sub_pool_start() <= 0) {
+        fprintf(stderr, "Worker threads could not be started: requests will not be pipelined\n");
+    }
     clithread.app_handle    = dth;
     clithread.fd_in         = dth->fd.in;
     clithread.tctx          = NULL;
@@ -1294,12 +2285,10 @@ void* dterm_piper(void* args) {
     /// Get each line from the pipe.
     while (dth->thread_active) {
         int linelen;
-        size_t poolsize;
-        size_t est_poolobj;
         
         if (loadlen <= 0) {
             sub_reset(dth->intf);
-            loadlen = (int)read(dth->fd.in, loadbuf, 1024);
+            loadlen = (int)read(dth->fd.in, loadbuf, LINESIZE-1);
             sub_str_sanitize(loadbuf, (size_t)loadlen);
         }
         
@@ -1307,17 +2296,12 @@ void* dterm_piper(void* args) {
         while (isspace(*loadbuf)) { loadbuf++; loadlen--; }
         linelen = (int)sub_str_mark(loadbuf, (size_t)loadlen);
 
-        // Create temporary context as a memory pool
-        poolsize    = cliopt_getpoolsize();
-        est_poolobj = 4; //(poolsize / 128) + 1;
-        dth->tctx   = talloc_pooled_object(NULL, void*, est_poolobj, poolsize);
-
-        // Process the line-input command
+        // Process the line-input command.  Its memory is in this thread's
+        // arena, which is reset when it is done.  Pushes from the backend
+        // take the isolation mutex, so commands run under it here too.
+        sub_iso_lock(dth);
         sub_proc_lineinput(dth, NULL, loadbuf, linelen);
-        
-        // Free temporary memory pool context
-        talloc_free(dth->tctx);
-        dth->tctx = NULL;
+        sub_iso_unlock(dth);
         
         // +1 eats the terminator
         loadlen -= (linelen + 1);
@@ -1381,7 +2365,7 @@ int dterm_cmdfile(dterm_handle_t* dth, const char* filename) {
     // Reset the terminal to default state
     sub_reset(dth->intf);
 
-    pthread_mutex_lock(dth->iso_mutex);
+    sub_iso_lock(dth);
     local.in    = STDIN_FILENO;
     local.out   = STDOUT_FILENO;
     saved       = dth->fd;
@@ -1392,28 +2376,17 @@ int dterm_cmdfile(dterm_handle_t* dth, const char* filename) {
     while (filebuf_sz > 0) {
         int linelen;
         int cmdrc;
-        size_t poolsize;
-        size_t est_poolobj;
         
         // Burn whitespace ahead of command.
         while (isspace(*filecursor)) { filecursor++; filebuf_sz--; }
         linelen = (int)sub_str_mark(filecursor, (size_t)filebuf_sz);
 
-        // Create temporary context as a memory pool
-        poolsize    = cliopt_getpoolsize();
-        est_poolobj = 4; //(poolsize / 128) + 1;
-        dth->tctx   = talloc_pooled_object(NULL, void, est_poolobj, poolsize);
-        
         // Echo input line to dterm
         dprintf(dth->fd.out, _E_MAG"%s"_E_NRM"%s\n", prompt_root, filecursor);
         
         // Process the line-input command.  Exit on proc error
         sub_proc_lineinput(dth, &cmdrc, filecursor, linelen);
         
-        // Free temporary memory pool context
-        talloc_free(dth->tctx);
-        dth->tctx = NULL;
-        
         // Exit the command sequence on first detection of error.
         if (cmdrc < 0) {
             dprintf(dth->fd.out, _E_RED"ERR: "_E_NRM"Command Returned %i: stopping.\n\n", cmdrc);
@@ -1426,7 +2399,7 @@ int dterm_cmdfile(dterm_handle_t* dth, const char* filename) {
     }
     
     dth->fd = saved;
-    pthread_mutex_unlock(dth->iso_mutex);
+    sub_iso_unlock(dth);
 
     dterm_cmdfile_END:
     if (fp != NULL) fclose(fp);
@@ -1562,7 +2535,8 @@ void* dterm_prompter(void* args) {
         // This mutex protects the terminal output from being written-to by
         // this thread and mpipe_parser() at the same time.
         if (dth->intf->state == prompt_off) {
-            pthread_mutex_lock(dth->iso_mutex);
+            LP_TAG("dterm");
+            sub_iso_lock(dth);
         }
         
         // These are error conditions
@@ -1637,29 +2611,18 @@ void* dterm_prompter(void* args) {
                 // 3. Search and try to execute cmd
                 // 4. Reset prompt, change to OFF State, unlock mutex on dterm
                 case ct_enter: {
-                    size_t poolsize;
-                    size_t est_poolobj;
                     sub_putc(&dth->fd, '\n');
 
                     if (!ch_contains(dth->ch, dth->intf->linebuf)) {
                         ch_add(dth->ch, dth->intf->linebuf);
                     }
 
-                    // Create temporary context as a memory pool
-                    poolsize    = cliopt_getpoolsize();
-                    est_poolobj = 4; //(poolsize / 128) + 1;
-                    dth->tctx   = talloc_pooled_object(NULL, void*, est_poolobj, poolsize);
-
                     // Run command(s) from line input
                     sub_proc_lineinput( dth, NULL,
                                         (char*)dth->intf->linebuf,
-                                        (int)sub_str_mark((char*)dth->intf->linebuf, 1024)
+                                        (int)sub_str_mark((char*)dth->intf->linebuf, LINESIZE)
                                     );
 
-                    // Free temporary memory pool context
-                    talloc_free(dth->tctx);
-                    dth->tctx = NULL;
-
                     sub_reset(dth->intf);
                     dth->intf->state = prompt_close;
                 } break;
@@ -1678,6 +2641,7 @@ void* dterm_prompter(void* args) {
                     else {
                         sub_puts(&dth->fd, ASCII_BEL);
                     }
+                    cmd_release(cmdptr);
                 } break;
                 
                 // DOWN-ARROW presses fill the prompt with the next command 
@@ -1722,7 +2686,7 @@ void* dterm_prompter(void* args) {
         // Unlock Mutex
         if (dth->intf->state != prompt_on) {
             dth->intf->state = prompt_off;
-            pthread_mutex_unlock(dth->iso_mutex);
+            sub_iso_unlock(dth);
         }
         
         if (dth->thread_active == false) {
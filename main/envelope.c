@@ -0,0 +1,312 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+
+// Local Headers
+#include "envelope.h"
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+
+
+/// Location of a JSON string in the line, excluding its quotes, or of a
+/// JSON number
+typedef struct {
+    char*   front;
+    char*   back;
+    bool    escaped;
+    bool    number;
+} jstring_t;
+
+
+
+static char* sub_skipws(char* cursor, char* end) {
+    while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t') || (*cursor == '\r') || (*cursor == '\n'))) {
+        cursor++;
+    }
+    return cursor;
+}
+
+
+static char* sub_string(jstring_t* str, char* cursor, char* end) {
+/// Scans the JSON string that opens at cursor.  Returns the position after
+/// the closing quote, or NULL if the string is malformed or uses an escape
+/// that sub_unescape() does not decode.
+    if ((cursor >= end) || (*cursor != '\"')) {
+        return NULL;
+    }
+    
+    str->front      = ++cursor;
+    str->escaped    = false;
+    str->number     = false;
+    while (cursor < end) {
+        unsigned char c = (unsigned char)*cursor;
+        
+        if (c == '\"') {
+            str->back = cursor;
+            return cursor + 1;
+        }
+        if (c < 0x20) {
+            return NULL;
+        }
+        if (c == '\\') {
+            if (++cursor >= end) {
+                return NULL;
+            }
+            switch (*cursor) {
+                case '\"':
+                case '\\':
+                case '/':
+                case 'b':
+                case 'f':
+                case 'n':
+                case 'r':
+                case 't':   break;
+                default:    return NULL;
+            }
+            str->escaped = true;
+        }
+        cursor++;
+    }
+    
+    return NULL;
+}
+
+
+static char* sub_number(jstring_t* str, char* cursor, char* end) {
+/// Scans the JSON number at cursor, loosely: sign, digits, fraction and
+/// exponent characters.  Returns the position after it, or NULL if empty.
+    str->front      = cursor;
+    str->escaped    = false;
+    str->number     = true;
+    while ((cursor < end) && (((*cursor >= '0') && (*cursor <= '9')) || (strchr("+-.eE", *cursor) != NULL))) {
+        cursor++;
+    }
+    str->back = cursor;
+    
+    return (cursor == str->front) ? NULL : cursor;
+}
+
+
+static char* sub_value(jstring_t* str, char* cursor, char* end) {
+    if ((cursor < end) && (*cursor == '\"')) {
+        return sub_string(str, cursor, end);
+    }
+    return sub_number(str, cursor, end);
+}
+
+
+static char* sub_unescape(jstring_t* str) {
+/// Decodes the string in place, which can only shorten it, and null
+/// terminates it over the closing quote or earlier.  A number is null
+/// terminated over the delimiter that follows it.
+    char* rd = str->front;
+    char* wr = str->front;
+    
+    if (str->escaped) {
+        while (rd < str->back) {
+            if (*rd == '\\') {
+                rd++;
+                switch (*rd) {
+                    case 'b':   *wr = '\b'; break;
+                    case 'f':   *wr = '\f'; break;
+                    case 'n':   *wr = '\n'; break;
+                    case 'r':   *wr = '\r'; break;
+                    case 't':   *wr = '\t'; break;
+                    default:    *wr = *rd;  break;
+                }
+            }
+            else {
+                *wr = *rd;
+            }
+            wr++;
+            rd++;
+        }
+        *wr = 0;
+    }
+    else {
+        *str->back = 0;
+    }
+    
+    return str->front;
+}
+
+
+static bool sub_iskey(jstring_t* key, const char* name, size_t namelen) {
+    return ((size_t)(key->back - key->front) == namelen) 
+        && (memcmp(key->front, name, namelen) == 0);
+}
+
+
+
+/// Members kept from an envelope object while it is scanned
+typedef struct {
+    jstring_t type;
+    jstring_t data;
+    jstring_t id;
+} jenvelope_t;
+
+
+static int sub_object(jenvelope_t* obj, char** pcursor, char* end) {
+/// Scans the object that opens at *pcursor, and moves *pcursor past it
+    jstring_t key;
+    jstring_t val;
+    char* cursor = *pcursor;
+    
+    memset(obj, 0, sizeof(jenvelope_t));
+    
+    /// Walk the members: "key" : "value" [, ...] }
+    /// Only the first "type", "data" and "id" members are kept, like cJSON.
+    cursor = sub_skipws(cursor+1, end);
+    if ((cursor < end) && (*cursor == '}')) {
+        *pcursor = cursor + 1;
+        return ENVELOPE_invalid;
+    }
+    while (1) {
+        cursor = sub_string(&key, cursor, end);
+        if ((cursor == NULL) || key.escaped) {
+            return ENVELOPE_fallback;
+        }
+        cursor = sub_skipws(cursor, end);
+        if ((cursor >= end) || (*cursor != ':')) {
+            return ENVELOPE_fallback;
+        }
+        cursor = sub_skipws(cursor+1, end);
+        cursor = sub_value(&val, cursor, end);
+        if (cursor == NULL) {
+            return ENVELOPE_fallback;
+        }
+        
+        if ((obj->type.front == NULL) && sub_iskey(&key, "type", 4)) {
+            obj->type = val;
+        }
+        else if ((obj->data.front == NULL) && sub_iskey(&key, "data", 4)) {
+            obj->data = val;
+        }
+        else if ((obj->id.front == NULL) && sub_iskey(&key, "id", 2)) {
+            obj->id = val;
+        }
+        
+        cursor = sub_skipws(cursor, end);
+        if ((cursor < end) && (*cursor == ',')) {
+            cursor = sub_skipws(cursor+1, end);
+            continue;
+        }
+        if ((cursor < end) && (*cursor == '}')) {
+            break;
+        }
+        return ENVELOPE_fallback;
+    }
+    
+    *pcursor = cursor + 1;
+    
+    if ((obj->type.front == NULL) || (obj->data.front == NULL) || obj->type.number || obj->data.number) {
+        return ENVELOPE_invalid;
+    }
+    return ENVELOPE_ok;
+}
+
+
+static void sub_commit(envelope_t* env, jenvelope_t* obj) {
+    env->type   = sub_unescape(&obj->type);
+    env->data   = sub_unescape(&obj->data);
+    env->id     = (obj->id.front == NULL) ? NULL : sub_unescape(&obj->id);
+}
+
+
+static char* sub_end(char* line, size_t len) {
+    char* end = memchr(line, 0, len);
+    return (end == NULL) ? (line + len) : end;
+}
+
+
+
+int envelope_scan(envelope_t* env, char* line, size_t len) {
+    jenvelope_t obj;
+    char* end;
+    char* cursor;
+    int rc;
+    
+    end     = sub_end(line, len);
+    cursor  = sub_skipws(line, end);
+    if ((cursor >= end) || (*cursor != '{')) {
+        return ENVELOPE_raw;
+    }
+    
+    rc = sub_object(&obj, &cursor, end);
+    if (rc == ENVELOPE_ok) {
+        sub_commit(env, &obj);
+    }
+    return rc;
+}
+
+
+
+int envelope_scan_batch(envelope_t* env, int maxenv, char* line, size_t len) {
+    jenvelope_t obj;
+    char* end;
+    char* front;
+    char* cursor;
+    int count;
+    int rc;
+    
+    end     = sub_end(line, len);
+    front   = sub_skipws(line, end);
+    if ((front >= end) || (*front != '[')) {
+        return ENVELOPE_raw;
+    }
+    
+    /// The array is scanned twice: once to validate all of it, and again to
+    /// commit each object.  Committing an object only writes inside it, so
+    /// the line is unchanged unless the whole batch is valid.
+    for (int pass=0; pass<2; pass++) {
+        cursor  = sub_skipws(front+1, end);
+        count   = 0;
+        while ((cursor < end) && (*cursor == '{')) {
+            rc = sub_object(&obj, &cursor, end);
+            if (rc != ENVELOPE_ok) {
+                return rc;
+            }
+            if (count >= maxenv) {
+                return ENVELOPE_overflow;
+            }
+            if (pass != 0) {
+                sub_commit(&env[count], &obj);
+            }
+            count++;
+            
+            cursor = sub_skipws(cursor, end);
+            if ((cursor < end) && (*cursor == ',')) {
+                cursor = sub_skipws(cursor+1, end);
+                if ((cursor >= end) || (*cursor != '{')) {
+                    return ENVELOPE_fallback;
+                }
+            }
+        }
+        if ((cursor >= end) || (*cursor != ']')) {
+            return ENVELOPE_fallback;
+        }
+        if (count == 0) {
+            return ENVELOPE_invalid;
+        }
+    }
+    
+    return count;
+}
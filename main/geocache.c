@@ -0,0 +1,361 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "geocache.h"
+#include "jobsched.h"
+#include "stats.h"
+
+// Standard C & POSIX Libraries
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define GEO_BUCKETS     (BIRDMON_PARAM_GEOCACHE_SIZE * 2)
+
+/// Entries are on a hash chain for lookup, and on the LRU list, most recent
+/// first.  Free entries are on the free list, through next.
+typedef struct geo_entry {
+    struct geo_entry*   hnext;
+    struct geo_entry*   prev;
+    struct geo_entry*   next;
+    uint32_t            hash;
+    bool                found;
+    time_t              expires;
+    double              lat;
+    double              lon;
+    char                key[GEOCACHE_KEYMAX];
+} geo_entry_t;
+
+static struct {
+    pthread_mutex_t     mutex;
+    bool                dirty;
+    char*               path;
+    char*               tmppath;
+    int                 used;               // entries taken from pool
+    geo_entry_t*        head;
+    geo_entry_t*        tail;
+    geo_entry_t*        free;
+    geo_entry_t*        bucket[GEO_BUCKETS];
+    geo_entry_t         pool[BIRDMON_PARAM_GEOCACHE_SIZE];
+} geo = { PTHREAD_MUTEX_INITIALIZER };
+
+
+
+
+static uint32_t sub_hash(const char* key) {
+/// FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*key != 0) {
+        hash ^= (uint8_t)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static void sub_lru_unlink(geo_entry_t* entry) {
+    if (entry->prev != NULL)    entry->prev->next = entry->next;
+    else                        geo.head = entry->next;
+    if (entry->next != NULL)    entry->next->prev = entry->prev;
+    else                        geo.tail = entry->prev;
+}
+
+static void sub_lru_push(geo_entry_t* entry) {
+    entry->prev = NULL;
+    entry->next = geo.head;
+    if (geo.head != NULL)   geo.head->prev = entry;
+    else                    geo.tail = entry;
+    geo.head = entry;
+}
+
+
+static geo_entry_t* sub_find(const char* key, uint32_t hash) {
+    geo_entry_t* entry;
+    
+    for (entry = geo.bucket[hash % GEO_BUCKETS]; entry != NULL; entry = entry->hnext) {
+        if ((entry->hash == hash) && (strcmp(entry->key, key) == 0)) {
+            break;
+        }
+    }
+    return entry;
+}
+
+
+static void sub_remove(geo_entry_t* entry) {
+    geo_entry_t** link = &geo.bucket[entry->hash % GEO_BUCKETS];
+    
+    while (*link != entry) {
+        link = &(*link)->hnext;
+    }
+    *link = entry->hnext;
+    sub_lru_unlink(entry);
+    entry->next = geo.free;
+    geo.free    = entry;
+}
+
+
+static void sub_insert(const char* key, bool found, double lat, double lon, time_t expires) {
+/// Replaces the key if it is cached.  Otherwise takes a free entry, or drops
+/// the least recently used one.
+    uint32_t hash = sub_hash(key);
+    geo_entry_t* entry = sub_find(key, hash);
+    
+    if (entry != NULL) {
+        sub_lru_unlink(entry);
+    }
+    else {
+        if ((geo.free == NULL) && (geo.used >= BIRDMON_PARAM_GEOCACHE_SIZE)) {
+            sub_remove(geo.tail);
+        }
+        if (geo.free != NULL) {
+            entry       = geo.free;
+            geo.free    = entry->next;
+        }
+        else {
+            entry = &geo.pool[geo.used++];
+        }
+        entry->hash     = hash;
+        entry->hnext    = geo.bucket[hash % GEO_BUCKETS];
+        geo.bucket[hash % GEO_BUCKETS] = entry;
+        strcpy(entry->key, key);
+    }
+    sub_lru_push(entry);
+    entry->found    = found;
+    entry->lat      = found ? lat : 0.;
+    entry->lon      = found ? lon : 0.;
+    entry->expires  = expires;
+}
+
+
+static int sub_load(FILE* fp) {
+/// One entry per line: "expires found lat lon key".  Lines are in LRU order,
+/// least recent first, so inserting them in turn restores the order.
+    char line[GEOCACHE_KEYMAX + 96];
+    time_t now = time(NULL);
+    int loaded = 0;
+    
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        long long expires;
+        int found;
+        double lat, lon;
+        int keypos = 0;
+        size_t keylen;
+        
+        if (line[0] == '#') {
+            continue;
+        }
+        if ((sscanf(line, "%lld %d %lf %lf %n", &expires, &found, &lat, &lon, &keypos) != 4)
+        ||  (keypos == 0)) {
+            continue;
+        }
+        keylen = strlen(&line[keypos]);
+        if ((keylen < 2) || (line[keypos+keylen-1] != '\n') || ((time_t)expires <= now)) {
+            continue;
+        }
+        line[keypos+keylen-1] = 0;
+        sub_insert(&line[keypos], (found != 0), lat, lon, (time_t)expires);
+        loaded++;
+    }
+    return loaded;
+}
+
+
+static void sub_save(void) {
+/// Written under the lock: at most BIRDMON_PARAM_GEOCACHE_SIZE short lines,
+/// into the page cache.  Readers never see a partial file.
+    time_t now = time(NULL);
+    FILE* fp;
+    
+    if ((geo.path == NULL) || !geo.dirty) {
+        return;
+    }
+    fp = fopen(geo.tmppath, "w");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "# birdmon geocache: expires found lat lon key\n");
+    for (geo_entry_t* entry = geo.tail; entry != NULL; entry = entry->prev) {
+        if (entry->expires > now) {
+            fprintf(fp, "%lld %i %.7f %.7f %s\n", (long long)entry->expires, 
+                    (int)entry->found, entry->lat, entry->lon, entry->key);
+        }
+    }
+    // The data must be on disk before the rename makes it the cache file,
+    // or a crash could leave an empty one.
+    fflush(fp);
+    fsync(fileno(fp));
+    if ((fclose(fp) == 0) && (rename(geo.tmppath, geo.path) == 0)) {
+        geo.dirty = false;
+    }
+}
+
+
+static void geocache_saver(void* args) {
+/// A job of the scheduler
+    pthread_mutex_lock(&geo.mutex);
+    sub_save();
+    pthread_mutex_unlock(&geo.mutex);
+}
+
+
+
+
+int geocache_init(const char* path) {
+    size_t pathlen;
+    FILE* fp;
+    int rc = 0;
+    
+    if (path == NULL) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&geo.mutex);
+    if (geo.path != NULL) {
+        rc = -1;
+        goto geocache_init_EXIT;
+    }
+    pathlen     = strlen(path);
+    geo.path    = strdup(path);
+    geo.tmppath = malloc(pathlen + 8);
+    if ((geo.path == NULL) || (geo.tmppath == NULL)) {
+        rc = -2;
+        goto geocache_init_ERR;
+    }
+    snprintf(geo.tmppath, pathlen + 8, "%s.tmp", path);
+    
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        sub_load(fp);
+        fclose(fp);
+    }
+    
+    if (jobsched_add_interval("geocache", BIRDMON_PARAM_GEOCACHE_SAVE*1000, 0, &geocache_saver, NULL) != 0) {
+        rc = -3;
+        goto geocache_init_ERR;
+    }
+    goto geocache_init_EXIT;
+    
+    geocache_init_ERR:
+    free(geo.path);
+    free(geo.tmppath);
+    geo.path    = NULL;
+    geo.tmppath = NULL;
+    
+    geocache_init_EXIT:
+    pthread_mutex_unlock(&geo.mutex);
+    return rc;
+}
+
+
+void geocache_deinit(void) {
+    pthread_mutex_lock(&geo.mutex);
+    sub_save();
+    free(geo.path);
+    free(geo.tmppath);
+    geo.path    = NULL;
+    geo.tmppath = NULL;
+    geo.head    = NULL;
+    geo.tail    = NULL;
+    geo.free    = NULL;
+    geo.used    = 0;
+    memset(geo.bucket, 0, sizeof(geo.bucket));
+    pthread_mutex_unlock(&geo.mutex);
+}
+
+
+size_t geocache_key(char* key, const char* address) {
+    size_t len = 0;
+    bool gap = false;
+    
+    if (address == NULL) {
+        return 0;
+    }
+    for (; *address != 0; address++) {
+        uint8_t c = (uint8_t)*address;
+        
+        if (isalnum(c) || (c == '#') || (c == '-') || (c >= 0x80)) {
+            if (gap && (len != 0)) {
+                if (len+1 >= GEOCACHE_KEYMAX) {
+                    return 0;
+                }
+                key[len++] = ' ';
+            }
+            if (len+1 >= GEOCACHE_KEYMAX) {
+                return 0;
+            }
+            key[len++]  = (char)tolower(c);
+            gap         = false;
+        }
+        else {
+            gap = true;
+        }
+    }
+    key[len] = 0;
+    return len;
+}
+
+
+GEOCACHE_Type geocache_get(const char* key, double* lat, double* lon) {
+    GEOCACHE_Type rc = GEOCACHE_miss;
+    geo_entry_t* entry;
+    
+    pthread_mutex_lock(&geo.mutex);
+    entry = sub_find(key, sub_hash(key));
+    if (entry != NULL) {
+        if (entry->expires <= time(NULL)) {
+            sub_remove(entry);
+        }
+        else {
+            sub_lru_unlink(entry);
+            sub_lru_push(entry);
+            if (entry->found) {
+                *lat    = entry->lat;
+                *lon    = entry->lon;
+                rc      = GEOCACHE_found;
+            }
+            else {
+                rc      = GEOCACHE_notfound;
+            }
+        }
+    }
+    pthread_mutex_unlock(&geo.mutex);
+    
+    stats_add((rc == GEOCACHE_miss) ? STAT_geo_misses : STAT_geo_hits, 1);
+    return rc;
+}
+
+
+void geocache_put(const char* key, bool found, double lat, double lon) {
+    time_t ttl = found ? BIRDMON_PARAM_GEOCACHE_TTL : BIRDMON_PARAM_GEOCACHE_NEGTTL;
+    
+    if ((key == NULL) || (key[0] == 0) || (strlen(key) >= GEOCACHE_KEYMAX)) {
+        return;
+    }
+    pthread_mutex_lock(&geo.mutex);
+    sub_insert(key, found, lat, lon, time(NULL) + ttl);
+    geo.dirty = true;
+    pthread_mutex_unlock(&geo.mutex);
+}
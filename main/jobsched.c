@@ -0,0 +1,717 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "jobsched.h"
+#include "lockprof.h"
+#include "trace.h"
+
+// HB Library Headers
+#include <ccronexpr.h>
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/// The wheel has 4 levels of 64 slots.  A job goes in the lowest level whose
+/// span covers its deadline, and moves down a level each time the level
+/// below wraps around (cascade).  With the default 100 ms tick, the wheel
+/// spans about 19 days: later deadlines wait in the top level and are
+/// placed again when they cascade.
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_SPAN      ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICK      BIRDMON_PARAM_SCHED_TICK
+
+#define JOB_NAME        16
+#define JOB_CRONSTR     64
+
+typedef enum {
+    JOB_cron = 0,
+    JOB_interval,
+    JOB_once            // jobsched_set_at()
+} JOB_Type;
+
+typedef struct job {
+    struct job*     next;
+    struct job**    pprev;          // NULL when not in the wheel
+    char            name[JOB_NAME];
+    JOB_Type        type;
+    cron_expr       cronexp;
+    bool            cronvalid;
+    char            cronstr[JOB_CRONSTR];
+    int64_t         interval_ms;
+    time_t          at;
+    time_t          retry;          // jobsched_retry(), or 0
+    int             jitter_ms;
+    jobsched_fn     fn;
+    void*           arg;
+    
+    int64_t         base_ms;        // deadline before jitter
+    uint64_t        tick;           // deadline in the wheel
+    time_t          next_wall;
+    bool            fire;
+    bool            pending;        // jobsched_run_now()
+    
+    uint64_t        runs;
+    time_t          last_wall;
+    int64_t         last_ms;        // duration of the last run
+} job_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    bool            active;
+    
+    int64_t         epoch_ms;       // monotonic time of tick 0
+    int64_t         wall_offset;    // realtime - monotonic, in ms
+    unsigned int    seed;
+    uint64_t        now;            // next tick to process
+    int             count[WHEEL_LEVELS];
+    job_t*          slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    
+    int             numjobs;
+    job_t           job[BIRDMON_PARAM_SCHED_JOBS];
+} sched = { PTHREAD_MUTEX_INITIALIZER };
+
+
+
+
+static int64_t sub_clock_ms(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+static job_t* sub_find(const char* name) {
+    for (int i=0; i<sched.numjobs; i++) {
+        if (strcmp(sched.job[i].name, name) == 0) {
+            return &sched.job[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/** Timer wheel <BR>
+  * ========================================================================<BR>
+  * This is the classic hashed and hierarchical wheel: insertion and removal
+  * are O(1), and each tick touches one slot.  The scheduler thread sleeps
+  * through the ticks with nothing due, and catches up on waking.
+  */
+
+static void sub_wheel_unlink(job_t* job) {
+    if (job->pprev != NULL) {
+        *job->pprev = job->next;
+        if (job->next != NULL) {
+            job->next->pprev = job->pprev;
+        }
+        job->pprev  = NULL;
+        job->next   = NULL;
+    }
+}
+
+
+static void sub_wheel_place(job_t* job) {
+    uint64_t tick = (job->tick > sched.now) ? job->tick : sched.now;
+    uint64_t delta;
+    job_t** head;
+    int level;
+    
+    if ((tick - sched.now) >= WHEEL_SPAN) {
+        tick = sched.now + WHEEL_SPAN - 1;
+    }
+    delta = tick - sched.now;
+    for (level=0; (level < WHEEL_LEVELS-1) && (delta >= ((uint64_t)1 << (WHEEL_BITS*(level+1)))); level++);
+    
+    head        = &sched.slot[level][(tick >> (WHEEL_BITS*level)) & WHEEL_MASK];
+    job->next   = *head;
+    job->pprev  = head;
+    if (*head != NULL) {
+        (*head)->pprev = &job->next;
+    }
+    *head = job;
+    sched.count[level]++;
+}
+
+
+static job_t* sub_wheel_take(int level, int index) {
+    job_t* list = sched.slot[level][index];
+    
+    sched.slot[level][index] = NULL;
+    for (job_t* job = list; job != NULL; job = job->next) {
+        job->pprev = NULL;
+        sched.count[level]--;
+    }
+    return list;
+}
+
+
+static void sub_wheel_tick(void) {
+/// Process tick sched.now.  When level 0 wraps, the current slot of level 1
+/// is spread over level 0, and so on up while the levels wrap together.
+    job_t* job;
+    
+    if ((sched.now & WHEEL_MASK) == 0) {
+        for (int level=1; level<WHEEL_LEVELS; level++) {
+            int index = (int)((sched.now >> (WHEEL_BITS*level)) & WHEEL_MASK);
+            job = sub_wheel_take(level, index);
+            while (job != NULL) {
+                job_t* next = job->next;
+                sub_wheel_place(job);
+                job = next;
+            }
+            if (index != 0) {
+                break;
+            }
+        }
+    }
+    
+    job = sub_wheel_take(0, (int)(sched.now & WHEEL_MASK));
+    while (job != NULL) {
+        job_t* next = job->next;
+        job->next   = NULL;
+        job->fire   = true;
+        job = next;
+    }
+    sched.now++;
+}
+
+
+static void sub_wheel_advance(uint64_t target) {
+/// Process the ticks up to and including target.  Runs of ticks with level
+/// 0 empty are skipped, up to the next cascade.
+    while (sched.now <= target) {
+        if ((sched.count[0] == 0) && ((sched.now & WHEEL_MASK) != 0)) {
+            uint64_t wrap = (sched.now | WHEEL_MASK) + 1;
+            sched.now = (wrap <= target) ? wrap : (target + 1);
+            continue;
+        }
+        sub_wheel_tick();
+    }
+}
+
+
+
+
+static void sub_arm(job_t* job, int64_t mono_ms) {
+/// Set the next deadline of a job and put it in the wheel.  Cron deadlines
+/// are in wall clock time, so they are converted with the current offset.
+    int64_t wall_ms = mono_ms + sched.wall_offset;
+    int64_t due_ms;
+    
+    sub_wheel_unlink(job);
+    job->next_wall = 0;
+    
+    if (job->type == JOB_cron) {
+        time_t next = 0;
+        if (job->cronvalid) {
+            next = cron_next(&job->cronexp, (time_t)(wall_ms / 1000));
+        }
+        if ((job->retry > 0) && ((next <= 0) || (job->retry < next))) {
+            next = job->retry;
+        }
+        if (next <= 0) {
+            return;
+        }
+        job->base_ms = ((int64_t)next * 1000) - sched.wall_offset;
+    }
+    else if (job->type == JOB_once) {
+        if (job->at == 0) {
+            return;
+        }
+        job->base_ms = ((int64_t)job->at * 1000) - sched.wall_offset;
+    }
+    else {
+        job->base_ms += job->interval_ms;
+        if (job->base_ms <= mono_ms) {
+            job->base_ms = mono_ms + job->interval_ms;
+        }
+    }
+    
+    // A one-time deadline is one to be met, so its jitter is taken early
+    due_ms = job->base_ms;
+    if (job->jitter_ms > 0) {
+        int jitter = rand_r(&sched.seed) % (job->jitter_ms + 1);
+        due_ms += (job->type == JOB_once) ? -jitter : jitter;
+    }
+    job->tick       = (uint64_t)((due_ms - sched.epoch_ms + WHEEL_TICK - 1) / WHEEL_TICK);
+    job->next_wall  = (time_t)((due_ms + sched.wall_offset) / 1000);
+    sub_wheel_place(job);
+}
+
+
+static void sub_check_wallclock(int64_t mono_ms) {
+/// If the wall clock has been stepped, cron deadlines are computed again
+    int64_t offset = sub_clock_ms(CLOCK_REALTIME) - mono_ms;
+    int64_t drift  = offset - sched.wall_offset;
+    
+    if ((drift > 1000) || (drift < -1000)) {
+        sched.wall_offset = offset;
+        for (int i=0; i<sched.numjobs; i++) {
+            if ((sched.job[i].type != JOB_interval) && (sched.job[i].pprev != NULL)) {
+                sub_arm(&sched.job[i], mono_ms);
+            }
+        }
+    }
+}
+
+
+static void sub_unlock(void* arg) {
+    pthread_mutex_unlock(&sched.mutex);
+}
+
+
+static void* sub_scheduler(void* args) {
+    trace_thread("scheduler");
+    
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    pthread_cleanup_push(&sub_unlock, NULL);
+    
+    while (1) {
+        int64_t mono_ms = sub_clock_ms(CLOCK_MONOTONIC);
+        uint64_t earliest;
+        job_t* job = NULL;
+        
+        sub_check_wallclock(mono_ms);
+        sub_wheel_advance((uint64_t)((mono_ms - sched.epoch_ms) / WHEEL_TICK));
+        
+        for (int i=0; i<sched.numjobs; i++) {
+            if (sched.job[i].fire || sched.job[i].pending) {
+                job = &sched.job[i];
+                break;
+            }
+        }
+        
+        /// Run a due job.  The next deadline is set first, so the job can
+        /// see it with jobsched_next().
+        if (job != NULL) {
+            int64_t t_run;
+            if (job->fire && (job->type == JOB_once)) {
+                job->at = 0;
+            }
+            else if (job->fire) {
+                job->retry = 0;
+                sub_arm(job, mono_ms);
+            }
+            job->fire       = false;
+            job->pending    = false;
+            job->last_wall  = time(NULL);
+            LP_UNLOCK(&sched.mutex, LOCK_cron);
+            
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            LP_TAG(job->name);
+            t_run = sub_clock_ms(CLOCK_MONOTONIC);
+            job->fn(job->arg);
+            t_run = sub_clock_ms(CLOCK_MONOTONIC) - t_run;
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            
+            LP_LOCK(&sched.mutex, LOCK_cron);
+            job->runs++;
+            job->last_ms = t_run;
+            continue;
+        }
+        
+        /// Sleep until the nearest deadline.  Jobs are few, so it is found
+        /// by looking at each one.
+        earliest = UINT64_MAX;
+        for (int i=0; i<sched.numjobs; i++) {
+            if ((sched.job[i].pprev != NULL) && (sched.job[i].tick < earliest)) {
+                earliest = sched.job[i].tick;
+            }
+        }
+        if (earliest == UINT64_MAX) {
+            LP_COND_WAIT(&sched.cond, &sched.mutex, LOCK_cron);
+        }
+        else {
+            int64_t wake_ms = sched.epoch_ms + (int64_t)(earliest * WHEEL_TICK);
+            struct timespec ts;
+#           if defined(__linux__)
+            ts.tv_sec   = wake_ms / 1000;
+            ts.tv_nsec  = (wake_ms % 1000) * 1000000;
+#           else
+            // No monotonic condition variables: wait on the wall clock
+            wake_ms    += sub_clock_ms(CLOCK_REALTIME) - mono_ms;
+            ts.tv_sec   = wake_ms / 1000;
+            ts.tv_nsec  = (wake_ms % 1000) * 1000000;
+#           endif
+            LP_COND_TIMEDWAIT(&sched.cond, &sched.mutex, LOCK_cron, &ts);
+        }
+    }
+    
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+
+
+
+static void sub_init_once(void) {
+/// The clock base is needed by the first job that is added
+    static bool ready = false;
+    int64_t mono_ms;
+    
+    if (ready) {
+        return;
+    }
+    mono_ms             = sub_clock_ms(CLOCK_MONOTONIC);
+    sched.epoch_ms      = mono_ms;
+    sched.wall_offset   = sub_clock_ms(CLOCK_REALTIME) - mono_ms;
+    sched.seed          = (unsigned int)(sched.wall_offset ^ getpid());
+    ready = true;
+}
+
+
+int jobsched_init(void) {
+    pthread_condattr_t attr;
+    int rc = 0;
+    
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    if (sched.active) {
+        goto jobsched_init_EXIT;
+    }
+    sub_init_once();
+    
+    pthread_condattr_init(&attr);
+#   if defined(__linux__)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#   endif
+    if (pthread_cond_init(&sched.cond, &attr) != 0) {
+        rc = -1;
+    }
+    else if (pthread_create(&sched.thread, NULL, &sub_scheduler, NULL) != 0) {
+        pthread_cond_destroy(&sched.cond);
+        rc = -2;
+    }
+    else {
+        sched.active = true;
+    }
+    pthread_condattr_destroy(&attr);
+    
+    jobsched_init_EXIT:
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+void jobsched_deinit(void) {
+    if (sched.active) {
+        pthread_cancel(sched.thread);
+        pthread_join(sched.thread, NULL);
+        pthread_cond_destroy(&sched.cond);
+        sched.active = false;
+    }
+}
+
+
+
+
+static int sub_add(const char* name, JOB_Type type, int jitter_ms, jobsched_fn fn, void* arg, job_t** job) {
+    if ((name == NULL) || (fn == NULL) || (strlen(name) >= JOB_NAME) || (jitter_ms < 0)) {
+        return -1;
+    }
+    if ((sub_find(name) != NULL) || (sched.numjobs >= BIRDMON_PARAM_SCHED_JOBS)) {
+        return -3;
+    }
+    sub_init_once();
+    
+    *job = &sched.job[sched.numjobs++];
+    memset(*job, 0, sizeof(job_t));
+    strcpy((*job)->name, name);
+    (*job)->type        = type;
+    (*job)->jitter_ms   = jitter_ms;
+    (*job)->fn          = fn;
+    (*job)->arg         = arg;
+    return 0;
+}
+
+
+static void sub_signal(void) {
+    if (sched.active) {
+        pthread_cond_signal(&sched.cond);
+    }
+}
+
+
+static int sub_parse(job_t* job, const char* cronstr, const char** err) {
+    cron_expr cronexp;
+    const char* cron_err = NULL;
+    
+    if (strlen(cronstr) >= JOB_CRONSTR) {
+        cron_err = "cron expression is too long";
+    }
+    else {
+        memset(&cronexp, 0, sizeof(cron_expr));
+        cron_parse_expr(cronstr, &cronexp, &cron_err);
+    }
+    if (err != NULL) {
+        *err = cron_err;
+    }
+    if (cron_err != NULL) {
+        return -2;
+    }
+    job->cronexp    = cronexp;
+    job->cronvalid  = true;
+    strcpy(job->cronstr, cronstr);
+    return 0;
+}
+
+
+int jobsched_add_cron(const char* name, const char* cronstr, int jitter_ms, 
+                      jobsched_fn fn, void* arg, const char** err) {
+    job_t* job;
+    int rc;
+    
+    if (cronstr == NULL) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    rc = sub_add(name, JOB_cron, jitter_ms, fn, arg, &job);
+    if (rc == 0) {
+        rc = sub_parse(job, cronstr, err);
+        sub_arm(job, sub_clock_ms(CLOCK_MONOTONIC));
+        sub_signal();
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_add_interval(const char* name, int interval_ms, int jitter_ms, 
+                          jobsched_fn fn, void* arg) {
+    job_t* job;
+    int rc;
+    
+    if (interval_ms <= 0) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    rc = sub_add(name, JOB_interval, jitter_ms, fn, arg, &job);
+    if (rc == 0) {
+        int64_t mono_ms     = sub_clock_ms(CLOCK_MONOTONIC);
+        job->interval_ms    = interval_ms;
+        job->base_ms        = mono_ms;
+        sub_arm(job, mono_ms);
+        sub_signal();
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_set_cron(const char* name, const char* cronstr, const char** err) {
+    job_t* job;
+    int rc = -3;
+    
+    if ((name == NULL) || (cronstr == NULL)) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if ((job != NULL) && (job->type != JOB_interval)) {
+        rc = sub_parse(job, cronstr, err);
+        if (rc == 0) {
+            job->type   = JOB_cron;
+            job->retry  = 0;
+            sub_arm(job, sub_clock_ms(CLOCK_MONOTONIC));
+            sub_signal();
+        }
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_set_at(const char* name, time_t when) {
+    job_t* job;
+    int rc = -3;
+    
+    if ((name == NULL) || (when <= 0)) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if ((job != NULL) && (job->type != JOB_interval)) {
+        job->type   = JOB_once;
+        job->at     = when;
+        sub_arm(job, sub_clock_ms(CLOCK_MONOTONIC));
+        sub_signal();
+        rc = 0;
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_retry(const char* name, time_t when) {
+    job_t* job;
+    int rc = -3;
+    
+    if ((name == NULL) || (when <= 0)) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if ((job != NULL) && (job->type != JOB_interval)) {
+        if (job->type == JOB_once) {
+            job->at = ((job->at == 0) || (when < job->at)) ? when : job->at;
+        }
+        else {
+            job->retry = when;
+        }
+        sub_arm(job, sub_clock_ms(CLOCK_MONOTONIC));
+        sub_signal();
+        rc = 0;
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_set_jitter(const char* name, int jitter_ms) {
+    job_t* job;
+    int rc = -3;
+    
+    if ((name == NULL) || (jitter_ms < 0)) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if (job != NULL) {
+        job->jitter_ms = jitter_ms;
+        rc = 0;
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+int jobsched_run_now(const char* name) {
+    job_t* job;
+    int rc = -3;
+    
+    if (name == NULL) {
+        return -1;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if (job != NULL) {
+        job->pending = true;
+        sub_signal();
+        rc = 0;
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return rc;
+}
+
+
+time_t jobsched_next(const char* name) {
+    job_t* job;
+    time_t next = 0;
+    
+    if (name == NULL) {
+        return 0;
+    }
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    job = sub_find(name);
+    if ((job != NULL) && (job->pprev != NULL)) {
+        next = job->next_wall;
+    }
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    return next;
+}
+
+
+int jobsched_print(char* dst, size_t dstmax, FORMAT_Type fmt) {
+    bool json   = ((fmt == FORMAT_Json) || (fmt == FORMAT_JsonHex));
+    char* dcurs = dst;
+    char* dend  = dst + dstmax;
+    time_t now  = time(NULL);
+    int rc;
+    
+    LP_LOCK(&sched.mutex, LOCK_cron);
+    
+    rc = json ? snprintf(dcurs, dend-dcurs, "{\"schedule\":[")
+              : snprintf(dcurs, dend-dcurs, "%-15s %-24s %8s %11s %8s %8s\n", 
+                            "job", "schedule", "jitter", "next", "runs", "last_ms");
+    for (int i=0; (rc >= 0) && (rc < (dend-dcurs)) && (i<sched.numjobs); i++) {
+        job_t* job = &sched.job[i];
+        char when[JOB_CRONSTR + 16];
+        time_t next = (job->pprev != NULL) ? job->next_wall : 0;
+        
+        dcurs += rc;
+        if (job->type == JOB_cron) {
+            snprintf(when, sizeof(when), json ? "\"cron\":\"%s\"" : "%s", job->cronvalid ? job->cronstr : "");
+        }
+        else if (job->type == JOB_once) {
+            snprintf(when, sizeof(when), json ? "\"once\":true" : "once");
+        }
+        else if (json) {
+            snprintf(when, sizeof(when), "\"interval\":%lli", (long long)job->interval_ms);
+        }
+        else if ((job->interval_ms % 1000) != 0) {
+            snprintf(when, sizeof(when), "every %llims", (long long)job->interval_ms);
+        }
+        else {
+            snprintf(when, sizeof(when), "every %llis", (long long)(job->interval_ms / 1000));
+        }
+        if (json) {
+            rc = snprintf(dcurs, dend-dcurs, 
+                        "%s{\"name\":\"%s\", %s, \"jitter\":%i, \"next\":%lu, \"runs\":%llu, \"last\":%lu, \"last_ms\":%lli}",
+                        (i > 0) ? ", " : "", job->name, when, job->jitter_ms, (unsigned long)next,
+                        (unsigned long long)job->runs, (unsigned long)job->last_wall, (long long)job->last_ms);
+        }
+        else {
+            char nextstr[16];
+            if (next == 0) {
+                strcpy(nextstr, "-");
+            }
+            else {
+                snprintf(nextstr, sizeof(nextstr), "in %llis", (long long)((next > now) ? (next - now) : 0));
+            }
+            rc = snprintf(dcurs, dend-dcurs, "%-15s %-24s %6ims %11s %8llu %8lli\n", 
+                        job->name, when, job->jitter_ms, nextstr, 
+                        (unsigned long long)job->runs, (long long)job->last_ms);
+        }
+    }
+    if ((rc >= 0) && (rc < (dend-dcurs))) {
+        dcurs += rc;
+        rc = json ? snprintf(dcurs, dend-dcurs, "]}\n") : 0;
+    }
+    
+    LP_UNLOCK(&sched.mutex, LOCK_cron);
+    
+    if ((rc < 0) || (rc >= (dend-dcurs))) {
+        return -1;
+    }
+    return (int)((dcurs + rc) - dst);
+}
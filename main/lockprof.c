@@ -0,0 +1,312 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "lockprof.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+#if BIRDMON_FEATURE(LOCKPROF)
+
+#define LP_TAGS_MAX     32
+#define LP_TAGNAME      16
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    contended;
+    uint64_t    wait_sum;
+    uint64_t    wait_max;
+    uint64_t    hold_sum;
+    uint64_t    hold_max;
+} lp_stat_t;
+
+static const char* lock_name[LOCK_MAX] = { "iso_mutex", "data_mutex", "schedmutex", "readymutex" };
+
+/// Slot 0 is for threads that never set a tag
+static lp_stat_t        lp_table[LOCK_MAX][LP_TAGS_MAX];
+static char             lp_tagname[LP_TAGS_MAX][LP_TAGNAME] = { "(none)" };
+static int              lp_numtags = 1;
+static pthread_mutex_t  lp_tagmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// The holder of a lock writes its acquire time; only the holder reads it.
+static uint64_t         lp_held_since[LOCK_MAX];
+
+static __thread const char* tls_tag     = NULL;
+static __thread int         tls_slot    = 0;
+static __thread unsigned    tls_held    = 0;
+
+
+static uint64_t sub_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+static void sub_max(uint64_t* dst, uint64_t val) {
+    uint64_t cur = __atomic_load_n(dst, __ATOMIC_RELAXED);
+    while ((val > cur) && !__atomic_compare_exchange_n(dst, &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+static int sub_tagslot(const char* name) {
+    int num;
+    
+    if (name == NULL) {
+        return 0;
+    }
+    
+    num = __atomic_load_n(&lp_numtags, __ATOMIC_ACQUIRE);
+    for (int i=1; i<num; i++) {
+        if (strncmp(lp_tagname[i], name, LP_TAGNAME-1) == 0) {
+            return i;
+        }
+    }
+    
+    pthread_mutex_lock(&lp_tagmutex);
+    num = lp_numtags;
+    for (int i=1; i<num; i++) {
+        if (strncmp(lp_tagname[i], name, LP_TAGNAME-1) == 0) {
+            pthread_mutex_unlock(&lp_tagmutex);
+            return i;
+        }
+    }
+    if (num < LP_TAGS_MAX) {
+        snprintf(lp_tagname[num], LP_TAGNAME, "%s", name);
+        __atomic_store_n(&lp_numtags, num+1, __ATOMIC_RELEASE);
+    }
+    else {
+        num = 0;
+    }
+    pthread_mutex_unlock(&lp_tagmutex);
+    return num;
+}
+
+
+/* Charge the hold time since the last mark to the current tag */
+static void sub_charge_hold(LOCK_Type id) {
+    lp_stat_t* stat = &lp_table[id][tls_slot];
+    uint64_t now    = sub_now();
+    uint64_t hold   = now - lp_held_since[id];
+    
+    __atomic_add_fetch(&stat->hold_sum, hold, __ATOMIC_RELAXED);
+    sub_max(&stat->hold_max, hold);
+    lp_held_since[id] = now;
+}
+
+
+/* The lock is acquired: count it, with its wait, against the current tag */
+static void sub_acquired(LOCK_Type id, uint64_t wait, bool contended) {
+    lp_stat_t* stat = &lp_table[id][tls_slot];
+    
+    __atomic_add_fetch(&stat->count, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&stat->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stat->wait_sum, wait, __ATOMIC_RELAXED);
+        sub_max(&stat->wait_max, wait);
+    }
+    lp_held_since[id]   = sub_now();
+    tls_held           |= (1 << id);
+}
+
+
+int lockprof_lock(pthread_mutex_t* mutex, LOCK_Type id) {
+    uint64_t t_start;
+    int rc;
+    
+    if ((unsigned)id >= LOCK_MAX) {
+        return pthread_mutex_lock(mutex);
+    }
+    
+    // An uncontended lock costs no wait: try first to count contention
+    t_start = sub_now();
+    rc = pthread_mutex_trylock(mutex);
+    if (rc == 0) {
+        sub_acquired(id, 0, false);
+    }
+    else {
+        rc = pthread_mutex_lock(mutex);
+        sub_acquired(id, sub_now() - t_start, true);
+    }
+    return rc;
+}
+
+
+int lockprof_unlock(pthread_mutex_t* mutex, LOCK_Type id) {
+    if ((unsigned)id < LOCK_MAX) {
+        sub_charge_hold(id);
+        tls_held &= ~(1 << id);
+    }
+    return pthread_mutex_unlock(mutex);
+}
+
+
+int lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, LOCK_Type id, const struct timespec* abstime) {
+    int rc;
+    
+    if ((unsigned)id >= LOCK_MAX) {
+        return (abstime == NULL) ? pthread_cond_wait(cond, mutex) : pthread_cond_timedwait(cond, mutex, abstime);
+    }
+    
+    // The mutex is released for the condition wait, so that time is neither
+    // wait nor hold.  Reacquiring it is not counted as an acquisition.
+    sub_charge_hold(id);
+    rc = (abstime == NULL) ? pthread_cond_wait(cond, mutex) : pthread_cond_timedwait(cond, mutex, abstime);
+    lp_held_since[id] = sub_now();
+    return rc;
+}
+
+
+void lockprof_tag(const char* name) {
+    if (name == tls_tag) {
+        return;
+    }
+    
+    // Locks held across a tag change split their hold time between the tags
+    for (int i=0; (tls_held != 0) && (i<LOCK_MAX); i++) {
+        if (tls_held & (1 << i)) {
+            sub_charge_hold((LOCK_Type)i);
+        }
+    }
+    tls_tag     = name;
+    tls_slot    = sub_tagslot(name);
+}
+
+
+void lockprof_reset(void) {
+    for (int i=0; i<LOCK_MAX; i++) {
+        for (int j=0; j<LP_TAGS_MAX; j++) {
+            lp_stat_t* stat = &lp_table[i][j];
+            __atomic_store_n(&stat->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stat->contended, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stat->wait_sum, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stat->wait_max, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stat->hold_sum, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stat->hold_max, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+int lockprof_print(char* dst, size_t dstmax, FORMAT_Type fmt) {
+    bool json   = ((fmt == FORMAT_Json) || (fmt == FORMAT_JsonHex));
+    char* dcurs = dst;
+    char* dend  = dst + dstmax;
+    int numtags = __atomic_load_n(&lp_numtags, __ATOMIC_ACQUIRE);
+    const char* lsep = "";
+
+#   define PRINT(...)   do { \
+        int n_ = snprintf(dcurs, (size_t)(dend - dcurs), __VA_ARGS__); \
+        if ((n_ < 0) || (n_ >= (dend - dcurs))) return -1; \
+        dcurs += n_; \
+    } while (0)
+    
+#   define PRINT_STAT(NAME, S) do { \
+        if (json) PRINT("%s\"%s\":{\"count\":%llu, \"contended\":%llu, \"wait_us\":%llu, \"wait_max_us\":%llu, " \
+                        "\"hold_us\":%llu, \"hold_max_us\":%llu}", tsep, NAME, \
+                        (unsigned long long)(S).count, (unsigned long long)(S).contended, \
+                        (unsigned long long)((S).wait_sum/1000), (unsigned long long)((S).wait_max/1000), \
+                        (unsigned long long)((S).hold_sum/1000), (unsigned long long)((S).hold_max/1000)); \
+        else PRINT("  %-16s n=%-8llu contended=%-8llu wait=%-10llu wait_max=%-8llu hold=%-10llu hold_max=%llu\n", NAME, \
+                        (unsigned long long)(S).count, (unsigned long long)(S).contended, \
+                        (unsigned long long)((S).wait_sum/1000), (unsigned long long)((S).wait_max/1000), \
+                        (unsigned long long)((S).hold_sum/1000), (unsigned long long)((S).hold_max/1000)); \
+        tsep = ", "; \
+    } while (0)
+
+    PRINT(json ? "{\"lockprof\":{" : "lock profile (times in us)\n");
+    
+    for (int i=0; i<LOCK_MAX; i++) {
+        lp_stat_t total;
+        const char* tsep = "";
+        
+        memset(&total, 0, sizeof(total));
+        for (int j=0; j<numtags; j++) {
+            lp_stat_t* stat = &lp_table[i][j];
+            uint64_t v;
+            total.count     += __atomic_load_n(&stat->count, __ATOMIC_RELAXED);
+            total.contended += __atomic_load_n(&stat->contended, __ATOMIC_RELAXED);
+            total.wait_sum  += __atomic_load_n(&stat->wait_sum, __ATOMIC_RELAXED);
+            total.hold_sum  += __atomic_load_n(&stat->hold_sum, __ATOMIC_RELAXED);
+            v = __atomic_load_n(&stat->wait_max, __ATOMIC_RELAXED);
+            total.wait_max  = (v > total.wait_max) ? v : total.wait_max;
+            v = __atomic_load_n(&stat->hold_max, __ATOMIC_RELAXED);
+            total.hold_max  = (v > total.hold_max) ? v : total.hold_max;
+        }
+        
+        PRINT(json ? "%s\"%s\":{" : "%s%s\n", lsep, lock_name[i]);
+        lsep = json ? ", " : "";
+        PRINT_STAT("total", total);
+        for (int j=0; j<numtags; j++) {
+            lp_stat_t snap;
+            snap.count      = __atomic_load_n(&lp_table[i][j].count, __ATOMIC_RELAXED);
+            if (snap.count == 0) {
+                continue;
+            }
+            snap.contended  = __atomic_load_n(&lp_table[i][j].contended, __ATOMIC_RELAXED);
+            snap.wait_sum   = __atomic_load_n(&lp_table[i][j].wait_sum, __ATOMIC_RELAXED);
+            snap.wait_max   = __atomic_load_n(&lp_table[i][j].wait_max, __ATOMIC_RELAXED);
+            snap.hold_sum   = __atomic_load_n(&lp_table[i][j].hold_sum, __ATOMIC_RELAXED);
+            snap.hold_max   = __atomic_load_n(&lp_table[i][j].hold_max, __ATOMIC_RELAXED);
+            PRINT_STAT(lp_tagname[j], snap);
+        }
+        if (json) {
+            PRINT("}");
+        }
+    }
+    PRINT(json ? "}}\n" : "");
+    
+#   undef PRINT_STAT
+#   undef PRINT
+    
+    return (int)(dcurs - dst);
+}
+
+
+#else   // BIRDMON_FEATURE(LOCKPROF)
+
+int lockprof_lock(pthread_mutex_t* mutex, LOCK_Type id) {
+    return pthread_mutex_lock(mutex);
+}
+
+int lockprof_unlock(pthread_mutex_t* mutex, LOCK_Type id) {
+    return pthread_mutex_unlock(mutex);
+}
+
+int lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, LOCK_Type id, const struct timespec* abstime) {
+    return (abstime == NULL) ? pthread_cond_wait(cond, mutex) : pthread_cond_timedwait(cond, mutex, abstime);
+}
+
+void lockprof_tag(const char* name) {
+}
+
+void lockprof_reset(void) {
+}
+
+int lockprof_print(char* dst, size_t dstmax, FORMAT_Type fmt) {
+    return -2;
+}
+
+#endif
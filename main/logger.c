@@ -0,0 +1,462 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "logger.h"
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/// Messages drained per writev().  Each message can take two iovecs (the
+/// message and its terminator), and one more is kept for the drop report.
+#define LOG_BATCH       64
+#define LOG_IOVMAX      ((LOG_BATCH * 2) + 1)
+
+/// Idle writer wakes at this interval even without a signal
+#define LOG_IDLE_NS     (100 * 1000000L)
+
+
+/// The ring is a bounded queue after D. Vyukov: each cell carries a sequence
+/// number that says whether it is free for the producer at position pos
+/// (seq == pos) or holds a message for the consumer (seq == pos + 1).  The
+/// producers claim positions with a CAS on enq_pos.  There is one consumer,
+/// so deq_pos needs no atomics.
+typedef struct {
+    size_t      seq;
+    size_t      len;
+    char        data[BIRDMON_PARAM(LOG_MSGSIZE)];
+} log_cell_t;
+
+typedef struct {
+    log_cell_t*     ring;
+    size_t          mask;
+    size_t          enq_pos;
+    size_t          deq_pos;
+    uint64_t        dropped;
+    uint64_t        reported;
+    
+    char*           path;
+    int             fd;
+    bool            is_fifo;
+    bool            is_reg;
+    size_t          filesize;
+    size_t          maxsize;
+    int             rotations;
+    
+    pthread_t       writer;
+    pthread_mutex_t wakemutex;
+    pthread_cond_t  wakecond;
+    int             waiting;
+    int             running;
+} logger_t;
+
+
+
+
+static int sub_open(logger_t* lg) {
+    struct stat st;
+    
+    if (lg->path == NULL) {
+        lg->fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+    else if (lg->is_fifo) {
+        // Opening a FIFO for write blocks until there is a reader, so it is
+        // opened non-blocking (which fails without a reader) and then set to
+        // blocking.  The writer thread is the only one that waits on it.
+        lg->fd = open(lg->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (lg->fd >= 0) {
+            fcntl(lg->fd, F_SETFL, fcntl(lg->fd, F_GETFL) & ~O_NONBLOCK);
+        }
+    }
+    else {
+        lg->fd = open(lg->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (lg->fd < 0) {
+        return -1;
+    }
+    
+    lg->filesize = 0;
+    if (fstat(lg->fd, &st) == 0) {
+        lg->is_reg   = S_ISREG(st.st_mode);
+        lg->filesize = lg->is_reg ? (size_t)st.st_size : 0;
+    }
+    return 0;
+}
+
+
+static void sub_close(logger_t* lg) {
+    if (lg->fd >= 0) {
+        close(lg->fd);
+        lg->fd = -1;
+    }
+}
+
+
+/* Rotate path -> path.1 -> ... -> path.N, dropping the oldest.  With no
+ * rotations configured, the file is simply truncated. */
+static void sub_rotate(logger_t* lg) {
+    size_t pathlen = strlen(lg->path);
+    char oldpath[pathlen + 16];
+    char newpath[pathlen + 16];
+    
+    sub_close(lg);
+    
+    if (lg->rotations <= 0) {
+        truncate(lg->path, 0);
+    }
+    else {
+        for (int i=lg->rotations-1; i>0; i--) {
+            snprintf(oldpath, sizeof(oldpath), "%s.%i", lg->path, i);
+            snprintf(newpath, sizeof(newpath), "%s.%i", lg->path, i+1);
+            rename(oldpath, newpath);
+        }
+        snprintf(newpath, sizeof(newpath), "%s.1", lg->path);
+        rename(lg->path, newpath);
+    }
+    
+    sub_open(lg);
+}
+
+
+/* Write the whole batch, resuming after short writes.  A write error closes
+ * the log, so it is reopened on the next batch (e.g. a FIFO reader came back).
+ *
+ * Return 0 on success, negative if the batch was lost. */
+static int sub_write(logger_t* lg, struct iovec* iov, int iovcnt, size_t bytes) {
+    if ((lg->fd < 0) && (sub_open(lg) != 0)) {
+        return -1;
+    }
+    if (lg->is_reg && (lg->maxsize > 0) && (lg->filesize > 0) && ((lg->filesize + bytes) > lg->maxsize)) {
+        sub_rotate(lg);
+        if (lg->fd < 0) {
+            return -1;
+        }
+    }
+    
+    while (iovcnt > 0) {
+        ssize_t rc = writev(lg->fd, iov, iovcnt);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sub_close(lg);
+            return -2;
+        }
+        lg->filesize += (size_t)rc;
+        
+        while ((iovcnt > 0) && ((size_t)rc >= iov->iov_len)) {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= (size_t)rc;
+        }
+    }
+    
+    return 0;
+}
+
+
+/* Write out up to LOG_BATCH queued messages in one writev().
+ *
+ * Return the number of messages taken from the ring. */
+static int sub_drain(logger_t* lg) {
+    static const char term_reg[1]   = { '\n' };
+    static const char term_fifo[1]  = { 0 };
+    const char* term    = lg->is_fifo ? term_fifo : term_reg;
+    struct iovec iov[LOG_IOVMAX];
+    char report[64];
+    size_t pos      = lg->deq_pos;
+    size_t bytes    = 0;
+    int iovcnt      = 0;
+    int count       = 0;
+    uint64_t dropped;
+    
+    // Drops are reported in the log itself, once there is room again
+    dropped = __atomic_load_n(&lg->dropped, __ATOMIC_RELAXED);
+    if (dropped != lg->reported) {
+        iov[0].iov_base = report;
+        iov[0].iov_len  = (size_t)snprintf(report, sizeof(report), 
+                            "logger: %llu messages dropped", 
+                            (unsigned long long)(dropped - lg->reported));
+        report[iov[0].iov_len++] = *term;
+        bytes          += iov[0].iov_len;
+        iovcnt          = 1;
+    }
+    
+    while (count < LOG_BATCH) {
+        log_cell_t* cell = &lg->ring[pos & lg->mask];
+        
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (pos + 1)) {
+            break;
+        }
+        iov[iovcnt].iov_base    = cell->data;
+        iov[iovcnt].iov_len     = cell->len;
+        bytes                  += cell->len;
+        iovcnt++;
+        if ((cell->len == 0) || (cell->data[cell->len-1] != *term)) {
+            iov[iovcnt].iov_base    = (void*)term;
+            iov[iovcnt].iov_len     = 1;
+            bytes++;
+            iovcnt++;
+        }
+        pos++;
+        count++;
+    }
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    if (sub_write(lg, iov, iovcnt, bytes) == 0) {
+        lg->reported = dropped;
+    }
+    else {
+        __atomic_add_fetch(&lg->dropped, (uint64_t)count, __ATOMIC_RELAXED);
+    }
+    
+    // Hand the cells back to the producers, one lap ahead
+    for (size_t p=lg->deq_pos; p!=pos; p++) {
+        __atomic_store_n(&lg->ring[p & lg->mask].seq, p + lg->mask + 1, __ATOMIC_RELEASE);
+    }
+    lg->deq_pos = pos;
+    
+    return count;
+}
+
+
+static bool sub_isempty(logger_t* lg) {
+    log_cell_t* cell = &lg->ring[lg->deq_pos & lg->mask];
+    return (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (lg->deq_pos + 1));
+}
+
+
+static void* logger_writer(void* args) {
+    logger_t* lg = args;
+    sigset_t sigset;
+    
+    // A FIFO with no reader raises SIGPIPE: take EPIPE instead
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    
+    while (1) {
+        if (sub_drain(lg) > 0) {
+            continue;
+        }
+        if (__atomic_load_n(&lg->running, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        
+        // Idle: sleep until a producer signals, or the idle interval passes
+        pthread_mutex_lock(&lg->wakemutex);
+        __atomic_store_n(&lg->waiting, 1, __ATOMIC_SEQ_CST);
+        if (sub_isempty(lg) && __atomic_load_n(&lg->running, __ATOMIC_ACQUIRE)) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += LOG_IDLE_NS;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_nsec -= 1000000000L;
+                until.tv_sec++;
+            }
+            pthread_cond_timedwait(&lg->wakecond, &lg->wakemutex, &until);
+        }
+        __atomic_store_n(&lg->waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&lg->wakemutex);
+    }
+    
+    return NULL;
+}
+
+
+
+
+int logger_init(logger_handle_t* handle, const char* path, size_t maxsize, int rotations) {
+    logger_t* lg;
+    struct stat st;
+    size_t slots = BIRDMON_PARAM(LOG_SLOTS);
+    int rc;
+    
+    if (handle == NULL) {
+        return -1;
+    }
+    if ((slots < 2) || ((slots & (slots - 1)) != 0)) {
+        return -1;
+    }
+    
+    lg = calloc(1, sizeof(logger_t));
+    if (lg == NULL) {
+        return -2;
+    }
+    lg->ring = malloc(slots * sizeof(log_cell_t));
+    lg->path = (path != NULL) ? strdup(path) : NULL;
+    if ((lg->ring == NULL) || ((path != NULL) && (lg->path == NULL))) {
+        rc = -2;
+        goto logger_init_ERR1;
+    }
+    for (size_t i=0; i<slots; i++) {
+        lg->ring[i].seq = i;
+    }
+    lg->mask        = slots - 1;
+    lg->fd          = -1;
+    lg->maxsize     = (path != NULL) ? maxsize : 0;
+    lg->rotations   = rotations;
+    lg->running     = 1;
+    lg->is_fifo     = (path != NULL) && (stat(path, &st) == 0) && S_ISFIFO(st.st_mode);
+    
+    // A FIFO without a reader can't be opened yet.  That is fine: it is
+    // opened on the first write that finds a reader.
+    if ((sub_open(lg) != 0) && (lg->is_fifo == false)) {
+        rc = -3;
+        goto logger_init_ERR1;
+    }
+    
+    if (pthread_mutex_init(&lg->wakemutex, NULL) != 0) {
+        rc = -4;
+        goto logger_init_ERR2;
+    }
+    if (pthread_cond_init(&lg->wakecond, NULL) != 0) {
+        rc = -5;
+        goto logger_init_ERR3;
+    }
+    if (pthread_create(&lg->writer, NULL, &logger_writer, lg) != 0) {
+        rc = -6;
+        goto logger_init_ERR4;
+    }
+    
+    *handle = lg;
+    return 0;
+    
+    logger_init_ERR4:   pthread_cond_destroy(&lg->wakecond);
+    logger_init_ERR3:   pthread_mutex_destroy(&lg->wakemutex);
+    logger_init_ERR2:   sub_close(lg);
+    logger_init_ERR1:   free(lg->path);
+                        free(lg->ring);
+                        free(lg);
+    return rc;
+}
+
+
+void logger_deinit(logger_handle_t handle) {
+    logger_t* lg = handle;
+    
+    if (lg == NULL) {
+        return;
+    }
+    
+    // The writer drains whatever is queued before it exits
+    pthread_mutex_lock(&lg->wakemutex);
+    __atomic_store_n(&lg->running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&lg->wakecond);
+    pthread_mutex_unlock(&lg->wakemutex);
+    pthread_join(lg->writer, NULL);
+    
+    pthread_cond_destroy(&lg->wakecond);
+    pthread_mutex_destroy(&lg->wakemutex);
+    sub_close(lg);
+    free(lg->path);
+    free(lg->ring);
+    free(lg);
+}
+
+
+int logger_pushv(logger_handle_t handle, const struct iovec* iov, int iovcnt) {
+    logger_t* lg = handle;
+    log_cell_t* cell;
+    size_t pos;
+    size_t len;
+    
+    if ((lg == NULL) || (iov == NULL)) {
+        return -2;
+    }
+    
+    // Claim a cell.  A cell still holding a message from the previous lap
+    // means the ring is full: drop rather than wait for the writer.
+    pos = __atomic_load_n(&lg->enq_pos, __ATOMIC_RELAXED);
+    while (1) {
+        intptr_t dif;
+        cell    = &lg->ring[pos & lg->mask];
+        dif     = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&lg->enq_pos, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            __atomic_add_fetch(&lg->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&lg->enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    len = 0;
+    for (int i=0; (i<iovcnt) && (len<sizeof(cell->data)); i++) {
+        size_t chunk = iov[i].iov_len;
+        if (chunk > (sizeof(cell->data) - len)) {
+            chunk = sizeof(cell->data) - len;
+        }
+        memcpy(&cell->data[len], iov[i].iov_base, chunk);
+        len += chunk;
+    }
+    cell->len = len;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    
+    // Only an idle writer needs a wakeup, so busy periods cost no syscalls.
+    // The fence orders the publish above against reading the flag.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lg->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&lg->wakemutex);
+        pthread_cond_signal(&lg->wakecond);
+        pthread_mutex_unlock(&lg->wakemutex);
+    }
+    
+    return (int)len;
+}
+
+
+int logger_push(logger_handle_t handle, const char* msg, size_t len) {
+    struct iovec iov = { .iov_base = (void*)msg, .iov_len = len };
+    return logger_pushv(handle, &iov, 1);
+}
+
+
+uint64_t logger_dropped(logger_handle_t handle) {
+    logger_t* lg = handle;
+    if (lg == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&lg->dropped, __ATOMIC_RELAXED);
+}
@@ -35,6 +35,11 @@
 #include "cmd_api.h"
 #include "cmdhistory.h"
 #include "debug.h"
+#include "geocache.h"
+#include "jobsched.h"
+#include "lockprof.h"
+#include "stats.h"
+#include "trace.h"
 
 // DTerm to be extricated into its own library
 #include "dterm.h"
@@ -130,7 +135,12 @@ int birdmon_main( INTF_Type intf,
                 char* ubxanow_key,
                 char* socket,
                 bool quiet,
-                const char* initfile
+                const char* initfile,
+                const char* logfile,
+                const char* metricsfile,
+                const char* xpath,
+                const char* geofile,
+                const char* tracedir
             ); 
 
 
@@ -211,13 +221,18 @@ int main(int argc, char* argv[]) {
     struct arg_str  *intf    = arg_str0("i","intf", "interactive|pipe|socket", "Interface select.  Default: interactive");
     struct arg_file *socket  = arg_file0("S","socket","path/addr",      "Socket path/address to use for birdmon daemon");
     struct arg_file *initfile= arg_file0("I","init","path",             "Path to initialization routine to run at startup");
-    struct arg_str  *cronstr = arg_str0("C","cron","cron-expr",         "Cron expression (with seconds) to use for AGNSS scheduling");
+    struct arg_file *logfile = arg_file0("L","logfile","path",          "Log file or FIFO (regular files are rotated by size)");
+    struct arg_file *metrics = arg_file0("M","metrics","path",          "File to periodically write stats to, in Prometheus format");
+    struct arg_file *xpath   = arg_file0("X","xpath","path",            "Directory of external command executables");
+    struct arg_file *geofile = arg_file0("g","geocache","path",         "File to keep geocoding results in, across restarts");
+    struct arg_file *tracedir= arg_file0("T","tracedir","path",         "Directory that socket clients can write traces to");
+    struct arg_str  *cronstr = arg_str0("C","cron","cron-expr",         "Cron expression (with seconds) for AGNSS fetches, or \"adaptive\"");
     struct arg_str  *gmaps   = arg_str0("G","gmapskey", "apikey",       "API key string to google maps");
     struct arg_str  *ubxanow = arg_str0("U","ubxkey", "apikey",         "API key string to UBlox AssistNow");
     // Terminator
     struct arg_end  *end     = arg_end(20);
     
-    void* argtable[] = { verbose, debug, quiet, help, version, fmt, intf, cronstr, socket, initfile, gmaps, ubxanow, end };
+    void* argtable[] = { verbose, debug, quiet, help, version, fmt, intf, cronstr, socket, initfile, logfile, metrics, xpath, geofile, tracedir, gmaps, ubxanow, end };
     const char* progname = BIRDMON_PARAM(NAME);
     int nerrors;
     bool bailout        = true;
@@ -225,6 +240,11 @@ int main(int argc, char* argv[]) {
     char* gmaps_val     = NULL;
     char* ubxanow_val   = NULL;
     char* initfile_val  = NULL;
+    char* logfile_val   = NULL;
+    char* metrics_val   = NULL;
+    char* xpath_val     = NULL;
+    char* geofile_val   = NULL;
+    char* tracedir_val  = NULL;
     char* cronstr_val   = NULL;
     FORMAT_Type fmt_val = FORMAT_Default;
     INTF_Type intf_val  = INTF_interactive;
@@ -301,6 +321,21 @@ int main(int argc, char* argv[]) {
     if (initfile->count != 0) {
         FILL_FILEARG(initfile, initfile_val);
     }
+    if (logfile->count != 0) {
+        FILL_FILEARG(logfile, logfile_val);
+    }
+    if (metrics->count != 0) {
+        FILL_FILEARG(metrics, metrics_val);
+    }
+    if (xpath->count != 0) {
+        FILL_FILEARG(xpath, xpath_val);
+    }
+    if (geofile->count != 0) {
+        FILL_FILEARG(geofile, geofile_val);
+    }
+    if (tracedir->count != 0) {
+        FILL_FILEARG(tracedir, tracedir_val);
+    }
     if (verbose->count != 0) {
         verbose_val = true;
     }
@@ -343,12 +378,22 @@ int main(int argc, char* argv[]) {
                                 ubxanow_val,
                                 socket_val,
                                 quiet_val,
-                                (const char*)initfile_val
+                                (const char*)initfile_val,
+                                (const char*)logfile_val,
+                                (const char*)metrics_val,
+                                (const char*)xpath_val,
+                                (const char*)geofile_val,
+                                (const char*)tracedir_val
                             );
     }
 
     free(socket_val);
     free(initfile_val);
+    free(logfile_val);
+    free(metrics_val);
+    free(xpath_val);
+    free(geofile_val);
+    free(tracedir_val);
     free(cronstr_val);
     free(gmaps_val);
     free(ubxanow_val);
@@ -368,7 +413,12 @@ int birdmon_main( INTF_Type intf,
                 char* ubxanow_key,
                 char* socket,
                 bool quiet,
-                const char* initfile) {    
+                const char* initfile,
+                const char* logfile,
+                const char* metricsfile,
+                const char* xpath,
+                const char* geofile,
+                const char* tracedir) {    
     int rc;
     
     // DTerm Datastructs
@@ -378,7 +428,6 @@ int birdmon_main( INTF_Type intf,
     birdmon_app_t appdata;
     
     // Thread Instances
-    pthread_t   thr_backend;
     void*       (*dterm_fn)(void* args);
     pthread_t   thr_dterm;
 
@@ -389,6 +438,31 @@ int birdmon_main( INTF_Type intf,
     DEBUG_PRINTF("Initializing Application Data\n");
     bzero(&appdata, sizeof(birdmon_app_t));
     
+    /// The job scheduler runs the AGNSS fetch and the other timed jobs
+    if (jobsched_init() != 0) {
+        cli.exitcode = 1;
+        goto birdmon_main_EXIT;
+    }
+    
+    /// Stats are optional: without them, recording calls do nothing.
+    if (stats_init() != 0) {
+        fprintf(stderr, "Stats could not be initialized: continuing without them.\n");
+    }
+    else if (metricsfile != NULL) {
+        if (stats_dump_start(metricsfile, BIRDMON_PARAM(STATS_INTERVAL)) != 0) {
+            fprintf(stderr, "Stats cannot be written to %s\n", metricsfile);
+        }
+    }
+    
+    if (trace_init(tracedir) != 0) {
+        fprintf(stderr, "Tracer could not be initialized: continuing without it.\n");
+    }
+    
+    /// Without a file, geocoding results are cached in memory only
+    if ((geofile != NULL) && (geocache_init(geofile) != 0)) {
+        fprintf(stderr, "Geocoding cache cannot be kept in %s\n", geofile);
+    }
+    
     if (pthread_mutex_init(&cli.kill_mutex, NULL) != 0) {
         cli.exitcode = 1;
         goto birdmon_main_EXIT;
@@ -397,7 +471,7 @@ int birdmon_main( INTF_Type intf,
         cli.exitcode = 2;
         goto birdmon_main_EXIT;
     }
-    if (backend_init((backend_handle_t*)&appdata.ctx, cronstr) != 0) {
+    if (backend_init((backend_handle_t*)&appdata.ctx) != 0) {
         cli.exitcode = 3;
         goto birdmon_main_EXIT;
     }
@@ -411,7 +485,7 @@ int birdmon_main( INTF_Type intf,
     /// Non intrinsic dterm elements (cmdtab, devtab, etc) get attached
     /// following initialization
     DEBUG_PRINTF("Initializing DTerm ...\n");
-    if (dterm_init(&dth, &appdata, NULL, intf) != 0) {
+    if (dterm_init(&dth, &appdata, logfile, intf) != 0) {
         cli.exitcode = 4;
         goto birdmon_main_EXIT;
     }
@@ -421,7 +495,7 @@ int birdmon_main( INTF_Type intf,
     ///@todo in the future, let's pull this from an initialization file or
     ///      something dynamic as such.
     DEBUG_PRINTF("Initializing commands ...\n");
-    if (dterm_init_cmdtab(&dth, NULL) < 0) {
+    if (dterm_init_cmdtab(&dth, xpath) < 0) {
         fprintf(stderr, "Err: command table cannot be initialized.\n");
         cli.exitcode = 5;
         goto birdmon_main_EXIT;
@@ -438,7 +512,8 @@ int birdmon_main( INTF_Type intf,
     else {
         otvar_add(dth.vardict, "gmaps_uri", VAR_String, "https://maps.googleapis.com/maps/api/geocode/json?key=");
         otvar_add(dth.vardict, "gmaps_key", VAR_String, "");
-        otvar_add(dth.vardict, "ubx_uri", VAR_String, "https://online-live1.services.u-blox.com/GetOnlineData.ashx");
+        otvar_add(dth.vardict, "ubx_uri", VAR_String, "https://online-live1.services.u-blox.com/GetOnlineData.ashx,"
+                                                   "https://online-live2.services.u-blox.com/GetOnlineData.ashx");
         otvar_add(dth.vardict, "ubx_key", VAR_String, "");
         otvar_add(dth.vardict, "ubx_datatype", VAR_String, "eph,alm,aux");
         otvar_add(dth.vardict, "ubx_format", VAR_String, "mga");
@@ -475,9 +550,9 @@ int birdmon_main( INTF_Type intf,
     /// be via Ctl+C or Ctl+\, or potentially also through a dterm command.  
     /// Each thread must be be implemented to raise SIGQUIT or SIGINT on exit
     /// i.e. raise(SIGINT).
-    DEBUG_PRINTF("Creating Backend theads\n");
+    DEBUG_PRINTF("Scheduling Backend jobs\n");
     if (appdata.ctx != NULL) {
-        pthread_create(&thr_backend, NULL, &agnss_reader, (void*)&appdata);
+        backend_start(appdata.ctx, &appdata, cronstr);
     }
     
     /// Before doing any interactions, run a command file if it exists.
@@ -529,13 +604,13 @@ int birdmon_main( INTF_Type intf,
     DEBUG_PRINTF("Cancelling Theads\n");
     pthread_cancel(thr_dterm);
 
-    if (appdata.ctx != NULL) {
-        pthread_cancel(thr_backend);
-    }
-
     /// Close the drivers/files and deinitialize all submodules
     birdmon_main_EXIT:
     
+    // Jobs use everything below, so they are stopped first
+    jobsched_deinit();
+    geocache_deinit();
+    
     // Return cJSON and argtable to generic context allocators
     cJSON_InitHooks(NULL);
     arg_set_allocators(NULL, NULL);
@@ -560,6 +635,19 @@ int birdmon_main( INTF_Type intf,
         
         case 1: break;
     }
+    
+#   if BIRDMON_FEATURE(LOCKPROF)
+    {   // Shutdown summary of lock contention
+        static char lpbuf[16384];
+        int lplen = lockprof_print(lpbuf, sizeof(lpbuf), FORMAT_Default);
+        if (lplen > 0) {
+            fwrite(lpbuf, 1, (size_t)lplen, stderr);
+        }
+    }
+#   endif
+    
+    trace_deinit();
+    stats_deinit();
 
     DEBUG_PRINTF("Exiting cleanly and flushing output buffers\n");
     fflush(stdout);
@@ -0,0 +1,589 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "jobsched.h"
+#include "stats.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/// Histograms are log-linear (HDR style): values below 8 us are exact, and
+/// each power of two above that is split into 8 linear sub-buckets, so a
+/// reported value is within 12.5% of the true one.  The top bucket covers
+/// values up to 2^36 us (~19 hours).
+#define HIST_SUBBITS    3
+#define HIST_SUB        (1 << HIST_SUBBITS)
+#define HIST_MAXEXP     35
+#define HIST_BUCKETS    ((HIST_MAXEXP - HIST_SUBBITS + 2) * HIST_SUB)
+
+#define STATS_CMD_MAX   32
+#define STATS_CMD_NAME  16
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    max;
+    uint64_t    bucket[HIST_BUCKETS];
+} stats_hist_t;
+
+typedef struct stats_block {
+    struct stats_block* next;
+    bool                live;
+    uint64_t            ctr[STAT_MAX];
+    stats_hist_t        hist[STATH_MAX];
+    uint64_t            cmd_errors[STATS_CMD_MAX];
+    stats_hist_t        cmd[STATS_CMD_MAX];
+} stats_block_t;
+
+typedef struct {
+    pthread_mutex_t     mutex;
+    pthread_key_t       key;
+    stats_block_t*      blocks;
+    stats_block_t       retired;
+    
+    // Command names are appended once, then only read.  numcmds is
+    // published with release order after the name is written.
+    char                cmdname[STATS_CMD_MAX][STATS_CMD_NAME];
+    int                 numcmds;
+    
+    char*               dump_path;
+    char*               dump_tmppath;
+    char*               dump_buf;
+    bool                dump_active;
+} stats_t;
+
+static stats_t stats;
+static bool stats_active = false;
+static __thread stats_block_t* tls_block = NULL;
+
+static const char* ctr_name[STAT_MAX] = {
+    "cmd_calls", "cmd_errors", "dl_calls", "dl_errors", "dl_bytes",
+    "anow_fetches", "anow_errors", "anow_snapshots", "anow_pkts", "anow_bytes",
+    "anow_unchanged", "anow_hedges", "anow_stale", "geo_hits", "geo_misses"
+};
+static const bool ctr_isgauge[STAT_MAX] = {
+    false, false, false, false, false,
+    false, false, false, true, true,
+    false, false, true, false, false
+};
+static const char* hist_name[STATH_MAX] = {
+    "cmd", "download", "anow_fetch", "anow_validate", "anow_ingest", "anow_publish"
+};
+
+
+/// Thread-local writes.  The block is only written by its own thread, so a
+/// relaxed load and store is enough: concurrent readers see whole values.
+#define TLS_ADD(LVAL, VAL)  __atomic_store_n(&(LVAL), __atomic_load_n(&(LVAL), __ATOMIC_RELAXED) + (VAL), __ATOMIC_RELAXED)
+#define TLS_SET(LVAL, VAL)  __atomic_store_n(&(LVAL), (VAL), __ATOMIC_RELAXED)
+#define TLS_GET(LVAL)       __atomic_load_n(&(LVAL), __ATOMIC_RELAXED)
+
+
+
+
+static inline int sub_bucket(uint64_t v) {
+    int e;
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAXEXP) {
+        return HIST_BUCKETS - 1;
+    }
+    return ((e - HIST_SUBBITS + 1) * HIST_SUB) + (int)((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/// Highest value that lands in bucket i
+static uint64_t sub_bucket_top(int i) {
+    int e;
+    if (i < HIST_SUB) {
+        return (uint64_t)i;
+    }
+    e = (i / HIST_SUB) + HIST_SUBBITS - 1;
+    return ((((uint64_t)HIST_SUB + (i % HIST_SUB)) + 1) << (e - HIST_SUBBITS)) - 1;
+}
+
+
+static void sub_hist_record(stats_hist_t* h, uint64_t v) {
+    TLS_ADD(h->count, 1);
+    TLS_ADD(h->sum, v);
+    if (v > TLS_GET(h->max)) {
+        TLS_SET(h->max, v);
+    }
+    TLS_ADD(h->bucket[sub_bucket(v)], 1);
+}
+
+
+static void sub_hist_merge(stats_hist_t* dst, stats_hist_t* src) {
+    dst->count += TLS_GET(src->count);
+    dst->sum   += TLS_GET(src->sum);
+    if (TLS_GET(src->max) > dst->max) {
+        dst->max = TLS_GET(src->max);
+    }
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        dst->bucket[i] += TLS_GET(src->bucket[i]);
+    }
+}
+
+
+static uint64_t sub_hist_pct(stats_hist_t* h, double pct) {
+    uint64_t rank;
+    uint64_t accum = 0;
+    
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t)(((double)h->count * pct) / 100.0);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        accum += h->bucket[i];
+        if (accum > rank) {
+            uint64_t top = sub_bucket_top(i);
+            return (top < h->max) ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+static void sub_block_merge(stats_block_t* dst, stats_block_t* src) {
+    for (int i=0; i<STAT_MAX; i++) {
+        if (ctr_isgauge[i]) {
+            if (TLS_GET(src->ctr[i]) != 0) {
+                dst->ctr[i] = TLS_GET(src->ctr[i]);
+            }
+        }
+        else {
+            dst->ctr[i] += TLS_GET(src->ctr[i]);
+        }
+    }
+    for (int i=0; i<STATH_MAX; i++) {
+        sub_hist_merge(&dst->hist[i], &src->hist[i]);
+    }
+    for (int i=0; i<STATS_CMD_MAX; i++) {
+        dst->cmd_errors[i] += TLS_GET(src->cmd_errors[i]);
+        sub_hist_merge(&dst->cmd[i], &src->cmd[i]);
+    }
+}
+
+
+/* Thread exit: fold the block into the retired totals and free it for reuse */
+static void sub_block_retire(void* arg) {
+    stats_block_t* block = arg;
+    
+    pthread_mutex_lock(&stats.mutex);
+    sub_block_merge(&stats.retired, block);
+    memset(block->ctr, 0, sizeof(stats_block_t) - offsetof(stats_block_t, ctr));
+    block->live = false;
+    pthread_mutex_unlock(&stats.mutex);
+}
+
+
+static stats_block_t* sub_block_get(void) {
+    stats_block_t* block;
+    
+    if (tls_block != NULL) {
+        return tls_block;
+    }
+    if (stats_active == false) {
+        return NULL;
+    }
+    
+    // First record on this thread: reuse a retired block if there is one
+    pthread_mutex_lock(&stats.mutex);
+    for (block=stats.blocks; block!=NULL; block=block->next) {
+        if (block->live == false) {
+            break;
+        }
+    }
+    if (block == NULL) {
+        block = calloc(1, sizeof(stats_block_t));
+        if (block != NULL) {
+            block->next     = stats.blocks;
+            stats.blocks    = block;
+        }
+    }
+    if (block != NULL) {
+        block->live = true;
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    
+    if (block != NULL) {
+        pthread_setspecific(stats.key, block);
+        tls_block = block;
+    }
+    return block;
+}
+
+
+static int sub_cmdslot(const char* cmdname) {
+    int num = __atomic_load_n(&stats.numcmds, __ATOMIC_ACQUIRE);
+    
+    for (int i=0; i<num; i++) {
+        if (strncmp(stats.cmdname[i], cmdname, STATS_CMD_NAME-1) == 0) {
+            return i;
+        }
+    }
+    
+    // New name: append it under the mutex, rechecking for a racing thread
+    pthread_mutex_lock(&stats.mutex);
+    num = stats.numcmds;
+    for (int i=0; i<num; i++) {
+        if (strncmp(stats.cmdname[i], cmdname, STATS_CMD_NAME-1) == 0) {
+            pthread_mutex_unlock(&stats.mutex);
+            return i;
+        }
+    }
+    if (num < STATS_CMD_MAX) {
+        snprintf(stats.cmdname[num], STATS_CMD_NAME, "%s", cmdname);
+        __atomic_store_n(&stats.numcmds, num+1, __ATOMIC_RELEASE);
+    }
+    else {
+        num = -1;
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    return num;
+}
+
+
+/* Sum of all blocks.  Caller frees. */
+static stats_block_t* sub_snapshot(void) {
+    stats_block_t* total = malloc(sizeof(stats_block_t));
+    if (total == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&stats.mutex);
+    memcpy(total, &stats.retired, sizeof(stats_block_t));
+    for (stats_block_t* block=stats.blocks; block!=NULL; block=block->next) {
+        if (block->live) {
+            sub_block_merge(total, block);
+        }
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    
+    return total;
+}
+
+
+
+
+int stats_init(void) {
+    memset(&stats, 0, sizeof(stats_t));
+    if (pthread_mutex_init(&stats.mutex, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_key_create(&stats.key, &sub_block_retire) != 0) {
+        pthread_mutex_destroy(&stats.mutex);
+        return -2;
+    }
+    stats_active = true;
+    return 0;
+}
+
+
+void stats_deinit(void) {
+/// Worker and client threads are not joined at exit, and they still reach
+/// their blocks through TLS.  So only retired blocks are freed.  Live ones,
+/// and the mutex that a late thread exit may still take, are left to the
+/// process exit.
+    stats_block_t** link;
+    
+    if (stats_active == false) {
+        return;
+    }
+    
+    pthread_mutex_lock(&stats.mutex);
+    stats_active = false;
+    link = &stats.blocks;
+    while (*link != NULL) {
+        stats_block_t* block = *link;
+        if (block->live) {
+            link = &block->next;
+        }
+        else {
+            *link = block->next;
+            free(block);
+        }
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    
+    pthread_key_delete(stats.key);
+    free(stats.dump_path);
+    free(stats.dump_tmppath);
+    free(stats.dump_buf);
+}
+
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+
+void stats_add(STAT_Type id, uint64_t value) {
+    stats_block_t* block = sub_block_get();
+    if ((block != NULL) && ((unsigned)id < STAT_MAX)) {
+        TLS_ADD(block->ctr[id], value);
+    }
+}
+
+
+void stats_set(STAT_Type id, uint64_t value) {
+    stats_block_t* block = sub_block_get();
+    if ((block != NULL) && ((unsigned)id < STAT_MAX)) {
+        TLS_SET(block->ctr[id], value);
+    }
+}
+
+
+void stats_record(STATH_Type id, uint64_t usec) {
+    stats_block_t* block = sub_block_get();
+    if ((block != NULL) && ((unsigned)id < STATH_MAX)) {
+        sub_hist_record(&block->hist[id], usec);
+    }
+}
+
+
+void stats_cmd(const char* cmdname, uint64_t usec, bool error) {
+    stats_block_t* block = sub_block_get();
+    int slot;
+    
+    if (block == NULL) {
+        return;
+    }
+    TLS_ADD(block->ctr[STAT_cmd_calls], 1);
+    sub_hist_record(&block->hist[STATH_cmd], usec);
+    if (error) {
+        TLS_ADD(block->ctr[STAT_cmd_errors], 1);
+    }
+    
+    slot = (cmdname != NULL) ? sub_cmdslot(cmdname) : -1;
+    if (slot >= 0) {
+        sub_hist_record(&block->cmd[slot], usec);
+        if (error) {
+            TLS_ADD(block->cmd_errors[slot], 1);
+        }
+    }
+}
+
+
+int stats_print(char* dst, size_t dstmax, FORMAT_Type fmt) {
+    stats_block_t* total;
+    bool json = ((fmt == FORMAT_Json) || (fmt == FORMAT_JsonHex));
+    char* dcurs = dst;
+    char* dend  = dst + dstmax;
+    int numcmds;
+    
+    total = sub_snapshot();
+    if (total == NULL) {
+        return -1;
+    }
+    numcmds = __atomic_load_n(&stats.numcmds, __ATOMIC_ACQUIRE);
+
+#   define PRINT(...)   do { \
+        int n_ = snprintf(dcurs, (size_t)(dend - dcurs), __VA_ARGS__); \
+        if ((n_ < 0) || (n_ >= (dend - dcurs))) goto stats_print_FULL; \
+        dcurs += n_; \
+    } while (0)
+    
+#   define PRINT_HIST(NAME, H, ERRS) do { \
+        stats_hist_t* h_ = (H); \
+        if (json) PRINT("%s\"%s\":{\"count\":%llu, \"errors\":%llu, \"mean\":%llu, \"p50\":%llu, \"p90\":%llu, " \
+                        "\"p99\":%llu, \"p999\":%llu, \"max\":%llu}", sep, NAME, \
+                        (unsigned long long)h_->count, (unsigned long long)(ERRS), \
+                        (unsigned long long)(h_->count ? (h_->sum / h_->count) : 0), \
+                        (unsigned long long)sub_hist_pct(h_, 50.0), (unsigned long long)sub_hist_pct(h_, 90.0), \
+                        (unsigned long long)sub_hist_pct(h_, 99.0), (unsigned long long)sub_hist_pct(h_, 99.9), \
+                        (unsigned long long)h_->max); \
+        else PRINT("  %-16s n=%-8llu err=%-6llu mean=%-8llu p50=%-8llu p90=%-8llu p99=%-8llu p999=%-8llu max=%llu\n", NAME, \
+                        (unsigned long long)h_->count, (unsigned long long)(ERRS), \
+                        (unsigned long long)(h_->count ? (h_->sum / h_->count) : 0), \
+                        (unsigned long long)sub_hist_pct(h_, 50.0), (unsigned long long)sub_hist_pct(h_, 90.0), \
+                        (unsigned long long)sub_hist_pct(h_, 99.0), (unsigned long long)sub_hist_pct(h_, 99.9), \
+                        (unsigned long long)h_->max); \
+        sep = ", "; \
+    } while (0)
+    
+    {   const char* sep = "";
+        PRINT(json ? "{\"stats\":{\"counters\":{" : "counters\n");
+        for (int i=0; i<STAT_MAX; i++) {
+            PRINT(json ? "%s\"%s\":%llu" : "%s  %-16s %llu\n", json ? sep : "", ctr_name[i], 
+                        (unsigned long long)total->ctr[i]);
+            sep = ", ";
+        }
+        
+        sep = "";
+        PRINT(json ? "}, \"latency_us\":{" : "latency (us)\n");
+        for (int i=0; i<STATH_MAX; i++) {
+            uint64_t errs = 0;
+            if (i == STATH_cmd)         errs = total->ctr[STAT_cmd_errors];
+            if (i == STATH_download)    errs = total->ctr[STAT_dl_errors];
+            if (i == STATH_anow_fetch)  errs = total->ctr[STAT_anow_errors];
+            PRINT_HIST(hist_name[i], &total->hist[i], errs);
+        }
+        
+        sep = "";
+        PRINT(json ? "}, \"commands_us\":{" : "commands (us)\n");
+        for (int i=0; i<numcmds; i++) {
+            PRINT_HIST(stats.cmdname[i], &total->cmd[i], total->cmd_errors[i]);
+        }
+        PRINT(json ? "}}}\n" : "");
+    }
+    
+#   undef PRINT_HIST
+#   undef PRINT
+    
+    free(total);
+    return (int)(dcurs - dst);
+    
+    stats_print_FULL:
+    free(total);
+    return -2;
+}
+
+
+int stats_print_prometheus(char* dst, size_t dstmax) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    stats_block_t* total;
+    char* dcurs = dst;
+    char* dend  = dst + dstmax;
+    int numcmds;
+    
+    total = sub_snapshot();
+    if (total == NULL) {
+        return -1;
+    }
+    numcmds = __atomic_load_n(&stats.numcmds, __ATOMIC_ACQUIRE);
+    
+#   define PRINT(...)   do { \
+        int n_ = snprintf(dcurs, (size_t)(dend - dcurs), __VA_ARGS__); \
+        if ((n_ < 0) || (n_ >= (dend - dcurs))) goto stats_prom_FULL; \
+        dcurs += n_; \
+    } while (0)
+    
+#   define PRINT_SUMMARY(METRIC, LABEL, H) do { \
+        stats_hist_t* h_ = (H); \
+        for (int q_=0; q_<4; q_++) { \
+            PRINT("%s{%s%squantile=\"%g\"} %llu\n", METRIC, LABEL, (LABEL)[0] ? "," : "", quantiles[q_], \
+                    (unsigned long long)sub_hist_pct(h_, quantiles[q_]*100.0)); \
+        } \
+        PRINT("%s_sum%s%s%s %llu\n", METRIC, (LABEL)[0] ? "{" : "", LABEL, (LABEL)[0] ? "}" : "", \
+                    (unsigned long long)h_->sum); \
+        PRINT("%s_count%s%s%s %llu\n", METRIC, (LABEL)[0] ? "{" : "", LABEL, (LABEL)[0] ? "}" : "", \
+                    (unsigned long long)h_->count); \
+    } while (0)
+    
+    for (int i=0; i<STAT_MAX; i++) {
+        PRINT("# TYPE birdmon_%s %s\n", ctr_name[i], ctr_isgauge[i] ? "gauge" : "counter");
+        PRINT("birdmon_%s %llu\n", ctr_name[i], (unsigned long long)total->ctr[i]);
+    }
+    for (int i=0; i<STATH_MAX; i++) {
+        char metric[64];
+        snprintf(metric, sizeof(metric), "birdmon_%s_latency_us", hist_name[i]);
+        PRINT("# TYPE %s summary\n", metric);
+        PRINT_SUMMARY(metric, "", &total->hist[i]);
+    }
+    PRINT("# TYPE birdmon_command_latency_us summary\n");
+    for (int i=0; i<numcmds; i++) {
+        char label[STATS_CMD_NAME + 16];
+        snprintf(label, sizeof(label), "command=\"%s\"", stats.cmdname[i]);
+        PRINT_SUMMARY("birdmon_command_latency_us", label, &total->cmd[i]);
+    }
+    PRINT("# TYPE birdmon_command_errors counter\n");
+    for (int i=0; i<numcmds; i++) {
+        PRINT("birdmon_command_errors{command=\"%s\"} %llu\n", stats.cmdname[i], 
+                (unsigned long long)total->cmd_errors[i]);
+    }
+    
+#   undef PRINT_SUMMARY
+#   undef PRINT
+    
+    free(total);
+    return (int)(dcurs - dst);
+    
+    stats_prom_FULL:
+    free(total);
+    return -2;
+}
+
+
+#define STATS_DUMP_MAX  (64*1024)
+
+static void stats_dumper(void* args) {
+/// A job of the scheduler.  Scrapers must never see a partial file: write
+/// aside, then rename.
+    int len;
+    FILE* fp;
+    
+    if (stats_active == false) {
+        return;
+    }
+    len = stats_print_prometheus(stats.dump_buf, STATS_DUMP_MAX);
+    if (len > 0) {
+        fp = fopen(stats.dump_tmppath, "w");
+        if (fp != NULL) {
+            fwrite(stats.dump_buf, 1, (size_t)len, fp);
+            fclose(fp);
+            rename(stats.dump_tmppath, stats.dump_path);
+        }
+    }
+}
+
+
+int stats_dump_start(const char* path, int interval) {
+    size_t pathlen;
+    
+    if ((stats_active == false) || (path == NULL) || (interval <= 0) || stats.dump_active) {
+        return -1;
+    }
+    pathlen             = strlen(path);
+    stats.dump_path     = strdup(path);
+    stats.dump_tmppath  = malloc(pathlen + 8);
+    stats.dump_buf      = malloc(STATS_DUMP_MAX);
+    if ((stats.dump_path == NULL) || (stats.dump_tmppath == NULL) || (stats.dump_buf == NULL)) {
+        goto stats_dump_start_ERR;
+    }
+    snprintf(stats.dump_tmppath, pathlen + 8, "%s.tmp", path);
+    
+    if (jobsched_add_interval("stats", interval*1000, 0, &stats_dumper, NULL) != 0) {
+        goto stats_dump_start_ERR;
+    }
+    stats.dump_active = true;
+    return 0;
+    
+    stats_dump_start_ERR:
+    free(stats.dump_path);
+    free(stats.dump_tmppath);
+    free(stats.dump_buf);
+    stats.dump_path     = NULL;
+    stats.dump_tmppath  = NULL;
+    stats.dump_buf      = NULL;
+    return -2;
+}
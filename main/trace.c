@@ -0,0 +1,328 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "birdmon_cfg.h"
+#include "trace.h"
+
+// Standard C & POSIX Libraries
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define TRACE_SPANS     BIRDMON_PARAM(TRACE_SPANS)
+#define TRACE_MASK      (TRACE_SPANS - 1)
+
+typedef struct {
+    const char* name;
+    const char* cat;
+    uint64_t    start;
+    uint64_t    dur;
+    uint64_t    req;
+} trace_span_t;
+
+/// head counts spans ever written to the ring.  Only the owner writes, and
+/// it publishes head after the span, so a reader can tell which spans it
+/// copied were overwritten meanwhile.
+typedef struct trace_ring {
+    struct trace_ring*  next;
+    bool                live;
+    int                 tid;
+    const char*         tname;
+    uint64_t            head;
+    uint64_t            tail;
+    trace_span_t        span[TRACE_SPANS];
+} trace_ring_t;
+
+typedef struct {
+    pthread_mutex_t     mutex;
+    pthread_key_t       key;
+    trace_ring_t*       rings;
+    int                 next_tid;
+    uint64_t            next_req;
+    int                 enabled;
+    char*               dir;
+} trace_t;
+
+static trace_t trace;
+static bool trace_active = false;
+static __thread trace_ring_t* tls_ring  = NULL;
+static __thread uint64_t tls_req        = 0;
+
+
+static uint64_t sub_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+
+/* Thread exit: the ring keeps its spans until it is reused by a new thread */
+static void sub_ring_retire(void* arg) {
+    trace_ring_t* ring = arg;
+    pthread_mutex_lock(&trace.mutex);
+    ring->live = false;
+    pthread_mutex_unlock(&trace.mutex);
+}
+
+
+static trace_ring_t* sub_ring_get(void) {
+    trace_ring_t* ring;
+    
+    if (tls_ring != NULL) {
+        return tls_ring;
+    }
+    if (trace_active == false) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&trace.mutex);
+    for (ring=trace.rings; ring!=NULL; ring=ring->next) {
+        if (ring->live == false) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring != NULL) {
+            ring->next  = trace.rings;
+            trace.rings = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->live  = true;
+        ring->tid   = ++trace.next_tid;
+        ring->tname = NULL;
+        __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&trace.mutex);
+    
+    if (ring != NULL) {
+        pthread_setspecific(trace.key, ring);
+        tls_ring = ring;
+    }
+    return ring;
+}
+
+
+
+
+int trace_init(const char* dir) {
+    memset(&trace, 0, sizeof(trace_t));
+    if (dir != NULL) {
+        trace.dir = strdup(dir);
+        if (trace.dir == NULL) {
+            return -3;
+        }
+    }
+    if (pthread_mutex_init(&trace.mutex, NULL) != 0) {
+        free(trace.dir);
+        return -1;
+    }
+    if (pthread_key_create(&trace.key, &sub_ring_retire) != 0) {
+        pthread_mutex_destroy(&trace.mutex);
+        free(trace.dir);
+        return -2;
+    }
+    trace_active = true;
+    return 0;
+}
+
+
+void trace_deinit(void) {
+/// As with stats, threads that are not joined still reach their rings
+/// through TLS, so only retired rings are freed.  Live ones and the mutex
+/// are left to the process exit.
+    trace_ring_t** link;
+    
+    if (trace_active == false) {
+        return;
+    }
+    __atomic_store_n(&trace.enabled, 0, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&trace.mutex);
+    trace_active = false;
+    link = &trace.rings;
+    while (*link != NULL) {
+        trace_ring_t* ring = *link;
+        if (ring->live) {
+            link = &ring->next;
+        }
+        else {
+            *link = ring->next;
+            free(ring);
+        }
+    }
+    pthread_mutex_unlock(&trace.mutex);
+    
+    pthread_key_delete(trace.key);
+    free(trace.dir);
+    trace.dir = NULL;
+}
+
+
+const char* trace_dir(void) {
+    return trace_active ? trace.dir : NULL;
+}
+
+
+void trace_enable(bool on) {
+    if (trace_active) {
+        __atomic_store_n(&trace.enabled, (int)on, __ATOMIC_RELAXED);
+    }
+}
+
+
+bool trace_isenabled(void) {
+    return (__atomic_load_n(&trace.enabled, __ATOMIC_RELAXED) != 0);
+}
+
+
+void trace_thread(const char* name) {
+    trace_ring_t* ring = sub_ring_get();
+    if (ring != NULL) {
+        ring->tname = name;
+    }
+}
+
+
+uint64_t trace_request(void) {
+    tls_req = __atomic_add_fetch(&trace.next_req, 1, __ATOMIC_RELAXED);
+    return tls_req;
+}
+
+
+uint64_t trace_begin(void) {
+    if (__atomic_load_n(&trace.enabled, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    return sub_now();
+}
+
+
+void trace_span(const char* name, const char* cat, uint64_t start, uint64_t dur) {
+    trace_ring_t* ring;
+    trace_span_t* span;
+    uint64_t head;
+    
+    if (start == 0) {
+        return;
+    }
+    ring = sub_ring_get();
+    if (ring == NULL) {
+        return;
+    }
+    
+    head        = ring->head;
+    span        = &ring->span[head & TRACE_MASK];
+    span->name  = name;
+    span->cat   = cat;
+    span->start = start;
+    span->dur   = dur;
+    span->req   = tls_req;
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+
+void trace_end(const char* name, const char* cat, uint64_t start) {
+    if (start != 0) {
+        trace_span(name, cat, start, sub_now() - start);
+    }
+}
+
+
+void trace_clear(void) {
+    if (trace_active == false) {
+        return;
+    }
+    pthread_mutex_lock(&trace.mutex);
+    for (trace_ring_t* ring=trace.rings; ring!=NULL; ring=ring->next) {
+        __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&trace.mutex);
+}
+
+
+int trace_dump(const char* path) {
+    FILE* fp;
+    trace_span_t* copy;
+    const char* sep = "";
+    int count = 0;
+    
+    if ((trace_active == false) || (path == NULL)) {
+        return -1;
+    }
+    copy = malloc(sizeof(trace_span_t) * TRACE_SPANS);
+    if (copy == NULL) {
+        return -2;
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        free(copy);
+        return -3;
+    }
+    
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\", \"traceEvents\":[\n");
+    
+    pthread_mutex_lock(&trace.mutex);
+    for (trace_ring_t* ring=trace.rings; ring!=NULL; ring=ring->next) {
+        uint64_t head   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail   = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        uint64_t first;
+        uint64_t after;
+        
+        if ((head - tail) > TRACE_SPANS) {
+            tail = head - TRACE_SPANS;
+        }
+        for (uint64_t i=tail; i<head; i++) {
+            copy[i & TRACE_MASK] = ring->span[i & TRACE_MASK];
+        }
+        
+        // Spans the owner overwrote while they were copied are discarded
+        after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        first = ((after - tail) > TRACE_SPANS) ? (after - TRACE_SPANS) : tail;
+        
+        if (ring->tname != NULL) {
+            fprintf(fp, "%s{\"name\":\"thread_name\", \"ph\":\"M\", \"pid\":%d, \"tid\":%d, \"args\":{\"name\":\"%s\"}}",
+                        sep, (int)getpid(), ring->tid, ring->tname);
+            sep = ",\n";
+        }
+        for (uint64_t i=first; i<head; i++) {
+            trace_span_t* span = &copy[i & TRACE_MASK];
+            fprintf(fp, "%s{\"name\":\"%s\", \"cat\":\"%s\", \"ph\":\"X\", \"ts\":%llu, \"dur\":%llu, "
+                        "\"pid\":%d, \"tid\":%d, \"args\":{\"req\":%llu}}",
+                        sep, span->name, span->cat, (unsigned long long)span->start, 
+                        (unsigned long long)span->dur, (int)getpid(), ring->tid, 
+                        (unsigned long long)span->req);
+            sep = ",\n";
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&trace.mutex);
+    
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    free(copy);
+    
+    return count;
+}
@@ -0,0 +1,283 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+// Local Headers
+#include "ubx.h"
+
+// Standard C & POSIX Libraries
+#include <stdint.h>
+#include <string.h>
+
+
+
+
+static int sub_checksum(const uint8_t* front, int plen) {
+/// UBX Fletcher-8 over class, id, length and payload.  Returns 0 if the two
+/// checksum bytes following the payload match.
+    uint8_t ck_a = 0;
+    uint8_t ck_b = 0;
+    const uint8_t* cursor = &front[2];
+    int length = 4 + plen;
+    
+    while (length > 0) {
+        length--;
+        ck_a += *cursor++;
+        ck_b += ck_a;
+    }
+    
+    return (int)((cursor[0] - ck_a) | (cursor[1] - ck_b));
+}
+
+
+int ubx_validate_mga(const uint8_t* buf, int size, int* numpkts, int* offset) {
+    int err     = UBX_ERR_framing;
+    int accum   = 0;
+    int count   = 0;
+    const uint8_t* cursor = buf;
+    
+    while (accum < size) {
+        int plen;
+        int filesize;
+        
+        if ((size - accum) < 8) {
+            //runt packet
+            break;
+        }
+        plen        = ((int)cursor[5] * 256) + cursor[4];    //little endian
+        filesize    = 6 + plen + 2;
+        if (filesize > (size - accum)) {
+            //truncated packet
+            break;
+        }
+        if (sub_checksum(cursor, plen) != 0) {
+            err = UBX_ERR_checksum;
+            break;
+        }
+        if ((cursor[0] != 0xB5) || (cursor[1] != 0x62)) {
+            err = UBX_ERR_header;
+            break;
+        }
+        if (cursor[2] != 0x13) {
+            err = UBX_ERR_notmga;
+            break;
+        }
+        
+        count++;
+        accum  += filesize;
+        cursor += filesize;
+    }
+    
+    if (accum == size) {
+        err = UBX_ERR_none;
+    }
+    if (numpkts != NULL) {
+        *numpkts = count;
+    }
+    if (offset != NULL) {
+        *offset = accum;
+    }
+    
+    return err;
+}
+
+
+const char* ubx_strerror(int err) {
+    static const char* errmsg[UBX_ERR_MAX] = {
+        "Unknown error",
+        "Checksum failed",
+        "Header not B562",
+        "Not an MGA Packet",
+        "Framing error"
+    };
+    
+    if ((err < 0) || (err >= UBX_ERR_MAX)) {
+        err = 0;
+    }
+    return errmsg[err];
+}
+
+
+size_t ubx_index(ubx_pkt_t* pkt, uint8_t* src) {
+    pkt->hdr.sync1      = src[0];
+    pkt->hdr.sync2      = src[1];
+    pkt->hdr.msg_class  = src[2];
+    pkt->hdr.msg_id     = src[3];
+    pkt->hdr.plen       = ((uint16_t)src[5] * 256) + src[4];    //little endian
+    pkt->data           = &src[6];
+    pkt->len            = pkt->hdr.plen;
+    pkt->key            = ubx_key(&pkt->hdr, pkt->data);
+    pkt->digest         = ubx_digest(pkt->data, pkt->len);
+    
+    return 6 + pkt->len + 2;
+}
+
+
+uint32_t ubx_key(const ubx_header_t* hdr, const uint8_t* payload) {
+/// All MGA messages carry the message type in the first payload byte.  The
+/// ephemeris (1) and almanac (2) messages of each constellation are per-SV,
+/// and they carry svId in the third payload byte.  MGA-INI (0x40) is not.
+    uint8_t type = 0;
+    uint8_t svid = 0;
+    
+    if (hdr->plen >= 1) {
+        type = payload[0];
+    }
+    if ((hdr->msg_id != 0x40) && ((type == 1) || (type == 2)) && (hdr->plen >= 3)) {
+        svid = payload[2];
+    }
+    
+    return UBX_KEY(hdr->msg_id, type, svid);
+}
+
+
+uint32_t ubx_digest(const uint8_t* payload, size_t len) {
+/// 32 bit FNV-1a.  Clients compute the same value over the payload bytes they
+/// hold, so it must not change between versions.
+    uint32_t hash = 2166136261u;
+    
+    while (len-- != 0) {
+        hash ^= *payload++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+
+
+static uint32_t sub_le(const uint8_t* src, int bytes) {
+    uint32_t val = 0;
+    while (bytes-- > 0) {
+        val = (val << 8) | src[bytes];
+    }
+    return val;
+}
+
+
+static time_t sub_nearest(time_t ref, time_t now, time_t period) {
+/// ref is in the period that starts at or before now.  Move it to the
+/// period that puts it nearest to now.
+    if ((ref - now) > (period / 2)) {
+        ref -= period;
+    }
+    else if ((now - ref) > (period / 2)) {
+        ref += period;
+    }
+    return ref;
+}
+
+
+time_t ubx_expiry(const ubx_pkt_t* pkt, time_t now) {
+/// Payload offsets and scales are from the u-blox 8 receiver description,
+/// UBX-MGA-*-EPH.  GPS and QZSS share a layout, and their toe is in GPS
+/// time of week.  Galileo time of week is aligned with GPS, and BeiDou time
+/// is 14 seconds behind it.  GLONASS tb is in 15 minute steps of the day,
+/// in Moscow time (UTC+3).
+    const time_t gps_epoch  = 315964800;    // 6 Jan 1980, in UTC
+    const time_t week       = 7*86400;
+    const uint8_t* data     = pkt->data;
+    time_t gps_now          = now - gps_epoch + UBX_LEAPSECONDS;
+    time_t week_start       = gps_now - (gps_now % week);
+    time_t toe;
+    time_t fit;
+    
+    if ((pkt->len < 1) || (data[0] != 1)) {
+        return 0;
+    }
+    
+    switch (pkt->hdr.msg_id) {
+        case 0x00:      // GPS
+        case 0x05:      // QZSS
+            if (pkt->len < 68) {
+                return 0;
+            }
+            toe = (time_t)sub_le(&data[40], 2) * 16;
+            fit = (data[4] == 0) ? (4*3600) : (6*3600);
+            break;
+            
+        case 0x02:      // Galileo
+            if (pkt->len < 76) {
+                return 0;
+            }
+            toe = (time_t)sub_le(&data[50], 2) * 60;
+            fit = 4*3600;
+            break;
+            
+        case 0x03:      // BeiDou
+            if (pkt->len < 88) {
+                return 0;
+            }
+            toe = ((time_t)sub_le(&data[24], 4) * 8) + 14;
+            fit = 2*3600;
+            break;
+            
+        case 0x06: {    // GLONASS
+            time_t msk_now = now + (3*3600);
+            time_t tb;
+            if (pkt->len < 48) {
+                return 0;
+            }
+            tb  = (msk_now - (msk_now % 86400)) + ((time_t)data[35] * 900) - (3*3600);
+            tb  = sub_nearest(tb, now, 86400);
+            return tb + (15*60);
+        }
+        
+        default:
+            return 0;
+    }
+    
+    toe = sub_nearest(week_start + toe, gps_now, week);
+    return toe + (fit / 2) + gps_epoch - UBX_LEAPSECONDS;
+}
+
+
+
+const char* ubx_datatype(const ubx_pkt_t* pkt) {
+/// Per GNSS, type 1 is the ephemeris and type 2 the almanac, and the others
+/// (time offset, health, UTC, ionosphere) are auxiliary.  MGA-INI position
+/// is the "pos" datatype.  MGA-INI time is in every response.
+    uint8_t type;
+    
+    if (pkt->len < 1) {
+        return NULL;
+    }
+    type = pkt->data[0];
+    
+    if (pkt->hdr.msg_id == 0x40) {
+        return (type <= 0x01) ? "pos" : NULL;
+    }
+    if (ubx_gnss(pkt) == NULL) {
+        return NULL;
+    }
+    switch (type) {
+        case 1:     return "eph";
+        case 2:     return "alm";
+        default:    return "aux";
+    }
+}
+
+
+const char* ubx_gnss(const ubx_pkt_t* pkt) {
+    switch (pkt->hdr.msg_id) {
+        case 0x00:  return "gps";
+        case 0x02:  return "gal";
+        case 0x03:  return "bds";
+        case 0x05:  return "qzss";
+        case 0x06:  return "glo";
+        default:    return NULL;
+    }
+}
@@ -15,6 +15,8 @@
  */
 
 
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <cJSON.h>
@@ -102,13 +104,47 @@ static size_t data_loader(void *contents, size_t size, size_t nmemb, void *userp
 //}
 
 
+/* Record the phases of a completed transfer as trace spans.  curl reports
+ * each phase as the time from the start of the transfer to its end. */
+static void sub_trace_phases(CURL* curl_handle, uint64_t t_start) {
+    curl_off_t t_dns    = 0;
+    curl_off_t t_conn   = 0;
+    curl_off_t t_tls    = 0;
+    curl_off_t t_first  = 0;
+    curl_off_t t_total  = 0;
+    
+    if (t_start == 0) {
+        return;
+    }
+    curl_easy_getinfo(curl_handle, CURLINFO_NAMELOOKUP_TIME_T, &t_dns);
+    curl_easy_getinfo(curl_handle, CURLINFO_CONNECT_TIME_T, &t_conn);
+    curl_easy_getinfo(curl_handle, CURLINFO_APPCONNECT_TIME_T, &t_tls);
+    curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &t_first);
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME_T, &t_total);
+    
+    // Reused connections and file:// have no connect or TLS phase
+    if (t_conn < t_dns)     t_conn  = t_dns;
+    if (t_tls < t_conn)     t_tls   = t_conn;
+    if (t_first < t_tls)    t_first = t_tls;
+    if (t_total < t_first)  t_total = t_first;
+    
+    trace_span("dns", "http", t_start, (uint64_t)t_dns);
+    trace_span("connect", "http", t_start + t_dns, (uint64_t)(t_conn - t_dns));
+    trace_span("tls", "http", t_start + t_conn, (uint64_t)(t_tls - t_conn));
+    trace_span("wait", "http", t_start + t_tls, (uint64_t)(t_first - t_tls));
+    trace_span("transfer", "http", t_start + t_first, (uint64_t)(t_total - t_first));
+}
+
+
+
 int utils_downloader(const char* url, char* errbuf, uint8_t* filebuf, size_t* bufmax, bool buf_isdynamic) {
     CURL* curl_handle;
     CURLcode curl_rc;
     memblock_t memblock;
     const char* err     = NULL;
     const char* errinit = "downloader could not be initialized";
-    
+    uint64_t t_start    = stats_now();
+    uint64_t t_trace    = trace_begin();
     int rc = 0;
     
     if ((url == NULL) || (filebuf == NULL) || (bufmax == NULL)) {
@@ -144,6 +180,7 @@ int utils_downloader(const char* url, char* errbuf, uint8_t* filebuf, size_t* bu
         default:    
                 *bufmax = memblock.max;
                 rc      = (int)memblock.size;
+                sub_trace_phases(curl_handle, t_trace);
                 goto download_TERM;
         }
         
@@ -156,6 +193,16 @@ int utils_downloader(const char* url, char* errbuf, uint8_t* filebuf, size_t* bu
     
     download_TERM:
     curl_easy_cleanup(curl_handle);
+    trace_end("download", "http", t_trace);
+    
+    stats_add(STAT_dl_calls, 1);
+    stats_record(STATH_download, stats_now() - t_start);
+    if (rc < 0) {
+        stats_add(STAT_dl_errors, 1);
+    }
+    else {
+        stats_add(STAT_dl_bytes, (uint64_t)rc);
+    }
     
     if ((errbuf != NULL) && (err != NULL)) {
         strcpy(errbuf, err);
@@ -163,3 +210,204 @@ int utils_downloader(const char* url, char* errbuf, uint8_t* filebuf, size_t* bu
     return rc;
 }
 
+
+
+
+
+/** Hedged downloads <BR>
+  * ========================================================================<BR>
+  * The URLs are mirrors of the same file.  They run on one curl multi
+  * handle, so a slow mirror costs a socket rather than a thread.
+  */
+
+#define HEDGE_MAX   8
+
+typedef struct {
+    CURL*       curl;           // NULL when not running
+    memblock_t  mem;
+    uint64_t    t_start;
+    uint64_t    t_trace;
+} hedge_xfer_t;
+
+
+static int sub_hedge_start(CURLM* multi, hedge_xfer_t* xfer, const char* url, 
+                           uint8_t* buf, size_t bufmax, int timeout_ms) {
+    xfer->mem.data      = buf;
+    xfer->mem.max       = bufmax;
+    xfer->mem.size      = 0;
+    xfer->mem.resizable = false;
+    
+    xfer->curl = curl_easy_init();
+    if (xfer->curl == NULL) {
+        return -1;
+    }
+    curl_easy_setopt(xfer->curl, CURLOPT_PROTOCOLS, CURLPROTO_ALL);
+    curl_easy_setopt(xfer->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(xfer->curl, CURLOPT_AUTOREFERER, 1L);
+    curl_easy_setopt(xfer->curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(xfer->curl, CURLOPT_URL, url);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEFUNCTION, &data_loader);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEDATA, (void*)&xfer->mem);
+    curl_easy_setopt(xfer->curl, CURLOPT_NOSIGNAL, 1L);
+    if (timeout_ms > 0) {
+        curl_easy_setopt(xfer->curl, CURLOPT_TIMEOUT_MS, (long)timeout_ms);
+    }
+    if (curl_multi_add_handle(multi, xfer->curl) != 0) {
+        curl_easy_cleanup(xfer->curl);
+        xfer->curl = NULL;
+        return -1;
+    }
+    
+    xfer->t_start = stats_now();
+    xfer->t_trace = trace_begin();
+    stats_add(STAT_dl_calls, 1);
+    return 0;
+}
+
+
+static void sub_hedge_stop(CURLM* multi, hedge_xfer_t* xfer) {
+    if (xfer->curl != NULL) {
+        curl_multi_remove_handle(multi, xfer->curl);
+        curl_easy_cleanup(xfer->curl);
+        xfer->curl = NULL;
+        trace_end("download", "http", xfer->t_trace);
+        stats_record(STATH_download, stats_now() - xfer->t_start);
+    }
+}
+
+
+static const char* sub_hedge_check(hedge_xfer_t* xfer, CURLcode result, utils_hedge_t* hedge) {
+/// Returns NULL if the completed transfer is good, else what is wrong
+    long status = 0;
+    
+    if (result != 0) {
+        return curl_easy_strerror(result);
+    }
+    
+    // file:// has no status
+    curl_easy_getinfo(xfer->curl, CURLINFO_RESPONSE_CODE, &status);
+    if ((status != 0) && ((status < 200) || (status > 299))) {
+        return "server returned an error status";
+    }
+    if (xfer->mem.size == 0) {
+        return "server returned no data";
+    }
+    sub_trace_phases(xfer->curl, xfer->t_trace);
+    
+    if (hedge->validate != NULL) {
+        return hedge->validate(xfer->mem.data, xfer->mem.size, hedge->arg);
+    }
+    return NULL;
+}
+
+
+int utils_hedged_downloader(const char* url[], uint8_t* buf[], int numurls, size_t bufmax,
+                            utils_hedge_t* hedge, char* errbuf) {
+    hedge_xfer_t xfer[HEDGE_MAX];
+    CURLM* multi;
+    const char* err = NULL;
+    uint64_t t_begin;
+    uint64_t t_next;
+    int active  = 0;
+    int rc      = -2;
+    
+    if ((url == NULL) || (buf == NULL) || (hedge == NULL) || (numurls <= 0) || (bufmax == 0)) {
+        return -1;
+    }
+    numurls             = (numurls < HEDGE_MAX) ? numurls : HEDGE_MAX;
+    hedge->winner       = -1;
+    hedge->started      = 0;
+    hedge->elapsed_ms   = 0;
+    memset(xfer, 0, sizeof(xfer));
+    
+    multi = curl_multi_init();
+    if (multi == NULL) {
+        err = "downloader could not be initialized";
+        goto hedged_TERM;
+    }
+    
+    t_begin = stats_now();
+    t_next  = t_begin;
+    while (hedge->winner < 0) {
+        uint64_t now = stats_now();
+        CURLMsg* msg;
+        int queued;
+        int running;
+        int wait_ms;
+        
+        // Start the next URL when the hedge delay is up, or when none of
+        // the ones started are still running.
+        if ((hedge->started < numurls) && ((now >= t_next) || (active == 0))) {
+            int i = hedge->started++;
+            if (sub_hedge_start(multi, &xfer[i], url[i], buf[i], bufmax, hedge->timeout_ms) == 0) {
+                active++;
+            }
+            else {
+                err = "downloader could not be initialized";
+            }
+            t_next = now + ((uint64_t)hedge->hedge_ms * 1000);
+            continue;
+        }
+        if (active == 0) {
+            break;
+        }
+        
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            const char* xfer_err;
+            int i;
+            
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            for (i=0; (i<hedge->started) && (xfer[i].curl != msg->easy_handle); i++);
+            if (i >= hedge->started) {
+                continue;
+            }
+            
+            active--;
+            xfer_err = sub_hedge_check(&xfer[i], msg->data.result, hedge);
+            if (xfer_err != NULL) {
+                err = xfer_err;
+                stats_add(STAT_dl_errors, 1);
+            }
+            else if (hedge->winner < 0) {
+                hedge->winner       = i;
+                hedge->elapsed_ms   = (uint32_t)((stats_now() - t_begin) / 1000);
+                rc                  = (int)xfer[i].mem.size;
+                stats_add(STAT_dl_bytes, (uint64_t)rc);
+            }
+            sub_hedge_stop(multi, &xfer[i]);
+            if (hedge->winner >= 0) {
+                break;
+            }
+        }
+        if (hedge->winner >= 0) {
+            break;
+        }
+        
+        // Wake up in time to start the next URL
+        wait_ms = 1000;
+        if (hedge->started < numurls) {
+            now     = stats_now();
+            wait_ms = (t_next > now) ? (int)((t_next - now + 999) / 1000) : 0;
+            wait_ms = (wait_ms < 1000) ? wait_ms : 1000;
+        }
+        curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+    }
+    
+    // The ones still running have lost
+    for (int i=0; i<hedge->started; i++) {
+        sub_hedge_stop(multi, &xfer[i]);
+    }
+    curl_multi_cleanup(multi);
+    
+    hedged_TERM:
+    if ((rc < 0) && (err == NULL)) {
+        err = "no URL gave a valid response";
+    }
+    if ((rc < 0) && (errbuf != NULL)) {
+        strcpy(errbuf, err);
+    }
+    return rc;
+}
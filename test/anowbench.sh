@@ -0,0 +1,131 @@
+#!/bin/sh
+# Copyright 2020, JP Norair
+#
+# Licensed under the OpenTag License, Version 1.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# AssistNow backend benchmark, fully offline.
+#
+# Starts mockanow and a birdmon daemon that fetches from it, then runs loadgen
+# twice: once with refreshes stopped, once with a refresh every second.  It
+# reports the end-to-end refresh time (fetch, validate, ingest, publish), the
+# parse throughput and the impact of refreshes on client latency.
+#
+# Usage: test/anowbench.sh [seconds] [mockanow options...]
+#   e.g. test/anowbench.sh 20 -n 128 -l 50 -b 1000000 -k 1024
+#
+# Environment: BIN (directory with birdmon, loadgen, mockanow), PORT, SOCK,
+# CLIENTS, RATE (loadgen request rate, default 1000 req/s)
+
+MACHINE=$(uname -srm | sed -e 's/ /-/g')
+BIN=${BIN:-bin/$MACHINE}
+PORT=${PORT:-8321}
+SOCK=${SOCK:-/tmp/birdmon-anowbench.sock}
+CLIENTS=${CLIENTS:-4}
+RATE=${RATE:-1000}
+SECS=${1:-10}
+[ $# -gt 0 ] && shift
+
+for tool in birdmon loadgen mockanow; do
+    if [ ! -x "$BIN/$tool" ]; then
+        echo "$BIN/$tool not found: run 'make', 'make loadgen' and 'make mockanow' first" >&2
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d)
+MOCK_PID=
+BIRD_PID=
+cleanup() {
+    [ -n "$BIRD_PID" ] && kill "$BIRD_PID" 2>/dev/null
+    [ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK" "$SOCK"
+}
+trap cleanup EXIT INT TERM
+
+"$BIN/mockanow" -p "$PORT" "$@" 2> "$WORK/mock.log" &
+MOCK_PID=$!
+
+echo "var ubx_uri=\"http://127.0.0.1:$PORT/GetOnlineData.ashx\"" > "$WORK/init.txt"
+rm -f "$SOCK"
+"$BIN/birdmon" -S "$SOCK" -I "$WORK/init.txt" -C "* * * * * *" > "$WORK/birdmon.log" 2>&1 &
+BIRD_PID=$!
+
+# Wait for the socket and the first snapshot
+i=0
+until "$BIN/loadgen" -S "$SOCK" -e "stats" 2>/dev/null | grep -q "anow_snapshots *[1-9]"; do
+    i=$((i+1))
+    if [ $i -gt 50 ]; then
+        echo "birdmon did not get a snapshot from mockanow" >&2
+        cat "$WORK/birdmon.log" "$WORK/mock.log" >&2
+        exit 1
+    fi
+    sleep 0.2
+done
+
+# Quiet phase: the next scheduled refresh is a year away
+"$BIN/loadgen" -S "$SOCK" -e 'schedule "0 0 0 1 1 *"' > /dev/null
+sleep 1
+"$BIN/loadgen" -S "$SOCK" -c "$CLIENTS" -r "$RATE" -t "$SECS" > "$WORK/quiet.txt"
+
+# Refresh phase: one refresh per second
+"$BIN/loadgen" -S "$SOCK" -e 'schedule -n "* * * * * *"' > /dev/null
+"$BIN/loadgen" -S "$SOCK" -c "$CLIENTS" -r "$RATE" -t "$SECS" > "$WORK/loaded.txt"
+
+"$BIN/loadgen" -S "$SOCK" -e "stats -p" > "$WORK/stats.prom"
+
+echo "== AssistNow refresh (us)"
+awk '
+    /^birdmon_anow_(fetch|validate|ingest|publish)_latency_us\{quantile="0.5"\}/ {
+        split($1, a, "_"); p50[a[3]] = $2
+    }
+    /^birdmon_anow_(fetch|validate|ingest|publish)_latency_us_sum / {
+        split($1, a, "_"); sum[a[3]] = $2
+    }
+    /^birdmon_anow_(fetch|validate|ingest|publish)_latency_us_count / {
+        split($1, a, "_"); cnt[a[3]] = $2
+    }
+    /^birdmon_anow_bytes / { bytes = $2 }
+    /^birdmon_anow_snapshots / { snaps = $2 }
+    /^birdmon_anow_errors / { errs = $2 }
+    END {
+        n = split("fetch validate ingest publish", stage, " ")
+        total = 0
+        for (i=1; i<=n; i++) {
+            s = stage[i]
+            mean = (cnt[s] > 0) ? sum[s] / cnt[s] : 0
+            printf "  %-10s p50=%-8d mean=%.1f\n", s, p50[s], mean
+            total += mean
+        }
+        printf "  %-10s mean=%.1f\n", "end-to-end", total
+        printf "  snapshots=%d errors=%d size=%d bytes\n", snaps, errs, bytes
+        vmean = (cnt["validate"] > 0) ? sum["validate"] / cnt["validate"] : 0
+        imean = (cnt["ingest"] > 0) ? sum["ingest"] / cnt["ingest"] : 0
+        if (vmean > 0) printf "  validate throughput  %.1f MB/s\n", bytes / vmean
+        if (vmean + imean > 0) printf "  parse throughput     %.1f MB/s (validate + ingest)\n", bytes / (vmean + imean)
+    }' "$WORK/stats.prom"
+
+echo "== Reader impact (corrected latency, us)"
+awk '/^  all / && !seen[FILENAME]++ {
+        printf "  %-22s p50=%-9s p99=%-9s p999=%-9s max=%s\n", \
+            (FILENAME ~ /quiet/) ? "no refreshes" : "refresh every second", $4, $6, $7, $8
+    }' "$WORK/quiet.txt" "$WORK/loaded.txt"
+
+# mockanow prints its totals when it is stopped
+kill "$BIRD_PID" "$MOCK_PID" 2>/dev/null
+wait 2>/dev/null
+BIRD_PID=
+MOCK_PID=
+echo "== Mock upstream"
+tail -n 1 "$WORK/mock.log"
@@ -0,0 +1,571 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+/** @file   bench.c
+  * @brief  Microbenchmarks for the formatters and parsers
+  *
+  * Each benchmark runs one operation on a fixed-seed synthetic input: first
+  * for a warmup period, then in timed batches.  The reported ns/op and
+  * cycles/op are the medians over the batches.  Cycles are TSC reference
+  * cycles where a TSC is available (x86), which is stable across frequency
+  * scaling but is not the core clock.
+  *
+  * formatters.c is compiled into this file, so that its static routines can
+  * be measured directly.
+  *
+  * Usage: bench [-f filter] [-t ms] [-j out.json] [-b baseline.json]
+  *   -j writes the results as JSON.  -b compares against an earlier -j file
+  *   and prints the change in ns/op.
+  */
+
+// Local Headers
+#include "../../main/formatters.c"
+#include "cliopt.h"
+#include "cmdutils.h"
+#include "envelope.h"
+#include "ubx.h"
+#include "utils.h"
+
+// HB Library Headers
+#include <bintex.h>
+#include <cJSON.h>
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#   define BENCH_HAS_TSC    1
+#else
+#   define BENCH_HAS_TSC    0
+#endif
+
+
+#define BENCH_SAMPLES       21
+#define BENCH_WARMUP_NS     50000000ull
+#define BENCH_MAXRESULTS    64
+
+typedef int (*bench_fn_t)(void* arg);
+
+typedef struct {
+    const char* name;
+    size_t      bytes;
+    double      ns_op;
+    double      cyc_op;
+    uint64_t    ops;
+} bench_result_t;
+
+static struct {
+    const char*     filter;
+    uint64_t        sample_ns;
+    double          tsc_ghz;
+    int             numresults;
+    bench_result_t  result[BENCH_MAXRESULTS];
+    cJSON*          baseline;
+    cliopt_t        opts;
+    volatile int    sink;
+} bench;
+
+
+
+
+static uint64_t sub_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t sub_cycles(void) {
+#if BENCH_HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double sub_tsc_ghz(void) {
+    uint64_t t0, t1, c0, c1;
+    if (!BENCH_HAS_TSC) {
+        return 0.0;
+    }
+    t0 = sub_now();
+    c0 = sub_cycles();
+    while ((t1 = sub_now()) < (t0 + 100000000ull));
+    c1 = sub_cycles();
+    return (double)(c1 - c0) / (double)(t1 - t0);
+}
+
+static int sub_cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t sub_rand(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+
+
+
+static double sub_baseline_ns(const char* name) {
+    cJSON* item;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(bench.baseline, "results")) {
+        cJSON* n = cJSON_GetObjectItemCaseSensitive(item, "name");
+        cJSON* v = cJSON_GetObjectItemCaseSensitive(item, "ns_per_op");
+        if (cJSON_IsString(n) && cJSON_IsNumber(v) && (strcmp(n->valuestring, name) == 0)) {
+            return v->valuedouble;
+        }
+    }
+    return 0.0;
+}
+
+static void sub_run(const char* name, bench_fn_t fn, void* arg, size_t bytes) {
+    double ns[BENCH_SAMPLES];
+    double cyc[BENCH_SAMPLES];
+    uint64_t batch = 1;
+    uint64_t ops = 0;
+    uint64_t t_end;
+    bench_result_t* res;
+    double base;
+    int sink = 0;
+    
+    if ((bench.filter != NULL) && (strstr(name, bench.filter) == NULL)) {
+        return;
+    }
+    if (bench.numresults >= BENCH_MAXRESULTS) {
+        return;
+    }
+    if (fn(arg) < 0) {
+        printf("%-32s rejected its input, skipped\n", name);
+        return;
+    }
+    
+    // Warmup, which also sizes a batch to about one sample period
+    t_end = sub_now() + BENCH_WARMUP_NS;
+    while (sub_now() < t_end) {
+        uint64_t t0 = sub_now();
+        for (uint64_t i=0; i<batch; i++) {
+            sink += fn(arg);
+        }
+        if ((sub_now() - t0) < bench.sample_ns) {
+            batch *= 2;
+        }
+    }
+    
+    for (int s=0; s<BENCH_SAMPLES; s++) {
+        uint64_t t0 = sub_now();
+        uint64_t c0 = sub_cycles();
+        for (uint64_t i=0; i<batch; i++) {
+            sink += fn(arg);
+        }
+        cyc[s]  = (double)(sub_cycles() - c0) / (double)batch;
+        ns[s]   = (double)(sub_now() - t0) / (double)batch;
+        ops    += batch;
+    }
+    bench.sink += sink;
+    
+    qsort(ns, BENCH_SAMPLES, sizeof(double), &sub_cmp_double);
+    qsort(cyc, BENCH_SAMPLES, sizeof(double), &sub_cmp_double);
+    res         = &bench.result[bench.numresults++];
+    res->name   = name;
+    res->bytes  = bytes;
+    res->ns_op  = ns[BENCH_SAMPLES/2];
+    res->cyc_op = cyc[BENCH_SAMPLES/2];
+    res->ops    = ops;
+    
+    printf("%-32s %8zu %11.1f %11.1f %8.2f %9.1f", name, bytes, res->ns_op, res->cyc_op,
+            (bytes != 0) ? (res->cyc_op / (double)bytes) : 0.0,
+            (bytes != 0) ? (((double)bytes * 1e3) / res->ns_op) : 0.0);
+    base = (bench.baseline != NULL) ? sub_baseline_ns(name) : 0.0;
+    if (base > 0.0) {
+        printf(" %+7.1f%%", ((res->ns_op - base) * 100.0) / base);
+    }
+    printf("\n");
+}
+
+static int sub_write_json(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    fprintf(fp, "{\"commit\":\"%s\", \"tsc_ghz\":%.4f, \"results\":[", BIRDMON_PARAM_GITHEAD, bench.tsc_ghz);
+    for (int i=0; i<bench.numresults; i++) {
+        bench_result_t* r = &bench.result[i];
+        fprintf(fp, "%s\n  {\"name\":\"%s\", \"bytes\":%zu, \"ops\":%llu, \"ns_per_op\":%.3f, \"cycles_per_op\":%.3f, "
+                    "\"cycles_per_byte\":%.4f, \"mb_per_s\":%.3f}", (i == 0) ? "" : ",", r->name, r->bytes,
+                    (unsigned long long)r->ops, r->ns_op, r->cyc_op,
+                    (r->bytes != 0) ? (r->cyc_op / (double)r->bytes) : 0.0,
+                    (r->bytes != 0) ? (((double)r->bytes * 1e3) / r->ns_op) : 0.0);
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp);
+}
+
+
+
+
+/** Inputs and benchmark bodies <BR>
+  * ========================================================================<BR>
+  * Every body does one operation and returns a non-negative value that
+  * depends on the output, so the work cannot be optimized away.
+  */
+
+typedef struct {
+    uint8_t*    src;
+    size_t      size;
+    size_t      cols;
+    uint8_t*    dst;
+} bench_buf_t;
+
+typedef struct {
+    const char* line;
+    size_t      size;
+    char*       work;
+} bench_line_t;
+
+typedef struct {
+    cJSON*      doc;
+    int         argc;
+    const char** argv;
+} bench_walk_t;
+
+static int bench_printhex(void* arg) {
+    bench_buf_t* b = arg;
+    uint8_t* src = b->src;
+    return fmt_printhex(b->dst, NULL, &src, b->size, b->cols);
+}
+
+static int bench_printtext(void* arg) {
+    bench_buf_t* b = arg;
+    uint8_t* src = b->src;
+    return fmt_printtext(b->dst, NULL, &src, b->size, b->cols);
+}
+
+static int bench_fprintalp(void* arg) {
+    bench_buf_t* b = arg;
+    uint8_t* src = b->src;
+    size_t accum = 0;
+    int rc = fmt_fprintalp(b->dst, &accum, &src, b->size);
+    
+    // Unknown ids return an error, but are still printed as hex
+    return (accum != 0) ? (int)accum : rc;
+}
+
+static int bench_hexdump_raw(void* arg) {
+    bench_buf_t* b = arg;
+    uint8_t* src = b->src;
+    return sub_hexdump_raw(b->dst, NULL, &src, b->size);
+}
+
+static int bench_passhex_loop(void* arg) {
+    bench_buf_t* b = arg;
+    uint8_t* src = b->src;
+    return sub_passhex_loop(b->dst, &src, b->size, b->cols);
+}
+
+static int bench_validate_ubx(void* arg) {
+    bench_buf_t* b = arg;
+    int numpkts;
+    int rc = ubx_validate_mga(b->src, (int)b->size, &numpkts, NULL);
+    return (rc != UBX_ERR_none) ? -1 : numpkts;
+}
+
+static int bench_parsestring(void* arg) {
+/// parsestring tokenizes in place, so each operation works on a fresh copy
+    bench_line_t* l = arg;
+    char** argv;
+    int argc;
+    memcpy(l->work, l->line, l->size + 1);
+    argc = cmdutils_parsestring(NULL, &argv, "getanow", l->work, l->size);
+    if (argc > 0) {
+        cmdutils_freeargv(NULL, argv);
+    }
+    return argc;
+}
+
+static int bench_parseargs(void* arg) {
+    bench_line_t* l = arg;
+    char** argv;
+    memcpy(l->work, l->line, l->size + 1);
+    return cmdutils_parseargs(&argv, "getanow", l->work, l->size);
+}
+
+static int bench_envelope_scan(void* arg) {
+    bench_line_t* l = arg;
+    envelope_t env;
+    memcpy(l->work, l->line, l->size + 1);
+    return envelope_scan(&env, l->work, l->size);
+}
+
+static int bench_envelope_cjson(void* arg) {
+/// What dterm did before the scanner, and still does on fallback
+    bench_line_t* l = arg;
+    cJSON* obj  = cJSON_Parse(l->line);
+    int rc      = cJSON_IsString(cJSON_GetObjectItemCaseSensitive(obj, "data")) ? 1 : -1;
+    cJSON_Delete(obj);
+    return rc;
+}
+
+static int bench_cjson_walk(void* arg) {
+    bench_walk_t* w = arg;
+    return (cJSON_walk(w->doc, w->argc, w->argv) != NULL) ? 1 : -1;
+}
+
+static int bench_bintex_ss(void* arg) {
+    bench_buf_t* b = arg;
+    return bintex_ss(b->src, b->dst, 4096);
+}
+
+
+
+
+static void sub_fill_binary(uint8_t* dst, size_t size, uint32_t* rng) {
+    for (size_t i=0; i<size; i++) {
+        dst[i] = (uint8_t)sub_rand(rng);
+    }
+}
+
+static void sub_fill_text(uint8_t* dst, size_t size, uint32_t* rng) {
+/// Printable ASCII, with the quotes and line breaks that the text
+/// formatters have to escape or replace
+    for (size_t i=0; i<size; i++) {
+        uint32_t r = sub_rand(rng) % 64;
+        dst[i] = (r == 0) ? '\"' : ((r == 1) ? '\n' : (uint8_t)(' ' + (sub_rand(rng) % 95)));
+    }
+}
+
+static void sub_fill_hextext(uint8_t* dst, size_t size, uint32_t* rng) {
+/// Hex digits in mixed case, in space separated pairs
+    static const char digits[] = "0123456789abcdefABCDEF";
+    for (size_t i=0; i<size; i++) {
+        dst[i] = ((i % 3) == 2) ? ' ' : (uint8_t)digits[sub_rand(rng) % 22];
+    }
+}
+
+static size_t sub_fill_ubx(uint8_t* dst, int numsv, uint32_t* rng) {
+/// MGA-GPS ephemeris and almanac packets, as in an AssistNow download
+    uint8_t* cursor = dst;
+    for (int i=0; i<(2*numsv); i++) {
+        uint16_t plen = (i & 1) ? 36 : 68;
+        uint8_t ck_a = 0;
+        uint8_t ck_b = 0;
+        cursor[0] = 0xB5;
+        cursor[1] = 0x62;
+        cursor[2] = 0x13;
+        cursor[3] = 0x00;
+        cursor[4] = (uint8_t)plen;
+        cursor[5] = 0;
+        sub_fill_binary(&cursor[6], plen, rng);
+        cursor[6] = (i & 1) ? 2 : 1;
+        cursor[8] = (uint8_t)((i / 2) % 32) + 1;
+        for (int j=2; j<(6+plen); j++) {
+            ck_a += cursor[j];
+            ck_b += ck_a;
+        }
+        cursor[6+plen]  = ck_a;
+        cursor[7+plen]  = ck_b;
+        cursor         += 8 + plen;
+    }
+    return (size_t)(cursor - dst);
+}
+
+static cJSON* sub_geocode_doc(void) {
+/// A Google geocoding response, shaped like the one geoloc walks
+    cJSON* doc = cJSON_CreateObject();
+    cJSON* results = cJSON_AddArrayToObject(doc, "results");
+    for (int r=0; r<3; r++) {
+        cJSON* res = cJSON_CreateObject();
+        cJSON* comps = cJSON_AddArrayToObject(res, "address_components");
+        cJSON* geom;
+        cJSON* loc;
+        for (int c=0; c<8; c++) {
+            cJSON* comp = cJSON_CreateObject();
+            cJSON_AddStringToObject(comp, "long_name", "Market Street");
+            cJSON_AddStringToObject(comp, "short_name", "Market St");
+            cJSON_AddItemToArray(comps, comp);
+        }
+        cJSON_AddStringToObject(res, "formatted_address", "1 Market St, San Francisco, CA 94105, USA");
+        geom = cJSON_AddObjectToObject(res, "geometry");
+        cJSON_AddStringToObject(geom, "location_type", "ROOFTOP");
+        cJSON_AddObjectToObject(geom, "viewport");
+        loc = cJSON_AddObjectToObject(geom, "location");
+        cJSON_AddNumberToObject(loc, "lat", 37.7769487);
+        cJSON_AddNumberToObject(loc, "lng", -122.3978603);
+        cJSON_AddStringToObject(res, "place_id", "ChIJIQBpAG2ahYAR_6128GcTUEo");
+        cJSON_AddItemToArray(results, res);
+    }
+    cJSON_AddStringToObject(doc, "status", "OK");
+    return doc;
+}
+
+
+
+
+int main(int argc, char* argv[]) {
+    static const char* walkv[] = { "results", "0", "geometry", "location" };
+    static const char cmdline[] = "getanow -a 30 -z zstd --dict -H \"GPS:1-32 GAL:1-30\" "
+                                  "--if-none-match 7D865E959B2466918C9863AFCA942D0FB89D7C9AC0C99BAFC3749504DED97730";
+    static const char envline[] = "{\"type\":\"birdmon\", \"data\":\"getanow -a 30 -z zstd -H \\\"GPS:1-32\\\" "
+                                  "--if-none-match 7D865E959B2466918C9863AFCA942D0FB89D7C9AC0C99BAFC3749504DED97730\"}";
+    uint32_t rng    = 0x1F2E3D4C;
+    uint8_t* bin    = malloc(4096);
+    uint8_t* text   = malloc(4096);
+    uint8_t* hex    = malloc(8192);
+    uint8_t* alp    = malloc(3 * 260);
+    uint8_t* ubx    = malloc(65536);
+    uint8_t* btx    = malloc(1024);
+    uint8_t* dst    = malloc(65536);
+    char* work      = malloc(sizeof(cmdline));
+    char* envwork   = malloc(sizeof(envline));
+    const char* jsonpath = NULL;
+    bench_buf_t buf;
+    bench_line_t line = { cmdline, sizeof(cmdline)-1, work };
+    bench_line_t envl = { envline, sizeof(envline)-1, envwork };
+    bench_walk_t walk = { NULL, 4, walkv };
+    size_t ubxsize;
+    int opt;
+    
+    bench.sample_ns = 5000000ull;
+    while ((opt = getopt(argc, argv, "f:t:j:b:h")) != -1) {
+        switch (opt) {
+            case 'f': bench.filter = optarg; break;
+            case 't': bench.sample_ns = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'j': jsonpath = optarg; break;
+            case 'b': {
+                FILE* fp = fopen(optarg, "r");
+                static char basebuf[65536];
+                size_t n = (fp != NULL) ? fread(basebuf, 1, sizeof(basebuf)-1, fp) : 0;
+                if (fp != NULL) fclose(fp);
+                basebuf[n]      = 0;
+                bench.baseline  = cJSON_Parse(basebuf);
+                if (bench.baseline == NULL) {
+                    fprintf(stderr, "bench: cannot read baseline %s\n", optarg);
+                    return 1;
+                }
+            } break;
+            default:
+                fprintf(stderr, "Usage: %s [-f filter] [-t sample-ms] [-j out.json] [-b baseline.json]\n", argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((bin == NULL) || (text == NULL) || (hex == NULL) || (alp == NULL) 
+    ||  (ubx == NULL) || (btx == NULL) || (dst == NULL) || (work == NULL)) {
+        fprintf(stderr, "bench: insufficient memory\n");
+        return 1;
+    }
+    
+    // Fixed-seed inputs
+    sub_fill_binary(bin, 4096, &rng);
+    sub_fill_text(text, 4096, &rng);
+    sub_fill_hextext(hex, 8192, &rng);
+    
+    // ALP records: logger text (id 4, cmd 1), logger raw (id 4, cmd 0),
+    // and an unknown id that falls back to hex
+    for (int i=0; i<3; i++) {
+        uint8_t* rec = &alp[i*260];
+        rec[0] = 0xC0;
+        rec[1] = 240;
+        rec[2] = (i < 2) ? 4 : 0x21;
+        rec[3] = (i == 0) ? 1 : 0;
+        if (i == 0) sub_fill_text(&rec[4], 240, &rng);
+        else        sub_fill_binary(&rec[4], 240, &rng);
+    }
+    
+    // Bintex expression: a quoted string and a bracketed hex block
+    {   char* bcurs = (char*)btx;
+        bcurs = stpcpy(bcurs, "\"birdmon bintex benchmark string, 48 characters\" [");
+        for (int i=0; i<128; i++) {
+            bcurs += sprintf(bcurs, "%02X", (uint8_t)sub_rand(&rng));
+        }
+        strcpy(bcurs, "]");
+    }
+    
+    ubxsize  = sub_fill_ubx(ubx, 128, &rng);
+    walk.doc = sub_geocode_doc();
+    
+    // Formatters take their output format from cliopt, as in the daemon
+    bench.opts.intf         = INTF_socket;
+    bench.opts.format       = FORMAT_Default;
+    bench.opts.mempool_size = 16384;
+    cliopt_init(&bench.opts);
+    bench.tsc_ghz = sub_tsc_ghz();
+    
+    printf("commit %s, tsc %.3f GHz\n", BIRDMON_PARAM_GITHEAD, bench.tsc_ghz);
+    printf("%-32s %8s %11s %11s %8s %9s%s\n", "benchmark", "bytes", "ns/op", "cycles/op", "cyc/B", "MB/s",
+            (bench.baseline != NULL) ? "   delta" : "");
+    
+#   define RUN(NAME, FN, SRC, SIZE, COLS) do { \
+        buf = (bench_buf_t){ .src=(SRC), .size=(SIZE), .cols=(COLS), .dst=dst }; \
+        sub_run(NAME, FN, &buf, SIZE); \
+    } while (0)
+    
+    bench.opts.format = FORMAT_Default;
+    RUN("fmt_printhex/default",     &bench_printhex,    bin, 4096, 16);
+    RUN("fmt_printtext/default",    &bench_printtext,   text, 4096, 0);
+    RUN("fmt_fprintalp/default/text", &bench_fprintalp, &alp[0], 244, 0);
+    RUN("fmt_fprintalp/default/raw", &bench_fprintalp,  &alp[260], 244, 0);
+    RUN("fmt_fprintalp/default/other", &bench_fprintalp, &alp[520], 244, 0);
+    bench.opts.format = FORMAT_Json;
+    RUN("fmt_printhex/json",        &bench_printhex,    bin, 4096, 16);
+    RUN("fmt_printtext/json",       &bench_printtext,   text, 4096, 0);
+    RUN("fmt_fprintalp/json/text",  &bench_fprintalp,   &alp[0], 244, 0);
+    RUN("fmt_fprintalp/json/raw",   &bench_fprintalp,   &alp[260], 244, 0);
+    bench.opts.format = FORMAT_Hex;
+    RUN("fmt_printhex/hex",         &bench_printhex,    bin, 4096, 16);
+    RUN("fmt_fprintalp/hex",        &bench_fprintalp,   &alp[260], 244, 0);
+    bench.opts.format = FORMAT_Default;
+    RUN("sub_hexdump_raw",          &bench_hexdump_raw, bin, 4096, 0);
+    RUN("sub_passhex_loop/cols0",   &bench_passhex_loop, hex, 8192, 0);
+    RUN("sub_passhex_loop/cols16",  &bench_passhex_loop, hex, 8192, 16);
+    RUN("ubx_validate_mga",         &bench_validate_ubx, ubx, ubxsize, 0);
+    RUN("bintex_ss",                &bench_bintex_ss,   btx, strlen((char*)btx), 0);
+    
+#   undef RUN
+    
+    sub_run("cmdutils_parsestring",  &bench_parsestring, &line, line.size);
+    sub_run("cmdutils_parseargs",    &bench_parseargs,   &line, line.size);
+    sub_run("envelope_scan",         &bench_envelope_scan,  &envl, envl.size);
+    sub_run("envelope_cjson",        &bench_envelope_cjson, &envl, envl.size);
+    sub_run("cJSON_walk",            &bench_cjson_walk,  &walk, 0);
+    
+    if ((jsonpath != NULL) && (sub_write_json(jsonpath) != 0)) {
+        fprintf(stderr, "bench: cannot write %s\n", jsonpath);
+    }
+    
+    cJSON_Delete(walk.doc);
+    cJSON_Delete(bench.baseline);
+    free(bin);
+    free(text);
+    free(hex);
+    free(alp);
+    free(ubx);
+    free(btx);
+    free(dst);
+    free(work);
+    free(envwork);
+    return 0;
+}
@@ -0,0 +1,54 @@
+CC := gcc
+LD := ld
+
+BIRDMON_PKG   ?=
+BIRDMON_DEF   ?= 
+BIRDMON_INC   ?=
+BIRDMON_LIB   ?= 
+BIRDMON_OSCFLAGS ?=
+BIRDMON_APP   ?= bin
+BIRDMON_BLD   ?= build
+
+# Same optimization as the release build, so results reflect the daemon
+CFLAGS      ?= -std=gnu99 -O3 $(BIRDMON_OSCFLAGS) -pthread
+
+APPDIR      := ../../$(BIRDMON_APP)
+BUILDDIR    := ../../$(BIRDMON_BLD)
+LIB         := $(BIRDMON_LIB)
+LIBINC      := $(subst -L./,-L./../../,$(BIRDMON_LIBINC))
+INC			:= $(subst -I./,-I./../../,$(BIRDMON_INC)) -I./../../cmds
+
+# formatters.c is compiled into bench.c, for access to its static routines
+SOURCES     := bench.c \
+               ../../main/cliopt.c \
+               ../../main/envelope.c \
+               ../../main/ubx.c \
+               ../../main/utils.c \
+               ../../main/stats.c \
+               ../../main/trace.c \
+               ../../cmds/cmdutils.c
+
+BENCH_JSON  ?= $(BUILDDIR)/bench.json
+BENCH_BASELINE ?=
+BENCH_FILTER ?=
+
+
+all: run
+
+#Make the Directories
+directories:
+	@mkdir -p $(APPDIR)
+	@mkdir -p $(BUILDDIR)
+
+bench: directories
+	$(CC) $(CFLAGS) $(BIRDMON_DEF) $(INC) $(LIBINC) -o $(APPDIR)/bench $(SOURCES) $(LIB)
+
+#Run the suite, writing JSON results and comparing to a baseline if given
+run: bench
+	$(APPDIR)/bench -j $(BENCH_JSON) $(if $(BENCH_BASELINE),-b $(BENCH_BASELINE)) $(if $(BENCH_FILTER),-f $(BENCH_FILTER))
+
+clean:
+	@$(RM) -f $(APPDIR)/bench $(BENCH_JSON)
+
+#Non-File Targets
+.PHONY: all directories bench run clean
@@ -0,0 +1,709 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+/** @file   loadgen.c
+  * @brief  Load generator and latency benchmark for the birdmon socket protocol
+  *
+  * loadgen opens N concurrent clients on the UNIX socket of a running
+  * birdmon daemon, sends a weighted mix of commands wrapped in the JSON
+  * envelope, and waits for each command's ack before sending the next one.
+  *
+  * Without --rate, every client runs closed loop (back to back requests).
+  * With --rate, the total rate is split across the clients and each client
+  * follows a fixed send schedule.  When a client falls behind schedule the
+  * delay is charged to the request, i.e. latency is measured from the time
+  * the request *should* have been sent (coordinated omission correction).
+  * The uncorrected service time is reported alongside.
+  *
+  * The daemon needs no network access for this: set ubx_uri to a local copy
+  * of an AssistNow response, or to the mock server in test/mockanow.c, e.g.
+  *
+  *     echo 'var ubx_uri="file:///tmp/mga.ubx"' > /tmp/init.txt
+  *     birdmon -S /tmp/birdmon.sock -f json -I /tmp/init.txt &
+  *     loadgen -S /tmp/birdmon.sock -c 8 -t 20 -w 2
+  *     loadgen -S /tmp/birdmon.sock -c 8 -t 20 -r 2000 -x 9:getanow -x 1:var
+  *
+  * loadgen -e sends a single command and prints the response, which lets
+  * scripts (e.g. test/anowbench.sh) drive the daemon without other tools.
+  */
+
+// Local Headers
+#include <argtable3.h>
+
+// Standard C & POSIX Libraries
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/// Latency histograms are log-linear in ns: each power of two is split into
+/// 32 linear sub-buckets, so reported percentiles are within ~3%.  The top
+/// bucket covers values up to 2^40 ns (~18 minutes).
+#define LG_SUBBITS      5
+#define LG_SUB          (1 << LG_SUBBITS)
+#define LG_MAXEXP       39
+#define LG_BUCKETS      ((LG_MAXEXP - LG_SUBBITS + 2) * LG_SUB)
+
+#define LG_MAXCMDS      16
+#define LG_RXSIZE       65536
+#define LG_TIMEOUT_MS   5000
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double   sum;
+    uint64_t bucket[LG_BUCKETS];
+} lg_hist_t;
+
+typedef struct {
+    char*       name;
+    char*       envelope;
+    size_t      envsize;
+    unsigned    weight;
+} lg_cmd_t;
+
+typedef struct {
+    pthread_t   thread;
+    int         id;
+    int         fd;
+    uint32_t    rng;
+    bool        echo;
+    
+    // Results: index 0 is all commands, index n+1 is command n
+    lg_hist_t*  corrected;
+    lg_hist_t*  service;
+    uint64_t    errors;
+    uint64_t    timeouts;
+    uint64_t    reconnects;
+    uint64_t    rxbytes;
+    
+    // Receive buffer for response scanning
+    size_t      rxlen;
+    char        rxbuf[LG_RXSIZE];
+} lg_client_t;
+
+typedef struct {
+    const char* sockpath;
+    int         numclients;
+    double      rate;
+    uint64_t    interval;
+    uint64_t    t_start;
+    uint64_t    t_warm;
+    uint64_t    t_end;
+    int         numcmds;
+    unsigned    weightsum;
+    lg_cmd_t    cmd[LG_MAXCMDS];
+} lg_run_t;
+
+
+static lg_run_t run;
+static volatile sig_atomic_t stop_flag = 0;
+
+
+
+
+static uint64_t sub_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static void sub_sleep_until(uint64_t t) {
+    struct timespec ts;
+    ts.tv_sec   = (time_t)(t / 1000000000ull);
+    ts.tv_nsec  = (long)(t % 1000000000ull);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        if (stop_flag) break;
+    }
+}
+
+static void sub_sigint(int sig) {
+    stop_flag = 1;
+}
+
+
+
+
+static int sub_hist_index(uint64_t v) {
+    int exp;
+    if (v < LG_SUB) {
+        return (int)v;
+    }
+    exp = 63 - __builtin_clzll(v);
+    if (exp > LG_MAXEXP) {
+        return LG_BUCKETS - 1;
+    }
+    return ((exp - LG_SUBBITS + 1) * LG_SUB) + (int)((v >> (exp - LG_SUBBITS)) & (LG_SUB - 1));
+}
+
+static uint64_t sub_hist_value(int i) {
+/// Highest value that maps to bucket i
+    int exp;
+    uint64_t width;
+    if (i < LG_SUB) {
+        return (uint64_t)i;
+    }
+    exp     = (i / LG_SUB) - 1 + LG_SUBBITS;
+    width   = 1ull << (exp - LG_SUBBITS);
+    return (1ull << exp) + ((uint64_t)(i % LG_SUB) * width) + width - 1;
+}
+
+static void sub_hist_record(lg_hist_t* h, uint64_t v) {
+    if ((h->count == 0) || (v < h->min)) h->min = v;
+    if (v > h->max) h->max = v;
+    h->count++;
+    h->sum += (double)v;
+    h->bucket[sub_hist_index(v)]++;
+}
+
+static void sub_hist_merge(lg_hist_t* dst, const lg_hist_t* src) {
+    if (src->count == 0) {
+        return;
+    }
+    if ((dst->count == 0) || (src->min < dst->min)) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    for (int i=0; i<LG_BUCKETS; i++) {
+        dst->bucket[i] += src->bucket[i];
+    }
+}
+
+static uint64_t sub_hist_percentile(const lg_hist_t* h, double pct) {
+    uint64_t rank;
+    uint64_t seen = 0;
+    
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t)((pct / 100.0) * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    
+    for (int i=0; i<LG_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint64_t v = sub_hist_value(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static void sub_hist_print(const char* label, const lg_hist_t* h) {
+    printf("  %-12s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+            (unsigned long long)h->count,
+            (h->count == 0) ? 0.0 : (h->sum / (double)h->count) / 1000.0,
+            (double)sub_hist_percentile(h, 50.0)  / 1000.0,
+            (double)sub_hist_percentile(h, 90.0)  / 1000.0,
+            (double)sub_hist_percentile(h, 99.0)  / 1000.0,
+            (double)sub_hist_percentile(h, 99.9)  / 1000.0,
+            (double)h->max / 1000.0);
+}
+
+
+
+
+static int sub_cmd_add(const char* spec) {
+/// spec is "weight:command line" or just "command line" (weight 1).  The
+/// command line is wrapped into the JSON envelope once, up front.
+    lg_cmd_t* cmd;
+    const char* line;
+    char* end;
+    char* dst;
+    size_t namelen;
+    unsigned long weight = 1;
+    
+    if (run.numcmds >= LG_MAXCMDS) {
+        return -1;
+    }
+    
+    line    = spec;
+    weight  = strtoul(spec, &end, 10);
+    if ((end != spec) && (*end == ':')) {
+        line = end + 1;
+    }
+    else {
+        weight = 1;
+    }
+    while (*line == ' ') line++;
+    if ((*line == 0) || (weight == 0)) {
+        return -2;
+    }
+    
+    cmd             = &run.cmd[run.numcmds];
+    namelen         = strcspn(line, " \t");
+    cmd->name       = strndup(line, namelen);
+    cmd->weight     = (unsigned)weight;
+    cmd->envelope   = malloc(32 + namelen + (2 * strlen(line)));
+    if ((cmd->name == NULL) || (cmd->envelope == NULL)) {
+        return -3;
+    }
+    
+    dst = cmd->envelope + sprintf(cmd->envelope, "{\"type\":\"%s\", \"data\":\"", cmd->name);
+    for (; *line != 0; line++) {
+        if ((*line == '\"') || (*line == '\\')) {
+            *dst++ = '\\';
+        }
+        *dst++ = *line;
+    }
+    dst = stpcpy(dst, "\"}\n");
+    cmd->envsize    = (size_t)(dst - cmd->envelope);
+    run.weightsum  += cmd->weight;
+    run.numcmds++;
+    return 0;
+}
+
+static int sub_cmd_pick(lg_client_t* cl) {
+    unsigned pick;
+    int i;
+    
+    // xorshift32: a per-client generator keeps the clients independent
+    cl->rng ^= cl->rng << 13;
+    cl->rng ^= cl->rng >> 17;
+    cl->rng ^= cl->rng << 5;
+    pick = cl->rng % run.weightsum;
+    
+    for (i=0; i<(run.numcmds-1); i++) {
+        if (pick < run.cmd[i].weight) {
+            break;
+        }
+        pick -= run.cmd[i].weight;
+    }
+    return i;
+}
+
+
+
+
+static int sub_connect(lg_client_t* cl) {
+    struct sockaddr_un addr;
+    
+    if (cl->fd >= 0) {
+        close(cl->fd);
+    }
+    cl->rxlen   = 0;
+    cl->fd      = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (cl->fd < 0) {
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, run.sockpath, sizeof(addr.sun_path)-1);
+    if (connect(cl->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(cl->fd);
+        cl->fd = -1;
+        return -2;
+    }
+    return 0;
+}
+
+static int sub_send(lg_client_t* cl, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(cl->fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int sub_scan_ack(lg_client_t* cl) {
+/// Looks for a complete ack line in the receive buffer.  Returns the ack's
+/// error code (0 on success), or -1 if no complete ack is buffered yet.  The
+/// markers cover the JSON and the default output formats.
+    static const char* markers[] = { "{\"type\":\"ack\"", "ACK: ", "ERR: " };
+    char* mark = NULL;
+    char* eol;
+    int which;
+    int err;
+    
+    cl->rxbuf[cl->rxlen] = 0;
+    for (which=0; which<3; which++) {
+        mark = strstr(cl->rxbuf, markers[which]);
+        if (mark != NULL) break;
+    }
+    if ((mark == NULL) || ((eol = strchr(mark, '\n')) == NULL)) {
+        // Drop payload bytes that cannot hold an ack, keeping enough of the
+        // tail that a marker split across reads is still found.
+        if ((mark == NULL) && (cl->rxlen > (LG_RXSIZE/2))) {
+            memmove(cl->rxbuf, &cl->rxbuf[cl->rxlen-16], 16);
+            cl->rxlen = 16;
+        }
+        return -1;
+    }
+    
+    if (which == 0) {
+        char* errfield = strstr(mark, "\"err\":");
+        err = ((errfield != NULL) && (errfield < eol)) ? abs(atoi(errfield+6)) : 1;
+    }
+    else if (which == 2) {
+        char* paren = strchr(mark, '(');
+        err = ((paren != NULL) && (paren < eol)) ? abs(atoi(paren+1)) : 1;
+        err = (err == 0) ? 1 : err;
+    }
+    else {
+        err = 0;
+    }
+    
+    // Consume through the end of the ack line
+    eol++;
+    cl->rxlen -= (size_t)(eol - cl->rxbuf);
+    memmove(cl->rxbuf, eol, cl->rxlen);
+    return err;
+}
+
+static int sub_await_ack(lg_client_t* cl) {
+/// Returns the ack error code (>= 0), -1 on timeout, -2 if the daemon closed
+/// the connection.
+    struct pollfd pfd;
+    int rc;
+    
+    while ((rc = sub_scan_ack(cl)) < 0) {
+        ssize_t n;
+        pfd.fd      = cl->fd;
+        pfd.events  = POLLIN;
+        rc = poll(&pfd, 1, LG_TIMEOUT_MS);
+        if (rc == 0) {
+            return -1;
+        }
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -2;
+        }
+        n = recv(cl->fd, &cl->rxbuf[cl->rxlen], (LG_RXSIZE-1) - cl->rxlen, 0);
+        if (n <= 0) {
+            return -2;
+        }
+        if (cl->echo) {
+            fwrite(&cl->rxbuf[cl->rxlen], 1, (size_t)n, stdout);
+        }
+        cl->rxlen   += (size_t)n;
+        cl->rxbytes += (uint64_t)n;
+    }
+    return rc;
+}
+
+
+
+
+static int sub_exec(const char* line) {
+/// Sends one raw command line (no envelope) and echoes the response through
+/// its ack.  Returns the ack error code, or -1 on connection failure.
+    static lg_client_t cl;
+    int rc;
+    
+    cl.fd   = -1;
+    cl.echo = true;
+    if (sub_connect(&cl) != 0) {
+        return -1;
+    }
+    rc = -1;
+    if ((sub_send(&cl, line, strlen(line)) == 0) && (sub_send(&cl, "\n", 1) == 0)) {
+        rc = sub_await_ack(&cl);
+    }
+    close(cl.fd);
+    return rc;
+}
+
+
+
+
+static void* sub_client_thread(void* arg) {
+    lg_client_t* cl = arg;
+    uint64_t t_next;
+    
+    if (sub_connect(cl) != 0) {
+        fprintf(stderr, "client %i: cannot connect to %s: %s\n", cl->id, run.sockpath, strerror(errno));
+        cl->errors++;
+        return NULL;
+    }
+    
+    // Stagger the schedules so the clients don't fire in lockstep
+    t_next = run.t_start + ((run.interval * (uint64_t)cl->id) / (uint64_t)run.numclients);
+    sub_sleep_until(t_next);
+    
+    while (!stop_flag) {
+        uint64_t t_intended;
+        uint64_t t_send;
+        uint64_t t_done;
+        int c;
+        int rc;
+        
+        t_send = sub_now();
+        if (run.interval != 0) {
+            if (t_send < t_next) {
+                sub_sleep_until(t_next);
+                t_send = sub_now();
+            }
+            t_intended  = t_next;
+            t_next     += run.interval;
+        }
+        else {
+            t_intended  = t_send;
+        }
+        if (t_intended >= run.t_end) {
+            break;
+        }
+        
+        c = sub_cmd_pick(cl);
+        if (sub_send(cl, run.cmd[c].envelope, run.cmd[c].envsize) == 0) {
+            rc = sub_await_ack(cl);
+        }
+        else {
+            rc = -2;
+        }
+        t_done = sub_now();
+        
+        if (t_intended >= run.t_warm) {
+            if (rc == 0) {
+                sub_hist_record(&cl->corrected[0],   t_done - t_intended);
+                sub_hist_record(&cl->corrected[c+1], t_done - t_intended);
+                sub_hist_record(&cl->service[0],     t_done - t_send);
+                sub_hist_record(&cl->service[c+1],   t_done - t_send);
+            }
+            else if (rc == -1) {
+                cl->timeouts++;
+            }
+            else {
+                cl->errors++;
+            }
+        }
+        
+        // A timed-out or dropped connection cannot be resynchronised
+        if (rc < 0) {
+            cl->reconnects++;
+            if (sub_connect(cl) != 0) {
+                sub_sleep_until(sub_now() + 100000000ull);
+            }
+        }
+    }
+    
+    if (cl->fd >= 0) {
+        close(cl->fd);
+    }
+    return NULL;
+}
+
+
+
+
+static void sub_report(lg_client_t* clients, double seconds) {
+    lg_hist_t* corrected;
+    lg_hist_t* service;
+    uint64_t errors     = 0;
+    uint64_t timeouts   = 0;
+    uint64_t reconnects = 0;
+    uint64_t rxbytes    = 0;
+    uint64_t total;
+    
+    corrected   = calloc((size_t)run.numcmds+1, sizeof(lg_hist_t));
+    service     = calloc((size_t)run.numcmds+1, sizeof(lg_hist_t));
+    if ((corrected == NULL) || (service == NULL)) {
+        goto sub_report_EXIT;
+    }
+    
+    for (int i=0; i<run.numclients; i++) {
+        for (int c=0; c<=run.numcmds; c++) {
+            sub_hist_merge(&corrected[c], &clients[i].corrected[c]);
+            sub_hist_merge(&service[c], &clients[i].service[c]);
+        }
+        errors     += clients[i].errors;
+        timeouts   += clients[i].timeouts;
+        reconnects += clients[i].reconnects;
+        rxbytes    += clients[i].rxbytes;
+    }
+    
+    if (run.interval != 0) {
+        printf("%i clients, %.2f s measured, open loop at %.1f req/s\n", run.numclients, seconds, run.rate);
+    }
+    else {
+        printf("%i clients, %.2f s measured, closed loop\n", run.numclients, seconds);
+    }
+    total = corrected[0].count + errors + timeouts;
+    printf("  requests   %12llu  (%.1f req/s)\n", (unsigned long long)total, (double)total / seconds);
+    printf("  errors     %12llu\n", (unsigned long long)errors);
+    printf("  timeouts   %12llu\n", (unsigned long long)timeouts);
+    printf("  reconnects %12llu\n", (unsigned long long)reconnects);
+    printf("  received   %12llu  (%.2f MB/s)\n", (unsigned long long)rxbytes, ((double)rxbytes / seconds) / 1e6);
+    
+    printf("\n%s latency (us)\n", (run.interval != 0) ? "Corrected" : "Request");
+    printf("  %-12s %10s %9s %9s %9s %9s %9s %9s\n", "command", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    sub_hist_print("all", &corrected[0]);
+    for (int c=0; c<run.numcmds; c++) {
+        sub_hist_print(run.cmd[c].name, &corrected[c+1]);
+    }
+    
+    if (run.interval != 0) {
+        printf("\nService time, uncorrected (us)\n");
+        printf("  %-12s %10s %9s %9s %9s %9s %9s %9s\n", "command", "count", "mean", "p50", "p90", "p99", "p999", "max");
+        sub_hist_print("all", &service[0]);
+        for (int c=0; c<run.numcmds; c++) {
+            sub_hist_print(run.cmd[c].name, &service[c+1]);
+        }
+    }
+    
+    sub_report_EXIT:
+    free(corrected);
+    free(service);
+}
+
+
+
+
+int main(int argc, char* argv[]) {
+    struct arg_file* sock   = arg_file1("S","socket","path",       "Socket path of the birdmon daemon");
+    struct arg_int* clients = arg_int0("c","clients","N",           "Number of concurrent clients (default 4)");
+    struct arg_dbl* secs    = arg_dbl0("t","time","seconds",        "Duration of the run, after warmup (default 10)");
+    struct arg_dbl* warm    = arg_dbl0("w","warmup","seconds",      "Warmup time excluded from results (default 1)");
+    struct arg_dbl* rate    = arg_dbl0("r","rate","req/s",          "Total open-loop request rate (default: closed loop)");
+    struct arg_str* cmds    = arg_strn("x","cmd","weight:cmdline", 0, LG_MAXCMDS,
+                                                                    "Command in the mix (default 8:getanow 1:var 1:cmdls)");
+    struct arg_str* exec    = arg_str0("e","exec","cmdline",        "Send one command, print the response and exit");
+    struct arg_lit* help    = arg_lit0(NULL,"help",                 "Print this help and exit");
+    struct arg_end* end     = arg_end(10);
+    void* argtable[]        = { sock, clients, secs, warm, rate, cmds, exec, help, end };
+    const char* progname    = "loadgen";
+    lg_client_t* client     = NULL;
+    int numalloc            = 0;
+    double seconds          = 10.0;
+    double warmup           = 1.0;
+    int exitcode            = 0;
+    
+    if (arg_nullcheck(argtable) != 0) {
+        fprintf(stderr, "%s: insufficient memory\n", progname);
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    if (arg_parse(argc, argv, argtable) > 0) {
+        if (help->count == 0) {
+            arg_print_errors(stderr, end, progname);
+            fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+            exitcode = 1;
+            goto main_FINISH;
+        }
+    }
+    if (help->count > 0) {
+        printf("Usage: %s", progname);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+        goto main_FINISH;
+    }
+    
+    run.sockpath    = sock->filename[0];
+    if (exec->count > 0) {
+        exitcode = (sub_exec(exec->sval[0]) == 0) ? 0 : 1;
+        goto main_FINISH;
+    }
+    
+    run.numclients  = (clients->count > 0) ? clients->ival[0] : 4;
+    run.rate        = (rate->count > 0) ? rate->dval[0] : 0.0;
+    seconds         = (secs->count > 0) ? secs->dval[0] : seconds;
+    warmup          = (warm->count > 0) ? warm->dval[0] : warmup;
+    if ((run.numclients < 1) || (seconds <= 0.0) || (warmup < 0.0) || (run.rate < 0.0)) {
+        fprintf(stderr, "%s: clients, time and rate must be positive\n", progname);
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    
+    if (cmds->count == 0) {
+        sub_cmd_add("8:getanow");
+        sub_cmd_add("1:var");
+        sub_cmd_add("1:cmdls");
+    }
+    for (int i=0; i<cmds->count; i++) {
+        if (sub_cmd_add(cmds->sval[i]) != 0) {
+            fprintf(stderr, "%s: bad command spec \"%s\"\n", progname, cmds->sval[i]);
+            exitcode = 1;
+            goto main_FINISH;
+        }
+    }
+    
+    client = calloc((size_t)run.numclients, sizeof(lg_client_t));
+    if (client == NULL) {
+        fprintf(stderr, "%s: insufficient memory\n", progname);
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    numalloc = run.numclients;
+    
+    signal(SIGINT, &sub_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Each client is scheduled every interval ns, so the aggregate is rate
+    run.interval    = (run.rate > 0.0) ? (uint64_t)(((double)run.numclients * 1e9) / run.rate) : 0;
+    run.t_start     = sub_now() + 100000000ull;
+    run.t_warm      = run.t_start + (uint64_t)(warmup * 1e9);
+    run.t_end       = run.t_warm + (uint64_t)(seconds * 1e9);
+    
+    for (int i=0; i<run.numclients; i++) {
+        client[i].id        = i;
+        client[i].fd        = -1;
+        client[i].rng       = 2463534242u + (uint32_t)i * 2654435761u;
+        client[i].corrected = calloc((size_t)run.numcmds+1, sizeof(lg_hist_t));
+        client[i].service   = calloc((size_t)run.numcmds+1, sizeof(lg_hist_t));
+        if ((client[i].corrected == NULL) || (client[i].service == NULL)
+        ||  (pthread_create(&client[i].thread, NULL, &sub_client_thread, &client[i]) != 0)) {
+            fprintf(stderr, "%s: could not start client %i\n", progname, i);
+            run.numclients  = i;
+            stop_flag       = 1;
+            exitcode        = 1;
+            break;
+        }
+    }
+    
+    for (int i=0; i<run.numclients; i++) {
+        pthread_join(client[i].thread, NULL);
+    }
+    
+    if (exitcode == 0) {
+        uint64_t t_stop = sub_now();
+        if (t_stop > run.t_end) {
+            t_stop = run.t_end;
+        }
+        sub_report(client, (t_stop > run.t_warm) ? (double)(t_stop - run.t_warm) / 1e9 : 0.0);
+    }
+    
+    main_FINISH:
+    if (client != NULL) {
+        for (int i=0; i<numalloc; i++) {
+            free(client[i].corrected);
+            free(client[i].service);
+        }
+        free(client);
+    }
+    for (int c=0; c<run.numcmds; c++) {
+        free(run.cmd[c].name);
+        free(run.cmd[c].envelope);
+    }
+    arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+    return exitcode;
+}
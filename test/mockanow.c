@@ -0,0 +1,502 @@
+/* Copyright 2020, JP Norair
+  *
+  * Licensed under the OpenTag License, Version 1.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  * http://www.indigresso.com/wiki/doku.php?id=opentag:license_1_0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  *
+  */
+
+
+/** @file   mockanow.c
+  * @brief  Mock u-blox AssistNow upstream, for offline backend benchmarks
+  *
+  * mockanow is a small HTTP/1.1 server on 127.0.0.1 that answers every GET
+  * with an MGA blob, ignoring the path and query.  The blobs come from
+  * recorded AssistNow responses (-f, rotated per request), or else a
+  * synthetic corpus of valid MGA packets is generated.  The response can be
+  * delayed, throttled, sent with chunked transfer encoding, corrupted (one
+  * byte flipped, so validation fails) or truncated (the connection closes
+  * before Content-Length bytes, so the download fails).
+  *
+  * Point the daemon at it with:
+  *
+  *     var ubx_uri="http://127.0.0.1:8321/GetOnlineData.ashx"
+  *
+  * Or write the synthetic corpus to a file and use a file:// ubx_uri, which
+  * takes no query string:
+  *
+  *     mockanow -n 64 -o /tmp/mga.ubx
+  *     var ubx_uri="file:///tmp/mga.ubx"
+  */
+
+// Local Headers
+#include <argtable3.h>
+
+// Standard C & POSIX Libraries
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MOCK_MAXFILES   16
+#define MOCK_REQSIZE    8192
+#define MOCK_SLICE      16384
+
+typedef struct {
+    uint8_t*    data;
+    size_t      size;
+} mock_blob_t;
+
+typedef struct {
+    int         numblobs;
+    mock_blob_t blob[MOCK_MAXFILES];
+    
+    // Response shaping
+    uint64_t    latency;        // ns before the response headers
+    uint64_t    jitter;         // ns, uniform, added to latency
+    double      bandwidth;      // bytes/s, 0 is unlimited
+    size_t      chunk;          // chunked transfer encoding, 0 is off
+    double      p_corrupt;
+    double      p_truncate;
+    uint32_t    seed;
+    
+    // Counters, updated atomically by the connection threads
+    uint64_t    requests;
+    uint64_t    corrupted;
+    uint64_t    truncated;
+    uint64_t    bytes;
+} mock_t;
+
+
+static mock_t mock;
+static volatile sig_atomic_t stop_flag = 0;
+
+
+
+
+static uint64_t sub_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static void sub_sleep_until(uint64_t t) {
+    struct timespec ts;
+    ts.tv_sec   = (time_t)(t / 1000000000ull);
+    ts.tv_nsec  = (long)(t % 1000000000ull);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void sub_sigstop(int sig) {
+    stop_flag = 1;
+}
+
+static uint32_t sub_rand(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static double sub_randf(uint32_t* state) {
+    return (double)sub_rand(state) / 4294967296.0;
+}
+
+
+
+
+static size_t sub_ubx_frame(uint8_t* dst, uint8_t msg_id, const uint8_t* payload, uint16_t plen) {
+/// Frames an MGA (class 0x13) payload, with the UBX Fletcher checksum over
+/// class, id, length and payload.
+    uint8_t ck_a = 0;
+    uint8_t ck_b = 0;
+    
+    dst[0]  = 0xB5;
+    dst[1]  = 0x62;
+    dst[2]  = 0x13;
+    dst[3]  = msg_id;
+    dst[4]  = (uint8_t)(plen & 255);
+    dst[5]  = (uint8_t)(plen >> 8);
+    memcpy(&dst[6], payload, plen);
+    
+    for (size_t i=2; i<(6+(size_t)plen); i++) {
+        ck_a += dst[i];
+        ck_b += ck_a;
+    }
+    dst[6+plen] = ck_a;
+    dst[7+plen] = ck_b;
+    
+    return 8 + (size_t)plen;
+}
+
+static int sub_synth_corpus(mock_blob_t* blob, int numsv, uint32_t seed) {
+/// Generates an AssistNow-like response: MGA-INI-TIME_UTC, GPS UTC and
+/// ionosphere, then ephemeris and almanac per SV.  SVs are spread over GPS,
+/// Galileo, BeiDou and GLONASS, 32 each.  Payload contents are random, but
+/// the type and svId bytes are where the backend keys them.
+    static const struct { uint8_t id; uint16_t eph; uint16_t alm; } gnss[4] = {
+        { 0x00, 68, 36 },   // GPS
+        { 0x02, 76, 32 },   // Galileo
+        { 0x03, 88, 40 },   // BeiDou
+        { 0x06, 48, 36 },   // GLONASS
+    };
+    uint8_t payload[128];
+    uint32_t rng = (seed == 0) ? 1 : seed;
+    uint8_t* cursor;
+    
+    blob->data = malloc(256 + ((size_t)numsv * (2*8 + 88 + 40)));
+    if (blob->data == NULL) {
+        return -1;
+    }
+    cursor = blob->data;
+    
+#   define SYNTH(ID, TYPE, SVID, LEN) do { \
+        for (int b_=0; b_<(LEN); b_++) payload[b_] = (uint8_t)sub_rand(&rng); \
+        payload[0] = (TYPE); \
+        payload[1] = 0; \
+        payload[2] = (SVID); \
+        cursor += sub_ubx_frame(cursor, (ID), payload, (LEN)); \
+    } while (0)
+    
+    SYNTH(0x40, 0x10, 0, 24);       // INI-TIME_UTC
+    SYNTH(0x00, 0x05, 0, 20);       // GPS-UTC
+    SYNTH(0x00, 0x06, 0, 16);       // GPS-IONO
+    for (int i=0; i<numsv; i++) {
+        int g = (i / 32) & 3;
+        SYNTH(gnss[g].id, 0x01, (uint8_t)((i % 32) + 1), gnss[g].eph);
+        SYNTH(gnss[g].id, 0x02, (uint8_t)((i % 32) + 1), gnss[g].alm);
+    }
+    
+#   undef SYNTH
+    
+    blob->size = (size_t)(cursor - blob->data);
+    return 0;
+}
+
+static int sub_load_blob(mock_blob_t* blob, const char* path) {
+    FILE* fp;
+    long size;
+    int rc = 0;
+    
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) <= 0)) {
+        rc = -2;
+        goto sub_load_blob_EXIT;
+    }
+    rewind(fp);
+    
+    blob->size = (size_t)size;
+    blob->data = malloc(blob->size);
+    if (blob->data == NULL) {
+        rc = -3;
+        goto sub_load_blob_EXIT;
+    }
+    if (fread(blob->data, 1, blob->size, fp) != blob->size) {
+        free(blob->data);
+        blob->data = NULL;
+        rc = -4;
+    }
+    
+    sub_load_blob_EXIT:
+    fclose(fp);
+    return rc;
+}
+
+
+
+
+static int sub_send(int fd, const void* data, size_t size) {
+    const uint8_t* cursor = data;
+    while (size > 0) {
+        ssize_t n = send(fd, cursor, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cursor += n;
+        size   -= (size_t)n;
+    }
+    return 0;
+}
+
+static int sub_send_paced(int fd, const uint8_t* data, size_t size, uint64_t t_start, size_t* sent) {
+/// Sends in slices, sleeping between them so that the running average does
+/// not exceed the configured bandwidth.
+    while (size > 0) {
+        size_t slice = (size > MOCK_SLICE) ? MOCK_SLICE : size;
+        if (mock.bandwidth > 0.0) {
+            size_t paced = (size_t)(mock.bandwidth / 100.0);
+            slice = (paced < 1) ? 1 : ((slice > paced) ? paced : slice);
+            sub_sleep_until(t_start + (uint64_t)(((double)*sent * 1e9) / mock.bandwidth));
+        }
+        if (sub_send(fd, data, slice) != 0) {
+            return -1;
+        }
+        data   += slice;
+        size   -= slice;
+        *sent  += slice;
+    }
+    return 0;
+}
+
+static void* sub_conn_thread(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char req[MOCK_REQSIZE] = "";
+    char hdr[256];
+    size_t reqlen = 0;
+    uint64_t reqnum;
+    uint32_t rng;
+    mock_blob_t* blob;
+    uint8_t* body = NULL;
+    size_t bodysize;
+    size_t sent = 0;
+    uint64_t t_start;
+    int hdrlen;
+    
+    // Read the request head.  The request itself does not matter.
+    while ((reqlen < (sizeof(req)-1)) && (strstr(req, "\r\n\r\n") == NULL)) {
+        ssize_t n = recv(fd, &req[reqlen], (sizeof(req)-1) - reqlen, 0);
+        if (n <= 0) {
+            goto sub_conn_thread_EXIT;
+        }
+        reqlen += (size_t)n;
+        req[reqlen] = 0;
+    }
+    
+    reqnum  = __atomic_fetch_add(&mock.requests, 1, __ATOMIC_RELAXED);
+    rng     = (mock.seed ^ (uint32_t)(reqnum * 2654435761u)) | 1;
+    blob    = &mock.blob[reqnum % (uint64_t)mock.numblobs];
+    
+    if (strncmp(req, "GET ", 4) != 0) {
+        hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        sub_send(fd, hdr, (size_t)hdrlen);
+        goto sub_conn_thread_EXIT;
+    }
+    
+    // Corruption flips one byte of a private copy of the blob
+    bodysize = blob->size;
+    body     = blob->data;
+    if (sub_randf(&rng) < mock.p_corrupt) {
+        body = malloc(bodysize);
+        if (body == NULL) {
+            goto sub_conn_thread_EXIT;
+        }
+        memcpy(body, blob->data, bodysize);
+        body[sub_rand(&rng) % bodysize] ^= (uint8_t)(1 + (sub_rand(&rng) % 255));
+        __atomic_fetch_add(&mock.corrupted, 1, __ATOMIC_RELAXED);
+    }
+    if (sub_randf(&rng) < mock.p_truncate) {
+        bodysize = sub_rand(&rng) % blob->size;
+        __atomic_fetch_add(&mock.truncated, 1, __ATOMIC_RELAXED);
+    }
+    
+    t_start = sub_now();
+    if ((mock.latency != 0) || (mock.jitter != 0)) {
+        uint64_t delay = mock.latency;
+        if (mock.jitter != 0) {
+            delay += (uint64_t)(sub_randf(&rng) * (double)mock.jitter);
+        }
+        sub_sleep_until(t_start + delay);
+        t_start = sub_now();
+    }
+    
+    if (mock.chunk != 0) {
+        hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: application/ubx\r\n"
+                                            "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+    }
+    else {
+        hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: application/ubx\r\n"
+                                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", blob->size);
+    }
+    if (sub_send(fd, hdr, (size_t)hdrlen) != 0) {
+        goto sub_conn_thread_EXIT;
+    }
+    
+    if (mock.chunk != 0) {
+        size_t offset = 0;
+        while (offset < bodysize) {
+            size_t len = bodysize - offset;
+            len     = (len > mock.chunk) ? mock.chunk : len;
+            hdrlen  = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+            if ((sub_send(fd, hdr, (size_t)hdrlen) != 0)
+            ||  (sub_send_paced(fd, &body[offset], len, t_start, &sent) != 0)
+            ||  (sub_send(fd, "\r\n", 2) != 0)) {
+                goto sub_conn_thread_EXIT;
+            }
+            offset += len;
+        }
+        // A truncated chunked response never gets its last-chunk
+        if (bodysize == blob->size) {
+            sub_send(fd, "0\r\n\r\n", 5);
+        }
+    }
+    else {
+        sub_send_paced(fd, body, bodysize, t_start, &sent);
+    }
+    
+    sub_conn_thread_EXIT:
+    __atomic_fetch_add(&mock.bytes, sent, __ATOMIC_RELAXED);
+    if ((body != NULL) && (body != blob->data)) {
+        free(body);
+    }
+    close(fd);
+    return NULL;
+}
+
+
+
+
+int main(int argc, char* argv[]) {
+    struct arg_int* port    = arg_int0("p","port","port",           "TCP port on 127.0.0.1 (default 8321)");
+    struct arg_file* files  = arg_filen("f","file","mga-file", 0, MOCK_MAXFILES,
+                                                                    "Recorded AssistNow response(s), rotated per request");
+    struct arg_int* synth   = arg_int0("n","synth","numsv",         "Without -f, synthesize a corpus with this many SVs (default 32)");
+    struct arg_file* output = arg_file0("o","output","path",        "Write the corpus to a file and exit");
+    struct arg_dbl* latency = arg_dbl0("l","latency","ms",          "Delay before the response headers");
+    struct arg_dbl* jitter  = arg_dbl0("j","jitter","ms",           "Uniform random delay added to latency");
+    struct arg_dbl* bw      = arg_dbl0("b","bandwidth","bytes/s",   "Throttle the response body");
+    struct arg_int* chunk   = arg_int0("k","chunk","bytes",         "Use chunked transfer encoding with this chunk size");
+    struct arg_dbl* corrupt = arg_dbl0("e","corrupt","probability", "Flip one byte of the response");
+    struct arg_dbl* trunc   = arg_dbl0("t","truncate","probability","Close the connection partway through the body");
+    struct arg_int* seed    = arg_int0("s","seed","N",              "Random seed (default 1)");
+    struct arg_lit* help    = arg_lit0(NULL,"help",                 "Print this help and exit");
+    struct arg_end* end     = arg_end(10);
+    void* argtable[]        = { port, files, synth, output, latency, jitter, bw, chunk, corrupt, trunc, seed, help, end };
+    const char* progname    = "mockanow";
+    struct sockaddr_in addr;
+    int srvfd               = -1;
+    int exitcode            = 0;
+    
+    if (arg_nullcheck(argtable) != 0) {
+        fprintf(stderr, "%s: insufficient memory\n", progname);
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    if ((arg_parse(argc, argv, argtable) > 0) && (help->count == 0)) {
+        arg_print_errors(stderr, end, progname);
+        fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    if (help->count > 0) {
+        printf("Usage: %s", progname);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+        goto main_FINISH;
+    }
+    
+    mock.seed       = (seed->count > 0) ? (uint32_t)seed->ival[0] : 1;
+    mock.latency    = (latency->count > 0) ? (uint64_t)(latency->dval[0] * 1e6) : 0;
+    mock.jitter     = (jitter->count > 0) ? (uint64_t)(jitter->dval[0] * 1e6) : 0;
+    mock.bandwidth  = (bw->count > 0) ? bw->dval[0] : 0.0;
+    mock.chunk      = (chunk->count > 0) ? (size_t)chunk->ival[0] : 0;
+    mock.p_corrupt  = (corrupt->count > 0) ? corrupt->dval[0] : 0.0;
+    mock.p_truncate = (trunc->count > 0) ? trunc->dval[0] : 0.0;
+    
+    for (int i=0; i<files->count; i++) {
+        if (sub_load_blob(&mock.blob[i], files->filename[i]) != 0) {
+            fprintf(stderr, "%s: cannot load %s\n", progname, files->filename[i]);
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        mock.numblobs++;
+    }
+    if (mock.numblobs == 0) {
+        int numsv = (synth->count > 0) ? synth->ival[0] : 32;
+        if ((numsv < 0) || (numsv > 128) || (sub_synth_corpus(&mock.blob[0], numsv, mock.seed) != 0)) {
+            fprintf(stderr, "%s: cannot synthesize a corpus of %i SVs (max 128)\n", progname, numsv);
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        mock.numblobs = 1;
+    }
+    
+    if (output->count > 0) {
+        FILE* fp = fopen(output->filename[0], "wb");
+        if ((fp == NULL) || (fwrite(mock.blob[0].data, 1, mock.blob[0].size, fp) != mock.blob[0].size)) {
+            fprintf(stderr, "%s: cannot write %s\n", progname, output->filename[0]);
+            exitcode = 1;
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        goto main_FINISH;
+    }
+    
+    srvfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srvfd < 0) {
+        perror("socket");
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    addr.sin_port           = htons((port->count > 0) ? (uint16_t)port->ival[0] : 8321);
+    if ((bind(srvfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(srvfd, 64) != 0)) {
+        perror("bind");
+        exitcode = 1;
+        goto main_FINISH;
+    }
+    
+    signal(SIGINT, &sub_sigstop);
+    signal(SIGTERM, &sub_sigstop);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "%s: serving %i blob(s) on 127.0.0.1:%u\n", progname, mock.numblobs, ntohs(addr.sin_port));
+    
+    while (!stop_flag) {
+        struct pollfd pfd = { .fd = srvfd, .events = POLLIN };
+        pthread_t thread;
+        int fd;
+        
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        fd = accept(srvfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, &sub_conn_thread, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    
+    fprintf(stderr, "%s: %llu requests, %llu corrupted, %llu truncated, %llu body bytes\n", progname,
+            (unsigned long long)mock.requests, (unsigned long long)mock.corrupted,
+            (unsigned long long)mock.truncated, (unsigned long long)mock.bytes);
+    
+    main_FINISH:
+    if (srvfd >= 0) {
+        close(srvfd);
+    }
+    for (int i=0; i<mock.numblobs; i++) {
+        free(mock.blob[i].data);
+    }
+    arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+    return exitcode;
+}
@@ -0,0 +1,36 @@
+CC := gcc
+LD := ld
+
+BIRDMON_PKG   ?=
+BIRDMON_DEF   ?= 
+BIRDMON_INC   ?=
+BIRDMON_LIB   ?= 
+BIRDMON_OSCFLAGS ?=
+BIRDMON_APP   ?= bin
+
+CFLAGS      ?= -std=gnu99 -O2 -Wall $(BIRDMON_OSCFLAGS) -pthread
+
+APPDIR      := ../$(BIRDMON_APP)
+LIBINC      := $(subst -L./,-L./../,$(BIRDMON_LIBINC))
+INC			:= $(subst -I./,-I./../,$(BIRDMON_INC))
+
+
+all: loadgen mockanow
+
+#Make the Directories
+directories:
+	@mkdir -p $(APPDIR)
+
+#Load generator: standalone client of the daemon socket, needs only argtable
+loadgen: directories
+	$(CC) $(CFLAGS) $(INC) $(LIBINC) -o $(APPDIR)/loadgen loadgen.c -largtable
+
+#Mock AssistNow upstream for offline backend benchmarks
+mockanow: directories
+	$(CC) $(CFLAGS) $(INC) $(LIBINC) -o $(APPDIR)/mockanow mockanow.c -largtable
+
+clean:
+	@$(RM) -f $(APPDIR)/loadgen $(APPDIR)/mockanow
+
+#Non-File Targets
+.PHONY: all directories loadgen mockanow clean